@@ -149,7 +149,8 @@ public:
       client = *w;
     } else {
       KJ_LOG(INFO, "become worker...");
-      client = kj::heap<WorkerImpl>(ioContext, subprocessSet, persistentRegistry);
+      client = kj::heap<WorkerImpl>(ioContext, subprocessSet, persistentRegistry,
+                                     context.getParams().getConfig());
       worker = client;
     }
 
@@ -18,6 +18,11 @@
 #include <sandstorm/util.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
+#include <string.h>
+
+#if __x86_64__
+#include <immintrin.h>
+#endif
 
 namespace blackrock {
 
@@ -41,4 +46,85 @@ void writeEvent(int fd, uint64_t value) {
   KJ_ASSERT(n == 8, "wrong-sized write on eventfd", n);
 }
 
+// =======================================================================================
+// isAllZero()
+//
+// The data we scan is usually a 4k block and is usually *not* zero, so the common case is an early
+// exit from the first vector. When the data is zero, though, we need to get through it at memory
+// bandwidth, hence the vector kernels. Each kernel ORs several vectors together per iteration and
+// tests the result once, which keeps the branch count low.
+
+namespace {
+
+bool isAllZeroScalar(const byte* ptr, size_t size) {
+  // Handles unaligned heads/tails and non-x86 builds.
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, ptr, sizeof(word));
+    if (word != 0) return false;
+    ptr += sizeof(word);
+    size -= sizeof(word);
+  }
+  while (size > 0) {
+    if (*ptr != 0) return false;
+    ++ptr;
+    --size;
+  }
+  return true;
+}
+
+#if __x86_64__
+
+bool isAllZeroSse2(const byte* ptr, size_t size) {
+  // SSE2 is part of the x86-64 baseline, so this is always available.
+  const byte* end = ptr + (size & ~size_t(63));
+  for (; ptr < end; ptr += 64) {
+    __m128i v = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 16))),
+        _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 32)),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) return false;
+  }
+  return isAllZeroScalar(ptr, size & 63);
+}
+
+__attribute__((target("avx2")))
+bool isAllZeroAvx2(const byte* ptr, size_t size) {
+  const byte* end = ptr + (size & ~size_t(127));
+  for (; ptr < end; ptr += 128) {
+    __m256i v = _mm256_or_si256(
+        _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr)),
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + 32))),
+        _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + 64)),
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + 96))));
+    if (!_mm256_testz_si256(v, v)) return false;
+  }
+  return isAllZeroScalar(ptr, size & 127);
+}
+
+#endif  // __x86_64__
+
+typedef bool IsAllZeroFunc(const byte* ptr, size_t size);
+
+IsAllZeroFunc* chooseIsAllZero() {
+#if __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &isAllZeroAvx2;
+  }
+  return &isAllZeroSse2;
+#else
+  return &isAllZeroScalar;
+#endif
+}
+
+IsAllZeroFunc* const isAllZeroImpl = chooseIsAllZero();
+
+}  // namespace
+
+bool isAllZero(const void* data, size_t size) {
+  return isAllZeroImpl(reinterpret_cast<const byte*>(data), size);
+}
+
 }  // namespace blackrock
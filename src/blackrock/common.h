@@ -36,6 +36,11 @@ uint64_t readEvent(int fd);
 void writeEvent(int fd, uint64_t value);
 // TODO(cleanup): Find a better home for these.
 
+bool isAllZero(const void* data, size_t size);
+// Returns true if the `size` bytes at `data` are all zero. Uses the widest vector instructions
+// the CPU supports (chosen at runtime), so it's cheap enough to call on every block of every
+// volume write.
+
 }  // namespace blackrock
 
 #endif // BLACKROCK_COMMON_H_
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include "bundle.h"
+#include "volume-backup.h"
 
 namespace blackrock {
 
@@ -196,7 +197,7 @@ protected:
     });
 
     return owner.getRequest().send()
-        .then([grainId](auto&& getResults) -> kj::Promise<void> {
+        .then([grainId,KJ_MVCAP(storage)](auto&& getResults) mutable -> kj::Promise<void> {
       auto userInfo = getResults.getValue();
 
       capnp::MallocMessageBuilder temp;
@@ -222,7 +223,10 @@ protected:
 
         auto req = getResults.getSetter().setRequest();
         req.setValue(userInfoCopy);
-        return req.send().ignoreResult();
+        return req.send().then([KJ_MVCAP(storage),grainId](auto&&) mutable {
+          // Drop the grain's block-level backup chain, unless backups still depend on it.
+          return dropVolumeBackups(kj::mv(storage), grainId);
+        });
       } else {
         return kj::READY_NOW;
       }
@@ -399,11 +403,17 @@ protected:
 
           // Get a snapshot of the volume for use during the backup process. If the grain is
           // running then we'll make sure to tell it to sync first.
-          Volume::Client volume = grainInfo.getState().getRequest().send()
-              .then([](auto&& results) -> kj::Promise<Volume::Client> {
+          struct PausedVolume {
+            Volume::Client snapshot;
+            uint64_t epoch;
+          };
+          auto paused = grainInfo.getState().getRequest().send()
+              .then([](auto&& results) -> kj::Promise<PausedVolume> {
             auto state = results.getValue();
             auto getVolume = [KJ_MVCAP(results),state]() {
-              return state.getVolume().pauseRequest().send().getSnapshot();
+              return state.getVolume().pauseRequest().send().then([](auto&& response) {
+                return PausedVolume { response.getSnapshot(), response.getEpoch() };
+              });
             };
 
             if (state.isActive()) {
@@ -421,22 +431,72 @@ protected:
             } else {
               return getVolume();
             }
+          }).fork();
+
+          Volume::Client volume = paused.addBranch().then([](PausedVolume&& result) {
+            return kj::mv(result.snapshot);
           });
 
-          // Make request to the Worker to pack this backup.
-          auto metadata = params.getInfo();
-          auto sizeHint = metadata.totalSize();
-          sizeHint.wordCount += 8;
-          sizeHint.capCount += 2;
-          auto req = worker.packBackupRequest(sizeHint);
-          req.setVolume(kj::mv(volume));
-          req.setMetadata(metadata);
-          req.setStorage(kj::mv(storageFactory));
-          return req.send().then([this,backupId,KJ_MVCAP(storage)](auto&& response) mutable {
-            auto req2 = storage.setRequest<sandstorm::Blob>(capnp::MessageSize {4, 1});
-            req2.setName(kj::str("backup-", backupId));
-            req2.setObject(response.getData());
-            return req2.send().then([](auto&&) {});
+          // If enabled, add the volume's changed blocks to its block-level backup chain. When that
+          // extends the chain, the backup is recorded as a prefix of it and we're done. When the
+          // chain starts over with a full copy -- or block-level backup fails -- pack a zip.
+          kj::Promise<bool> chained = false;
+          if (frontend.config.getBlockBackups()) {
+            chained = paused.addBranch()
+                .then([context,grainId,backupId,storage](PausedVolume&& result) mutable {
+              return appendVolumeBackup(storage, grainId, kj::mv(result.snapshot), result.epoch,
+                                        backupId);
+            }).then([context,params,grainId,backupId,storage,storageFactory]
+                    (kj::Maybe<VolumeBackupPosition> position) mutable -> kj::Promise<bool> {
+              KJ_IF_MAYBE(p, position) {
+                auto metadata = params.getInfo();
+                auto sizeHint = metadata.totalSize();
+                sizeHint.wordCount += 8;
+                auto record = ({
+                  auto req = storageFactory.newAssignableRequest<ChainedBackup>(sizeHint);
+                  auto value = req.initInitialValue();
+                  value.setGrainId(grainId);
+                  value.setGeneration(p->generation);
+                  value.setDeltaCount(p->deltaCount);
+                  value.setInfo(metadata);
+                  req.send().getAssignable();
+                });
+
+                auto req = storage.setRequest<Assignable<ChainedBackup>>();
+                req.setName(kj::str("chained-backup-", backupId));
+                req.setObject(kj::mv(record));
+                return req.send().then([](auto&&) { return true; });
+              } else {
+                return false;
+              }
+            }).catch_([grainId = kj::heapString(grainId)](kj::Exception&& exception) {
+              KJ_LOG(ERROR, "block-level backup failed; packing a zip instead", grainId,
+                     exception);
+              return false;
+            });
+          }
+
+          return chained.then(
+              [this,context,params,backupId,KJ_MVCAP(worker),KJ_MVCAP(storage),
+               KJ_MVCAP(storageFactory),KJ_MVCAP(volume)](bool isChained) mutable
+              -> kj::Promise<void> {
+            if (isChained) return kj::READY_NOW;
+
+            // Make request to the Worker to pack this backup.
+            auto metadata = params.getInfo();
+            auto sizeHint = metadata.totalSize();
+            sizeHint.wordCount += 8;
+            sizeHint.capCount += 2;
+            auto req = worker.packBackupRequest(sizeHint);
+            req.setVolume(kj::mv(volume));
+            req.setMetadata(metadata);
+            req.setStorage(kj::mv(storageFactory));
+            return req.send().then([this,backupId,KJ_MVCAP(storage)](auto&& response) mutable {
+              auto req2 = storage.setRequest<sandstorm::Blob>(capnp::MessageSize {4, 1});
+              req2.setName(kj::str("backup-", backupId));
+              req2.setObject(response.getData());
+              return req2.send().then([](auto&&) {});
+            });
           });
         }
       }
@@ -454,39 +514,36 @@ protected:
     StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
-    auto blob = ({
-      auto req = storage.getRequest<sandstorm::Blob>();
-      req.setName(kj::str("backup-", backupId));
-      req.send().getObject().castAs<sandstorm::Blob>();
-    });
-
-    auto req = worker.unpackBackupRequest();
-    req.setData(kj::mv(blob));
-    req.setStorage(storageFactory);
-
-    return req.send().then([this,context,params,grainId,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
-                           (auto&& response) mutable {
-      auto grainState = ({
-        auto req = storageFactory.newAssignableRequest<GrainState>();
-        auto state = req.initInitialValue();
-        state.setInactive();
-        state.setVolume(response.getVolume());
-        req.send().getAssignable();
-      });
+    auto lookup = tryGetChainedBackup(storage, backupId);
+    return lookup.then([this,context,backupId,KJ_MVCAP(worker),KJ_MVCAP(storage),
+                        KJ_MVCAP(storageFactory)](auto&& record) mutable -> kj::Promise<void> {
+      KJ_IF_MAYBE(r, record) {
+        // The backup is a prefix of a block-level backup chain. Replay it into a new volume.
+        auto backup = r->getValue();
+        OwnedVolume::Client volume = storageFactory.newVolumeRequest().send().getVolume();
+        auto restored = restoreVolumeBackup(storage, backup, volume);
+        return restored.then([this,context,backup,KJ_MVCAP(record),KJ_MVCAP(storage),
+                              KJ_MVCAP(storageFactory),KJ_MVCAP(volume)]() mutable {
+          return addRestoredGrain(context, kj::mv(storage), kj::mv(storageFactory),
+                                  kj::mv(volume), backup.getInfo());
+        });
+      }
 
-      auto ownerGet = ({
-        auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-        req.setName(kj::str("user-", params.getOwnerId()));
-        req.initDefaultValue();
-        req.send().getObject().getRequest().send();
+      auto blob = ({
+        auto req = storage.getRequest<sandstorm::Blob>();
+        req.setName(kj::str("backup-", backupId));
+        req.send().getObject().castAs<sandstorm::Blob>();
       });
 
-      auto metadata = response.getMetadata();
-      auto sizeHint = metadata.totalSize();
-      sizeHint.wordCount += 4;
-      context.getResults(sizeHint).setInfo(metadata);
+      auto req = worker.unpackBackupRequest();
+      req.setData(kj::mv(blob));
+      req.setStorage(storageFactory);
 
-      return addGrainToUser(kj::mv(ownerGet), grainId, kj::mv(grainState));
+      return req.send().then([this,context,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
+                             (auto&& response) mutable {
+        return addRestoredGrain(context, kj::mv(storage), kj::mv(storageFactory),
+                                response.getVolume(), response.getMetadata());
+      });
     });
   }
 
@@ -514,28 +571,76 @@ protected:
   kj::Promise<void> downloadBackup(DownloadBackupContext context) override {
     auto params = context.getParams();
     auto stream = params.getStream();
-    auto backupId = params.getBackupId();
+    auto backupId = kj::heapString(params.getBackupId());
     KJ_LOG(INFO, "Backend: downloadBackup", backupId);
+    context.releaseParams();
 
     StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
 
-    auto req = storage.getRequest<sandstorm::Blob>();
-    req.setName(kj::str("backup-", backupId));
-    context.releaseParams();
+    auto lookup = tryGetChainedBackup(storage, backupId);
+    return lookup.then([this,KJ_MVCAP(stream),KJ_MVCAP(backupId),KJ_MVCAP(storage)]
+                       (auto&& record) mutable {
+      sandstorm::Blob::Client blob = nullptr;
+      KJ_IF_MAYBE(r, record) {
+        // The backup is a prefix of a block-level backup chain, but downloads are zips. Replay it
+        // into a temporary volume and pack that.
+        Worker::Client worker = frontend.workers->chooseOne();
+        StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
+        OwnedVolume::Client volume = storageFactory.newVolumeRequest().send().getVolume();
+        auto backup = r->getValue();
+        auto restored = restoreVolumeBackup(storage, backup, volume);
+        blob = restored.then([backup,KJ_MVCAP(record),KJ_MVCAP(worker),KJ_MVCAP(storageFactory),
+                              KJ_MVCAP(volume)]() mutable {
+          auto metadata = backup.getInfo();
+          auto sizeHint = metadata.totalSize();
+          sizeHint.wordCount += 8;
+          sizeHint.capCount += 2;
+          auto req = worker.packBackupRequest(sizeHint);
+          req.setVolume(kj::mv(volume));
+          req.setMetadata(metadata);
+          req.setStorage(kj::mv(storageFactory));
+          return req.send().then([](auto&& response) -> sandstorm::Blob::Client {
+            return response.getData();
+          });
+        });
+      } else {
+        auto req = storage.getRequest<sandstorm::Blob>();
+        req.setName(kj::str("backup-", backupId));
+        blob = req.send().getObject().castAs<sandstorm::Blob>();
+      }
 
-    auto req2 = req.send().getObject().castAs<sandstorm::Blob>().writeToRequest();
-    req2.setStream(kj::mv(stream));
-    return req2.send().then([](auto&&) {});
+      auto req = blob.writeToRequest();
+      req.setStream(kj::mv(stream));
+      return req.send().then([](auto&&) {});
+    });
   }
 
   kj::Promise<void> deleteBackup(DeleteBackupContext context) override {
-    auto backupId = context.getParams().getBackupId();
+    auto backupId = kj::heapString(context.getParams().getBackupId());
     KJ_LOG(INFO, "Backend: deleteBackup", backupId);
-
-    auto req = frontend.storageRoots->chooseOne().removeRequest();
-    req.setName(kj::str("backup-", backupId));
     context.releaseParams();
-    return req.send().then([](auto&&) {});
+
+    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+
+    auto lookup = tryGetChainedBackup(storage, backupId);
+    return lookup.then([KJ_MVCAP(backupId),KJ_MVCAP(storage)]
+                       (auto&& record) mutable -> kj::Promise<void> {
+      KJ_IF_MAYBE(r, record) {
+        // Take the backup off its chain's list before removing the record, so that if we fail in
+        // between, deleting again finishes the job.
+        auto released = releaseVolumeBackup(storage, r->getValue(), backupId)
+            .attach(kj::mv(record));
+        return released.then([KJ_MVCAP(backupId),KJ_MVCAP(storage)]() mutable {
+          auto req = storage.removeRequest();
+          req.setName(kj::str("chained-backup-", backupId));
+          return req.send().ignoreResult();
+        });
+      }
+
+      auto req = storage.removeRequest();
+      req.setName(kj::str("backup-", backupId));
+      return req.send().then([](auto&&) {});
+    });
   }
 
   // ---------------------------------------------------------------------------
@@ -696,6 +801,63 @@ private:
     });
   }
 
+  typedef capnp::Response<sandstorm::Assignable<ChainedBackup>::GetResults> ChainedBackupRecord;
+
+  kj::Promise<kj::Maybe<ChainedBackupRecord>> tryGetChainedBackup(
+      StorageRootSet::Client storage, kj::StringPtr backupId) {
+    // Reads the record of a backup taken as a prefix of a block-level backup chain, or returns
+    // null if the backup is a zip.
+
+    auto req = storage.tryGetRequest<Assignable<ChainedBackup>>();
+    req.setName(kj::str("chained-backup-", backupId));
+    return req.send().then([](auto&& result) -> kj::Promise<kj::Maybe<ChainedBackupRecord>> {
+      if (!result.hasObject()) {
+        return kj::Maybe<ChainedBackupRecord>(nullptr);
+      }
+
+      return result.getObject().template castAs<OwnedAssignable<ChainedBackup>>()
+          .getRequest().send().then([](auto&& record) -> kj::Maybe<ChainedBackupRecord> {
+        return kj::mv(record);
+      });
+    });
+  }
+
+  kj::Promise<void> addRestoredGrain(
+      RestoreGrainContext context, StorageRootSet::Client storage,
+      StorageFactory::Client storageFactory, OwnedVolume::Client volume,
+      sandstorm::GrainInfo::Reader metadata) {
+    // Add a grain restored from a backup to its owner's account, and return its metadata.
+
+    auto params = context.getParams();
+    auto grainId = params.getGrainId();
+
+    auto grainState = ({
+      auto req = storageFactory.newAssignableRequest<GrainState>();
+      auto state = req.initInitialValue();
+      state.setInactive();
+      state.setVolume(kj::mv(volume));
+      req.send().getAssignable();
+    });
+
+    auto ownerGet = ({
+      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
+      req.setName(kj::str("user-", params.getOwnerId()));
+      req.initDefaultValue();
+      req.send().getObject().getRequest().send();
+    });
+
+    auto sizeHint = metadata.totalSize();
+    sizeHint.wordCount += 4;
+    context.getResults(sizeHint).setInfo(metadata);
+
+    // The grain has a new volume, so a block-level backup chain left from its old one -- e.g. when
+    // transferring it -- must not be extended.
+    auto promises = kj::heapArrayBuilder<kj::Promise<void>>(2);
+    promises.add(addGrainToUser(kj::mv(ownerGet), grainId, kj::mv(grainState)));
+    promises.add(dropVolumeBackups(kj::mv(storage), grainId));
+    return kj::joinPromises(promises.finish());
+  }
+
   struct ContinueParams {
     sandstorm::Assignable<GrainState>::Client grainAssignable;
     StorageFactory::Client storageFactory;
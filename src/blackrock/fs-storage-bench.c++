@@ -0,0 +1,539 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fs-storage.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <sandstorm/util.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "fs-storage-test.capnp.h"
+#undef BLOCK_SIZE
+
+namespace blackrock {
+
+class StorageBench {
+  // Benchmarks FilesystemStorage by running a workload against a fresh storage directory and
+  // reporting throughput, latency percentiles, and journal activity.
+
+public:
+  StorageBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock storage benchmark",
+                           "Runs <workload> against a FilesystemStorage in a scratch directory "
+                           "and reports ops/s and latency. Workloads are: assignable, "
+                           "volume-seq-write, volume-seq-read, volume-rand-write, "
+                           "volume-rand-read, volume-zero, blob-upload, blob-download, tree.")
+        .addOptionWithArg({'d', "dir"}, KJ_BIND_METHOD(*this, setDir), "<path>",
+                          "scratch directory; anything in it is deleted "
+                          "(default: /var/tmp/blackrock-fs-storage-bench)")
+        .addOptionWithArg({'n', "ops"}, KJ_BIND_METHOD(*this, setOps), "<count>",
+                          "number of operations to time (default: 10000)")
+        .addOptionWithArg({'q', "queue-depth"}, KJ_BIND_METHOD(*this, setQueueDepth), "<count>",
+                          "operations in flight at once (default: 1)")
+        .addOptionWithArg({'b', "blocks"}, KJ_BIND_METHOD(*this, setBlocks), "<count>",
+                          "4k blocks per volume operation (default: 1)")
+        .addOptionWithArg({"span"}, KJ_BIND_METHOD(*this, setSpan), "<MB>",
+                          "size of the volume region that volume workloads touch "
+                          "(default: 1024)")
+        .addOptionWithArg({"blob-size"}, KJ_BIND_METHOD(*this, setBlobSize), "<KB>",
+                          "size of each blob (default: 1024)")
+        .addOptionWithArg({"depth"}, KJ_BIND_METHOD(*this, setDepth), "<count>",
+                          "depth of the trees built by the tree workload (default: 8)")
+        .addOptionWithArg({"io-threads"}, KJ_BIND_METHOD(*this, setIoThreads), "<count>",
+                          "FilesystemStorage::Options::ioThreadCount")
+        .addOptionWithArg({"journal-threads"}, KJ_BIND_METHOD(*this, setJournalThreads), "<count>",
+                          "FilesystemStorage::Options::journalThreadCount")
+        .expectArg("<workload>", KJ_BIND_METHOD(*this, setWorkload))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::StringPtr dir = "/var/tmp/blackrock-fs-storage-bench";
+  kj::StringPtr workloadName;
+  uint opCount = 10000;
+  uint queueDepth = 1;
+  uint blocksPerOp = 1;
+  uint spanMb = 1024;
+  uint blobKb = 1024;
+  uint treeDepth = 8;
+  FilesystemStorage::Options options;
+
+  static constexpr uint ROOT_COUNT = 64;
+  // Number of distinct roots the assignable and tree workloads cycle through.
+
+  static constexpr size_t UPLOAD_CHUNK_SIZE = 65536;
+
+  static kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint& result) {
+    KJ_IF_MAYBE(n, sandstorm::parseUInt(arg, 10)) {
+      if (*n == 0) return "must be positive";
+      result = *n;
+      return true;
+    } else {
+      return "not a number";
+    }
+  }
+
+  kj::MainBuilder::Validity setDir(kj::StringPtr arg) { dir = arg; return true; }
+  kj::MainBuilder::Validity setOps(kj::StringPtr arg) { return parseCount(arg, opCount); }
+  kj::MainBuilder::Validity setQueueDepth(kj::StringPtr arg) {
+    return parseCount(arg, queueDepth);
+  }
+  kj::MainBuilder::Validity setBlocks(kj::StringPtr arg) { return parseCount(arg, blocksPerOp); }
+  kj::MainBuilder::Validity setSpan(kj::StringPtr arg) { return parseCount(arg, spanMb); }
+  kj::MainBuilder::Validity setBlobSize(kj::StringPtr arg) { return parseCount(arg, blobKb); }
+  kj::MainBuilder::Validity setDepth(kj::StringPtr arg) { return parseCount(arg, treeDepth); }
+  kj::MainBuilder::Validity setIoThreads(kj::StringPtr arg) {
+    return parseCount(arg, options.ioThreadCount);
+  }
+  kj::MainBuilder::Validity setJournalThreads(kj::StringPtr arg) {
+    return parseCount(arg, options.journalThreadCount);
+  }
+
+  kj::MainBuilder::Validity setWorkload(kj::StringPtr arg) {
+    for (auto name: {"assignable", "volume-seq-write", "volume-seq-read", "volume-rand-write",
+                     "volume-rand-read", "volume-zero", "blob-upload", "blob-download", "tree"}) {
+      if (arg == name) {
+        workloadName = arg;
+        return true;
+      }
+    }
+    return "unknown workload";
+  }
+
+  // ---------------------------------------------------------------------------
+
+  struct Env {
+    // Like StorageTestFixture in fs-storage-test.c++.
+
+    kj::AsyncIoContext io;
+    kj::AutoCloseFd dirFd;
+    FilesystemStorage* storageServer;
+    StorageRootSet::Client storage;
+    StorageFactory::Client factory;
+
+    Env(kj::AutoCloseFd dirFdParam, FilesystemStorage::Options options)
+        : io(kj::setupAsyncIo()), dirFd(kj::mv(dirFdParam)), storage(nullptr), factory(nullptr) {
+      auto server = kj::heap<FilesystemStorage>(dirFd,
+          io.unixEventPort, io.provider->getTimer(), nullptr, options);
+      storageServer = server.get();
+      storage = kj::mv(server);
+      factory = storage.getFactoryRequest().send().getFactory();
+    }
+  };
+
+  class Workload {
+  public:
+    virtual ~Workload() noexcept(false) {}
+
+    virtual kj::Promise<void> setup() { return kj::READY_NOW; }
+    // Prepares state that the timed operations use.
+
+    virtual kj::Promise<void> op(uint64_t i) = 0;
+    // Performs the i'th timed operation. Up to `queueDepth` of these run concurrently.
+
+    virtual uint64_t bytesPerOp() { return 0; }
+    // Payload bytes moved by each operation, for reporting throughput.
+  };
+
+  class AssignableWorkload: public Workload {
+    // Each op reads one of a set of root Assignables and replaces its value.
+
+  public:
+    explicit AssignableWorkload(Env& env): env(env) {}
+
+    kj::Promise<void> setup() override {
+      auto promises = kj::heapArrayBuilder<kj::Promise<void>>(ROOT_COUNT);
+      for (uint i = 0; i < ROOT_COUNT; i++) {
+        auto req = env.factory.newAssignableRequest<TestStoredObject>();
+        req.getInitialValue().setText("initial");
+        auto setReq = env.storage.setRequest<Assignable<TestStoredObject>>();
+        setReq.setName(kj::str("assignable", i));
+        setReq.setObject(req.send().getAssignable());
+        promises.add(setReq.send().then([](auto&&) {}));
+      }
+      return kj::joinPromises(promises.finish()).then([this]() {
+        auto builder = kj::heapArrayBuilder<OwnedAssignable<TestStoredObject>::Client>(ROOT_COUNT);
+        for (uint i = 0; i < ROOT_COUNT; i++) {
+          auto req = env.storage.getRequest<Assignable<TestStoredObject>>();
+          req.setName(kj::str("assignable", i));
+          builder.add(req.send().getObject().castAs<OwnedAssignable<TestStoredObject>>());
+        }
+        objects = builder.finish();
+      });
+    }
+
+    kj::Promise<void> op(uint64_t i) override {
+      return objects[i % ROOT_COUNT].getRequest().send()
+          .then([i](capnp::Response<Assignable<TestStoredObject>::GetResults>&& response) {
+        auto req = response.getSetter().setRequest();
+        req.initValue().setText(kj::str("value", i));
+        return req.send().then([](auto&&) {});
+      });
+    }
+
+  private:
+    Env& env;
+    kj::Array<OwnedAssignable<TestStoredObject>::Client> objects;
+  };
+
+  class VolumeWorkload: public Workload {
+  public:
+    enum Kind { SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ, ZERO };
+
+    VolumeWorkload(Env& env, Kind kind, uint blocksPerOp, uint spanMb)
+        : env(env), kind(kind), blocksPerOp(blocksPerOp),
+          spanOps(kj::max(uint64_t(spanMb) * 256 / blocksPerOp, uint64_t(1))),
+          volume(env.factory.newVolumeRequest().send().getVolume()),
+          buffer(kj::heapArray<byte>(blocksPerOp * Volume::BLOCK_SIZE)) {
+      for (size_t i = 0; i < buffer.size(); i++) {
+        // Not all zero, so that writes don't get turned into hole punches.
+        buffer[i] = i * 7 + 1;
+      }
+    }
+
+    kj::Promise<void> setup() override {
+      auto req = env.storage.setRequest<Volume>();
+      req.setName("volume");
+      req.setObject(volume);
+      return req.send().then([this](auto&&) -> kj::Promise<void> {
+        if (kind != SEQ_READ && kind != RAND_READ) return kj::READY_NOW;
+
+        // Fill the span so that reads hit data rather than holes.
+        return fill(0);
+      });
+    }
+
+    kj::Promise<void> op(uint64_t i) override {
+      uint64_t slot = (kind == RAND_WRITE || kind == RAND_READ) ? random() % spanOps : i % spanOps;
+      uint32_t blockNum = slot * blocksPerOp;
+
+      switch (kind) {
+        case SEQ_WRITE:
+        case RAND_WRITE: {
+          auto req = volume.writeRequest();
+          req.setBlockNum(blockNum);
+          req.setData(buffer);
+          return req.send().then([](auto&&) {});
+        }
+        case SEQ_READ:
+        case RAND_READ: {
+          auto req = volume.readRequest();
+          req.setBlockNum(blockNum);
+          req.setCount(blocksPerOp);
+          return req.send().then([](auto&&) {});
+        }
+        case ZERO: {
+          auto req = volume.zeroRequest();
+          req.setBlockNum(blockNum);
+          req.setCount(blocksPerOp);
+          return req.send().then([](auto&&) {});
+        }
+      }
+      KJ_UNREACHABLE;
+    }
+
+    uint64_t bytesPerOp() override {
+      return uint64_t(blocksPerOp) * Volume::BLOCK_SIZE;
+    }
+
+  private:
+    Env& env;
+    Kind kind;
+    uint blocksPerOp;
+    uint64_t spanOps;
+    OwnedVolume::Client volume;
+    kj::Array<byte> buffer;
+
+    kj::Promise<void> fill(uint64_t slot) {
+      if (slot >= spanOps) {
+        return volume.syncRequest().send().then([](auto&&) {});
+      }
+
+      auto req = volume.writeRequest();
+      req.setBlockNum(slot * blocksPerOp);
+      req.setData(buffer);
+      return req.send().then([this,slot](auto&&) { return fill(slot + 1); });
+    }
+  };
+
+  class NullByteStream final: public sandstorm::ByteStream::Server {
+    // Discards everything written to it.
+
+  public:
+    explicit NullByteStream(kj::Own<kj::PromiseFulfiller<void>> doneFulfiller)
+        : doneFulfiller(kj::mv(doneFulfiller)) {}
+
+    kj::Promise<void> write(WriteContext context) override {
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> done(DoneContext context) override {
+      doneFulfiller->fulfill();
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> expectSize(ExpectSizeContext context) override {
+      return kj::READY_NOW;
+    }
+
+  private:
+    kj::Own<kj::PromiseFulfiller<void>> doneFulfiller;
+  };
+
+  class BlobWorkload: public Workload {
+    // Uploads blobs in chunks, the way the worker does, or repeatedly downloads one blob.
+
+  public:
+    BlobWorkload(Env& env, bool download, uint blobKb)
+        : env(env), download(download), content(kj::heapArray<byte>(size_t(blobKb) * 1024)) {
+      for (size_t i = 0; i < content.size(); i++) {
+        content[i] = i * 13 + 1;
+      }
+    }
+
+    kj::Promise<void> setup() override {
+      if (!download) return kj::READY_NOW;
+
+      return upload(0).then([this](OwnedBlob::Client&& blob) {
+        auto req = env.storage.setRequest<sandstorm::Blob>();
+        req.setName("blob");
+        req.setObject(blob);
+        return req.send().then([this,KJ_MVCAP(blob)](auto&&) mutable {
+          downloadBlob = kj::mv(blob);
+        });
+      });
+    }
+
+    kj::Promise<void> op(uint64_t i) override {
+      if (download) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        auto req = KJ_ASSERT_NONNULL(downloadBlob).writeToRequest();
+        req.setStream(kj::heap<NullByteStream>(kj::mv(paf.fulfiller)));
+        return req.send().then([KJ_MVCAP(paf)](auto&&) mutable {
+          return kj::mv(paf.promise);
+        });
+      } else {
+        // Wait for the upload to be complete, then drop the blob.
+        return upload(i).then([](OwnedBlob::Client&& blob) {
+          return blob.getSizeRequest().send().then([](auto&&) {});
+        });
+      }
+    }
+
+    uint64_t bytesPerOp() override {
+      return content.size();
+    }
+
+  private:
+    Env& env;
+    bool download;
+    kj::Array<byte> content;
+    kj::Maybe<OwnedBlob::Client> downloadBlob;
+
+    kj::Promise<OwnedBlob::Client> upload(uint64_t i) {
+      auto upload = env.factory.uploadBlobRequest().send();
+      auto stream = upload.getStream();
+      OwnedBlob::Client blob = upload.getBlob();
+
+      // Make each blob unique in its first bytes, in case deduplication is on.
+      memcpy(content.begin(), &i, kj::min(sizeof(i), content.size()));
+
+      auto writes = kj::heapArrayBuilder<kj::Promise<void>>(
+          (content.size() + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE);
+      for (size_t offset = 0; offset < content.size(); offset += UPLOAD_CHUNK_SIZE) {
+        auto req = stream.writeRequest();
+        req.setData(content.slice(offset, kj::min(offset + UPLOAD_CHUNK_SIZE, content.size())));
+        writes.add(req.send().then([](auto&&) {}));
+      }
+
+      return kj::joinPromises(writes.finish()).then([KJ_MVCAP(stream)]() mutable {
+        return stream.doneRequest().send();
+      }).then([KJ_MVCAP(blob)](auto&&) mutable {
+        return kj::mv(blob);
+      });
+    }
+  };
+
+  class TreeWorkload: public Workload {
+    // Each op builds a chain of nested Assignables and makes it a root, replacing (and thereby
+    // deleting) the tree that was there before.
+
+  public:
+    TreeWorkload(Env& env, uint depth): env(env), depth(depth) {}
+
+    kj::Promise<void> op(uint64_t i) override {
+      OwnedAssignable<TestStoredObject>::Client tree = nullptr;
+      for (uint level = 0; level < depth; level++) {
+        auto req = env.factory.newAssignableRequest<TestStoredObject>();
+        auto value = req.getInitialValue();
+        value.setText(kj::str("level", level));
+        if (level > 0) {
+          value.setSub1(kj::mv(tree));
+        }
+        tree = req.send().getAssignable();
+      }
+
+      auto req = env.storage.setRequest<Assignable<TestStoredObject>>();
+      req.setName(kj::str("tree", i % ROOT_COUNT));
+      req.setObject(kj::mv(tree));
+      return req.send().then([](auto&&) {});
+    }
+
+  private:
+    Env& env;
+    uint depth;
+  };
+
+  kj::Own<Workload> makeWorkload(Env& env) {
+    if (workloadName == "assignable") {
+      return kj::heap<AssignableWorkload>(env);
+    } else if (workloadName == "volume-seq-write") {
+      return kj::heap<VolumeWorkload>(env, VolumeWorkload::SEQ_WRITE, blocksPerOp, spanMb);
+    } else if (workloadName == "volume-seq-read") {
+      return kj::heap<VolumeWorkload>(env, VolumeWorkload::SEQ_READ, blocksPerOp, spanMb);
+    } else if (workloadName == "volume-rand-write") {
+      return kj::heap<VolumeWorkload>(env, VolumeWorkload::RAND_WRITE, blocksPerOp, spanMb);
+    } else if (workloadName == "volume-rand-read") {
+      return kj::heap<VolumeWorkload>(env, VolumeWorkload::RAND_READ, blocksPerOp, spanMb);
+    } else if (workloadName == "volume-zero") {
+      return kj::heap<VolumeWorkload>(env, VolumeWorkload::ZERO, blocksPerOp, spanMb);
+    } else if (workloadName == "blob-upload") {
+      return kj::heap<BlobWorkload>(env, false, blobKb);
+    } else if (workloadName == "blob-download") {
+      return kj::heap<BlobWorkload>(env, true, blobKb);
+    } else if (workloadName == "tree") {
+      return kj::heap<TreeWorkload>(env, treeDepth);
+    }
+    KJ_UNREACHABLE;
+  }
+
+  // ---------------------------------------------------------------------------
+
+  static uint64_t nowNs() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+  uint64_t nextOp = 0;
+  kj::Vector<uint64_t> latencies;
+
+  kj::Promise<void> runQueue(Workload& workload) {
+    // One of `queueDepth` loops, each keeping one operation in flight until all have been issued.
+
+    if (nextOp >= opCount) return kj::READY_NOW;
+
+    uint64_t start = nowNs();
+    return workload.op(nextOp++).then([this,&workload,start]() {
+      latencies.add(nowNs() - start);
+      return runQueue(workload);
+    });
+  }
+
+  bool run() {
+    if (access(dir.cStr(), F_OK) >= 0) {
+      sandstorm::recursivelyDelete(dir);
+    }
+    KJ_SYSCALL(mkdir(dir.cStr(), 0777), dir);
+
+    Env env(sandstorm::raiiOpen(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC), options);
+    auto workload = makeWorkload(env);
+    workload->setup().wait(env.io.waitScope);
+
+    auto before = env.storageServer->getStats();
+    latencies.reserve(opCount);
+
+    uint64_t start = nowNs();
+    auto queues = kj::heapArrayBuilder<kj::Promise<void>>(queueDepth);
+    for (uint i = 0; i < queueDepth; i++) {
+      queues.add(runQueue(*workload));
+    }
+    kj::joinPromises(queues.finish()).wait(env.io.waitScope);
+    uint64_t elapsed = nowNs() - start;
+
+    auto after = env.storageServer->getStats();
+
+    report(elapsed, workload->bytesPerOp(), before, after);
+    return true;
+  }
+
+  void report(uint64_t elapsedNs, uint64_t bytesPerOp,
+              const FilesystemStorage::Stats& before, const FilesystemStorage::Stats& after) {
+    double seconds = elapsedNs / 1e9;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> double {
+      size_t index = kj::min(size_t(latencies.size() * p), latencies.size() - 1);
+      return latencies[index] / 1e3;
+    };
+
+    context.warning(kj::str(
+        workloadName, ": ", latencies.size(), " ops, queue depth ", queueDepth,
+        ", ", seconds, " s\n"
+        "  throughput: ", uint64_t(latencies.size() / seconds), " ops/s"));
+    if (bytesPerOp > 0) {
+      context.warning(kj::str(
+          "  bandwidth:  ", uint64_t(bytesPerOp * latencies.size() / seconds / (1 << 20)),
+          " MB/s"));
+    }
+    context.warning(kj::str(
+        "  latency us: p50 ", percentile(0.5), ", p99 ", percentile(0.99),
+        ", p999 ", percentile(0.999), ", max ", latencies.back() / 1e3));
+
+    // Log2 histogram of latencies, in microseconds.
+    kj::Vector<uint64_t> buckets;
+    for (uint64_t ns: latencies) {
+      uint64_t us = ns / 1000;
+      uint bucket = 0;
+      while (us > 1) {
+        us >>= 1;
+        ++bucket;
+      }
+      while (buckets.size() <= bucket) buckets.add(0);
+      ++buckets[bucket];
+    }
+    for (uint i = 0; i < buckets.size(); i++) {
+      if (buckets[i] == 0) continue;
+      context.warning(kj::str(
+          "    < ", 2ull << i, " us: ", buckets[i],
+          " (", buckets[i] * 100 / latencies.size(), "%)"));
+    }
+
+    context.warning(kj::str(
+        "  journal: ", after.journalTransactions - before.journalTransactions,
+        " transactions, ", after.journalBytesWritten - before.journalBytesWritten,
+        " bytes, ", after.journalSyncs - before.journalSyncs,
+        " journal fsyncs, ", after.objectSyncs - before.objectSyncs, " object fsyncs\n"
+        "  death row: ", after.deathRowDeleted - before.deathRowDeleted,
+        " deleted, ", after.deathRowBacklog, " pending\n"
+        "  warm cache: ", after.warmCacheHits - before.warmCacheHits, " hits, ",
+        after.warmCacheMisses - before.warmCacheMisses, " misses"));
+  }
+};
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::StorageBench)
@@ -15,24 +15,41 @@
 // limitations under the License.
 
 #include "fs-storage.h"
+#include "io-pool.h"
+#include "stream-window.h"
 #include <kj/debug.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <linux/btrfs.h>
 #include <sodium/randombytes.h>
 #include <sodium/crypto_generichash_blake2b.h>
 #include <sandstorm/util.h>
 #include <capnp/serialize.h>
+#include <blackrock/blank-ext4.capnp.h>
 #include <sys/eventfd.h>
 #include <kj/thread.h>
+#include <kj/mutex.h>
+#include <kj/function.h>
 #include <kj/async-unix.h>
 #include <queue>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <atomic>
 #include <unordered_map>
 #include <unordered_set>
 #include <capnp/persistent.capnp.h>
 #include <dirent.h>
+#include <time.h>
+#include <stdlib.h>
 
 namespace blackrock {
 
@@ -67,6 +84,66 @@ void pwriteAll(int fd, const void* data, size_t size, off_t offset) {
   }
 }
 
+off_t seekExtent(int fd, off_t offset, int whence) {
+  // lseek() with SEEK_DATA or SEEK_HOLE. Returns -1 if there is no data at or after `offset`.
+
+  for (;;) {
+    off_t result = lseek(fd, offset, whence);
+    if (result >= 0) return result;
+    int error = errno;
+    if (error == ENXIO) {
+      return -1;
+    } else if (error != EINTR) {
+      KJ_FAIL_SYSCALL("lseek", error, offset, whence);
+    }
+  }
+}
+
+struct FileExtent {
+  uint32_t count;  // in blocks
+  bool isData;     // false if it's a hole
+};
+
+void mapFileExtents(int fd, uint64_t offset, uint64_t size, kj::Vector<FileExtent>& extents) {
+  // Determine which blocks of the given block-aligned range of the file are allocated and which
+  // are holes, according to SEEK_DATA / SEEK_HOLE, and append them to `extents`. A block that is
+  // only partially allocated counts as data. Adjacent extents of the same kind are merged, but
+  // never with extents that were already in the vector.
+
+  static constexpr uint64_t BLOCK_MASK = ~uint64_t(Volume::BLOCK_SIZE - 1);
+
+  size_t first = extents.size();
+  auto add = [&](uint64_t from, uint64_t to, bool isData) {
+    if (to <= from) return;
+    uint32_t count = (to - from) / Volume::BLOCK_SIZE;
+    if (extents.size() > first && extents.back().isData == isData) {
+      extents.back().count += count;
+    } else {
+      extents.add(FileExtent { count, isData });
+    }
+  };
+
+  uint64_t end = offset + size;
+  uint64_t pos = offset;
+  while (pos < end) {
+    off_t dataStart = seekExtent(fd, pos, SEEK_DATA);
+    if (dataStart < 0 || uint64_t(dataStart) >= end) {
+      add(pos, end, false);
+      break;
+    }
+
+    uint64_t alignedStart = kj::max(uint64_t(dataStart) & BLOCK_MASK, pos);
+    add(pos, alignedStart, false);
+
+    // There is always an implicit hole at EOF, so this can't fail.
+    off_t holeStart = seekExtent(fd, dataStart, SEEK_HOLE);
+    KJ_ASSERT(holeStart > dataStart);
+    uint64_t dataEnd = kj::min((uint64_t(holeStart) + Volume::BLOCK_SIZE - 1) & BLOCK_MASK, end);
+    add(alignedStart, dataEnd, true);
+    pos = dataEnd;
+  }
+}
+
 uint64_t getFileSize(int fd) {
   struct stat stats;
   KJ_SYSCALL(fstat(fd, &stats));
@@ -85,6 +162,46 @@ uint64_t getFilePosition(int fd) {
   return offset;
 }
 
+uint64_t monotonicNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class MmapDisposer: public kj::ArrayDisposer {
+protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const override {
+    if (munmap(firstElement, elementSize * elementCount) < 0) {
+      KJ_LOG(ERROR, "munmap() failed", strerror(errno));
+    }
+  }
+};
+
+constexpr MmapDisposer mmapDisposer = MmapDisposer();
+
+kj::Array<const capnp::word> mmapWords(int fd) {
+  // Map the whole file read-only. Storage objects in StoredObject format are never modified in
+  // place -- set() writes a new file and renames it over the old one -- so the mapping stays
+  // consistent for as long as it is held, even if the object is replaced or deleted.
+
+  uint64_t size = getFileSize(fd);
+  if (size == 0) {
+    // mmap() refuses empty mappings.
+    return nullptr;
+  }
+  KJ_ASSERT(size % sizeof(capnp::word) == 0, "storage object isn't a whole number of words", size);
+
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    int error = errno;
+    KJ_FAIL_SYSCALL("mmap", error, size);
+  }
+
+  return kj::Array<const capnp::word>(reinterpret_cast<const capnp::word*>(mapping),
+                                      size / sizeof(capnp::word), mmapDisposer);
+}
+
 template <typename T>
 kj::Array<T> removeNulls(kj::Array<kj::Maybe<T>> array) {
   size_t count = 0;
@@ -100,6 +217,17 @@ kj::Array<T> removeNulls(kj::Array<kj::Maybe<T>> array) {
   return result.finish();
 }
 
+struct JobBuffer: public kj::Refcounted {
+  // Memory that an I/O pool job reads into. Jobs can't be canceled, so they must never fill in an
+  // RPC's results directly: if the caller goes away, the call's messages are freed while the job
+  // may still be queued. Instead the job holds a reference to one of these, and the event loop
+  // copies the data out once the job is done.
+
+  kj::Array<byte> bytes;
+
+  explicit JobBuffer(size_t size): bytes(kj::heapArray<byte>(size)) {}
+};
+
 static constexpr uint64_t EVENTFD_MAX = (uint64_t)-2;
 
 typedef capnp::Persistent<SturdyRef, SturdyRef::Owner> StandardPersistent;
@@ -206,6 +334,19 @@ enum class FilesystemStorage::Type: uint8_t {
   REFERENCE
 };
 
+enum class FilesystemStorage::BlobContent: uint8_t {
+  INLINE = 0,
+  // The object file holds the content. (Always the case when deduplication is disabled.)
+
+  INDEXED,
+  // The object file holds the content, and is also linked into the content store so that other
+  // blobs with the same content can share it.
+
+  REFERENCE
+  // The object file is empty. The content is shared with other blobs, and this object holds a
+  // hard link to it in `blob-refs`, named after the object's ID.
+};
+
 struct FilesystemStorage::Xattr {
   // Format of the xattr block stored on each file. On ext4 we have about 76 bytes available in
   // the inode to store this attribute, but in theory this space could get smaller in the future,
@@ -223,8 +364,13 @@ struct FilesystemStorage::Xattr {
   // either the stream is still uploading, or it failed to fully upload). Once set this
   // can never be unset.
 
-  byte reserved[2];
-  // Must be zero.
+  BlobContent blobContent;
+  // For Blobs, where the content lives. See BlobStore. Zero for other types.
+
+  bool sharesTemplate;
+  // For volumes, indicates that the volume was created by reflinking the blank ext4 template, so
+  // blocks it hasn't rewritten since may still share storage with the template. False for other
+  // types. (This byte used to be reserved, and hence is zero in older files.)
 
   uint32_t accountedBlockCount;
   // The number of 4k blocks consumed by this object the last time we considered it for
@@ -237,66 +383,461 @@ struct FilesystemStorage::Xattr {
   // What object owns this one?
 };
 
+// =======================================================================================
+
+class FilesystemStorage::BlobStore {
+  // Content-addressed store through which blobs with identical content share a single file, when
+  // Options::deduplicateBlobs is enabled.
+  //
+  // `blobs/<hash>` is a hard link to a file holding some blob's content, named by the content's
+  // BLAKE2b hash. The first blob with given content keeps it in its own object file, which is also
+  // linked into `blobs` (BlobContent::INDEXED). Later blobs with the same content instead add a
+  // hard link to that file at `blob-refs/<object ID>` and truncate their own object file
+  // (BlobContent::REFERENCE). The link count of the shared file is thus its reference count: when
+  // the link in `blobs` is the only one left, nobody is using the content and it is removed.
+  //
+  // Each blob's size is still charged in full to its owners. Deduplication only saves disk space
+  // and write bandwidth; it doesn't change accounting.
+
+public:
+  typedef kj::FixedArray<byte, 32> Hash;
+
+  BlobStore(kj::AutoCloseFd blobsFd, kj::AutoCloseFd refsFd, IoPool& ioPool, bool enabled)
+      : blobsFd(kj::mv(blobsFd)), refsFd(kj::mv(refsFd)), ioPool(ioPool),
+        refsFlow(ioPool.newFlow()), enabled(enabled) {}
+
+  inline bool isEnabled() { return enabled; }
+  // Whether new blobs should be deduplicated. Existing deduplicated blobs are handled either way.
+
+  bool addRef(const Hash& hash, ObjectId id) {
+    // If content with the given hash is already stored, link it into `blob-refs` for the given
+    // object and return true. Otherwise return false.
+
+    auto refName = id.filename('o');
+    if (linkat(blobsFd, hashName(hash).begin(), refsFd, refName.begin(), 0) == 0) {
+      return true;
+    } else {
+      int error = errno;
+      switch (error) {
+        case ENOENT:
+          return false;
+        default:
+          KJ_FAIL_SYSCALL("linkat(blob ref)", error, fixedStr(refName));
+      }
+    }
+  }
+
+  kj::Promise<void> syncRefs() {
+    // Make links previously added by addRef() durable.
+    int fd = refsFd;
+    return ioPool.runUrgent(refsFlow, [fd]() { KJ_SYSCALL(fsync(fd)); });
+  }
+
+  void index(const Hash& hash, int fd) {
+    // Add the file `fd`, which holds content with the given hash, to the store.
+
+    KJ_SYSCALL(fsetxattr(fd, HASH_XATTR_NAME, hash.begin(), hash.size(), 0));
+    auto name = hashName(hash);
+    if (linkat(AT_FDCWD, kj::str("/proc/self/fd/", fd).cStr(), blobsFd, name.begin(),
+               AT_SYMLINK_FOLLOW) < 0) {
+      int error = errno;
+      switch (error) {
+        case EEXIST:
+          // Identical content was indexed since we checked. We'll just keep our own copy.
+          break;
+        default:
+          KJ_FAIL_SYSCALL("linkat(blob content)", error, fixedStr(name));
+      }
+    }
+  }
+
+  kj::AutoCloseFd openRef(ObjectId id) {
+    auto name = id.filename('o');
+    return sandstorm::raiiOpenAt(refsFd, fixedStr(name), O_RDONLY | O_CLOEXEC);
+  }
+
+  void releaseRef(ObjectId id) {
+    auto name = id.filename('o');
+    releaseRef(fixedStr(name));
+  }
+
+  void releaseRef(kj::StringPtr name) {
+    // Drop an object's link to shared content, if it exists. `name` is the object's filename.
+
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(refsFd, name, O_RDONLY | O_CLOEXEC)) {
+      if (unlinkat(refsFd, name.cStr(), 0) < 0) {
+        int error = errno;
+        if (error == ENOENT) return;  // someone else got here first
+        KJ_FAIL_SYSCALL("unlinkat(blob ref)", error, name);
+      }
+      released(*fd);
+    }
+  }
+
+  void released(int fd) {
+    // Called after removing a link to the content file `fd`. If all that remains is the link in
+    // `blobs`, remove that too.
+
+    struct stat st;
+    KJ_SYSCALL(fstat(fd, &st));
+    if (st.st_nlink != 1) return;
+
+    Hash hash;
+    ssize_t n = fgetxattr(fd, HASH_XATTR_NAME, hash.begin(), hash.size());
+    if (n != ssize_t(hash.size())) return;  // never indexed
+
+    // Make sure the name still refers to this file before removing it. Note that another blob may
+    // take a reference between our check and the unlink, in which case its link keeps the content
+    // alive; we just lose the index entry, so the next upload of the same content won't share it.
+    auto name = hashName(hash);
+    struct stat indexed;
+    if (fstatat(blobsFd, name.begin(), &indexed, 0) < 0) return;
+    if (indexed.st_ino == st.st_ino && indexed.st_dev == st.st_dev) {
+      if (unlinkat(blobsFd, name.begin(), 0) < 0) {
+        int error = errno;
+        if (error == ENOENT) return;  // someone else got here first
+        KJ_FAIL_SYSCALL("unlinkat(blob content)", error, fixedStr(name));
+      }
+    }
+  }
+
+  kj::Promise<void> cleanupAfter(kj::Promise<void> recovered, int mainDirFd) {
+    // Remove store entries leaked by a crash: refs whose blob never committed as a REFERENCE, and
+    // content which is no longer referenced by anyone. Call at startup, before any new blobs are
+    // created. The scan itself waits for `recovered` -- i.e. for the journal to execute the
+    // transactions recovered at startup -- so that it sees their results, and considers only the
+    // entries which exist now, since blobs created in the meantime aren't committed yet.
+
+    auto refNames = sandstorm::listDirectoryFd(refsFd);
+    auto blobNames = sandstorm::listDirectoryFd(blobsFd);
+    if (refNames.size() == 0 && blobNames.size() == 0) {
+      // Nothing to do, e.g. because deduplication was never enabled.
+      return kj::READY_NOW;
+    }
+
+    return recovered.then([this,mainDirFd,KJ_MVCAP(refNames),KJ_MVCAP(blobNames)]() {
+      cleanup(mainDirFd, refNames, blobNames);
+    });
+  }
+
+  void cleanup(int mainDirFd, kj::ArrayPtr<const kj::String> refNames,
+               kj::ArrayPtr<const kj::String> blobNames) {
+    uint refCount = 0, contentCount = 0;
+
+    for (auto& name: refNames) {
+      bool keep = false;
+      KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(mainDirFd, name, O_RDONLY | O_CLOEXEC)) {
+        Xattr xattr;
+        memset(&xattr, 0, sizeof(xattr));
+        KJ_SYSCALL(fgetxattr(*fd, Xattr::NAME, &xattr, sizeof(xattr)));
+        keep = xattr.blobContent == BlobContent::REFERENCE;
+      } else {
+        // Object isn't in main. If it's on death row, the death row thread releases it.
+        keep = true;
+      }
+      if (!keep) {
+        auto fd = sandstorm::raiiOpenAt(refsFd, name, O_RDONLY | O_CLOEXEC);
+        KJ_SYSCALL(unlinkat(refsFd, name.cStr(), 0));
+        released(fd);
+        ++refCount;
+      }
+    }
+
+    for (auto& name: blobNames) {
+      struct stat st;
+      if (fstatat(blobsFd, name.cStr(), &st, 0) < 0) {
+        // Already gone, e.g. released by death row.
+        int error = errno;
+        if (error == ENOENT) continue;
+        KJ_FAIL_SYSCALL("fstatat(blob)", error, name);
+      }
+      if (st.st_nlink == 1) {
+        KJ_SYSCALL(unlinkat(blobsFd, name.cStr(), 0));
+        ++contentCount;
+      }
+    }
+
+    if (refCount > 0 || contentCount > 0) {
+      KJ_LOG(WARNING, "cleaned up leaked blob store entries", refCount, contentCount);
+    }
+  }
+
+private:
+  static constexpr const char* HASH_XATTR_NAME = "user.sandhash";
+  // Extended attribute on shared content files storing the content hash, so that we can find its
+  // entry in `blobs` when the last reference goes away.
+
+  kj::AutoCloseFd blobsFd;
+  kj::AutoCloseFd refsFd;
+  IoPool& ioPool;
+  IoPool::FlowId refsFlow;
+  bool enabled;
+
+  static kj::FixedArray<char, 65> hashName(const Hash& hash) {
+    kj::FixedArray<char, 65> result;
+    static const char DIGITS[] = "0123456789abcdef";
+    for (uint i = 0; i < hash.size(); i++) {
+      result[i * 2] = DIGITS[hash[i] >> 4];
+      result[i * 2 + 1] = DIGITS[hash[i] & 0x0fu];
+    }
+    result[64] = '\0';
+    return result;
+  }
+};
+
 class FilesystemStorage::DeathRow {
+  // Deletes objects which have been moved to the death-row directory, after first moving their
+  // children there too.
+  //
+  // Inmates are tracked in an in-memory queue, fed by moveToDeathRowIfExists(), so that we don't
+  // need to re-list the directory to find new work. The directory is only scanned once, at
+  // startup, to pick up inmates left over from a previous run. A small pool of threads drains the
+  // queue in batches, subject to a token-bucket limit on deletions per second so that deleting a
+  // large tree doesn't starve foreground I/O.
+  //
+  // The IDs of deleted objects are reported back to the event loop, so that the object factory
+  // can let go of any file descriptor it still holds for them in the warm cache. Otherwise the
+  // disk space of a deleted object would stay allocated until the descriptor happened to be
+  // evicted.
+
 public:
-  explicit DeathRow(FilesystemStorage& storage)
+  DeathRow(FilesystemStorage& storage, kj::UnixEventPort& unixEventPort,
+           uint threadCount, uint opsPerSecond)
       : storage(storage),
-        eventFd(newEventFd(0, EFD_CLOEXEC)),
-        thread([this]() { doThread(); }) {}
+        opsPerSecond(opsPerSecond),
+        burst(kj::max(opsPerSecond / 4, uint(BATCH_SIZE))),
+        eventFd(newEventFd(0, EFD_CLOEXEC | EFD_SEMAPHORE)),
+        deletedEventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        deletedEventFdObserver(unixEventPort, deletedEventFd,
+            kj::UnixEventPort::FdObserver::OBSERVE_READ),
+        deletedTask(deletedLoop().catch_([](kj::Exception&& exception) {
+          KJ_LOG(FATAL, "death row notification loop threw exception", exception);
+          abort();
+        })) {
+    {
+      auto lock = state.lockExclusive();
+      for (auto& file: sandstorm::listDirectoryFd(storage.deathRowFd)) {
+        // We don't know these inmates' IDs, but neither can they be in the warm cache, since
+        // they were moved here by a previous run.
+        lock->queue.push_back(Inmate { kj::mv(file), nullptr });
+      }
+      lock->tokens = burst;
+      lock->lastRefill = monotonicNs();
+    }
+    threads = makeThreads(kj::max(threadCount, 1u));
+  }
 
   ~DeathRow() noexcept(false) {
-    // Write the maximum possible value to the eventfd. This write will actually block until the
-    // eventfd reaches 0, which is nice because it means the processing thread will be able to
-    // receive the previous event and process it before it receives this one, resulting in clean
-    // shutdown.
-    writeEvent(eventFd, EVENTFD_MAX);
+    // Ask the threads to exit after their current batch. Anything still queued remains in the
+    // death-row directory and will be found by the startup scan next time. The threads'
+    // destructors then wait for them to exit.
+    state.lockExclusive()->shutdown = true;
+    writeEvent(eventFd, threads.size());
+  }
 
-    // Now the destructor of the thread will wait for the thread to exit.
+  void add(kj::StringPtr name, ObjectId id) {
+    // Queue an inmate which was just moved into the death-row directory.
+
+    bool wasEmpty;
+    {
+      auto lock = state.lockExclusive();
+      wasEmpty = lock->queue.empty();
+      lock->queue.push_back(Inmate { kj::heapString(name), id });
+    }
+
+    // If the queue was already non-empty then some thread is already busy with it, or will be
+    // woken by a peer when it takes its batch.
+    if (wasEmpty) writeEvent(eventFd, 1);
   }
 
-  void notifyNewInmates() {
-    // Alert deleter thread that there's new stuff.
-    writeEvent(eventFd, 1);
+  void getStats(Stats& stats) {
+    auto lock = state.lockShared();
+    stats.deathRowBacklog = lock->queue.size();
+    stats.deathRowDeleted = lock->deleted;
   }
 
 private:
+  static constexpr uint BATCH_SIZE = 32;
+  // Maximum inmates one thread takes from the queue at a time.
+
   FilesystemStorage& storage;
+  uint opsPerSecond;
+  uint burst;
+  // Deletions allowed per second (0 = unlimited) and how many may be saved up while idle.
+
+  struct Inmate {
+    kj::String name;
+    // File name in the death-row directory.
+
+    ObjectId id;
+    // The object's ID, or null if it's unknown.
+  };
+
+  struct State {
+    std::deque<Inmate> queue;
+    // Inmates not yet claimed by any thread.
+
+    double tokens = 0;
+    uint64_t lastRefill = 0;
+    // Token bucket: each inmate deleted consumes one token. `lastRefill` is in nanoseconds on the
+    // monotonic clock.
+
+    uint64_t deleted = 0;
+    bool shutdown = false;
+  };
+  kj::MutexGuarded<State> state;
+
   kj::AutoCloseFd eventFd;
-  kj::Thread thread;
+  // Semaphore-mode eventfd, signaled when the queue becomes non-empty, when a thread leaves work
+  // behind in the queue, and once per thread for shutdown.
+
+  kj::AutoCloseFd deletedEventFd;
+  kj::UnixEventPort::FdObserver deletedEventFdObserver;
+  kj::MutexGuarded<kj::Vector<ObjectId>> deletedIds;
+  // Threads add the IDs of objects they've unlinked to `deletedIds` and then signal
+  // `deletedEventFd`, which the event loop observes.
+
+  kj::Promise<void> deletedTask;
+
+  kj::Array<kj::Own<kj::Thread>> threads;
+  // Must be last, so that the threads are joined before anything else is destroyed.
+
+  kj::Array<kj::Own<kj::Thread>> makeThreads(uint count) {
+    auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(count);
+    for (uint i = 0; i < count; i++) {
+      builder.add(kj::heap<kj::Thread>([this]() { doThread(); }));
+    }
+    return builder.finish();
+  }
+
+  kj::Promise<void> deletedLoop();
+  // Hands IDs from `deletedIds` to the object factory. (Defined after ObjectFactory.)
+
+  kj::Vector<Inmate> takeBatch() {
+    // Wait for work and claim up to BATCH_SIZE inmates, as the budget allows. Returns an empty
+    // batch on shutdown.
+
+    for (;;) {
+      uint64_t waitNs = 0;
+      {
+        auto lock = state.lockExclusive();
+        if (lock->shutdown) return {};
+
+        if (!lock->queue.empty()) {
+          size_t count = kj::min(lock->queue.size(), size_t(BATCH_SIZE));
+
+          if (opsPerSecond != 0) {
+            uint64_t time = monotonicNs();
+            lock->tokens = kj::min(double(burst),
+                lock->tokens + (time - lock->lastRefill) * 1e-9 * opsPerSecond);
+            lock->lastRefill = time;
+
+            if (lock->tokens < 1) {
+              waitNs = (1 - lock->tokens) * 1e9 / opsPerSecond;
+              count = 0;
+            } else {
+              count = kj::min(count, size_t(lock->tokens));
+              lock->tokens -= count;
+            }
+          }
+
+          if (count > 0) {
+            kj::Vector<Inmate> batch(count);
+            for (size_t i = 0; i < count; i++) {
+              batch.add(kj::mv(lock->queue.front()));
+              lock->queue.pop_front();
+            }
+            if (!lock->queue.empty()) writeEvent(eventFd, 1);
+            return batch;
+          }
+        }
+      }
+
+      if (waitNs > 0) {
+        // Over budget. Sleep until a token is available.
+        struct timespec ts = { time_t(waitNs / 1000000000), long(waitNs % 1000000000) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+      } else {
+        // Wait for signal that more inmates have arrived.
+        readEvent(eventFd);
+      }
+    }
+  }
+
+  bool execute(kj::StringPtr file) {
+    // Delete one inmate, but not before moving its children to death row. Returns false if it
+    // was already gone.
+
+    kj::AutoCloseFd fd;
+    KJ_IF_MAYBE(f, sandstorm::raiiOpenAtIfExists(storage.deathRowFd, file, O_RDONLY | O_CLOEXEC)) {
+      fd = kj::mv(*f);
+    } else {
+      // Already deleted; it must have been queued twice.
+      return false;
+    }
+
+    Xattr xattr;
+    memset(&xattr, 0, sizeof(xattr));
+    KJ_SYSCALL(fgetxattr(fd, Xattr::NAME, &xattr, sizeof(xattr)));
+    if (isStoredObjectType(xattr.type)) {
+      // Read children to move them to death row.
+      capnp::StreamFdMessageReader reader(fd.get());
 
-  // TODO(perf): Replace use of eventFd in DeathRow and in Journal with a thread signaling
-  //   primitive ultimately based on futex?
+      for (auto child: reader.getRoot<StoredChildIds>().getChildren()) {
+        storage.moveToDeathRowIfExists(child);
+      };
+    }
+    KJ_SYSCALL(unlinkat(storage.deathRowFd, file.cStr(), 0));
+
+    if (xattr.type == Type::VOLUME) {
+      // Drop the volume's changed-block map, if it has one.
+      if (unlinkat(storage.changedBlocksFd, file.cStr(), 0) < 0) {
+        int error = errno;
+        if (error != ENOENT) {
+          KJ_FAIL_SYSCALL("unlinkat(changed blocks)", error, file);
+        }
+      }
+    }
+
+    if (xattr.type == Type::BLOB) {
+      // Release the blob's share of deduplicated content.
+      switch (xattr.blobContent) {
+        case BlobContent::INLINE:
+          break;
+        case BlobContent::INDEXED:
+          storage.blobStore->released(fd);
+          break;
+        case BlobContent::REFERENCE:
+          storage.blobStore->releaseRef(file);
+          break;
+      }
+    }
+
+    return true;
+  }
 
   void doThread() {
     KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
       for (;;) {
-        // Scan directory, delete all files.
-        auto files = sandstorm::listDirectoryFd(storage.deathRowFd);
-        if (files.size() == 0) {
-          // Wait for signal that more files have arrived to be deleted.
-          uint64_t count = readEvent(eventFd);
-          if (count == EVENTFD_MAX) {
-            // Clean shutdown requested.
-            break;
-          }
-        } else {
-          // Delete the files, but not before moving their children to death row.
-          for (auto& file: files) {
-            auto fd = sandstorm::raiiOpenAt(storage.deathRowFd, file, O_RDONLY | O_CLOEXEC);
-            Xattr xattr;
-            memset(&xattr, 0, sizeof(xattr));
-            KJ_SYSCALL(fgetxattr(fd, Xattr::NAME, &xattr, sizeof(xattr)));
-            if (isStoredObjectType(xattr.type)) {
-              // Read children to move them to death row.
-              capnp::StreamFdMessageReader reader(fd.get());
-
-              for (auto child: reader.getRoot<StoredChildIds>().getChildren()) {
-                storage.moveToDeathRowIfExists(child, false);
-              };
-            }
-            KJ_SYSCALL(unlinkat(storage.deathRowFd, file.cStr(), 0));
+        auto batch = takeBatch();
+        if (batch.size() == 0) {
+          // Clean shutdown requested.
+          break;
+        }
+
+        kj::Vector<ObjectId> ids;
+        for (auto& inmate: batch) {
+          if (execute(inmate.name) && inmate.id != nullptr) {
+            ids.add(inmate.id);
           }
         }
+
+        state.lockExclusive()->deleted += batch.size();
+
+        if (ids.size() > 0) {
+          deletedIds.lockExclusive()->addAll(ids);
+          writeEvent(deletedEventFd, 1);
+        }
       }
     })) {
       // exception!
@@ -311,10 +852,12 @@ private:
 class FilesystemStorage::Journal {
   struct Entry;
 public:
-  Journal(FilesystemStorage& storage, kj::UnixEventPort& unixEventPort, kj::AutoCloseFd journalFd)
+  Journal(FilesystemStorage& storage, kj::UnixEventPort& unixEventPort, kj::AutoCloseFd journalFd,
+          uint executorCount)
       : storage(storage),
         journalFd(kj::mv(journalFd)),
         journalEnd(getFileSize(this->journalFd)),
+        journalStart(journalEnd),
         journalSynced(journalEnd),
         journalExecuted(journalEnd),
         journalReadyEventFd(newEventFd(0, EFD_CLOEXEC)),
@@ -325,12 +868,26 @@ public:
           KJ_LOG(FATAL, "journal sync loop threw exception", exception);
           abort();
         })),
+        executorDoneEventFd(newEventFd(0, EFD_CLOEXEC | EFD_SEMAPHORE)),
+        executors(makeExecutors(kj::max(executorCount, 1u))),
+        recoveredEventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        recoveredEventFdObserver(unixEventPort, recoveredEventFd,
+            kj::UnixEventPort::FdObserver::OBSERVE_READ),
+        recoveryStartTime(monotonicNs()),
+        recoveryEnd(loadBacklog()),
         processingThread([this]() { doProcessingThread(); }) {
     KJ_ON_SCOPE_FAILURE(writeEvent(journalReadyEventFd, EVENTFD_MAX));
-    doRecovery();
+
+    if (staleStagingFiles.size() > 0) {
+      stagingCleanupThread = kj::heap<kj::Thread>([this]() { deleteStaleStaging(); });
+    }
   }
 
   ~Journal() noexcept(false) {
+    // Let the staging cleanup thread quit early; whatever it doesn't get to is cleaned up on the
+    // next startup.
+    __atomic_store_n(&stopStagingCleanup, true, __ATOMIC_RELAXED);
+
     // Write the maximum possible value to the eventfd. This write will actually block until the
     // eventfd reaches 0, which is nice because it means the processing thread will be able to
     // receive the previous event and process it before it receives this one, resulting in clean
@@ -368,6 +925,33 @@ public:
     return storage.createTempFile();
   }
 
+  kj::Promise<void> whenRecovered() {
+    // Resolves once all transactions recovered from the journal at startup have been executed.
+    // The journal serves reads (via its cache) and accepts new transactions before then, so this
+    // is only needed by startup tasks that inspect the on-disk state directly. Call at most once.
+
+    return recoveredEventFdObserver.whenBecomesReadable().then([this]() -> kj::Promise<void> {
+      uint64_t count;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = read(recoveredEventFd, &count, sizeof(count)));
+      if (n < 0) {
+        // Oops, not actually ready.
+        return whenRecovered();
+      }
+      return kj::READY_NOW;
+    });
+  }
+
+  inline bool isTransactionInProgress() { return txInProgress; }
+  // Whether a `Transaction` exists which hasn't been committed. Only one may exist at a time.
+
+  void getStats(Stats& stats) {
+    stats.journalTransactions = transactionCount;
+    stats.journalBytesWritten = journalEnd - journalStart;
+    stats.journalSyncs = __atomic_load_n(&journalSyncCount, __ATOMIC_RELAXED);
+    stats.objectSyncs = __atomic_load_n(&objectSyncCount, __ATOMIC_RELAXED);
+  }
+
   class Transaction: private kj::ExceptionCallback {
   public:
     explicit Transaction(Journal& journal): journal(journal) {
@@ -527,6 +1111,7 @@ public:
       auto bytes = entries.asPtr().asBytes();
       pwriteAll(journal.journalFd, bytes.begin(), bytes.size(), journal.journalEnd);
       journal.journalEnd += bytes.size();
+      ++journal.transactionCount;
 
       // Notify journal thread.
       writeEvent(journal.journalReadyEventFd, entries.size());
@@ -631,9 +1216,16 @@ private:
 
   kj::AutoCloseFd journalFd;
   uint64_t journalEnd;
+  uint64_t journalStart;
   uint64_t journalSynced;
   uint64_t journalExecuted;
 
+  uint64_t transactionCount = 0;
+  uint64_t journalSyncCount = 0;
+  uint64_t objectSyncCount = 0;
+  // Counters for getStats(). The sync counts are updated from the journal threads, with relaxed
+  // atomics.
+
   kj::AutoCloseFd journalReadyEventFd;
   kj::AutoCloseFd journalProcessedEventFd;
   kj::UnixEventPort::FdObserver journalProcessedEventFdObserver;
@@ -678,6 +1270,8 @@ private:
 
   uint32_t nextStagingId = 0;
   // Counter to use to generate staging file names. The names are 7-digit zero-padded hex.
+  // Starts past any staging file or journal entry that existed at startup, since recovered
+  // entries may still be waiting to execute.
 
   bool txInProgress = false;
   // True if a `Transaction` exists which has not been committed.
@@ -700,8 +1294,60 @@ private:
   // be overwritten with later modifications and therefore we must check the current value of
   // the cache entry, not just delete it indiscriminently.
 
+  struct Executor {
+    // A thread which executes the entries for a subset of objects, as directed by the processing
+    // thread.
+
+    struct State {
+      kj::Maybe<kj::Function<void()>> work;
+      kj::Maybe<kj::Exception> exception;
+      bool shutdown = false;
+    };
+    kj::MutexGuarded<State> state;
+
+    kj::AutoCloseFd eventFd;
+    // Semaphore-mode eventfd, signaled when `work` is set and for shutdown.
+
+    kj::Thread thread;
+
+    explicit Executor(Journal& journal)
+        : eventFd(newEventFd(0, EFD_CLOEXEC | EFD_SEMAPHORE)),
+          thread([this,&journal]() { journal.doExecutorThread(*this); }) {}
+
+    ~Executor() noexcept(false) {
+      state.lockExclusive()->shutdown = true;
+      writeEvent(eventFd, 1);
+    }
+  };
+
+  kj::AutoCloseFd executorDoneEventFd;
+  // Semaphore-mode eventfd which each executor signals when it finishes its work.
+
+  kj::Array<kj::Own<Executor>> executors;
+  // Only the processing thread gives executors work.
+
+  kj::AutoCloseFd recoveredEventFd;
+  kj::UnixEventPort::FdObserver recoveredEventFdObserver;
+  // Signaled by the processing thread once the entries recovered at startup have been executed.
+
+  kj::Array<kj::String> staleStagingFiles;
+  // Staging files left behind by transactions that never made it into the journal, found by
+  // loadBacklog() and deleted by `stagingCleanupThread`. (Declared before `recoveryEnd`, since
+  // loadBacklog() fills it in.)
+
+  uint64_t recoveryStartTime;
+  uint64_t recoveryEnd;
+  // When recovery started (monotonic ns), and the journal offset through which entries recovered
+  // at startup extend. `recoveryEnd` must be initialized (by loadBacklog()) before the processing
+  // thread starts.
+
+  bool stopStagingCleanup = false;
+  // Set (atomically) on shutdown.
+
   kj::Thread processingThread;
 
+  kj::Maybe<kj::Own<kj::Thread>> stagingCleanupThread;
+
   kj::Promise<void> syncQueueLoop() {
     return journalProcessedEventFdObserver.whenBecomesReadable().then([this]() {
       uint64_t byteCount;
@@ -732,62 +1378,407 @@ private:
     });
   }
 
-  void doRecovery() {
-    // Find the first actual data (skip leading hole).
-  retry:
-    off_t position = lseek(journalFd, 0, SEEK_DATA);
-    if (position < 0) {
-      int error = errno;
-      if (error == EINTR) {
-        goto retry;
-      } else if (error == ENXIO) {
-        // The journal is empty.
-        return;
-      } else {
-        KJ_FAIL_SYSCALL("lseek", error);
-      }
-    }
-
-    if (journalEnd > position) {
-      // Recover from previous journal failure.
-
-      // Read all entries.
-      auto entries = kj::heapArray<Entry>((journalEnd - position) / sizeof(Entry));
-      preadAllOrZero(journalFd, entries.begin(), entries.asBytes().size(), position);
-
-      // Process valid entries and discard any incomplete transaction.
-      for (auto& entry: validateEntries(entries, true)) {
-        executeEntry(entry);
-      }
+  kj::Array<kj::Own<Executor>> makeExecutors(uint count) {
+    auto builder = kj::heapArrayBuilder<kj::Own<Executor>>(count);
+    for (uint i = 0; i < count; i++) {
+      builder.add(kj::heap<Executor>(*this));
     }
-
-    storage.deleteAllStaging();
+    return builder.finish();
   }
 
-  void doProcessingThread() {
-    // This thread reads the journal, makes sure things are synced to disk, and actually executes
-    // the transactions.
+  uint executorFor(ObjectId id) {
+    return id.id[0] % executors.size();
+  }
 
+  void doExecutorThread(Executor& executor) {
     KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
-      // Get the current position from journalSynced rather than journalEnd since journalEnd could
-      // possibly have changed already, but journalSynced can't change until we signal back to the
-      // main thread.
+      for (;;) {
+        readEvent(executor.eventFd);
+
+        kj::Maybe<kj::Function<void()>> work;
+        {
+          auto lock = executor.state.lockExclusive();
+          if (lock->work == nullptr) {
+            KJ_ASSERT(lock->shutdown, "journal executor signaled with no work");
+            break;
+          }
+          work = kj::mv(lock->work);
+          lock->work = nullptr;
+        }
+
+        auto error = kj::runCatchingExceptions([&]() {
+          KJ_IF_MAYBE(w, work) {
+            (*w)();
+          }
+        });
+        executor.state.lockExclusive()->exception = kj::mv(error);
+        writeEvent(executorDoneEventFd, 1);
+      }
+    })) {
+      // exception!
+      KJ_LOG(FATAL, "exception in journal executor thread", *exception);
+      abort();
+    }
+  }
+
+  void runOnExecutors(kj::Function<void(uint executor)> func) {
+    // Call `func(i)` for every executor `i`, on that executor's thread, in parallel. Returns when
+    // all calls have completed, rethrowing the first exception if any failed. `func` must
+    // therefore be safe to call concurrently for different executors.
+
+    for (auto i: kj::indices(executors)) {
+      executors[i]->state.lockExclusive()->work = kj::Function<void()>([&func,i]() { func(i); });
+      writeEvent(executors[i]->eventFd, 1);
+    }
+
+    for (size_t i = 0; i < executors.size(); i++) {
+      readEvent(executorDoneEventFd);
+    }
+
+    for (auto& executor: executors) {
+      kj::Maybe<kj::Exception> exception;
+      {
+        auto lock = executor->state.lockExclusive();
+        exception = kj::mv(lock->exception);
+        lock->exception = nullptr;
+      }
+      KJ_IF_MAYBE(e, exception) {
+        kj::throwFatalException(kj::mv(*e));
+      }
+    }
+  }
+
+  void executeInParallel(kj::ArrayPtr<const Entry> entries) {
+    // Execute the entries with each object's entries on its own executor, in order.
+    //
+    // Entries for different objects are independent, with two exceptions: creating an object
+    // checks that its owner still exists, and moving an object to death row lets the death row
+    // thread go looking for its children, so both must observe the other having happened (or
+    // not) in journal order. Such entries are split into successive "waves", and each wave is
+    // finished on all executors before the next starts. Usually there is only one wave.
+
+    std::unordered_map<ObjectId, uint, ObjectId::Hash> objectWave;
+    // For each object touched so far, the wave of its latest entry.
+
+    std::unordered_map<ObjectId, uint, ObjectId::Hash> childWave;
+    // For each owner, the wave of the latest entry creating one of its children.
+
+    kj::Vector<kj::Vector<kj::Vector<const Entry*>>> waves;
+    // waves[w][executor] = entries, in order
+
+    for (auto& entry: entries) {
+      uint executor = executorFor(entry.objectId);
+      uint wave = 0;
+
+      auto iter = objectWave.find(entry.objectId);
+      if (iter != objectWave.end()) {
+        // Same executor, so ordering within the wave suffices.
+        wave = iter->second;
+      }
+
+      if (entry.type == Entry::Type::CREATE_OBJECT && entry.xattr.owner != nullptr) {
+        auto ownerIter = objectWave.find(entry.xattr.owner);
+        if (ownerIter != objectWave.end()) {
+          uint ownerExecutor = executorFor(entry.xattr.owner);
+          wave = kj::max(wave, ownerIter->second + (ownerExecutor == executor ? 0 : 1));
+        }
+      } else if (entry.type == Entry::Type::MOVE_TO_DEATH_ROW) {
+        auto childIter = childWave.find(entry.objectId);
+        if (childIter != childWave.end()) {
+          wave = kj::max(wave, childIter->second + 1);
+        }
+      }
+
+      objectWave[entry.objectId] = wave;
+      if (entry.type == Entry::Type::CREATE_OBJECT && entry.xattr.owner != nullptr) {
+        uint& w = childWave[entry.xattr.owner];
+        w = kj::max(w, wave);
+      }
+
+      while (waves.size() <= wave) {
+        auto& perExecutor = waves.add();
+        for (size_t i = 0; i < executors.size(); i++) {
+          perExecutor.add();
+        }
+      }
+      waves[wave][executor].add(&entry);
+    }
+
+    for (auto& wave: waves) {
+      runOnExecutors([&](uint executor) {
+        for (auto entry: wave[executor]) {
+          executeEntry(*entry);
+        }
+      });
+    }
+  }
+
+  static constexpr size_t RECOVERY_BUFFER_ENTRIES = 4096;
+  // Recovery reads the journal this many entries (256k) at a time.
+
+  static constexpr size_t MAX_BATCH_ENTRIES = 4096;
+  // The processing thread reads at most this many entries at a time, rounded to whole
+  // transactions, so that a large backlog doesn't have to be held in memory at once.
+
+  static constexpr uint64_t RECOVERY_PROGRESS_INTERVAL_NS = 5000000000ull;
+
+  uint64_t loadBacklog() {
+    // Recover from an unclean shutdown. We don't execute the journal here. Instead, the valid
+    // entries remaining in it are loaded into `cache`, exactly as if they were transactions that
+    // had just been written, and then handed to the processing thread. That way, the storage
+    // node can serve requests -- with the cache covering objects whose updates haven't been
+    // executed yet -- while the processing thread catches up on the backlog in the background.
+    //
+    // Called from the constructor's initializer list, before the processing thread starts.
+    // Returns the end offset of the recovered entries.
+
+    // Note which staging files exist. Those not referenced by a valid journal entry are garbage.
+    std::unordered_set<uint64_t> referencedStaging;
+    uint64_t stagingIdLimit = 0;
+    auto stagingFiles = sandstorm::listDirectoryFd(storage.stagingDirFd);
+    for (auto& name: stagingFiles) {
+      uint64_t id = strtoull(name.cStr(), nullptr, 16);
+      stagingIdLimit = kj::max(stagingIdLimit, id + 1);
+    }
+
+    // Find the first actual data (skip leading hole).
+    off_t dataStart = seekExtent(journalFd, 0, SEEK_DATA);
+    uint64_t start = dataStart < 0 ? journalEnd : kj::min(uint64_t(dataStart), journalEnd);
+
+    // Stream through the journal, loading whole transactions.
+    uint64_t offset = start;
+    uint64_t entryCount = 0;
+    auto buffer = kj::heapArray<Entry>(RECOVERY_BUFFER_ENTRIES);
+    while (offset < journalEnd) {
+      size_t remaining = (journalEnd - offset) / sizeof(Entry);
+      if (remaining == 0) break;  // partial trailing entry; discard
+      size_t count = kj::min(remaining, buffer.size());
+      bool atEnd = count == remaining;
+      auto chunk = buffer.slice(0, count);
+      preadAllOrZero(journalFd, chunk.begin(), chunk.asBytes().size(), offset);
+
+      kj::ArrayPtr<const Entry> valid;
+      if (atEnd) {
+        // Discard any incomplete transaction at the end.
+        valid = validateEntries(chunk, true);
+      } else {
+        size_t complete = wholeTransactions(chunk);
+        if (complete == 0) {
+          size_t needed = chunk[0].txSize;
+          if (needed == 0) {
+            // ext4 zero-extension, which must extend to the end. Check that it does, a buffer at
+            // a time, and then discard it like an incomplete transaction.
+            checkZeroTail(buffer.asBytes(), offset);
+            KJ_LOG(ERROR, "detected ext4 zero-extension on journal recovery");
+            break;
+          } else if (needed > remaining) {
+            // The transaction runs past the end of the journal, so it's the incomplete one at the
+            // end, whatever its size claims. Don't let a bogus size make us read it all at once.
+            break;
+          }
+
+          // A single transaction doesn't fit in the buffer. Read a bigger chunk.
+          KJ_ASSERT(needed > buffer.size());
+          buffer = kj::heapArray<Entry>(needed);
+          continue;
+        }
+        valid = validateEntries(chunk.slice(0, complete), false);
+      }
+
+      for (auto& entry: valid) {
+        offset += sizeof(Entry);
+        cacheRecoveredEntry(entry, offset);
+        if (entry.stagingId != 0) {
+          referencedStaging.insert(entry.stagingId);
+          stagingIdLimit = kj::max(stagingIdLimit, entry.stagingId + 1);
+        }
+      }
+      entryCount += valid.size();
+
+      if (atEnd) break;
+    }
+
+    if (offset < journalEnd) {
+      // Drop the incomplete transaction so that new ones are appended right after the backlog.
+      KJ_LOG(WARNING, "discarding incomplete transaction from journal", journalEnd - offset);
+      KJ_SYSCALL(ftruncate(journalFd, offset));
+    }
+
+    journalEnd = offset;
+    journalStart = offset;
+    journalSynced = start;
+    journalExecuted = start;
+    nextStagingId = stagingIdLimit;
+
+    auto stale = kj::heapArrayBuilder<kj::String>(stagingFiles.size());
+    for (auto& name: stagingFiles) {
+      if (referencedStaging.count(strtoull(name.cStr(), nullptr, 16)) == 0) {
+        stale.add(kj::mv(name));
+      }
+    }
+    staleStagingFiles = stale.finish();
+
+    if (entryCount > 0) {
+      KJ_LOG(INFO, "journal recovery: loaded backlog; executing in background",
+             entryCount, staleStagingFiles.size(),
+             (monotonicNs() - recoveryStartTime) / 1000000, "ms");
+
+      // The processing thread will sync and execute these like any other transactions.
+      writeEvent(journalReadyEventFd, entryCount);
+    }
+
+    return offset;
+  }
+
+  void cacheRecoveredEntry(const Entry& entry, uint64_t endOffset) {
+    // Update the cache for a recovered entry, as the Transaction method that wrote it did.
+
+    CacheEntry& cache = this->cache[entry.objectId];
+    bool isNew = cache.location == CacheEntry::Location::UNDEFINED;
+    cache.lastUpdate = endOffset;
+    cacheDropQueue.push({endOffset, entry.objectId});
+
+    switch (entry.type) {
+      case Entry::Type::CREATE_OBJECT:
+      case Entry::Type::UPDATE_OBJECT:
+        cache.location = CacheEntry::Location::STAGING;
+        cache.stagingId = entry.stagingId;
+        cache.xattr = entry.xattr;
+        break;
+      case Entry::Type::UPDATE_XATTR:
+        cache.xattr = entry.xattr;
+        break;
+      case Entry::Type::MOVE_TO_DEATH_ROW:
+        cache.location = CacheEntry::Location::DELETED;
+        if (isNew) {
+          memset(&cache.xattr, 0, sizeof(cache.xattr));
+          KJ_IF_MAYBE(fd, storage.openObject(entry.objectId)) {
+            KJ_SYSCALL(fgetxattr(*fd, Xattr::NAME, &cache.xattr, sizeof(cache.xattr)));
+          }
+        }
+        cache.xattr.owner = nullptr;
+        break;
+    }
+  }
+
+  void checkZeroTail(kj::ArrayPtr<byte> buffer, uint64_t offset) {
+    // Verify that the journal is all zeros from `offset` to the end, using `buffer` as scratch.
+
+    while (offset < journalEnd) {
+      auto chunk = buffer.slice(0, kj::min(buffer.size(), journalEnd - offset));
+      preadAllOrZero(journalFd, chunk.begin(), chunk.size(), offset);
+      for (auto b: chunk) {
+        if (KJ_UNLIKELY(b != 0)) {
+          KJ_FAIL_ASSERT("journal corrupted");
+        }
+      }
+      offset += chunk.size();
+    }
+  }
+
+  static size_t wholeTransactions(kj::ArrayPtr<const Entry> entries) {
+    // Returns the number of leading entries which form complete transactions. Stops early at an
+    // entry with zero `txSize`, which validateEntries() deals with.
+
+    size_t i = 0;
+    while (i < entries.size()) {
+      uint32_t txSize = entries[i].txSize;
+      if (txSize == 0 || txSize > entries.size() - i) break;
+      i += txSize;
+    }
+    return i;
+  }
+
+  void deleteStaleStaging() {
+    // Runs on `stagingCleanupThread`, concurrently with execution of the backlog. None of these
+    // files is referenced by the journal, and new staging IDs never collide with them.
+
+    uint64_t startTime = monotonicNs();
+    size_t count = 0;
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      for (auto& name: staleStagingFiles) {
+        if (__atomic_load_n(&stopStagingCleanup, __ATOMIC_RELAXED)) break;
+        if (unlinkat(storage.stagingDirFd, name.cStr(), 0) < 0) {
+          int error = errno;
+          if (error != ENOENT) {
+            KJ_FAIL_SYSCALL("unlinkat(staging)", error, name);
+          }
+        }
+        ++count;
+      }
+    })) {
+      KJ_LOG(ERROR, "failed to clean up staging", *exception);
+    }
+
+    KJ_LOG(INFO, "journal recovery: deleted stale staging files", count,
+           (monotonicNs() - startTime) / 1000000, "ms");
+  }
+
+  void doProcessingThread() {
+    // This thread reads the journal, makes sure things are synced to disk, and actually executes
+    // the transactions.
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      // Get the current position from journalSynced rather than journalEnd since journalEnd could
+      // possibly have changed already, but journalSynced can't change until we signal back to the
+      // main thread. At startup, this is the beginning of the recovered backlog.
       uint64_t position = journalSynced;
+      uint64_t recoveryStart = position;
+
+      bool recovered = false;
+      uint64_t lastProgressTime = recoveryStartTime;
+      uint64_t pendingCount = 0;
 
       for (;;) {
-        // Wait for some data to read.
-        uint64_t count = readEvent(journalReadyEventFd);
+        if (!recovered) {
+          uint64_t time = monotonicNs();
+          if (position >= recoveryEnd) {
+            recovered = true;
+            if (recoveryEnd > recoveryStart) {
+              KJ_LOG(INFO, "journal recovery: backlog executed",
+                     (time - recoveryStartTime) / 1000000, "ms");
+            }
+            writeEvent(recoveredEventFd, 1);
+          } else if (time - lastProgressTime >= RECOVERY_PROGRESS_INTERVAL_NS) {
+            lastProgressTime = time;
+            KJ_LOG(INFO, "journal recovery: in progress", recoveryEnd - position, "bytes remain");
+          }
+        }
 
-        KJ_ASSERT(count > 0);
+        if (pendingCount == 0) {
+          // Wait for some data to read.
+          uint64_t count = readEvent(journalReadyEventFd);
 
-        if (count == EVENTFD_MAX) {
-          // Clean shutdown requested.
-          break;
+          KJ_ASSERT(count > 0);
+
+          if (count == EVENTFD_MAX) {
+            // Clean shutdown requested.
+            break;
+          }
+
+          pendingCount = count;
         }
 
-        // Read the entries.
+        // Read the entries, a bounded number of whole transactions at a time.
+        size_t count = kj::min(pendingCount, uint64_t(MAX_BATCH_ENTRIES));
         auto entries = kj::heapArray<Entry>(count);
         preadAllOrZero(journalFd, entries.begin(), entries.asBytes().size(), position);
+        if (count < pendingCount) {
+          size_t complete = wholeTransactions(entries);
+          if (complete == 0) {
+            // A single transaction bigger than the batch size.
+            count = entries[0].txSize;
+            KJ_ASSERT(count > entries.size() && count <= pendingCount, "journal corrupted");
+            entries = kj::heapArray<Entry>(count);
+            preadAllOrZero(journalFd, entries.begin(), entries.asBytes().size(), position);
+          } else if (complete < count) {
+            count = complete;
+            auto trimmed = kj::heapArray<Entry>(count);
+            memcpy(trimmed.begin(), entries.begin(), trimmed.asBytes().size());
+            entries = kj::mv(trimmed);
+          }
+        }
+        pendingCount -= count;
 
         // Make sure the journal is synced. We do fsync() instead of fdatasync() because:
         // - We want to make sure that the metadata for all staging files used in this transaction
@@ -797,17 +1788,18 @@ private:
         //   journal when adding a transaction, therefore a metadata flush is necessary even if
         //   we use fdatasync().
         KJ_SYSCALL(fsync(journalFd));
+        __atomic_fetch_add(&journalSyncCount, 1, __ATOMIC_RELAXED);
 
         // Post back to main thread that sync is finished through these bytes.
         uint64_t byteCount = entries.asBytes().size();
         writeEvent(journalProcessedEventFd, byteCount);
 
         // Now process them.
-        for (auto& entry: validateEntries(entries, false)) {
-          executeEntry(entry);
-        }
+        auto validEntries = validateEntries(entries, false);
+        executeInParallel(validEntries);
 
-        storage.sync();
+        // Make sure the changes are on disk before we punch them out of the journal.
+        syncExecuted(validEntries);
 
         // Now we can punch out any journal pages we've completed.
         static constexpr uint64_t pageMask = ~4095ull;
@@ -897,6 +1889,67 @@ private:
     return kj::arrayPtr(entries.begin(), end);
   }
 
+  static constexpr uint MAX_TARGETED_SYNC = 64;
+  // If a batch touches more objects than this, give up on syncing them individually and syncfs()
+  // the whole filesystem instead.
+
+  void syncExecuted(kj::ArrayPtr<const Entry> entries) {
+    // Make the effects of the given entries durable, after they've been executed. We fsync() only
+    // the objects and directories the entries actually touched: a syncfs() would also have to
+    // flush every dirty page of every volume on the machine, and those have nothing to do with
+    // the journal.
+
+    std::unordered_set<ObjectId, ObjectId::Hash> objects;
+    bool stagingChanged = false;
+    bool deathRowChanged = false;
+    for (auto& entry: entries) {
+      switch (entry.type) {
+        case Entry::Type::CREATE_OBJECT:
+        case Entry::Type::UPDATE_OBJECT:
+          objects.insert(entry.objectId);
+          stagingChanged = true;
+          break;
+        case Entry::Type::UPDATE_XATTR:
+          objects.insert(entry.objectId);
+          break;
+        case Entry::Type::MOVE_TO_DEATH_ROW:
+          // Only the directories change.
+          deathRowChanged = true;
+          break;
+      }
+    }
+
+    if (objects.size() > MAX_TARGETED_SYNC) {
+      storage.sync();
+      __atomic_fetch_add(&objectSyncCount, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    // Each executor syncs its own objects, so that the fsync()s overlap.
+    auto perExecutor = kj::heapArray<kj::Vector<ObjectId>>(executors.size());
+    for (auto& id: objects) {
+      perExecutor[executorFor(id)].add(id);
+    }
+    runOnExecutors([&](uint executor) {
+      for (auto& id: perExecutor[executor]) {
+        // If the object isn't there, a later entry in the batch moved it to death row, in which
+        // case its content no longer matters.
+        KJ_IF_MAYBE(fd, storage.openObject(id)) {
+          KJ_SYSCALL(fsync(*fd));
+          __atomic_fetch_add(&objectSyncCount, 1, __ATOMIC_RELAXED);
+        }
+      }
+    });
+
+    KJ_SYSCALL(fsync(storage.mainDirFd));
+    if (stagingChanged) {
+      KJ_SYSCALL(fsync(storage.stagingDirFd));
+    }
+    if (deathRowChanged) {
+      KJ_SYSCALL(fsync(storage.deathRowFd));
+    }
+  }
+
   void executeEntry(const Entry& entry) {
     switch (entry.type) {
       case Entry::Type::CREATE_OBJECT:
@@ -917,7 +1970,13 @@ private:
 
 // =======================================================================================
 
-class FilesystemStorage::ObjectFactory: public kj::Refcounted {
+static constexpr size_t MAX_PENDING_SIZE_CHANGES = 256;
+static constexpr kj::Duration SIZE_FLUSH_DELAY = 1 * kj::SECONDS;
+// Deferred size changes are written out once this many objects have them, or after this delay,
+// whichever comes first.
+
+class FilesystemStorage::ObjectFactory: public kj::Refcounted,
+                                        private kj::TaskSet::ErrorHandler {
   // Class responsible for keeping track of live objects.
   //
   // This is refcounted because ObjectBase's destructor needs to call it, and it's hard to ensure
@@ -926,8 +1985,24 @@ class FilesystemStorage::ObjectFactory: public kj::Refcounted {
   // tests.)
 
 public:
-  explicit ObjectFactory(Journal& journal, kj::Timer& timer,
-                         Restorer<SturdyRef>::Client&& restorer);
+  explicit ObjectFactory(Journal& journal, kj::Own<IoPool> ioPool, BlobStore& blobStore,
+                         kj::AutoCloseFd blankExt4Template, kj::AutoCloseFd changedBlocksDir,
+                         kj::Timer& timer, Restorer<SturdyRef>::Client&& restorer,
+                         const Options& options);
+
+  struct WarmObject {
+    // What's left of an object after its last reference is dropped, kept around in case it's
+    // opened again soon. Equivalent to ObjectBase's CurrentData for a committed object.
+
+    kj::AutoCloseFd fd;
+    IoPool::FlowId flow;
+    Xattr xattr;
+    kj::Array<ObjectId> children;
+    uint32_t storedChildIdsWords;
+    uint32_t storedObjectWords;
+    kj::Array<const capnp::word> mapping;
+    // The file mapped into memory, or empty if it wasn't mapped.
+  };
 
   template <typename T, typename U>
   struct ClientObjectPair {
@@ -952,14 +2027,30 @@ public:
   // If the given capability points to an OwnedStorage implemented by this server, get the
   // underlying ObjectBase.
 
-  void destroyed(ObjectBase& object);
-  // Called by destructor of ObjectBase. Shouldn't be called anywhere else.
+  void destroyed(ObjectBase& object, kj::Maybe<WarmObject> warm);
+  // Called by destructor of ObjectBase. Shouldn't be called anywhere else. `warm` is the object's
+  // on-disk state, if it's committed, to be added to the warm cache.
 
   auto restoreRequest() { return restorer.restoreRequest(); }
   auto dropRequest() { return restorer.dropRequest(); }
   // Call methods on the `Restorer` capbaility.
 
   inline kj::Timer& getTimer() { return timer; }
+  inline IoPool& getIoPool() { return *ioPool; }
+  inline BlobStore& getBlobStore() { return blobStore; }
+  inline int getBlankExt4Template() { return blankExt4Template; }
+  inline int getChangedBlocksDir() { return changedBlocksDir; }
+  inline size_t getStreamWindowBytes() { return streamWindowBytes; }
+  inline kj::Maybe<kj::Duration> getVolumeCompressionDelay() { return volumeCompressionDelay; }
+
+  void saveChangedBlocks(ObjectId id, kj::Array<byte> content);
+  // Write a closed volume's changed-block map to `changed-blocks/<id>`. The write happens on the
+  // I/O pool, since the map of a large volume can be megabytes.
+
+  kj::Maybe<kj::Array<byte>> takeChangedBlocks(ObjectId id);
+  // If a map saved by saveChangedBlocks() might not have reached the file yet, cancel the write --
+  // if it hasn't happened -- and return the map. A volume which is reopened must use this in
+  // preference to the file.
 
   void modifyTransitiveSize(ObjectId id, int64_t deltaBlocks, Journal::Transaction& txn);
   // Update the transitive size of the given object and its parents, adding `deltaBlocks` to each.
@@ -968,11 +2059,47 @@ public:
   void disowned(ObjectId id);
   // Notes that the given object ID has been disowned by its owner. If the object is live, it needs
   // to have its owner reference cleared so that any later changes to the object's size don't
-  // cause the owner to be updated.
+  // cause the owner to be updated. If it's in the warm cache, it's dropped, since it's about to be
+  // deleted.
+
+  void deleted(ObjectId id);
+  // Notes that death row has unlinked the given object's file. Drops it from the warm cache, so
+  // that the file's space is actually freed. (Descendants of a disowned object are deleted
+  // without ever being disowned themselves.)
+
+  void deferSizeChange(ObjectId id, uint64_t blocks);
+  // Records that the committed volume `id` itself now occupies `blocks` blocks. Updating its
+  // accounted size, and the transitive size of it and its ancestors, is left to the next
+  // flushSizeChanges(), which happens automatically after a short delay or once enough changes
+  // have built up. This way, a volume under heavy writes doesn't generate a transaction every few
+  // blocks.
+  //
+  // Changes not yet flushed are lost on a crash. That's only acceptable for volumes, whose size
+  // is recomputed from the file on their next write anyway.
+
+  void flushSizeChanges();
+  // Writes out all deferred size changes in a single transaction, updating each affected object
+  // once. If a transaction is already in progress, the flush is left for the timer instead, since
+  // only one may be open at a time.
+
+  inline const Stats& getStats() { return stats; }
+
+  kj::Array<ObjectIoStats> getIoStats();
+  // Implements FilesystemStorage::getIoStats().
 
 private:
   Journal& journal;
+  kj::Own<IoPool> ioPool;
+  BlobStore& blobStore;
+  kj::AutoCloseFd blankExt4Template;
+  kj::AutoCloseFd changedBlocksDir;
+  IoPool::FlowId changedBlocksFlow;
   kj::Timer& timer;
+  uint64_t warmCacheBytes;
+  uint warmCacheMaxObjects;
+  size_t streamWindowBytes;
+  kj::Maybe<kj::Duration> volumeCompressionDelay;
+  Stats stats;
 
   capnp::CapabilityServerSet<capnp::Capability> serverSet;
   // Lets us map our own capabilities -- when they come back from the caller -- back to the
@@ -981,6 +2108,49 @@ private:
   std::unordered_map<ObjectId, ObjectBase*, ObjectId::Hash> objectCache;
   // Maps object IDs to live objects representing them, if any.
 
+  struct WarmEntry {
+    WarmObject object;
+    uint64_t bytes;
+    std::list<ObjectId>::iterator lruPos;
+  };
+  std::unordered_map<ObjectId, WarmEntry, ObjectId::Hash> warmCache;
+  std::list<ObjectId> warmLru;
+  // Objects which aren't live but were recently, most-recently-closed first in `warmLru`. An object
+  // is never in both `objectCache` and `warmCache`.
+  //
+  // Objects are only modified while live, except for their Xattrs, which modifyTransitiveSize()
+  // updates here as well, so the cached state stays current. Objects are dropped from here when
+  // they are disowned and again when death row deletes them; a closing object whose file has
+  // already been unlinked isn't added at all.
+
+  kj::Maybe<WarmObject> takeWarm(ObjectId id);
+  void forgetWarm(ObjectId id);
+  void evictWarm();
+
+  std::unordered_map<ObjectId, uint64_t, ObjectId::Hash> pendingSizes;
+  // Deferred size changes: for each committed object whose own size changed since the last flush,
+  // its new block count.
+
+  bool sizeFlushScheduled = false;
+  kj::Promise<void> sizeFlushTask = kj::READY_NOW;
+
+  void scheduleSizeFlush();
+
+  struct PendingChangedBlocks: public kj::Refcounted {
+    kj::MutexGuarded<kj::Maybe<kj::Array<byte>>> content;
+    // The map to write. Taken by takeChangedBlocks() to cancel the write, or by the I/O thread
+    // once written; the lock is held while writing so that the two can't race.
+  };
+  std::unordered_map<ObjectId, kj::Own<PendingChangedBlocks>, ObjectId::Hash> pendingChangedBlocks;
+  // Changed-block maps queued by saveChangedBlocks() whose jobs haven't completed.
+
+  kj::TaskSet tasks;
+  void taskFailed(kj::Exception&& exception) override;
+
+  Xattr* findXattr(ObjectId id, Xattr& scratch);
+  // Get the current attributes of the given object, wherever they are: the live object, the warm
+  // cache, or else read into `scratch`. Returns null if the object no longer exists.
+
   Restorer<SturdyRef>::Client restorer;
 
   template <typename T>
@@ -995,7 +2165,7 @@ class FilesystemStorage::ObjectBase: public virtual capnp::Capability::Server {
 
 public:
   ObjectBase(Journal& journal, kj::Own<ObjectFactory> factory, Type type)
-      : journal(journal), factory(kj::mv(factory)),
+      : journal(journal), factory(kj::mv(factory)), flow(this->factory->getIoPool().newFlow()),
         key(ObjectKey::generate()), id(key), state(ORPHAN) {
     // Create a new object. A key will be generated.
 
@@ -1006,7 +2176,7 @@ public:
   ObjectBase(Journal& journal, kj::Own<ObjectFactory> factory,
              const ObjectKey& key, const ObjectId& id, const Xattr& xattr,
              kj::AutoCloseFd fd)
-      : journal(journal), factory(kj::mv(factory)),
+      : journal(journal), factory(kj::mv(factory)), flow(this->factory->getIoPool().newFlow()),
         key(key), id(id), xattr(xattr), state(COMMITTED) {
     // Construct an ObjectBase around an existing on-disk object.
 
@@ -1014,15 +2184,17 @@ public:
     data.fd = kj::mv(fd);
 
     if (isStoredObjectType(xattr.type)) {
-      capnp::StreamFdMessageReader reader(data.fd.get());
+      // Map the file rather than reading it, so that the StoredObject part is already in memory
+      // for get().
+      data.mapping = mmapWords(data.fd);
+      capnp::FlatArrayMessageReader reader(data.mapping);
 
       data.children = KJ_MAP(child, reader.getRoot<StoredChildIds>().getChildren()) {
         return ObjectId(child);
       };
 
-      data.storedChildIdsWords = getFilePosition(data.fd) / sizeof(capnp::word);
-      data.storedObjectWords = getFileSize(data.fd) / sizeof(capnp::word) -
-                               data.storedChildIdsWords;
+      data.storedChildIdsWords = reader.getEnd() - data.mapping.begin();
+      data.storedObjectWords = data.mapping.size() - data.storedChildIdsWords;
     } else {
       data.storedChildIdsWords = 0;
       data.storedObjectWords = 0;
@@ -1031,8 +2203,32 @@ public:
     currentData = kj::mv(data);
   }
 
+  ObjectBase(Journal& journal, kj::Own<ObjectFactory> factory,
+             const ObjectKey& key, const ObjectId& id, ObjectFactory::WarmObject&& warm)
+      : journal(journal), factory(kj::mv(factory)), flow(warm.flow),
+        key(key), id(id), xattr(warm.xattr), state(COMMITTED) {
+    // Reconstruct an ObjectBase from the warm cache.
+
+    CurrentData data;
+    data.fd = kj::mv(warm.fd);
+    data.children = kj::mv(warm.children);
+    data.storedChildIdsWords = warm.storedChildIdsWords;
+    data.storedObjectWords = warm.storedObjectWords;
+    data.mapping = kj::mv(warm.mapping);
+    currentData = kj::mv(data);
+  }
+
   ~ObjectBase() noexcept(false) {
-    factory->destroyed(*this);
+    kj::Maybe<ObjectFactory::WarmObject> warm;
+    if (state == COMMITTED) {
+      KJ_IF_MAYBE(data, currentData) {
+        warm = ObjectFactory::WarmObject {
+          kj::mv(data->fd), flow, xattr, kj::mv(data->children),
+          data->storedChildIdsWords, data->storedObjectWords, kj::mv(data->mapping)
+        };
+      }
+    }
+    factory->destroyed(*this, kj::mv(warm));
 
     // Note: If the object hasn't been committed yet, then our FD is an unlinked temp file and
     // closing it will delete the data from disk, so we don't have to worry about it here. If the
@@ -1048,6 +2244,16 @@ public:
   inline const ObjectKey& getKey() const { return key; }
   inline Xattr& getXattrRef() { return xattr; }
 
+  kj::Maybe<int> getOpenFd() {
+    // The object's file descriptor, if it has been opened.
+    return currentData.map([](CurrentData& data) -> int { return data.fd; });
+  }
+
+  IoPool::FlowId getFlow() {
+    // The I/O pool flow under which jobs on the object's file are submitted.
+    return flow;
+  }
+
   class AdoptionIntent {
     // When an orphaned object is being adopted by a new owner, first the new owner has to ensure
     // that all of the objects it proposed to adopt are adoptable before it actually commits to
@@ -1342,9 +2548,17 @@ protected:
 
     auto& data = KJ_ASSERT_NONNULL(currentData, "can't read from uninitialized storage object");
 
-    KJ_SYSCALL(lseek(data.fd, data.storedChildIdsWords * sizeof(capnp::word), SEEK_SET));
+    if (data.mapping == nullptr) {
+      // Map the file (just written by set()). We keep the mapping, so that later reads (including
+      // after the object has gone to the warm cache) make no syscalls and copy nothing until the
+      // payload is copied into the response.
+      data.mapping = mmapWords(data.fd);
+      KJ_ASSERT(data.mapping.size() == data.storedChildIdsWords + data.storedObjectWords,
+                "storage object changed size while open");
+    }
 
-    capnp::StreamFdMessageReader reader(data.fd.get());
+    capnp::FlatArrayMessageReader reader(data.mapping.slice(
+        data.storedChildIdsWords, data.mapping.size()));
     auto root = reader.getRoot<StoredObject>();
     capnp::ReaderCapabilityTable capTable(KJ_MAP(cap, root.getCapTable()) {
       return restoreCap(cap);
@@ -1364,18 +2578,20 @@ protected:
 
     KJ_ASSERT(blocks <= uint32_t(kj::maxValue), "file too big");
 
-    if (state == COMMITTED) {
-      if (blocks != xattr.accountedBlockCount) {
-        int64_t delta = blocks - xattr.accountedBlockCount;
-        Journal::Transaction txn(journal);
-        xattr.accountedBlockCount = blocks;
-        factory->modifyTransitiveSize(id, delta, txn);
-        txn.commit();
-      }
-    } else {
+    if (state != COMMITTED) {
       // We don't bother counting child size until we're committed to disk.
       xattr.accountedBlockCount = blocks;
       xattr.transitiveBlockCount = blocks;
+    } else if (xattr.type == Type::VOLUME) {
+      // Volumes change size constantly under writes, so batch up their accounting.
+      factory->deferSizeChange(id, blocks);
+    } else if (blocks != xattr.accountedBlockCount) {
+      // Anything else changes size rarely, and only its own transaction can make that durable.
+      int64_t delta = blocks - xattr.accountedBlockCount;
+      Journal::Transaction txn(journal);
+      xattr.accountedBlockCount = blocks;
+      factory->modifyTransitiveSize(id, delta, txn);
+      txn.commit();
     }
   }
 
@@ -1412,12 +2628,62 @@ protected:
   }
 
   uint64_t getStorageUsageImpl() {
+    // Make sure deferred size changes to this object or its descendants are counted.
+    factory->flushSizeChanges();
     return xattr.transitiveBlockCount * Volume::BLOCK_SIZE;
   }
 
+  IoPool& getIoPool() {
+    // Disk I/O on the object's contents which could block for a while should go through here.
+    return factory->getIoPool();
+  }
+
+  BlobStore& getBlobStore() {
+    return factory->getBlobStore();
+  }
+
+  int getBlankExt4Template() {
+    return factory->getBlankExt4Template();
+  }
+
+  int getChangedBlocksDir() {
+    return factory->getChangedBlocksDir();
+  }
+
+  void queueChangedBlocks(kj::Array<byte> content) {
+    factory->saveChangedBlocks(id, kj::mv(content));
+  }
+
+  kj::Maybe<kj::Array<byte>> takeChangedBlocks() {
+    return factory->takeChangedBlocks(id);
+  }
+
+  bool isCommitted() {
+    return state == COMMITTED;
+  }
+
+  kj::Timer& getTimer() {
+    return factory->getTimer();
+  }
+
+  kj::Maybe<kj::Duration> getVolumeCompressionDelay() {
+    return factory->getVolumeCompressionDelay();
+  }
+
+  kj::AutoCloseFd createTempFile() {
+    // Create an unlinked temp file on the same filesystem as the object.
+    return journal.createTempFile();
+  }
+
 private:
   Journal& journal;
   kj::Own<ObjectFactory> factory;
+
+  IoPool::FlowId flow;
+  // I/O pool flow for jobs on the object's file. Carried through the warm cache along with the
+  // file descriptor, so that a reopened object's sync() still follows writes queued before it was
+  // closed.
+
   ObjectKey key;
   ObjectId id;
   Xattr xattr;
@@ -1435,10 +2701,8 @@ private:
   // value if available so that it can be consistent with the most-recent set() even if that set()
   // hasn't hit disk yet.
   //
-  // TODO(perf): We currently only keep the value cached while set() is in progress. We could keep
-  //   it for some defined time after that, possibly improving performance. Alternatively, if we
-  //   don't do that, we don't really need it to be refcounted because the set() task owns the
-  //   other reference anyway, so it can make sure the object stays live.
+  // Once the set() completes, reads are served from `CurrentData::mapping` instead, which is
+  // mapped once and survives in the warm cache after the object is closed.
 
   enum {
     ORPHAN,
@@ -1466,6 +2730,10 @@ private:
     uint32_t storedObjectWords;
     // Size (in words) of the StoredObject part of the file.
 
+    kj::Array<const capnp::word> mapping;
+    // The whole file mapped read-only, from when the object was opened or first read after a
+    // set(); empty until then. StoredObject readers point directly into it.
+
     kj::Array<AdoptionIntent> transitiveAdoptions;
     // Objects which this one will adopt if this object is itself adopted.
   };
@@ -1602,11 +2870,39 @@ public:
   static constexpr Type TYPE = Type::BLOB;
   using ObjectBase::ObjectBase;
 
-  void init(capnp::Data::Reader data) {
+  ~BlobImpl() noexcept(false) {
+    if (!isCommitted()) {
+      // Our object file is an unlinked temp file which disappears when closed, but our share of
+      // the content store has to be released explicitly.
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        switch (getXattrRef().blobContent) {
+          case BlobContent::INLINE:
+            break;
+          case BlobContent::INDEXED:
+            getBlobStore().released(openRaw());
+            break;
+          case BlobContent::REFERENCE:
+            getBlobStore().releaseRef(getId());
+            break;
+        }
+      })) {
+        KJ_LOG(ERROR, "failed to release deduplicated blob content", *exception);
+      }
+    }
+  }
+
+  kj::Promise<void> init(capnp::Data::Reader data) {
     int fd = openRaw();
     pwriteAll(fd, data.begin(), data.size(), 0);
     updateSize((data.size() + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
-    setReadOnly();
+
+    kj::Maybe<BlobStore::Hash> hash;
+    if (getBlobStore().isEnabled()) {
+      Hasher hasher;
+      hasher.update(data);
+      hash = hasher.finish();
+    }
+    return finish(hash);
   }
 
   sandstorm::ByteStream::Client init() {
@@ -1624,7 +2920,7 @@ public:
     context.releaseParams();
     auto& xattr = getXattrRef();
     if (xattr.readOnly) {
-      int fd = openRaw();
+      int fd = openContent();
       context.getResults(capnp::MessageSize {4, 0}).setSize(getFileSize(fd));
       return kj::READY_NOW;
     } else KJ_IF_MAYBE(i, currentInitializer) {
@@ -1642,7 +2938,7 @@ public:
     auto offset = params.getStartAtOffset();
     context.releaseParams();
 
-    int fd = openRaw();
+    int fd = openContent();
     uint64_t currentSize = getFileSize(fd);
 
     kj::Maybe<uint64_t> expectedSize;
@@ -1672,17 +2968,49 @@ public:
         }
       });
 
-      return sizeHintPromise.exclusiveJoin(writeLoop(offset, kj::mv(target)));
+      return sizeHintPromise.exclusiveJoin(writeLoop(offset, newWindow(kj::mv(target))));
     } else {
-      return writeLoop(offset, kj::mv(target));
+      return writeLoop(offset, newWindow(kj::mv(target)));
     }
   }
 
 private:
+  class Hasher {
+    // Computes the BLAKE2b hash identifying blob content in the BlobStore. libsodium requires its
+    // state to be 64-byte aligned, which heap allocation doesn't guarantee, so we align by hand.
+
+  public:
+    KJ_DISALLOW_COPY(Hasher);
+    Hasher() {
+      KJ_ASSERT(crypto_generichash_blake2b_init(state(), nullptr, 0, BlobStore::Hash().size()) == 0);
+    }
+
+    void update(kj::ArrayPtr<const byte> data) {
+      KJ_ASSERT(crypto_generichash_blake2b_update(state(), data.begin(), data.size()) == 0);
+    }
+
+    BlobStore::Hash finish() {
+      BlobStore::Hash result;
+      KJ_ASSERT(crypto_generichash_blake2b_final(state(), result.begin(), result.size()) == 0);
+      return result;
+    }
+
+  private:
+    byte space[sizeof(crypto_generichash_blake2b_state) + 63];
+
+    crypto_generichash_blake2b_state* state() {
+      return reinterpret_cast<crypto_generichash_blake2b_state*>(
+          (reinterpret_cast<uintptr_t>(space) + 63) & ~uintptr_t(63));
+    }
+  };
+
   class Initializer: public sandstorm::ByteStream::Server {
   public:
     Initializer(BlobImpl& object, capnp::Capability::Client client)
         : object(object), client(kj::mv(client)) {
+      if (object.getBlobStore().isEnabled()) {
+        hasher.emplace();
+      }
       KJ_REQUIRE(object.currentInitializer == nullptr);
       object.currentInitializer = *this;
     }
@@ -1707,7 +3035,8 @@ private:
     }
 
     kj::Promise<void> onNextData() {
-      if (isDone) return kj::READY_NOW;
+      // Note: Even after done() has been called, we don't resolve until the final writes have
+      //   landed and the blob has been marked read-only.
       KJ_IF_MAYBE(n, nextData) {
         return n->promise.addBranch();
       } else {
@@ -1727,21 +3056,32 @@ private:
         }
       }
 
-      pwriteAll(object.openRaw(), data.begin(), data.size(), currentOffset);
+      uint64_t offset = currentOffset;
+      currentOffset = newOffset;
 
-      // Update accounting for every megabyte uploaded.
-      if ((currentOffset >> 20) != (newOffset >> 20)) {
-        object.updateSize((newOffset + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
+      KJ_IF_MAYBE(h, hasher) {
+        // Writes arrive in order, so we can hash as we go.
+        h->update(data);
       }
 
-      currentOffset = newOffset;
-
-      KJ_IF_MAYBE(n, nextData) {
-        n->fulfiller->fulfill();
-        nextData = nullptr;
-      }
+      // The job can't be canceled, but the call's message can be freed under it if the caller
+      // disconnects, so the job writes from its own copy.
+      auto copy = kj::heapArray<byte>(data);
+      int fd = object.openRaw();
+      return object.getIoPool().run(object.getFlow(), copy.size(),
+          [fd,KJ_MVCAP(copy),offset]() {
+        pwriteAll(fd, copy.begin(), copy.size(), offset);
+      }).then([this,offset,newOffset]() {
+        // Update accounting for every megabyte uploaded.
+        if ((offset >> 20) != (newOffset >> 20)) {
+          object.updateSize((newOffset + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
+        }
 
-      return kj::READY_NOW;
+        KJ_IF_MAYBE(n, nextData) {
+          n->fulfiller->fulfill();
+          nextData = nullptr;
+        }
+      });
     }
 
     kj::Promise<void> done(DoneContext context) override {
@@ -1759,15 +3099,20 @@ private:
         }
       }
 
-      KJ_IF_MAYBE(n, nextData) {
-        n->fulfiller->fulfill();
-        nextData = nullptr;
-      }
+      // The sync is queued behind any writes still in flight, so once it completes the whole
+      // stream is on disk.
+      return object.getIoPool().sync(object.getFlow(), object.openRaw()).then([this]() {
+        object.updateSize((currentOffset + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
+        auto promise = object.finish(hasher.map([](Hasher& h) { return h.finish(); }));
 
-      int fd = object.openRaw();
-      KJ_SYSCALL(fdatasync(fd));
-      object.updateSize((currentOffset + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE);
-      return object.setReadOnly();
+        // Wake up writeTo() loops, which will now see EOF on a read-only blob.
+        KJ_IF_MAYBE(n, nextData) {
+          n->fulfiller->fulfill();
+          nextData = nullptr;
+        }
+
+        return promise;
+      });
     }
 
     kj::Promise<void> expectSize(ExpectSizeContext context) override {
@@ -1797,6 +3142,9 @@ private:
     kj::Maybe<uint64_t> expectedSize;
     bool isDone = false;
 
+    kj::Maybe<Hasher> hasher;
+    // Hash of the content so far, if the blob is to be deduplicated.
+
     template <typename T>
     struct ForkedPromiseAndFulfiller {
       kj::ForkedPromise<T> promise;
@@ -1820,43 +3168,105 @@ private:
 
   kj::Maybe<Initializer&> currentInitializer;
 
-  kj::Promise<void> writeLoop(uint64_t offset, sandstorm::ByteStream::Client target) {
-    int fd = openRaw();
+  kj::Maybe<kj::AutoCloseFd> contentFd;
+  // Link to shared content, opened on first use, if the blob is a BlobContent::REFERENCE. Reads
+  // from it are submitted under the blob's own flow.
 
-    auto req = target.writeRequest(capnp::MessageSize { 2052, 0 });
-    auto orphan =
-        capnp::Orphanage::getForMessageContaining(sandstorm::ByteStream::WriteParams::Builder(req))
-        .newOrphan<capnp::Data>(8192);
-    auto buffer = orphan.get();
-    ssize_t n;
-    KJ_SYSCALL(n = pread(fd, buffer.begin(), buffer.size(), offset));
-    if (n > 0) {
-      if (n < buffer.size()) {
-        orphan.truncate(n);
-      }
-      req.adoptData(kj::mv(orphan));
-      offset += n;
-      // TODO(perf): flow control / parallel writes
-      return req.send().then([this,offset,KJ_MVCAP(target)](auto&&) mutable {
-        return writeLoop(offset, kj::mv(target));
-      });
-    } else if (getXattrRef().readOnly) {
-      // EOF, and file is finalized.
-      return target.doneRequest().send().then([](auto&&) {});
-    } else KJ_IF_MAYBE(i, currentInitializer) {
-      // Still uploading. Wait for more data to be available.
-      //
-      // Note that we don't set up to directly copy data from the initializer capability to the
-      // output stream because if the output stream backs up we don't want to buffer data
-      // in-memory. Doing so could lead to DoS, etc.
-      return i->onNextData().then([this,offset,KJ_MVCAP(target)]() mutable {
-        return writeLoop(offset, kj::mv(target));
+  int openContent() {
+    // Get the file descriptor from which the blob's content should be read.
+
+    if (getXattrRef().blobContent == BlobContent::REFERENCE) {
+      KJ_IF_MAYBE(fd, contentFd) {
+        return *fd;
+      } else {
+        return contentFd.emplace(getBlobStore().openRef(getId()));
+      }
+    } else {
+      return openRaw();
+    }
+  }
+
+  kj::Promise<void> finish(kj::Maybe<BlobStore::Hash> maybeHash) {
+    // Called when the content is complete and on disk, with its hash if the blob is to be
+    // deduplicated. Shares the content with other blobs if possible, then marks the blob
+    // read-only.
+
+    auto& store = getBlobStore();
+    BlobStore::Hash hash;
+    KJ_IF_MAYBE(h, maybeHash) {
+      hash = *h;
+    } else {
+      return setReadOnly();
+    }
+
+    if (store.addRef(hash, getId())) {
+      // Identical content is already stored. Once our link to it is durable, switch over to it and
+      // then drop our own copy.
+      contentFd = store.openRef(getId());
+      return store.syncRefs().then([this]() {
+        getXattrRef().blobContent = BlobContent::REFERENCE;
+        return setReadOnly();
+      }).then([this]() {
+        int fd = openRaw();
+        return getIoPool().runUrgent(getFlow(), [fd]() { KJ_SYSCALL(ftruncate(fd, 0)); });
       });
     } else {
-      // Blob is incomplete and no longer being initialized.
-      return KJ_EXCEPTION(FAILED, "blob was not fully uploaded");
+      // We're the first. Add our file to the store for others to share.
+      store.index(hash, openRaw());
+      getXattrRef().blobContent = BlobContent::INDEXED;
+      return setReadOnly();
     }
   }
+
+  kj::Own<ByteStreamWindow> newWindow(sandstorm::ByteStream::Client target) {
+    return kj::heap<ByteStreamWindow>(kj::mv(target), factory->getStreamWindowBytes());
+  }
+
+  struct PendingChunk: public kj::Refcounted {
+    // A chunk being read on the I/O pool. The job holds a reference, so that the chunk outlives
+    // it even if the writeTo() is canceled.
+
+    ByteStreamWindow::Chunk chunk;
+    ssize_t n = 0;
+
+    explicit PendingChunk(ByteStreamWindow::Chunk&& chunk): chunk(kj::mv(chunk)) {}
+  };
+
+  kj::Promise<void> writeLoop(uint64_t offset, kj::Own<ByteStreamWindow> window) {
+    // Read the next chunk on the I/O pool while earlier writes are still in flight.
+    int fd = openContent();
+    auto pending = kj::refcounted<PendingChunk>(window->newChunk());
+    size_t size = pending->chunk.getBuffer().size();
+
+    return getIoPool().run(getFlow(), size, [fd,job = kj::addRef(*pending),offset]() mutable {
+      auto buffer = job->chunk.getBuffer();
+      KJ_SYSCALL(job->n = pread(fd, buffer.begin(), buffer.size(), offset));
+    }).then([this,offset,KJ_MVCAP(window),KJ_MVCAP(pending)]() mutable
+            -> kj::Promise<void> {
+      if (pending->n > 0) {
+        auto promise = window->send(kj::mv(pending->chunk), pending->n);
+        return promise.then([this,offset = offset + pending->n,KJ_MVCAP(window)]() mutable {
+          return writeLoop(offset, kj::mv(window));
+        });
+      } else if (getXattrRef().readOnly) {
+        // EOF, and file is finalized.
+        auto promise = window->done();
+        return promise.attach(kj::mv(window));
+      } else KJ_IF_MAYBE(i, currentInitializer) {
+        // Still uploading. Wait for more data to be available.
+        //
+        // Note that we don't set up to directly copy data from the initializer capability to the
+        // output stream because if the output stream backs up we don't want to buffer data
+        // in-memory. Doing so could lead to DoS, etc.
+        return i->onNextData().then([this,offset,KJ_MVCAP(window)]() mutable {
+          return writeLoop(offset, kj::mv(window));
+        });
+      } else {
+        // Blob is incomplete and no longer being initialized.
+        return KJ_EXCEPTION(FAILED, "blob was not fully uploaded");
+      }
+    });
+  }
 };
 
 constexpr FilesystemStorage::Type FilesystemStorage::BlobImpl::TYPE;
@@ -1868,33 +3278,84 @@ public:
   static constexpr Type TYPE = Type::VOLUME;
   using ObjectBase::ObjectBase;
 
+  ~VolumeImpl() noexcept(false) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      saveChangedBlocks();
+    })) {
+      KJ_LOG(ERROR, "failed to save changed-block map; next backup will be a full one",
+             *exception);
+    }
+
+    if (!uncompressedExtents.empty()) {
+      // Don't leave recent writes uncompressed just because the volume was closed. (No snapshot
+      // can be live at this point, since snapshots hold a reference to the volume.)
+      kj::Vector<uint32_t> extents(uncompressedExtents.size());
+      for (auto& entry: uncompressedExtents) {
+        extents.add(entry.first);
+      }
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        compressExtents(extents.releaseAsArray());
+      })) {
+        KJ_LOG(ERROR, "failed to compress volume on close", *exception);
+      }
+    }
+  }
+
   void init() {
     openRaw();
   }
 
+  kj::Promise<void> initFormatted() {
+    // Initialize the volume with a blank ext4 filesystem: the same image NbdDevice::format()
+    // writes, so that the client can skip formatting. We reflink the template file when the
+    // filesystem allows, in which case the new volume shares the template's extents until they are
+    // modified and no data is written at all. Otherwise we write the image ourselves, which still
+    // saves the client from pushing it through NBD and RPC.
+
+    int fd = openRaw();
+
+    if (noReflink) {
+      return writeBlankExt4();
+    }
+
+    // The job may outlive the factory (which owns the template) if the volume is dropped.
+    int jobFd;
+    KJ_SYSCALL(jobFd = dup(getBlankExt4Template()));
+    kj::AutoCloseFd templateFd(jobFd);
+
+    return getIoPool().run(getFlow(), [fd,KJ_MVCAP(templateFd)]() {
+      KJ_SYSCALL(ioctl(fd, FICLONE, templateFd.get()));
+    }).then([this]() -> kj::Promise<void> {
+      // The volume isn't committed yet, so this is saved along with the rest of the xattr.
+      getXattrRef().sharesTemplate = true;
+      updateSize(getFileBlockCount(openRaw()));
+      return kj::READY_NOW;
+    }, [this](kj::Exception&& exception) -> kj::Promise<void> {
+      // Most likely the filesystem doesn't support reflinks (e.g. ext4). Don't try again.
+      if (!noReflink) {
+        noReflink = true;
+        KJ_LOG(WARNING, "can't reflink volumes; formatting new volumes by writing the image",
+                        exception);
+      }
+      return writeBlankExt4();
+    });
+  }
+
   kj::Promise<void> getStorageUsage(GetStorageUsageContext context) override {
     context.getResults().setTotalBytes(getStorageUsageImpl());
     return kj::READY_NOW;
   }
 
   kj::Promise<void> read(ReadContext context) override {
-    auto params = context.getParams();
-    uint64_t blockNum = params.getBlockNum();
-    uint32_t count = params.getCount();
-    context.releaseParams();
-
-    KJ_REQUIRE(blockNum + count < (1ull << 32), "volume read overflow");
-    KJ_REQUIRE(count < 2048, "can't read over 8MB from a volume per call");
-
-    uint64_t offset = blockNum * Volume::BLOCK_SIZE;
-    uint size = count * Volume::BLOCK_SIZE;
-
-    auto results = context.getResults(capnp::MessageSize {16 + size / sizeof(capnp::word), 0});
-    auto data = results.initData(size);
+    return readFd(getIoPool(), getFlow(), openRaw(), context);
+  }
 
-    preadAllOrZero(openRaw(), data.begin(), data.size(), offset);
+  kj::Promise<void> readExtents(ReadExtentsContext context) override {
+    return readExtentsFd(getIoPool(), getFlow(), openRaw(), context);
+  }
 
-    return kj::READY_NOW;
+  kj::Promise<void> readv(ReadvContext context) override {
+    return readvFd(getIoPool(), getFlow(), openRaw(), context);
   }
 
   kj::Promise<void> write(WriteContext context) override {
@@ -1916,11 +3377,66 @@ public:
     KJ_REQUIRE(blockNum + count < (1ull << 32), "volume write overflow");
 
     uint64_t offset = blockNum * Volume::BLOCK_SIZE;
+    noteChanged(blockNum, count);
 
-    pwriteAll(openRaw(), data.begin(), data.size(), offset);
-    maybeUpdateSize(count);
+    // The job writes from its own copy, since the call's message may be freed before it runs if
+    // the caller disconnects.
+    auto copy = kj::heapArray<byte>(data);
+    int fd = openRaw();
+    return getIoPool().run(getFlow(), copy.size(), [fd,KJ_MVCAP(copy),offset]() {
+      writeSplittingZeros(fd, copy, offset);
+    }).then([this,blockNum,count]() {
+      maybeUpdateSize(count);
+      noteWritten(blockNum, count);
+    });
+  }
 
-    return kj::READY_NOW;
+  kj::Promise<void> writev(WritevContext context) override {
+    KJ_REQUIRE(!getXattrRef().readOnly, "attempted to write to a read-only Volume");
+
+    if (snapshotCount > 0) {
+      // Wait for snapshot destruction.
+      return onZeroSnapshots.addBranch().then([this,context]() mutable {
+        return writev(context);
+      });
+    }
+
+    auto params = context.getParams();
+    auto ranges = params.getRanges();
+    capnp::Data::Reader data = params.getData();
+
+    uint64_t totalCount = 0;
+    for (auto range: ranges) {
+      KJ_REQUIRE(uint64_t(range.getBlockNum()) + range.getCount() < (1ull << 32),
+                 "volume write overflow");
+      totalCount += range.getCount();
+    }
+    KJ_REQUIRE(data.size() == totalCount * Volume::BLOCK_SIZE,
+               "writev() data doesn't match ranges");
+    for (auto range: ranges) {
+      noteChanged(range.getBlockNum(), range.getCount());
+    }
+
+    // All ranges are written in a single job, so this costs one trip through the I/O pool. As
+    // with write(), the job gets its own copy of everything it uses.
+    auto copy = kj::heapArray<byte>(data);
+    auto byteRanges = KJ_MAP(range, ranges) {
+      return ByteRange { uint64_t(range.getBlockNum()) * Volume::BLOCK_SIZE,
+                         uint64_t(range.getCount()) * Volume::BLOCK_SIZE };
+    };
+    int fd = openRaw();
+    return getIoPool().run(getFlow(), copy.size(), [fd,KJ_MVCAP(copy),KJ_MVCAP(byteRanges)]() {
+      const byte* pos = copy.begin();
+      for (auto& range: byteRanges) {
+        writeSplittingZeros(fd, kj::arrayPtr(pos, range.size), range.offset);
+        pos += range.size;
+      }
+    }).then([this,ranges,totalCount]() {
+      maybeUpdateSize(totalCount);
+      for (auto range: ranges) {
+        noteWritten(range.getBlockNum(), range.getCount());
+      }
+    });
   }
 
   kj::Promise<void> zero(ZeroContext context) override {
@@ -1938,120 +3454,882 @@ public:
     uint32_t count = params.getCount();
     context.releaseParams();
 
-    KJ_REQUIRE(blockNum + count < (1ull << 32), "volume write overflow");
+    KJ_REQUIRE(blockNum + count < (1ull << 32), "volume write overflow");
+
+    uint64_t offset = blockNum * Volume::BLOCK_SIZE;
+    uint size = count * Volume::BLOCK_SIZE;
+    noteChanged(blockNum, count);
+
+    int fd = openRaw();
+    return getIoPool().run(getFlow(), [fd,offset,size]() {
+      KJ_SYSCALL(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size),
+                 offset, size);
+    }).then([this,count]() {
+      maybeUpdateSize(count);
+    });
+  }
+
+  kj::Promise<void> sync(SyncContext context) override {
+    // Concurrent syncs are coalesced by the I/O pool.
+    return getIoPool().sync(getFlow(), openRaw());
+  }
+
+//  kj::Promise<void> asBlob(AsBlobContext context) override {
+    // TODO(someday)
+//  }
+
+  kj::Promise<void> getExclusive(GetExclusiveContext context) override {
+    context.getResults(capnp::MessageSize {4, 1}).setExclusive(
+        capnp::Capability::Client(kj::heap<ExclusiveWrapper>(*this)).castAs<Volume>());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> freeze(FreezeContext context) override {
+    return setReadOnly();
+  }
+
+  kj::Promise<void> pause(PauseContext context) override {
+    // Writes from here on belong to the next epoch.
+    auto& tracker = changeTracker();
+    uint64_t epoch = uint64_t(tracker.generation) << 32 | tracker.epoch++;
+
+    if (noReflink) {
+      return pauseWrites(context, epoch);
+    }
+
+    // Try to take a copy-on-write clone of the whole file. This is queued behind any writes still
+    // in flight, so the clone reflects exactly the writes issued before pause().
+    auto clone = createTempFile();
+    int fd = openRaw();
+    int jobFd;
+    KJ_SYSCALL(jobFd = dup(clone));
+    kj::AutoCloseFd cloneFd(jobFd);
+    return getIoPool().run(getFlow(), [fd,KJ_MVCAP(cloneFd)]() {
+      KJ_SYSCALL(ioctl(cloneFd, FICLONE, fd));
+    }).then([this,context,epoch,KJ_MVCAP(clone)]() mutable -> kj::Promise<void> {
+      auto results = context.getResults(capnp::MessageSize {6, 1});
+      results.setSnapshot(
+          capnp::Capability::Client(kj::heap<CloneSnapshot>(*this, kj::mv(clone)))
+              .castAs<Volume>());
+      results.setEpoch(epoch);
+      return kj::READY_NOW;
+    }, [this,context,epoch](kj::Exception&& exception) mutable -> kj::Promise<void> {
+      // Most likely the filesystem doesn't support reflinks (e.g. ext4). Don't try again.
+      if (!noReflink) {
+        noReflink = true;
+        KJ_LOG(WARNING, "can't reflink volumes; falling back to pausing writes during snapshots",
+                        exception);
+      }
+      return pauseWrites(context, epoch);
+    });
+  }
+
+  kj::Promise<void> getChangedBlocks(GetChangedBlocksContext context) override {
+    return changedBlocks(getFlow(), openRaw(), context);
+  }
+
+private:
+  struct BlockRun {
+    uint32_t blockNum;
+    uint32_t count;
+  };
+
+  static void addBlockRun(kj::Vector<BlockRun>& runs, uint64_t blockNum, uint64_t count) {
+    // Append the given blocks to `runs`, extending the last run if they're adjacent to it. Runs
+    // are split where needed so that each count fits in 32 bits; the whole 2^32-block address
+    // space doesn't.
+
+    static constexpr uint32_t MAX_COUNT = 0xffffffffu;
+    while (count > 0) {
+      if (runs.size() > 0 && runs.back().count < MAX_COUNT &&
+          uint64_t(runs.back().blockNum) + runs.back().count == blockNum) {
+        uint32_t n = kj::min(count, uint64_t(MAX_COUNT - runs.back().count));
+        runs.back().count += n;
+        blockNum += n;
+        count -= n;
+      } else {
+        uint32_t n = kj::min(count, uint64_t(MAX_COUNT));
+        runs.add(BlockRun { uint32_t(blockNum), n });
+        blockNum += n;
+        count -= n;
+      }
+    }
+  }
+
+  static void setChangedBlocks(GetChangedBlocksContext& context,
+                               kj::ArrayPtr<const BlockRun> runs) {
+    auto results = context.getResults(capnp::MessageSize { 8 + runs.size() * 2, 0 });
+    results.setKnown(true);
+    auto list = results.initRanges(runs.size());
+    for (auto i: kj::indices(runs)) {
+      list[i].setBlockNum(runs[i].blockNum);
+      list[i].setCount(runs[i].count);
+    }
+  }
+
+  kj::Promise<void> changedBlocks(IoPool::FlowId flow, int fd, GetChangedBlocksContext context) {
+    // Implements getChangedBlocks() for the volume, or for a snapshot of it, where `fd` is the
+    // file the caller reads from and `flow` its I/O pool flow.
+    //
+    // For epoch zero we report every block which may be non-zero, as told by the file's holes.
+    // Otherwise we consult the change tracker, which belongs to the volume: for a clone snapshot
+    // it also reports blocks changed since the snapshot was taken, which costs the caller some
+    // extra reading but is otherwise harmless.
+
+    uint64_t since = context.getParams().getSinceEpoch();
+    context.releaseParams();
+
+    if (since == 0) {
+      return allocatedBlocksFd(getIoPool(), flow, fd, context);
+    }
+
+    auto& tracker = changeTracker();
+    if (since >> 32 != tracker.generation || uint32_t(since) >= tracker.epoch) {
+      // Not an epoch we handed out, or at least not since we lost track.
+      context.getResults(capnp::MessageSize { 4, 0 }).setKnown(false);
+      return kj::READY_NOW;
+    }
+
+    kj::Vector<BlockRun> runs;
+    for (uint32_t i = 0; i < tracker.groups.size(); i++) {
+      if (tracker.groups[i] > uint32_t(since)) {
+        addBlockRun(runs, uint64_t(i) * CHANGE_GROUP_BLOCKS, CHANGE_GROUP_BLOCKS);
+      }
+    }
+
+    setChangedBlocks(context, runs);
+    return kj::READY_NOW;
+  }
+
+  static kj::Promise<void> allocatedBlocksFd(IoPool& ioPool, IoPool::FlowId flow, int fd,
+                                             GetChangedBlocksContext context) {
+    // Reports the data extents of the file as getChangedBlocks() ranges.
+
+    static constexpr uint64_t MAP_CHUNK_BYTES = 1ull << 30;
+    // Map the file a gigabyte at a time so that no extent's block count can overflow.
+
+    struct Extents: public kj::Refcounted {
+      kj::Vector<FileExtent> list;
+    };
+    // Shared with the job, which must not be left writing to freed memory if we're canceled.
+
+    auto extents = kj::refcounted<Extents>();
+    auto jobExtents = kj::addRef(*extents);
+    return ioPool.run(flow, [fd,KJ_MVCAP(jobExtents)]() mutable {
+      uint64_t size = getFileSize(fd);
+      size = (size + Volume::BLOCK_SIZE - 1) / Volume::BLOCK_SIZE * Volume::BLOCK_SIZE;
+      for (uint64_t offset = 0; offset < size; offset += MAP_CHUNK_BYTES) {
+        mapFileExtents(fd, offset, kj::min(size - offset, MAP_CHUNK_BYTES), jobExtents->list);
+      }
+    }).then([context,KJ_MVCAP(extents)]() mutable {
+      kj::Vector<BlockRun> runs;
+      uint64_t blockNum = 0;
+      for (auto& extent: extents->list) {
+        if (extent.isData) {
+          addBlockRun(runs, blockNum, extent.count);
+        }
+        blockNum += extent.count;
+      }
+      setChangedBlocks(context, runs);
+    });
+  }
+
+  class ExclusiveWrapper: public capnp::Capability::Server {
+  public:
+    explicit ExclusiveWrapper(VolumeImpl& inner)
+        : inner(inner), innerCap(inner.thisCap()),
+          exclusiveNumber(++inner.currentExclusiveNumber) {
+      // All pause() snapshots are disabled by a new getExclusive().
+      if (inner.snapshotCount > 0) {
+        inner.snapshotCount = 0;
+        inner.onZeroSnapshotsFulfiller->fulfill();
+      }
+    }
+
+    kj::Promise<void> dispatchCall(uint64_t interfaceId, uint16_t methodId,
+        capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+      if (inner.currentExclusiveNumber != exclusiveNumber) {
+        return KJ_EXCEPTION(DISCONNECTED, "Volume revoked due to concurrent write");
+      }
+
+      if (interfaceId != capnp::typeId<Volume>()) {
+        return KJ_EXCEPTION(UNIMPLEMENTED, "actual interface: blackrock::Volume",
+                            interfaceId, methodId);
+      }
+
+      return inner.dispatchCall(interfaceId, methodId, context);
+    }
+
+  private:
+    VolumeImpl& inner;
+    capnp::Capability::Client innerCap;  // prevent gc
+    uint32_t exclusiveNumber;
+  };
+
+  class CloneSnapshot: public Volume::Server {
+    // Snapshot backed by a reflinked copy of the volume's file, so that writes to the original
+    // can continue immediately. The copy is an unlinked temp file, so it disappears when the
+    // snapshot is dropped. It shares extents with the original until either is modified, and it is
+    // not charged to the volume's owner.
+
+  public:
+    CloneSnapshot(VolumeImpl& inner, kj::AutoCloseFd fd)
+        : inner(inner), innerCap(inner.thisCap()), fd(kj::mv(fd)),
+          flow(inner.getIoPool().newFlow()) {
+      ++inner.cloneCount;
+    }
+
+    ~CloneSnapshot() noexcept(false) {
+      --inner.cloneCount;
+      inner.getIoPool().forget(flow);
+    }
+
+    kj::Promise<void> read(ReadContext context) override {
+      return readFd(inner.getIoPool(), flow, fd, context);
+    }
+
+    kj::Promise<void> readExtents(ReadExtentsContext context) override {
+      return readExtentsFd(inner.getIoPool(), flow, fd, context);
+    }
+
+    kj::Promise<void> readv(ReadvContext context) override {
+      return readvFd(inner.getIoPool(), flow, fd, context);
+    }
+
+    kj::Promise<void> getChangedBlocks(GetChangedBlocksContext context) override {
+      return inner.changedBlocks(flow, fd, context);
+    }
+
+  private:
+    VolumeImpl& inner;
+    capnp::Capability::Client innerCap;  // prevent gc; also keeps the I/O pool alive
+    kj::AutoCloseFd fd;
+    IoPool::FlowId flow;
+  };
+
+  class SnapshotWrapper: public Volume::Server {
+    // Snapshot implemented by blocking writes to the original volume until the snapshot is
+    // dropped. Used when the filesystem can't reflink.
+
+  public:
+    explicit SnapshotWrapper(VolumeImpl& inner)
+        : inner(inner), innerCap(inner.thisCap()),
+          exclusiveNumber(inner.currentExclusiveNumber) {
+      if (inner.snapshotCount++ == 0) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        inner.onZeroSnapshots = paf.promise.fork();
+        inner.onZeroSnapshotsFulfiller = kj::mv(paf.fulfiller);
+      }
+    }
+
+    ~SnapshotWrapper() noexcept(false) {
+      if (inner.currentExclusiveNumber == exclusiveNumber) {
+        KJ_ASSERT(inner.snapshotCount > 0) { return; }
+        if (--inner.snapshotCount == 0) {
+          inner.onZeroSnapshotsFulfiller->fulfill();
+        }
+      }
+    }
+
+    kj::Promise<void> read(ReadContext context) override {
+      if (inner.currentExclusiveNumber != exclusiveNumber) {
+        return KJ_EXCEPTION(DISCONNECTED,
+            "snapshot Volume revoked due to concurrent getExclusive()");
+      }
+
+      return inner.read(context);
+    }
+
+    kj::Promise<void> readExtents(ReadExtentsContext context) override {
+      if (inner.currentExclusiveNumber != exclusiveNumber) {
+        return KJ_EXCEPTION(DISCONNECTED,
+            "snapshot Volume revoked due to concurrent getExclusive()");
+      }
+
+      return inner.readExtents(context);
+    }
+
+    kj::Promise<void> readv(ReadvContext context) override {
+      if (inner.currentExclusiveNumber != exclusiveNumber) {
+        return KJ_EXCEPTION(DISCONNECTED,
+            "snapshot Volume revoked due to concurrent getExclusive()");
+      }
+
+      return inner.readv(context);
+    }
+
+    kj::Promise<void> getChangedBlocks(GetChangedBlocksContext context) override {
+      if (inner.currentExclusiveNumber != exclusiveNumber) {
+        return KJ_EXCEPTION(DISCONNECTED,
+            "snapshot Volume revoked due to concurrent getExclusive()");
+      }
+
+      return inner.getChangedBlocks(context);
+    }
+
+  private:
+    VolumeImpl& inner;
+    capnp::Capability::Client innerCap;  // prevent gc
+    uint32_t exclusiveNumber;
+  };
+
+  static bool noReflink;
+  // Set once we discover that the filesystem doesn't support FICLONE.
+
+  static constexpr uint COMPRESSION_EXTENT_BLOCKS = 256;
+  // Volumes are compressed in 1MB extents.
+
+  static std::atomic<bool> noCompression;
+  // Set (by an I/O thread) once we discover that the filesystem can't compress files.
+
+  std::map<uint32_t, kj::TimePoint> uncompressedExtents;
+  // Extents written since they were last compressed, mapped to the time of their latest write.
+  // Only populated when volume compression is enabled.
+
+  bool compressionScheduled = false;
+  kj::Promise<void> compressionTask = nullptr;
+
+  static constexpr uint CHANGE_GROUP_BLOCKS = 64;
+  // Changed blocks are tracked in groups of 256k.
+
+  struct ChangeTracker {
+    uint32_t generation;
+    // Random, chosen whenever tracking starts without history: for a new volume, or one that
+    // wasn't closed cleanly. The epochs we hand out are `generation << 32 | epoch`, so that epochs
+    // from before we lost track are recognized as unknown.
+
+    uint32_t epoch;
+    // Current epoch. pause() ends it.
+
+    std::vector<uint32_t> groups;
+    // For each group of CHANGE_GROUP_BLOCKS blocks, the epoch in which it was last written, or
+    // zero if it hasn't been written during this generation.
+  };
+
+  kj::Maybe<ChangeTracker> changes;
+  // Loaded on first use, and saved to `changed-blocks/<object ID>` when the volume is closed.
+
+  struct ChangeTrackerHeader {
+    // Header of a saved ChangeTracker. It's followed by the groups.
+
+    static constexpr uint64_t MAGIC = 0x736b636f6c426843ull;  // "ChBlocks"
+
+    uint64_t magic;
+    uint32_t generation;
+    uint32_t epoch;
+    uint32_t groupBlocks;
+    uint32_t groupCount;
+    uint64_t checksum;
+    // Hash of the groups. The file isn't synced when saved, so it could be garbage after a crash.
+  };
+
+  uint32_t counter = 0;
+  uint32_t currentExclusiveNumber = 0;
+  uint32_t snapshotCount = 0;
+  uint32_t cloneCount = 0;
+  // Live SnapshotWrappers and CloneSnapshots, respectively.
+
+  kj::ForkedPromise<void> onZeroSnapshots = nullptr;
+  kj::Own<kj::PromiseFulfiller<void>> onZeroSnapshotsFulfiller;
+
+  ChangeTracker& changeTracker() {
+    KJ_IF_MAYBE(c, changes) {
+      return *c;
+    }
+
+    ChangeTracker tracker;
+    bool loaded = false;
+    auto name = getId().filename('o');
+
+    KJ_IF_MAYBE(content, takeChangedBlocks()) {
+      // We were closed and reopened before the map was saved, or soon after. Either way, this
+      // copy is the current one.
+      loaded = parseChangeTracker(*content, tracker);
+    }
+
+    int dirFd = getChangedBlocksDir();
+    KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(dirFd, fixedStr(name), O_RDONLY | O_CLOEXEC)) {
+      if (!loaded) {
+        loaded = loadChangeTracker(*fd, tracker);
+        if (!loaded) {
+          KJ_LOG(WARNING, "discarding corrupt changed-block map", fixedStr(name));
+        }
+      }
+
+      // From here on, our in-memory copy is authoritative, and the file must not be mistaken for a
+      // current one if we crash. The unlink has to be durable before any write reaches the disk;
+      // since a volume's I/O runs in order, queuing the fsync() ahead of our writes ensures that.
+      KJ_SYSCALL(unlinkat(dirFd, name.begin(), 0));
+      int jobFd;
+      KJ_SYSCALL(jobFd = dup(dirFd));
+      kj::AutoCloseFd ownedFd(jobFd);
+      getIoPool().run(getFlow(), [KJ_MVCAP(ownedFd)]() {
+        KJ_SYSCALL(fsync(ownedFd));
+      }).eagerlyEvaluate([](kj::Exception&& exception) {
+        KJ_LOG(ERROR, "failed to sync changed-block directory", exception);
+      });
+    }
+
+    if (!loaded) {
+      randombytes_buf(&tracker.generation, sizeof(tracker.generation));
+      tracker.epoch = 1;
+      tracker.groups.clear();
+    }
+
+    return changes.emplace(kj::mv(tracker));
+  }
+
+  static uint64_t hashGroups(const std::vector<uint32_t>& groups) {
+    uint64_t result;
+    KJ_ASSERT(crypto_generichash_blake2b(
+        reinterpret_cast<byte*>(&result), sizeof(result),
+        reinterpret_cast<const byte*>(groups.data()), groups.size() * sizeof(uint32_t),
+        nullptr, 0) == 0);
+    return result;
+  }
+
+  static bool loadChangeTracker(int fd, ChangeTracker& tracker) {
+    static constexpr uint64_t MAX_SIZE =
+        sizeof(ChangeTrackerHeader) + (1ull << 32) / CHANGE_GROUP_BLOCKS * sizeof(uint32_t);
+    uint64_t size = getFileSize(fd);
+    if (size < sizeof(ChangeTrackerHeader) || size > MAX_SIZE) {
+      return false;
+    }
+    auto content = kj::heapArray<byte>(size);
+    preadAllOrZero(fd, content.begin(), content.size(), 0);
+    return parseChangeTracker(content, tracker);
+  }
+
+  static bool parseChangeTracker(kj::ArrayPtr<const byte> content, ChangeTracker& tracker) {
+    ChangeTrackerHeader header;
+    if (content.size() < sizeof(header)) return false;
+    memcpy(&header, content.begin(), sizeof(header));
+    if (header.magic != ChangeTrackerHeader::MAGIC ||
+        header.groupBlocks != CHANGE_GROUP_BLOCKS ||
+        header.groupCount > (1ull << 32) / CHANGE_GROUP_BLOCKS ||
+        content.size() != sizeof(header) + uint64_t(header.groupCount) * sizeof(uint32_t) ||
+        header.epoch == 0) {
+      return false;
+    }
+
+    tracker.generation = header.generation;
+    tracker.epoch = header.epoch;
+    tracker.groups.resize(header.groupCount);
+    memcpy(tracker.groups.data(), content.begin() + sizeof(header),
+           header.groupCount * sizeof(uint32_t));
+    return hashGroups(tracker.groups) == header.checksum;
+  }
+
+  static kj::Array<byte> serializeChangeTracker(const ChangeTracker& tracker) {
+    ChangeTrackerHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ChangeTrackerHeader::MAGIC;
+    header.generation = tracker.generation;
+    header.epoch = tracker.epoch;
+    header.groupBlocks = CHANGE_GROUP_BLOCKS;
+    header.groupCount = tracker.groups.size();
+    header.checksum = hashGroups(tracker.groups);
+
+    size_t groupBytes = tracker.groups.size() * sizeof(uint32_t);
+    auto result = kj::heapArray<byte>(sizeof(header) + groupBytes);
+    memcpy(result.begin(), &header, sizeof(header));
+    memcpy(result.begin() + sizeof(header), tracker.groups.data(), groupBytes);
+    return result;
+  }
+
+  void saveChangedBlocks() {
+    // Called when the volume is closed. The file is written by the I/O pool.
+
+    KJ_IF_MAYBE(tracker, changes) {
+      if (!isCommitted()) return;  // about to vanish anyway
+
+      KJ_IF_MAYBE(fd, getOpenFd()) {
+        struct stat stats;
+        KJ_SYSCALL(fstat(*fd, &stats));
+        if (stats.st_nlink == 0) return;  // deleted by death row already
+      }
+
+      queueChangedBlocks(serializeChangeTracker(*tracker));
+    }
+  }
+
+  void noteChanged(uint64_t blockNum, uint32_t count) {
+    // Record that the given blocks are about to be written, for getChangedBlocks().
+
+    if (count == 0) return;
+    auto& tracker = changeTracker();
+    uint32_t first = blockNum / CHANGE_GROUP_BLOCKS;
+    uint32_t last = (blockNum + count - 1) / CHANGE_GROUP_BLOCKS;
+    if (last >= tracker.groups.size()) {
+      tracker.groups.resize(last + 1);
+    }
+    for (uint32_t i = first; i <= last; i++) {
+      tracker.groups[i] = tracker.epoch;
+    }
+  }
+
+  void noteWritten(uint64_t blockNum, uint32_t count) {
+    // Remember that the given blocks were rewritten (and therefore stored uncompressed), so that
+    // their extents get compressed once they have gone cold.
+
+    if (count == 0 || noCompression.load(std::memory_order_relaxed)) return;
+
+    KJ_IF_MAYBE(delay, getVolumeCompressionDelay()) {
+      auto now = getTimer().now();
+      uint32_t first = blockNum / COMPRESSION_EXTENT_BLOCKS;
+      uint32_t last = (blockNum + count - 1) / COMPRESSION_EXTENT_BLOCKS;
+      for (uint32_t i = first; i <= last; i++) {
+        uncompressedExtents[i] = now;
+      }
+
+      if (!compressionScheduled) {
+        compressionScheduled = true;
+        compressionTask = compressLoop(*delay)
+            .eagerlyEvaluate([this](kj::Exception&& exception) {
+          compressionScheduled = false;
+          KJ_LOG(ERROR, "volume compression failed", exception);
+        });
+      }
+    }
+  }
+
+  kj::Promise<void> compressLoop(kj::Duration delay) {
+    return getTimer().afterDelay(delay).then([this]() -> kj::Promise<void> {
+      // Compress every extent that hasn't been written for a full delay period. Extents still
+      // being written are left alone, since compressing them would just be wasted work.
+      auto fullDelay = KJ_ASSERT_NONNULL(getVolumeCompressionDelay());
+
+      if (snapshotCount > 0 || cloneCount > 0) {
+        // Compression rewrites whole extents, so it would unshare the blocks a clone snapshot
+        // still shares with us and leave two copies on disk. Wait for the snapshots to go away.
+        return compressLoop(kj::max(fullDelay, 1 * kj::SECONDS));
+      }
+
+      auto now = getTimer().now();
+      kj::TimePoint nextDue = now + fullDelay;
+      kj::Vector<uint32_t> cold;
+      for (auto iter = uncompressedExtents.begin(); iter != uncompressedExtents.end();) {
+        auto due = iter->second + fullDelay;
+        if (due <= now) {
+          cold.add(iter->first);
+          iter = uncompressedExtents.erase(iter);
+        } else {
+          nextDue = kj::min(nextDue, due);
+          ++iter;
+        }
+      }
+
+      if (cold.size() > 0) {
+        compressExtents(cold.releaseAsArray());
+      }
+
+      if (uncompressedExtents.empty() || noCompression.load(std::memory_order_relaxed)) {
+        uncompressedExtents.clear();
+        compressionScheduled = false;
+        return kj::READY_NOW;
+      } else {
+        return compressLoop(nextDue - now);
+      }
+    });
+  }
+
+  void compressExtents(kj::Array<uint32_t> extents) {
+    // Ask the filesystem to rewrite the given extents compressed. Reads will transparently
+    // decompress them. The job runs in the volume's I/O flow, so it's ordered with respect to
+    // writes, and owns its own file descriptor, so it may outlive the volume.
+    //
+    // The caller must make sure no snapshot is live, since rewriting an extent unshares it.
+
+    if (getXattrRef().sharesTemplate) {
+      // Leave alone the extents where the volume may still share data with the template:
+      // rewriting them would trade a shared copy for a private, compressed one.
+      auto& shared = templateExtents();
+      kj::Vector<uint32_t> filtered(extents.size());
+      for (uint32_t extent: extents) {
+        if (shared.count(extent) == 0) filtered.add(extent);
+      }
+      if (filtered.size() == 0) return;
+      extents = filtered.releaseAsArray();
+    }
+
+    int fd = openRaw();
+    int jobFd;
+    KJ_SYSCALL(jobFd = dup(fd));
+    kj::AutoCloseFd ownedFd(jobFd);
+
+    // Nobody waits for this; errors are logged by the job itself. The job is charged for all the
+    // data it rewrites, so that compression doesn't crowd out other volumes' I/O.
+    uint64_t bytes = extents.size() * COMPRESSION_EXTENT_BLOCKS * Volume::BLOCK_SIZE;
+    getIoPool().run(getFlow(), bytes, [KJ_MVCAP(ownedFd),KJ_MVCAP(extents)]() {
+      for (uint32_t extent: extents) {
+        if (noCompression.load(std::memory_order_relaxed)) return;
+
+        struct btrfs_ioctl_defrag_range_args args;
+        memset(&args, 0, sizeof(args));
+        args.start = uint64_t(extent) * COMPRESSION_EXTENT_BLOCKS * Volume::BLOCK_SIZE;
+        args.len = COMPRESSION_EXTENT_BLOCKS * Volume::BLOCK_SIZE;
+        args.flags = BTRFS_DEFRAG_RANGE_COMPRESS | BTRFS_DEFRAG_RANGE_START_IO;
+        args.compress_type = 2;  // LZO: cheap enough that reads from cold extents stay fast.
+
+        if (ioctl(ownedFd, BTRFS_IOC_DEFRAG_RANGE, &args) < 0) {
+          int error = errno;
+          if (error == ENOTTY || error == EOPNOTSUPP) {
+            // Not btrfs (or compression is unavailable). Don't try again.
+            if (!noCompression.exchange(true)) {
+              KJ_LOG(WARNING, "filesystem can't compress volumes; volume compression disabled");
+            }
+            return;
+          }
+
+          // Anything else (e.g. EINVAL) is specific to this extent; the file stays readable
+          // either way.
+          KJ_LOG(ERROR, "failed to compress volume extent", strerror(error), extent);
+        }
+      }
+    });
+  }
+
+  static const std::unordered_set<uint32_t>& templateExtents() {
+    // The compression extents in which the blank ext4 image has data.
+
+    static const std::unordered_set<uint32_t> result = []() {
+      std::unordered_set<uint32_t> extents;
+      SparseData::Reader sparse = BLANK_EXT4;
+      const uint64_t extentBytes = COMPRESSION_EXTENT_BLOCKS * Volume::BLOCK_SIZE;
+      for (auto chunk: sparse.getChunks()) {
+        uint64_t size = chunk.getData().size();
+        if (size == 0) continue;
+        uint64_t first = chunk.getOffset() / extentBytes;
+        uint64_t last = (chunk.getOffset() + size - 1) / extentBytes;
+        for (uint64_t i = first; i <= last; i++) {
+          extents.insert(i);
+        }
+      }
+      return extents;
+    }();
+    return result;
+  }
+
+  kj::Promise<void> writeBlankExt4() {
+    SparseData::Reader sparse = BLANK_EXT4;
+    uint64_t bytes = 0;
+    for (auto chunk: sparse.getChunks()) {
+      bytes += chunk.getData().size();
+    }
+
+    int fd = openRaw();
+    return getIoPool().run(getFlow(), bytes, [fd]() {
+      // BLANK_EXT4 is a constant, so it's safe to read from the I/O thread.
+      SparseData::Reader sparse = BLANK_EXT4;
+      for (auto chunk: sparse.getChunks()) {
+        auto data = chunk.getData();
+        pwriteAll(fd, data.begin(), data.size(), chunk.getOffset());
+      }
+    }).then([this]() {
+      updateSize(getFileBlockCount(openRaw()));
+    });
+  }
+
+  kj::Promise<void> pauseWrites(PauseContext context, uint64_t epoch) {
+    auto results = context.getResults(capnp::MessageSize {6, 1});
+    results.setSnapshot(
+        capnp::Capability::Client(kj::heap<SnapshotWrapper>(*this)).castAs<Volume>());
+    results.setEpoch(epoch);
+    return kj::READY_NOW;
+  }
+
+  template <typename Context>
+  static kj::Promise<void> readFd(IoPool& ioPool, IoPool::FlowId flow, int fd,
+                                  Context context) {
+    // Implements read() against the given file, which may be the volume itself or a snapshot.
+
+    auto params = context.getParams();
+    uint64_t blockNum = params.getBlockNum();
+    uint32_t count = params.getCount();
+    context.releaseParams();
+
+    KJ_REQUIRE(blockNum + count < (1ull << 32), "volume read overflow");
+    KJ_REQUIRE(count < 2048, "can't read over 8MB from a volume per call");
+
+    uint64_t offset = blockNum * Volume::BLOCK_SIZE;
+    uint size = count * Volume::BLOCK_SIZE;
+
+    // The job reads into a buffer of its own rather than the results, which are freed if the
+    // call is canceled, and we copy the data over once it's done.
+    auto buffer = kj::refcounted<JobBuffer>(size);
+    return ioPool.run(flow, size, [fd,job = kj::addRef(*buffer),offset]() mutable {
+      preadAllOrZero(fd, job->bytes.begin(), job->bytes.size(), offset);
+    }).then([context,KJ_MVCAP(buffer)]() mutable {
+      auto results = context.getResults(
+          capnp::MessageSize {16 + buffer->bytes.size() / sizeof(capnp::word), 0});
+      auto data = results.initData(buffer->bytes.size());
+      memcpy(data.begin(), buffer->bytes.begin(), data.size());
+    });
+  }
+
+  struct ByteRange {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  template <typename Context>
+  static kj::Promise<void> readExtentsFd(IoPool& ioPool, IoPool::FlowId flow, int fd,
+                                         Context context) {
+    // Implements readExtents() against the given file, which may be the volume itself or a
+    // snapshot.
+
+    auto params = context.getParams();
+    uint64_t blockNum = params.getBlockNum();
+    uint32_t count = params.getCount();
+    context.releaseParams();
+
+    KJ_REQUIRE(blockNum + count < (1ull << 32), "volume read overflow");
+    KJ_REQUIRE(count < 2048, "can't read over 8MB from a volume per call");
 
-    uint64_t offset = blockNum * Volume::BLOCK_SIZE;
-    uint size = count * Volume::BLOCK_SIZE;
+    auto ranges = kj::heapArray<ByteRange>(1);
+    ranges[0] = ByteRange { blockNum * Volume::BLOCK_SIZE, count * Volume::BLOCK_SIZE };
+    return readRangesFd(ioPool, flow, fd, kj::mv(ranges), context);
+  }
 
-    int fd = openRaw();
-    KJ_SYSCALL(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size),
-               offset, size);
+  template <typename Context>
+  static kj::Promise<void> readvFd(IoPool& ioPool, IoPool::FlowId flow, int fd,
+                                   Context context) {
+    // Implements readv() against the given file.
 
-    maybeUpdateSize(count);
+    auto params = context.getParams();
+    auto list = params.getRanges();
+
+    uint64_t totalCount = 0;
+    auto ranges = kj::heapArrayBuilder<ByteRange>(list.size());
+    for (auto range: list) {
+      uint64_t blockNum = range.getBlockNum();
+      uint32_t count = range.getCount();
+      KJ_REQUIRE(blockNum + count < (1ull << 32), "volume read overflow");
+      totalCount += count;
+      ranges.add(ByteRange { blockNum * Volume::BLOCK_SIZE, count * Volume::BLOCK_SIZE });
+    }
+    context.releaseParams();
 
-    return kj::READY_NOW;
-  }
+    KJ_REQUIRE(totalCount < 2048, "can't read over 8MB from a volume per call");
 
-  kj::Promise<void> sync(SyncContext context) override {
-    int fd = openRaw();
-    KJ_SYSCALL(fdatasync(fd));
-    return kj::READY_NOW;
+    return readRangesFd(ioPool, flow, fd, ranges.finish(), context);
   }
 
-//  kj::Promise<void> asBlob(AsBlobContext context) override {
-    // TODO(someday)
-//  }
-
-  kj::Promise<void> getExclusive(GetExclusiveContext context) override {
-    context.getResults(capnp::MessageSize {4, 1}).setExclusive(
-        capnp::Capability::Client(kj::heap<ExclusiveWrapper>(*this)).castAs<Volume>());
-    return kj::READY_NOW;
-  }
+  struct RangeRead: public kj::Refcounted {
+    // State of a readRangesFd(), shared with its jobs so that they never touch memory which is
+    // freed if the call is canceled.
 
-  kj::Promise<void> freeze(FreezeContext context) override {
-    return setReadOnly();
-  }
+    kj::Array<ByteRange> ranges;
+    kj::Vector<FileExtent> extents;
+    // The ranges to read, and the extents they turned out to consist of.
 
-  kj::Promise<void> pause(PauseContext context) override {
-    context.getResults(capnp::MessageSize {4, 1}).setSnapshot(
-        capnp::Capability::Client(kj::heap<SnapshotWrapper>(*this)).castAs<Volume>());
-    return kj::READY_NOW;
-  }
+    kj::Vector<ByteRange> reads;
+    kj::Array<byte> data;
+    // The data extents' positions in the file, and their contents, back to back.
 
-private:
-  class ExclusiveWrapper: public capnp::Capability::Server {
-  public:
-    explicit ExclusiveWrapper(VolumeImpl& inner)
-        : inner(inner), innerCap(inner.thisCap()),
-          exclusiveNumber(++inner.currentExclusiveNumber) {
-      // All pause() snapshots are disabled by a new getExclusive().
-      if (inner.snapshotCount > 0) {
-        inner.snapshotCount = 0;
-        inner.onZeroSnapshotsFulfiller->fulfill();
-      }
-    }
+    explicit RangeRead(kj::Array<ByteRange> ranges): ranges(kj::mv(ranges)) {}
+  };
 
-    kj::Promise<void> dispatchCall(uint64_t interfaceId, uint16_t methodId,
-        capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
-      if (inner.currentExclusiveNumber != exclusiveNumber) {
-        return KJ_EXCEPTION(DISCONNECTED, "Volume revoked due to concurrent write");
+  template <typename Context>
+  static kj::Promise<void> readRangesFd(IoPool& ioPool, IoPool::FlowId flow, int fd,
+                                        kj::Array<ByteRange> ranges, Context context) {
+    // Reads the given ranges of the file as a list of extents. First we map out the holes in all
+    // the ranges, then we read only the data extents. Each step is a single job on the I/O pool
+    // regardless of the number of ranges. The results are filled in once both are done.
+
+    auto state = kj::refcounted<RangeRead>(kj::mv(ranges));
+    return ioPool.run(flow, [fd,job = kj::addRef(*state)]() mutable {
+      for (auto& range: job->ranges) {
+        mapFileExtents(fd, range.offset, range.size, job->extents);
       }
+    }).then([&ioPool,flow,fd,KJ_MVCAP(state)]() mutable -> kj::Promise<kj::Own<RangeRead>> {
+      uint64_t readBytes = 0;
+      size_t nextRange = 0;
+      uint64_t pos = 0;
+      uint64_t rangeEnd = 0;
+      for (auto& extent: state->extents) {
+        // Extents never span ranges, so when we reach the end of one range, move to the next.
+        while (pos == rangeEnd) {
+          KJ_ASSERT(nextRange < state->ranges.size());
+          pos = state->ranges[nextRange].offset;
+          rangeEnd = pos + state->ranges[nextRange].size;
+          ++nextRange;
+        }
 
-      if (interfaceId != capnp::typeId<Volume>()) {
-        return KJ_EXCEPTION(UNIMPLEMENTED, "actual interface: blackrock::Volume",
-                            interfaceId, methodId);
+        uint64_t size = uint64_t(extent.count) * Volume::BLOCK_SIZE;
+        if (extent.isData) {
+          state->reads.add(ByteRange { pos, size });
+          readBytes += size;
+        }
+        pos += size;
       }
 
-      return inner.dispatchCall(interfaceId, methodId, context);
-    }
-
-  private:
-    VolumeImpl& inner;
-    capnp::Capability::Client innerCap;  // prevent gc
-    uint32_t exclusiveNumber;
-  };
-
-  class SnapshotWrapper: public Volume::Server {
-  public:
-    explicit SnapshotWrapper(VolumeImpl& inner)
-        : inner(inner), innerCap(inner.thisCap()),
-          exclusiveNumber(inner.currentExclusiveNumber) {
-      if (inner.snapshotCount++ == 0) {
-        auto paf = kj::newPromiseAndFulfiller<void>();
-        inner.onZeroSnapshots = paf.promise.fork();
-        inner.onZeroSnapshotsFulfiller = kj::mv(paf.fulfiller);
+      if (readBytes == 0) {
+        return kj::mv(state);
       }
-    }
 
-    ~SnapshotWrapper() noexcept(false) {
-      if (inner.currentExclusiveNumber == exclusiveNumber) {
-        KJ_ASSERT(inner.snapshotCount > 0) { return; }
-        if (--inner.snapshotCount == 0) {
-          inner.onZeroSnapshotsFulfiller->fulfill();
+      state->data = kj::heapArray<byte>(readBytes);
+      auto promise = ioPool.run(flow, readBytes, [fd,job = kj::addRef(*state)]() mutable {
+        byte* out = job->data.begin();
+        for (auto& read: job->reads) {
+          preadAllOrZero(fd, out, read.size, read.offset);
+          out += read.size;
+        }
+      });
+      return promise.then([KJ_MVCAP(state)]() mutable { return kj::mv(state); });
+    }).then([context](kj::Own<RangeRead> state) mutable {
+      auto results = context.getResults(capnp::MessageSize {
+          16 + state->extents.size() * 4 + state->data.size() / sizeof(capnp::word), 0});
+      auto list = results.initExtents(state->extents.size());
+      const byte* in = state->data.begin();
+      for (auto i: kj::indices(state->extents)) {
+        auto& extent = state->extents[i];
+        auto builder = list[i];
+        builder.setCount(extent.count);
+        if (extent.isData) {
+          size_t size = size_t(extent.count) * Volume::BLOCK_SIZE;
+          memcpy(builder.initData(size).begin(), in, size);
+          in += size;
+        } else {
+          builder.setZeros();
         }
       }
-    }
+    });
+  }
 
-    kj::Promise<void> read(ReadContext context) override {
-      if (inner.currentExclusiveNumber != exclusiveNumber) {
-        return KJ_EXCEPTION(DISCONNECTED,
-            "snapshot Volume revoked due to concurrent getExclusive()");
+  static void writeSplittingZeros(int fd, capnp::Data::Reader data, uint64_t offset) {
+    // Writes `data` at `offset`, except that runs of all-zero blocks are punched out rather than
+    // written, so that they consume neither disk nor quota. Filesystems and databases commonly
+    // write partially-zero extents (e.g. preallocation, fresh inode tables) and the client can
+    // only cheaply detect the case where a whole request is zero. Runs on the I/O thread.
+
+    const byte* begin = data.begin();
+    const byte* end = data.end();
+    const byte* runStart = begin;
+    bool runIsZero = false;
+
+    auto flush = [&](const byte* runEnd) {
+      if (runEnd == runStart) return;
+      uint64_t runOffset = offset + (runStart - begin);
+      size_t runSize = runEnd - runStart;
+      if (runIsZero) {
+        KJ_SYSCALL(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             runOffset, runSize), runOffset, runSize);
+      } else {
+        pwriteAll(fd, runStart, runSize, runOffset);
       }
+      runStart = runEnd;
+    };
 
-      return inner.read(context);
+    for (const byte* block = begin; block < end; block += Volume::BLOCK_SIZE) {
+      bool zero = isAllZero(block, Volume::BLOCK_SIZE);
+      if (zero != runIsZero) {
+        flush(block);
+        runIsZero = zero;
+      }
     }
-
-  private:
-    VolumeImpl& inner;
-    capnp::Capability::Client innerCap;  // prevent gc
-    uint32_t exclusiveNumber;
-  };
-
-  uint32_t counter = 0;
-  uint32_t currentExclusiveNumber = 0;
-  uint32_t snapshotCount = 0;
-  kj::ForkedPromise<void> onZeroSnapshots = nullptr;
-  kj::Own<kj::PromiseFulfiller<void>> onZeroSnapshotsFulfiller;
+    flush(end);
+  }
 
   void maybeUpdateSize(uint32_t count) {
     // Periodically update our accounting of the volume size. Called every time some blocks are
@@ -2067,6 +4345,10 @@ private:
 };
 
 constexpr FilesystemStorage::Type FilesystemStorage::VolumeImpl::TYPE;
+constexpr uint FilesystemStorage::VolumeImpl::CHANGE_GROUP_BLOCKS;
+constexpr uint64_t FilesystemStorage::VolumeImpl::ChangeTrackerHeader::MAGIC;
+bool FilesystemStorage::VolumeImpl::noReflink = false;
+std::atomic<bool> FilesystemStorage::VolumeImpl::noCompression(false);
 
 // =======================================================================================
 
@@ -2077,9 +4359,9 @@ public:
 
   kj::Promise<void> newBlob(NewBlobContext context) override {
     auto result = factory.newObject<BlobImpl>();
-    result.object.init(context.getParams().getContent());
+    auto promise = result.object.init(context.getParams().getContent());
     context.getResults(capnp::MessageSize { 4, 1 }).setBlob(kj::mv(result.client));
-    return kj::READY_NOW;
+    return promise;
   }
 
   kj::Promise<void> uploadBlob(UploadBlobContext context) override {
@@ -2097,6 +4379,13 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> newFormattedVolume(NewFormattedVolumeContext context) override {
+    auto result = factory.newObject<VolumeImpl>();
+    auto promise = result.object.initFormatted();
+    context.getResults(capnp::MessageSize { 4, 1 }).setVolume(kj::mv(result.client));
+    return kj::mv(promise);
+  }
+
   kj::Promise<void> newAssignable(NewAssignableContext context) override {
     auto result = factory.newObject<AssignableImpl>();
     auto promise = result.object.setStoredObject(context.getParams().getInitialValue());
@@ -2112,9 +4401,22 @@ private:
 // =======================================================================================
 // finish implementing ObjectFactory
 
-FilesystemStorage::ObjectFactory::ObjectFactory(Journal& journal, kj::Timer& timer,
-                                                Restorer<SturdyRef>::Client&& restorer)
-    : journal(journal), timer(timer), restorer(kj::mv(restorer)) {}
+FilesystemStorage::ObjectFactory::ObjectFactory(Journal& journal, kj::Own<IoPool> ioPool,
+                                                BlobStore& blobStore,
+                                                kj::AutoCloseFd blankExt4Template,
+                                                kj::AutoCloseFd changedBlocksDir,
+                                                kj::Timer& timer,
+                                                Restorer<SturdyRef>::Client&& restorer,
+                                                const Options& options)
+    : journal(journal), ioPool(kj::mv(ioPool)), blobStore(blobStore),
+      blankExt4Template(kj::mv(blankExt4Template)), changedBlocksDir(kj::mv(changedBlocksDir)),
+      changedBlocksFlow(this->ioPool->newFlow()), timer(timer),
+      warmCacheBytes(options.warmCacheBytes), warmCacheMaxObjects(options.warmCacheMaxObjects),
+      streamWindowBytes(options.streamWindowBytes), tasks(*this), restorer(kj::mv(restorer)) {
+  if (options.compressVolumes) {
+    volumeCompressionDelay = options.volumeCompressionDelaySeconds * kj::SECONDS;
+  }
+}
 
 template <typename T>
 auto FilesystemStorage::ObjectFactory::newObject() -> ClientObjectPair<typename T::Serves, T> {
@@ -2130,7 +4432,24 @@ auto FilesystemStorage::ObjectFactory::openObject(ObjectKey key)
     return { object.self(), object };
   }
 
+  KJ_IF_MAYBE(warm, takeWarm(id)) {
+    ++stats.warmCacheHits;
+    switch (warm->xattr.type) {
+#define HANDLE_TYPE(tag, type) \
+      case Type::tag: \
+        return registerObject(kj::heap<type>(journal, kj::addRef(*this), key, id, kj::mv(*warm)))
+      HANDLE_TYPE(BLOB, BlobImpl);
+      HANDLE_TYPE(VOLUME, VolumeImpl);
+      HANDLE_TYPE(ASSIGNABLE, AssignableImpl);
+#undef HANDLE_TYPE
+      default:
+        // Can't happen since we only ever constructed these types.
+        KJ_UNREACHABLE;
+    }
+  }
+
   // Not in cache. Create it.
+  ++stats.warmCacheMisses;
   Xattr xattr;
   auto fd = KJ_ASSERT_NONNULL(journal.openObject(id, xattr), "object not found");
 
@@ -2160,8 +4479,181 @@ auto FilesystemStorage::ObjectFactory::getLiveObject(capnp::Capability::Client&
   });
 }
 
-void FilesystemStorage::ObjectFactory::destroyed(ObjectBase& object) {
+void FilesystemStorage::ObjectFactory::destroyed(ObjectBase& object,
+                                                 kj::Maybe<WarmObject> warm) {
   objectCache.erase(object.getId());
+
+  KJ_IF_MAYBE(w, warm) {
+    if (warmCacheBytes == 0 || warmCacheMaxObjects == 0) {
+      ioPool->forget(w->flow);
+      return;
+    }
+
+    struct stat st;
+    KJ_SYSCALL(fstat(w->fd, &st));
+    if (st.st_nlink == 0) {
+      // Deleted while it was open. Holding on to the fd would only keep the space allocated.
+      ioPool->forget(w->flow);
+      return;
+    }
+
+    // Shouldn't be there already, but just in case, replace the old entry.
+    forgetWarm(object.getId());
+
+    uint64_t bytes = sizeof(WarmEntry) + w->children.size() * sizeof(ObjectId) +
+                     w->mapping.asBytes().size();
+    warmLru.push_front(object.getId());
+    warmCache.insert(std::make_pair(object.getId(),
+        WarmEntry { kj::mv(*w), bytes, warmLru.begin() }));
+    stats.warmCacheBytes += bytes;
+    ++stats.warmCacheObjects;
+
+    evictWarm();
+  } else {
+    // The object's fd (if any) is closed as soon as we return.
+    ioPool->forget(object.getFlow());
+  }
+}
+
+auto FilesystemStorage::ObjectFactory::takeWarm(ObjectId id) -> kj::Maybe<WarmObject> {
+  auto iter = warmCache.find(id);
+  if (iter == warmCache.end()) return nullptr;
+
+  WarmObject result = kj::mv(iter->second.object);
+  stats.warmCacheBytes -= iter->second.bytes;
+  --stats.warmCacheObjects;
+  warmLru.erase(iter->second.lruPos);
+  warmCache.erase(iter);
+
+  struct stat st;
+  KJ_SYSCALL(fstat(result.fd, &st));
+  if (st.st_nlink == 0) {
+    // The file has been deleted out from under us (e.g. it was a descendant of a deleted object).
+    ioPool->forget(result.flow);
+    return nullptr;
+  }
+
+  return kj::mv(result);
+}
+
+void FilesystemStorage::ObjectFactory::deleted(ObjectId id) {
+  forgetWarm(id);
+
+  if (takeChangedBlocks(id) != nullptr) {
+    // The volume was closed just before death row got to it, so its map may have been written
+    // after death row removed the old one.
+    auto name = id.filename('o');
+    if (unlinkat(changedBlocksDir, name.begin(), 0) < 0) {
+      int error = errno;
+      if (error != ENOENT) {
+        KJ_FAIL_SYSCALL("unlinkat(changed blocks)", error, fixedStr(name));
+      }
+    }
+  }
+}
+
+void FilesystemStorage::ObjectFactory::saveChangedBlocks(ObjectId id, kj::Array<byte> content) {
+  auto pending = kj::refcounted<PendingChangedBlocks>();
+  *pending->content.lockExclusive() = kj::mv(content);
+
+  int dirFd;
+  KJ_SYSCALL(dirFd = dup(changedBlocksDir));
+  kj::AutoCloseFd ownedDirFd(dirFd);
+
+  // All saves share the directory's flow, so that they happen in the order they were queued.
+  PendingChangedBlocks* pendingPtr = pending.get();
+  auto jobRef = kj::addRef(*pending);
+  auto promise = ioPool->run(changedBlocksFlow, [id,KJ_MVCAP(ownedDirFd),KJ_MVCAP(jobRef)]() {
+    auto lock = jobRef->content.lockExclusive();
+    KJ_IF_MAYBE(c, *lock) {
+      auto name = id.filename('o');
+      auto tmpName = kj::str(fixedStr(name), ".tmp");
+      {
+        auto fd = sandstorm::raiiOpenAt(ownedDirFd, tmpName,
+                                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+        pwriteAll(fd, c->begin(), c->size(), 0);
+      }
+      KJ_SYSCALL(renameat(ownedDirFd, tmpName.cStr(), ownedDirFd, name.begin()));
+      *lock = nullptr;
+    }
+  });
+
+  // Replaces any earlier save for the same volume; that one's job is ahead of ours anyway.
+  pendingChangedBlocks[id] = kj::mv(pending);
+
+  tasks.add(promise.then([]() {}, [](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "failed to save changed-block map; next backup will be a full one",
+           exception);
+  }).then([this,id,pendingPtr]() {
+    auto iter = pendingChangedBlocks.find(id);
+    if (iter != pendingChangedBlocks.end() && iter->second.get() == pendingPtr) {
+      pendingChangedBlocks.erase(iter);
+    }
+  }));
+}
+
+kj::Maybe<kj::Array<byte>> FilesystemStorage::ObjectFactory::takeChangedBlocks(ObjectId id) {
+  auto iter = pendingChangedBlocks.find(id);
+  if (iter == pendingChangedBlocks.end()) {
+    return nullptr;
+  }
+
+  kj::Maybe<kj::Array<byte>> result;
+  {
+    auto lock = iter->second->content.lockExclusive();
+    KJ_IF_MAYBE(c, *lock) {
+      result = kj::mv(*c);
+      *lock = nullptr;
+    } else {
+      // Already written, but the job's completion hasn't reached us. The file is current.
+    }
+  }
+  pendingChangedBlocks.erase(iter);
+  return result;
+}
+
+void FilesystemStorage::ObjectFactory::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+void FilesystemStorage::ObjectFactory::forgetWarm(ObjectId id) {
+  auto iter = warmCache.find(id);
+  if (iter != warmCache.end()) {
+    ioPool->forget(iter->second.object.flow);
+    stats.warmCacheBytes -= iter->second.bytes;
+    --stats.warmCacheObjects;
+    warmLru.erase(iter->second.lruPos);
+    warmCache.erase(iter);
+  }
+}
+
+kj::Array<FilesystemStorage::ObjectIoStats> FilesystemStorage::ObjectFactory::getIoStats() {
+  // The I/O pool only knows flows, so match them up with live objects. I/O on objects in the warm
+  // cache is rare enough (warm objects aren't being read or written) to ignore.
+  auto flowStats = ioPool->takeFlowStats();
+  kj::Vector<ObjectIoStats> result;
+  for (auto& entry: objectCache) {
+    auto iter = flowStats.find(entry.second->getFlow());
+    if (iter != flowStats.end()) {
+      auto& stats = iter->second;
+      result.add(ObjectIoStats { entry.first, stats.queued, stats.jobs, stats.bytes,
+                                 stats.totalLatencyNs, stats.maxLatencyNs });
+    }
+  }
+  return result.releaseAsArray();
+}
+
+void FilesystemStorage::ObjectFactory::evictWarm() {
+  while (!warmLru.empty() &&
+         (stats.warmCacheBytes > warmCacheBytes || stats.warmCacheObjects > warmCacheMaxObjects)) {
+    auto iter = warmCache.find(warmLru.back());
+    KJ_ASSERT(iter != warmCache.end());
+    ioPool->forget(iter->second.object.flow);
+    stats.warmCacheBytes -= iter->second.bytes;
+    --stats.warmCacheObjects;
+    warmCache.erase(iter);
+    warmLru.pop_back();
+  }
 }
 
 void FilesystemStorage::ObjectFactory::modifyTransitiveSize(
@@ -2172,18 +4664,10 @@ void FilesystemStorage::ObjectFactory::modifyTransitiveSize(
   }
 
   Xattr scratchXattr;
-  Xattr* xattr;
-
-  auto iter = objectCache.find(id);
-  if (iter == objectCache.end()) {
-    // Object not loaded. Edit directly.
-    if (journal.openObject(id, scratchXattr) == nullptr) {
-      // Apparently the object has been deleted. There's no use trying to modify it or its parents.
-      return;
-    }
-    xattr = &scratchXattr;
-  } else {
-    xattr = &iter->second->getXattrRef();
+  Xattr* xattr = findXattr(id, scratchXattr);
+  if (xattr == nullptr) {
+    // Apparently the object has been deleted. There's no use trying to modify it or its parents.
+    return;
   }
 
   if (deltaBlocks < 0 && -deltaBlocks > xattr->transitiveBlockCount) {
@@ -2198,11 +4682,121 @@ void FilesystemStorage::ObjectFactory::modifyTransitiveSize(
   modifyTransitiveSize(xattr->owner, deltaBlocks, txn);
 }
 
+auto FilesystemStorage::ObjectFactory::findXattr(ObjectId id, Xattr& scratch) -> Xattr* {
+  auto iter = objectCache.find(id);
+  if (iter != objectCache.end()) {
+    return &iter->second->getXattrRef();
+  }
+
+  auto warmIter = warmCache.find(id);
+  if (warmIter != warmCache.end()) {
+    // Not live, but warm. Edit the cached copy so that it stays current.
+    return &warmIter->second.object.xattr;
+  }
+
+  // Object not loaded. Edit directly.
+  if (journal.openObject(id, scratch) == nullptr) {
+    return nullptr;
+  }
+  return &scratch;
+}
+
+void FilesystemStorage::ObjectFactory::deferSizeChange(ObjectId id, uint64_t blocks) {
+  pendingSizes[id] = blocks;
+
+  if (pendingSizes.size() >= MAX_PENDING_SIZE_CHANGES) {
+    flushSizeChanges();
+  } else {
+    scheduleSizeFlush();
+  }
+}
+
+void FilesystemStorage::ObjectFactory::scheduleSizeFlush() {
+  if (!sizeFlushScheduled) {
+    sizeFlushScheduled = true;
+    sizeFlushTask = timer.afterDelay(SIZE_FLUSH_DELAY).then([this]() {
+      sizeFlushScheduled = false;
+      flushSizeChanges();
+    }).eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "failed to flush deferred storage size changes", exception);
+    });
+  }
+}
+
+void FilesystemStorage::ObjectFactory::flushSizeChanges() {
+  if (pendingSizes.empty()) return;
+
+  if (journal.isTransactionInProgress()) {
+    // We were reached from inside another transaction, e.g. by something it did asking for an
+    // object's storage usage. Opening a second one would abort the process.
+    scheduleSizeFlush();
+    return;
+  }
+
+  auto changes = kj::mv(pendingSizes);
+  pendingSizes.clear();
+
+  // First work out the net effect on every affected object, so that an ancestor of several
+  // changed objects is only updated once.
+  struct Update {
+    kj::Maybe<uint64_t> accountedBlockCount;
+    int64_t transitiveDelta = 0;
+  };
+  std::unordered_map<ObjectId, Update, ObjectId::Hash> updates;
+
+  for (auto& change: changes) {
+    Xattr scratchXattr;
+    Xattr* xattr = findXattr(change.first, scratchXattr);
+    if (xattr == nullptr || xattr->accountedBlockCount == change.second) continue;
+
+    int64_t delta = int64_t(change.second) - int64_t(xattr->accountedBlockCount);
+    updates[change.first].accountedBlockCount = change.second;
+
+    ObjectId id = change.first;
+    while (id != nullptr) {
+      updates[id].transitiveDelta += delta;
+      xattr = findXattr(id, scratchXattr);
+      if (xattr == nullptr) break;
+      id = xattr->owner;
+    }
+  }
+
+  if (updates.empty()) return;
+
+  Journal::Transaction txn(journal);
+  for (auto& update: updates) {
+    Xattr scratchXattr;
+    Xattr* xattr = findXattr(update.first, scratchXattr);
+    if (xattr == nullptr) continue;
+
+    KJ_IF_MAYBE(blocks, update.second.accountedBlockCount) {
+      xattr->accountedBlockCount = *blocks;
+    }
+
+    int64_t deltaBlocks = update.second.transitiveDelta;
+    if (deltaBlocks < 0 && -deltaBlocks > xattr->transitiveBlockCount) {
+      KJ_LOG(ERROR, "storage object had inconsistent transitive block count",
+          deltaBlocks, xattr->transitiveBlockCount);
+      deltaBlocks = -xattr->transitiveBlockCount;
+    }
+    xattr->transitiveBlockCount += deltaBlocks;
+
+    txn.updateObjectXattr(update.first, *xattr);
+  }
+  txn.commit();
+}
+
 void FilesystemStorage::ObjectFactory::disowned(ObjectId id) {
   auto iter = objectCache.find(id);
   if (iter != objectCache.end()) {
     iter->second->getXattrRef().owner = nullptr;
   }
+
+  forgetWarm(id);
+
+  // The owner's accounting drops the object as it stands on disk, so any size change not yet
+  // written must not be applied later.
+  pendingSizes.erase(id);
 }
 
 template <typename T>
@@ -2216,6 +4810,35 @@ auto FilesystemStorage::ObjectFactory::registerObject(kj::Own<T> object)
   return { serverSet.add(kj::mv(object)).template castAs<typename T::Serves>(), ref };
 }
 
+// =======================================================================================
+// DeathRow methods which depend on ObjectFactory
+
+kj::Promise<void> FilesystemStorage::DeathRow::deletedLoop() {
+  return deletedEventFdObserver.whenBecomesReadable().then([this]() {
+    uint64_t count;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = read(deletedEventFd, &count, sizeof(count)));
+
+    if (n < 0) {
+      // Oops, not actually ready.
+    } else {
+      KJ_ASSERT(n == sizeof(count), "eventfd read had unexpected size", n);
+
+      kj::Vector<ObjectId> ids;
+      {
+        auto lock = deletedIds.lockExclusive();
+        ids = kj::mv(*lock);
+      }
+
+      for (auto& id: ids) {
+        storage.factory->deleted(id);
+      }
+    }
+
+    return deletedLoop();
+  });
+}
+
 // =======================================================================================
 
 static kj::AutoCloseFd openOrCreateDirectory(int parentFd, kj::StringPtr name) {
@@ -2224,19 +4847,110 @@ static kj::AutoCloseFd openOrCreateDirectory(int parentFd, kj::StringPtr name) {
   return f;
 }
 
+kj::AutoCloseFd FilesystemStorage::openBlankExt4Template(int directoryFd) {
+  // Volumes created by newFormattedVolume() are reflinked from `templates/blank-ext4-<hash>`, a
+  // file containing the image NbdDevice::format() writes. The name includes a hash of the image,
+  // so that a build with a different image writes a new template rather than using a stale one.
+
+  auto templatesFd = openOrCreateDirectory(directoryFd, "templates");
+
+  SparseData::Reader sparse = BLANK_EXT4;
+  alignas(64) crypto_generichash_blake2b_state state;
+  uint64_t hash;
+  KJ_ASSERT(crypto_generichash_blake2b_init(&state, nullptr, 0, sizeof(hash)) == 0);
+  for (auto chunk: sparse.getChunks()) {
+    uint64_t offset = chunk.getOffset();
+    auto data = chunk.getData();
+    KJ_ASSERT(crypto_generichash_blake2b_update(
+        &state, reinterpret_cast<const byte*>(&offset), sizeof(offset)) == 0);
+    KJ_ASSERT(crypto_generichash_blake2b_update(&state, data.begin(), data.size()) == 0);
+  }
+  KJ_ASSERT(crypto_generichash_blake2b_final(
+      &state, reinterpret_cast<byte*>(&hash), sizeof(hash)) == 0);
+  auto hashName = hex64(hash);
+  auto name = kj::str("blank-ext4-", fixedStr(hashName));
+
+  for (auto& other: sandstorm::listDirectoryFd(templatesFd)) {
+    if (other.startsWith("blank-ext4-") && other.size() == name.size() && other != name) {
+      // Written by an older build. Volumes cloned from it have their own references to its
+      // extents, so it can go. Anything else in the directory isn't ours to delete.
+      KJ_SYSCALL(unlinkat(templatesFd, other.cStr(), 0), other);
+    }
+  }
+
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(templatesFd, name, O_RDONLY | O_CLOEXEC)) {
+    return kj::mv(*fd);
+  }
+
+  // Write the template to an anonymous file and only link it in once it's complete and durable,
+  // so that a crash can't leave a partial template behind.
+  auto fd = sandstorm::raiiOpenAt(templatesFd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC);
+  for (auto chunk: sparse.getChunks()) {
+    auto data = chunk.getData();
+    pwriteAll(fd, data.begin(), data.size(), chunk.getOffset());
+  }
+  KJ_SYSCALL(fdatasync(fd));
+  KJ_SYSCALL(linkat(AT_FDCWD, kj::str("/proc/self/fd/", fd.get()).cStr(),
+                    templatesFd, name.cStr(), AT_SYMLINK_FOLLOW));
+  KJ_SYSCALL(fsync(templatesFd));
+  return fd;
+}
+
 FilesystemStorage::FilesystemStorage(
     int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
     Restorer<SturdyRef>::Client&& restorer)
+    : FilesystemStorage(directoryFd, eventPort, timer, kj::mv(restorer), Options()) {}
+
+FilesystemStorage::FilesystemStorage(
+    int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
+    Restorer<SturdyRef>::Client&& restorer, Options options)
     : mainDirFd(openOrCreateDirectory(directoryFd, "main")),
       stagingDirFd(openOrCreateDirectory(directoryFd, "staging")),
       deathRowFd(openOrCreateDirectory(directoryFd, "death-row")),
       rootsFd(openOrCreateDirectory(directoryFd, "roots")),
-      deathRow(kj::heap<DeathRow>(*this)),
+      changedBlocksFd(openOrCreateDirectory(directoryFd, "changed-blocks")),
+      ioPool(kj::refcounted<IoPool>(eventPort, options.ioThreadCount,
+                                    options.ioOpsPerSecondPerObject,
+                                    options.ioBytesPerSecondPerObject)),
+      blobStore(kj::heap<BlobStore>(openOrCreateDirectory(directoryFd, "blobs"),
+                                    openOrCreateDirectory(directoryFd, "blob-refs"),
+                                    *ioPool, options.deduplicateBlobs)),
+      deathRow(kj::heap<DeathRow>(*this, eventPort, options.deathRowThreadCount,
+                                  options.deathRowOpsPerSecond)),
       journal(kj::heap<Journal>(*this, eventPort,
-          sandstorm::raiiOpenAt(directoryFd, "journal", O_RDWR | O_CREAT | O_CLOEXEC))),
-      factory(kj::refcounted<ObjectFactory>(*journal, timer, kj::mv(restorer))) {}
+          sandstorm::raiiOpenAt(directoryFd, "journal", O_RDWR | O_CREAT | O_CLOEXEC),
+          options.journalThreadCount)),
+      factory(kj::refcounted<ObjectFactory>(*journal, kj::addRef(*ioPool), *blobStore,
+                                            openBlankExt4Template(directoryFd),
+                                            sandstorm::raiiOpenAt(changedBlocksFd, ".",
+                                                O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                                            timer,
+                                            kj::mv(restorer), options)) {
+  // The journal executes recovered transactions in the background, and blob store cleanup needs
+  // to see their results, so it follows on once they're done rather than holding up startup.
+  blobCleanupTask = blobStore->cleanupAfter(journal->whenRecovered(), mainDirFd)
+      .eagerlyEvaluate([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "blob store cleanup failed", exception);
+  });
+}
+
+FilesystemStorage::~FilesystemStorage() noexcept(false) {
+  // Don't lose size changes that haven't been written yet.
+  factory->flushSizeChanges();
+}
+
+FilesystemStorage::Stats FilesystemStorage::getStats() {
+  Stats result = factory->getStats();
+  deathRow->getStats(result);
+  journal->getStats(result);
+  result.ioQueueDepth = ioPool->getQueueDepth();
+  result.ioThrottleStalls = ioPool->getThrottleStalls();
+  return result;
+}
 
-FilesystemStorage::~FilesystemStorage() noexcept(false) {}
+kj::Array<FilesystemStorage::ObjectIoStats> FilesystemStorage::getIoStats() {
+  return factory->getIoStats();
+}
 
 kj::Promise<void> FilesystemStorage::set(SetContext context) {
   auto params = context.getParams();
@@ -2323,6 +5037,7 @@ kj::Promise<void> FilesystemStorage::remove(RemoveContext context) {
     ObjectKey key(message.getRoot<StoredRoot>().getKey());
     Journal::Transaction txn(*journal);
     txn.moveToDeathRow(key);
+    factory->disowned(key);
     return txn.commit().then([this,name]() {
       while (unlinkat(rootsFd, name.cStr(), 0) < 0) {
         int error = errno;
@@ -2343,6 +5058,12 @@ kj::Promise<void> FilesystemStorage::getFactory(GetFactoryContext context) {
   return kj::READY_NOW;
 }
 
+// TODO(perf): Every object, however small, is its own file in `main`, costing an inode, an xattr,
+//   a rename through staging, and a directory entry. Small StoredObjects could instead be
+//   appended to log-structured segment files with an in-memory ID -> offset index, checkpointed
+//   and compacted in the background, leaving Volumes and large Blobs as files. That needs the
+//   journal's staging/rename protocol, per-object xattrs, death row, and storage-tool to learn
+//   about segment entries.
 kj::Maybe<kj::AutoCloseFd> FilesystemStorage::openObject(ObjectId id) {
   return sandstorm::raiiOpenAtIfExists(mainDirFd, id.filename('o').begin(), O_RDWR | O_CLOEXEC);
 }
@@ -2371,12 +5092,6 @@ void FilesystemStorage::deleteStaging(uint64_t number) {
   KJ_SYSCALL(unlinkat(stagingDirFd, hex64(number).begin(), 0));
 }
 
-void FilesystemStorage::deleteAllStaging() {
-  for (auto& file: sandstorm::listDirectoryFd(stagingDirFd)) {
-    KJ_SYSCALL(unlinkat(stagingDirFd, file.cStr(), 0));
-  }
-}
-
 void FilesystemStorage::createFromStagingIfExists(
     uint64_t stagingId, ObjectId finalId, const Xattr& attributes) {
   auto stagingName = hex64(stagingId);
@@ -2450,9 +5165,9 @@ void FilesystemStorage::replaceFromStagingIfExists(
   // First check that the old file still exists, since we're updating. If it doesn't, it was
   // probably deleted, and the new copy should also be immediately deleted.
   //
-  // Note that since all modifications are done by the journal thread we can assume no race between
-  // faccessat() and renameat(), but if races were possible we could use renameat2() (new feature
-  // in Linux 3.15).
+  // Note that since all modifications to a given object are done by the same journal executor
+  // thread we can assume no race between faccessat() and renameat(), but if races were possible we
+  // could use renameat2() (new feature in Linux 3.15).
 retryAccess:
   if (faccessat(mainDirFd, finalName.begin(), F_OK, 0) != 0) {
     int error = errno;
@@ -2513,12 +5228,12 @@ retry:
   }
 }
 
-void FilesystemStorage::moveToDeathRowIfExists(ObjectId id, bool notify) {
+void FilesystemStorage::moveToDeathRowIfExists(ObjectId id) {
   auto name = id.filename('o');
 
 retry:
   if (renameat(mainDirFd, name.begin(), deathRowFd, name.begin()) == 0) {
-    if (notify) deathRow->notifyNewInmates();
+    deathRow->add(fixedStr(name), id);
   } else {
     int error = errno;
     switch (error) {
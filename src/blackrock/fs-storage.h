@@ -30,10 +30,102 @@ namespace kj {
 
 namespace blackrock {
 
+class IoPool;
+
 class FilesystemStorage: public StorageRootSet::Server {
+  // TODO(perf): Apart from blocking disk I/O (see IoPool) and executing journal entries, all work
+  //   happens on the one event loop, so a storage node still tops out at about one core for RPCs,
+  //   the object cache, and journal appends. Scaling up needs the object space sharded by
+  //   ObjectId, each shard with its own event loop, journal, staging directory, and cache. The
+  //   hard part is that one transaction may touch objects in several shards -- e.g. an Assignable
+  //   adopting a child created elsewhere, or transitive size updates up the ownership chain --
+  //   which then needs a two-phase commit across the shards' journals.
 public:
+  struct Options {
+    uint ioThreadCount = 8;
+    // Number of threads performing blocking disk I/O (reads, writes, hole punching, fdatasync())
+    // on behalf of the event loop. Each thread serves a fixed subset of open objects, sharing its
+    // time fairly among them by bytes transferred.
+
+    uint ioOpsPerSecondPerObject = 0;
+    uint64_t ioBytesPerSecondPerObject = 0;
+    // Caps on the disk I/O of any one object (in practice, a grain's volume), 0 = unlimited. I/O
+    // beyond the cap is delayed, not failed, and may burst up to one second's worth. Syncs and
+    // metadata updates are never delayed by the caps, but do count against them.
+
+    uint journalThreadCount = 4;
+    // Number of threads executing committed journal transactions. Objects are partitioned among
+    // them by ID, so that renames, xattr updates, and the fsync()s that make them durable proceed
+    // on several objects at once. This only parallelizes the journal's back end: RPCs, the object
+    // cache, and appends to the (single) journal file are all still handled on the event loop.
+
+    uint64_t warmCacheBytes = 64ull << 20;
+    uint warmCacheMaxObjects = 4096;
+    // Budget for recently-closed objects which are kept open (file descriptor, attributes, child
+    // list, and StoredObject content) so that reopening them is cheap. Each one holds a file
+    // descriptor, hence the separate limit on their number.
+
+    uint deathRowThreadCount = 2;
+    uint deathRowOpsPerSecond = 2000;
+    // Threads deleting objects which are no longer reachable, and the maximum number of objects
+    // they delete per second (0 = unlimited). Lower the rate to keep deletion of large trees from
+    // competing with foreground I/O.
+
+    size_t streamWindowBytes = 1 << 20;
+    // How much data Blob.writeTo() keeps in flight to the receiving stream before waiting for
+    // acknowledgment.
+
+    bool deduplicateBlobs = false;
+    // Store blobs content-addressed, so that blobs with identical content (e.g. repeated backups of
+    // the same grain, or the same package uploaded twice) share disk space.
+
+    bool compressVolumes = false;
+    uint volumeCompressionDelaySeconds = 60;
+    // Compress Volume contents in 1MB extents once they haven't been written for the given delay.
+    // Reads decompress transparently. Requires the storage directory to be on btrfs; on other
+    // filesystems a warning is logged and volumes are left uncompressed.
+  };
+
+  struct Stats {
+    uint64_t warmCacheHits = 0;
+    uint64_t warmCacheMisses = 0;
+    // Number of times an object which wasn't live was opened, and whether it was found in the warm
+    // cache.
+
+    uint64_t warmCacheObjects = 0;
+    uint64_t warmCacheBytes = 0;
+    // Current size of the warm cache.
+
+    uint64_t deathRowBacklog = 0;
+    // Number of objects on death row waiting to be deleted.
+
+    uint64_t deathRowDeleted = 0;
+    // Total objects deleted since startup.
+
+    uint64_t journalTransactions = 0;
+    uint64_t journalBytesWritten = 0;
+    // Transactions committed, and bytes appended to the journal, since startup.
+
+    uint64_t journalSyncs = 0;
+    uint64_t objectSyncs = 0;
+    // fsync()s of the journal itself, and of objects made durable after their journal entries
+    // were executed (a fallback to syncing the whole filesystem counts as one).
+
+    uint64_t ioQueueDepth = 0;
+    // Disk I/O jobs currently queued or running.
+
+    uint64_t ioThrottleStalls = 0;
+    // Number of times an I/O thread had work queued but all of it was held back by the
+    // per-object caps.
+  };
+
+  Stats getStats();
+  // Snapshot of counters, for monitoring and benchmarks.
+
   FilesystemStorage(int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
                     Restorer<SturdyRef>::Client&& restorer);
+  FilesystemStorage(int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
+                    Restorer<SturdyRef>::Client&& restorer, Options options);
   ~FilesystemStorage() noexcept(false);
 
 protected:
@@ -100,6 +192,23 @@ public:
     kj::FixedArray<char, 24> filename(char prefix) const;
   };
 
+  struct ObjectIoStats {
+    ObjectId id;
+
+    uint queueDepth;
+    // Disk I/O jobs currently queued or running for the object.
+
+    uint64_t jobs;
+    uint64_t bytes;
+    uint64_t totalLatencyNs;
+    uint64_t maxLatencyNs;
+    // I/O completed since the last getIoStats(), and time from queuing to completion.
+  };
+
+  kj::Array<ObjectIoStats> getIoStats();
+  // Per-object disk I/O for each live object which has done any since the last call. Resets the
+  // counters. Meant for spotting the grain that's hogging a storage node.
+
 private:
   class ObjectBase;
   class BlobImpl;
@@ -110,8 +219,10 @@ private:
   class OpaqueImpl;
   class StorageFactoryImpl;
   enum class Type: uint8_t;
+  enum class BlobContent: uint8_t;
   struct Xattr;
   class Journal;
+  class BlobStore;
   class DeathRow;
   class ObjectFactory;
 
@@ -119,24 +230,31 @@ private:
   kj::AutoCloseFd stagingDirFd;
   kj::AutoCloseFd deathRowFd;
   kj::AutoCloseFd rootsFd;
+  kj::AutoCloseFd changedBlocksFd;
 
+  kj::Own<IoPool> ioPool;
+  kj::Own<BlobStore> blobStore;
   kj::Own<DeathRow> deathRow;
   kj::Own<Journal> journal;
   kj::Own<ObjectFactory> factory;
 
+  kj::Promise<void> blobCleanupTask = nullptr;
+  // Removes blob store entries leaked by a crash, once journal recovery is done.
+
   kj::Promise<void> setImpl(kj::String name, OwnedStorage<>::Client object);
 
+  static kj::AutoCloseFd openBlankExt4Template(int directoryFd);
+
   kj::Maybe<kj::AutoCloseFd> openObject(ObjectId id);
   kj::Maybe<kj::AutoCloseFd> openStaging(uint64_t number);
   kj::AutoCloseFd createObject(ObjectId id);
   kj::AutoCloseFd createTempFile();
   void linkTempIntoStaging(uint64_t number, int fd, const Xattr& xattr);
   void deleteStaging(uint64_t number);
-  void deleteAllStaging();
   void createFromStagingIfExists(uint64_t stagingId, ObjectId finalId, const Xattr& attributes);
   void replaceFromStagingIfExists(uint64_t stagingId, ObjectId finalId, const Xattr& attributes);
   void setAttributesIfExists(ObjectId objectId, const Xattr& attributes);
-  void moveToDeathRowIfExists(ObjectId id, bool notify = true);
+  void moveToDeathRowIfExists(ObjectId id);
   void sync();
 
   static bool isStoredObjectType(Type type);
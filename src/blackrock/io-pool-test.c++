@@ -0,0 +1,241 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "io-pool.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+namespace blackrock {
+namespace {
+
+// All tests use a pool with a single lane, so that every flow competes for the same thread. The
+// jobs don't touch any files; they only record the order in which they ran. Since one thread
+// runs them all, that's also the order in which the scheduler picked them.
+
+uint64_t nowMs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+struct IoPoolTestFixture {
+  explicit IoPoolTestFixture(uint opsPerSecond = 0, uint64_t bytesPerSecond = 0)
+      : io(kj::setupAsyncIo()),
+        pool(kj::refcounted<IoPool>(io.unixEventPort, 1, opsPerSecond, bytesPerSecond)),
+        gateFlow(pool->newFlow()) {
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    gateIn = kj::AutoCloseFd(fds[0]);
+    gateOut = kj::AutoCloseFd(fds[1]);
+  }
+
+  kj::AsyncIoContext io;
+  kj::Own<IoPool> pool;
+
+  kj::MutexGuarded<kj::Vector<kj::String>> ran;
+  // Names of jobs, in the order they ran.
+
+  IoPool::FlowId gateFlow;
+  kj::AutoCloseFd gateIn;
+  kj::AutoCloseFd gateOut;
+  kj::Vector<kj::Promise<void>> promises;
+
+  void gate() {
+    // Queue a job which holds the lane until open() is called, so that everything submitted in
+    // the meantime is scheduled together.
+    int fd = gateIn;
+    promises.add(pool->run(gateFlow, [fd]() {
+      char c;
+      KJ_SYSCALL(read(fd, &c, 1));
+    }));
+  }
+
+  void open() {
+    KJ_SYSCALL(write(gateOut, "x", 1));
+  }
+
+  kj::Function<void()> record(kj::String name) {
+    return [this,KJ_MVCAP(name)]() { ran.lockExclusive()->add(kj::str(name)); };
+  }
+
+  void run(IoPool::FlowId flow, uint64_t bytes, kj::StringPtr name) {
+    promises.add(pool->run(flow, bytes, record(kj::str(name))));
+  }
+
+  void runUrgent(IoPool::FlowId flow, kj::StringPtr name) {
+    promises.add(pool->runUrgent(flow, record(kj::str(name))));
+  }
+
+  void wait() {
+    kj::joinPromises(promises.releaseAsArray()).wait(io.waitScope);
+  }
+
+  size_t position(kj::StringPtr name) {
+    auto lock = ran.lockExclusive();
+    for (size_t i = 0; i < lock->size(); i++) {
+      if ((*lock)[i] == name) return i;
+    }
+    KJ_FAIL_ASSERT("job never ran", name);
+  }
+};
+
+KJ_TEST("I/O pool: light flow isn't stuck behind heavy flow") {
+  IoPoolTestFixture env;
+  auto heavy = env.pool->newFlow();
+  auto light = env.pool->newFlow();
+
+  env.gate();
+  for (uint i = 0; i < 8; i++) {
+    env.run(heavy, 1 << 20, kj::str("heavy", i));
+  }
+  for (uint i = 0; i < 8; i++) {
+    env.run(light, 64 << 10, kj::str("light", i));
+  }
+  env.open();
+  env.wait();
+
+  // In FIFO order, all of the heavy flow's 8MB would go first. With byte-weighted round-robin,
+  // the light flow's 512k is done before the heavy flow gets through its second job.
+  size_t secondHeavy = env.position("heavy1");
+  for (uint i = 0; i < 8; i++) {
+    KJ_EXPECT(env.position(kj::str("light", i)) < secondHeavy, i);
+  }
+
+  // Each flow's own jobs still ran in order.
+  for (uint i = 1; i < 8; i++) {
+    KJ_EXPECT(env.position(kj::str("heavy", i - 1)) < env.position(kj::str("heavy", i)));
+    KJ_EXPECT(env.position(kj::str("light", i - 1)) < env.position(kj::str("light", i)));
+  }
+
+  KJ_EXPECT(env.pool->getThrottleStalls() == 0);
+  KJ_EXPECT(env.pool->getQueueDepth() == 0);
+}
+
+KJ_TEST("I/O pool: urgent jobs jump ahead") {
+  IoPoolTestFixture env;
+  auto heavy = env.pool->newFlow();
+  auto other = env.pool->newFlow();
+  auto idle = env.pool->newFlow();
+  auto busy = env.pool->newFlow();
+
+  env.gate();
+  for (uint i = 0; i < 4; i++) {
+    env.run(heavy, 1 << 20, kj::str("heavy", i));
+    env.run(other, 1 << 20, kj::str("other", i));
+  }
+  env.runUrgent(idle, "urgent");
+  env.run(busy, 0, "behind");
+  env.runUrgent(busy, "queued");
+  env.open();
+  env.wait();
+
+  // The urgent job on an otherwise idle flow runs first, ahead of data queued before it.
+  KJ_EXPECT(env.position("urgent") == 0);
+
+  // An urgent job doesn't jump ahead of its own flow, but does once it reaches the head.
+  KJ_EXPECT(env.position("behind") < env.position("queued"));
+  KJ_EXPECT(env.position("queued") < env.position("heavy3"));
+  KJ_EXPECT(env.position("queued") < env.position("other3"));
+}
+
+KJ_TEST("I/O pool: byte cap delays the capped flow only") {
+  IoPoolTestFixture env(0, 1 << 20);
+  auto capped = env.pool->newFlow();
+
+  // A new flow starts with a second's worth of tokens. The first job uses them up, the second
+  // runs on credit, and the third has to wait about 250ms for the debt to be repaid.
+  uint64_t start = nowMs();
+  uint64_t thirdDone = 0;
+  env.promises.add(env.pool->run(capped, 1 << 20, env.record(kj::str("capped0"))));
+  env.promises.add(env.pool->run(capped, 256 << 10, env.record(kj::str("capped1"))));
+  env.promises.add(env.pool->run(capped, 4096, env.record(kj::str("capped2")))
+      .then([&]() { thirdDone = nowMs(); }));
+
+  // Other flows on the same lane aren't held up, and neither are urgent jobs.
+  env.run(env.pool->newFlow(), 4096, "other");
+  env.runUrgent(env.pool->newFlow(), "urgent");
+  env.wait();
+
+  KJ_EXPECT(thirdDone - start >= 200, thirdDone - start);
+  KJ_EXPECT(env.position("other") < env.position("capped2"));
+  KJ_EXPECT(env.position("urgent") < env.position("capped2"));
+  KJ_EXPECT(env.pool->getThrottleStalls() > 0);
+}
+
+KJ_TEST("I/O pool: ops cap") {
+  IoPoolTestFixture env(20, 0);
+  auto flow = env.pool->newFlow();
+
+  // 20 tokens to start with. The 21st job runs on credit and each one after that waits 50ms.
+  uint64_t start = nowMs();
+  for (uint i = 0; i < 24; i++) {
+    env.run(flow, 0, kj::str("job", i));
+  }
+  env.wait();
+
+  uint64_t elapsed = nowMs() - start;
+  KJ_EXPECT(elapsed >= 120, elapsed);
+  KJ_EXPECT(env.pool->getThrottleStalls() > 0);
+}
+
+KJ_TEST("I/O pool: new flow doesn't inherit token buckets") {
+  IoPoolTestFixture env(0, 1 << 20);
+  auto closed = env.pool->newFlow();
+
+  // Run up a 2MB debt: 2 seconds until the flow may transfer again.
+  env.run(closed, 1 << 20, "first");
+  env.run(closed, 2 << 20, "second");
+  env.wait();
+
+  // The file is closed. Another file, even one which gets the same descriptor number, shouldn't
+  // have to wait.
+  env.pool->forget(closed);
+
+  uint64_t start = nowMs();
+  env.run(env.pool->newFlow(), 4096, "reopened");
+  env.wait();
+  uint64_t elapsed = nowMs() - start;
+  KJ_EXPECT(elapsed < 1000, elapsed);
+}
+
+KJ_TEST("I/O pool: jobs left on a forgotten flow don't hold up a new one") {
+  IoPoolTestFixture env;
+  auto closed = env.pool->newFlow();
+
+  // A background job still queued when its file is closed (e.g. one holding its own dup() of the
+  // fd) keeps its own queue, rather than a new file's jobs being appended to it.
+  env.gate();
+  for (uint i = 0; i < 4; i++) {
+    env.run(closed, 1 << 20, kj::str("closed", i));
+  }
+  env.pool->forget(closed);
+  env.run(env.pool->newFlow(), 4096, "reopened");
+  env.open();
+  env.wait();
+
+  KJ_EXPECT(env.position("reopened") < env.position("closed1"));
+  for (uint i = 1; i < 4; i++) {
+    KJ_EXPECT(env.position(kj::str("closed", i - 1)) < env.position(kj::str("closed", i)));
+  }
+  KJ_EXPECT(env.pool->getQueueDepth() == 0);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -0,0 +1,364 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "io-pool.h"
+#include <blackrock/storage.capnp.h>
+#include <kj/debug.h>
+#include <unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+namespace blackrock {
+
+static uint64_t monotonicNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+constexpr int64_t IoPool::QUANTUM_BYTES;
+
+IoPool::Job::Job(FlowId flow, uint64_t bytes, bool urgent, kj::Function<void()> func)
+    : flow(flow), bytes(bytes), urgent(urgent), func(kj::mv(func)), submitTime(monotonicNs()) {}
+
+IoPool::Lane::Lane(IoPool& pool)
+    : eventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      thread([this,&pool]() { pool.doLaneThread(*this); }) {}
+
+IoPool::IoPool(kj::UnixEventPort& unixEventPort, uint threadCount,
+               uint opsPerSecondLimit, uint64_t bytesPerSecondLimit)
+    : opsPerSecondLimit(opsPerSecondLimit),
+      bytesPerSecondLimit(bytesPerSecondLimit),
+      completionEventFd(newEventFd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      completionEventFdObserver(unixEventPort, completionEventFd,
+          kj::UnixEventPort::FdObserver::OBSERVE_READ),
+      completionTask(completionLoop().catch_([](kj::Exception&& exception) {
+        KJ_LOG(FATAL, "I/O completion loop threw exception", exception);
+        abort();
+      })),
+      lanes(makeLanes(kj::max(threadCount, 1u))) {}
+
+IoPool::~IoPool() noexcept(false) {
+  // Ask each lane to shut down once its queue is drained. The lanes' destructors then wait for
+  // the threads to exit.
+  for (auto& lane: lanes) {
+    lane->state.lockExclusive()->shutdown = true;
+    writeEvent(lane->eventFd, 1);
+  }
+}
+
+IoPool::FlowId IoPool::newFlow() {
+  return nextFlowId++;
+}
+
+kj::Promise<void> IoPool::run(FlowId flow, kj::Function<void()> func) {
+  return run(flow, 0, kj::mv(func));
+}
+
+kj::Promise<void> IoPool::run(FlowId flow, uint64_t bytes, kj::Function<void()> func) {
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto job = kj::heap<Job>(flow, bytes, false, kj::mv(func));
+  job->waiters.add(kj::mv(paf.fulfiller));
+  submit(kj::mv(job));
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> IoPool::runUrgent(FlowId flow, kj::Function<void()> func) {
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto job = kj::heap<Job>(flow, 0, true, kj::mv(func));
+  job->waiters.add(kj::mv(paf.fulfiller));
+  submit(kj::mv(job));
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> IoPool::sync(FlowId flow, int fd) {
+  auto paf = kj::newPromiseAndFulfiller<void>();
+
+  auto iter = pendingSyncs.find(flow);
+  if (iter != pendingSyncs.end()) {
+    iter->second->waiters.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  auto job = kj::heap<Job>(flow, 0, true, [fd]() { KJ_SYSCALL(fdatasync(fd)); });
+  job->waiters.add(kj::mv(paf.fulfiller));
+  Job& jobRef = *job;
+  submit(kj::mv(job));
+  pendingSyncs.insert(std::make_pair(flow, &jobRef));
+  return kj::mv(paf.promise);
+}
+
+void IoPool::forget(FlowId flow) {
+  pendingSyncs.erase(flow);
+
+  auto lock = laneFor(flow).state.lockExclusive();
+  auto iter = lock->flows.find(flow);
+  if (iter == lock->flows.end()) return;
+
+  if (iter->second.jobs.empty()) {
+    lock->flows.erase(iter);
+  } else {
+    // Still has work queued (e.g. a background job holding its own dup() of the file). take()
+    // drops the flow when it drains. Nothing else is submitted to it, since IDs aren't reused.
+    iter->second.forgotten = true;
+  }
+}
+
+std::unordered_map<IoPool::FlowId, IoPool::FlowStats> IoPool::takeFlowStats() {
+  auto result = flowStats;
+  for (auto iter = flowStats.begin(); iter != flowStats.end();) {
+    if (iter->second.queued == 0) {
+      iter = flowStats.erase(iter);
+    } else {
+      iter->second = FlowStats { iter->second.queued };
+      ++iter;
+    }
+  }
+  return result;
+}
+
+kj::Array<kj::Own<IoPool::Lane>> IoPool::makeLanes(uint count) {
+  auto builder = kj::heapArrayBuilder<kj::Own<Lane>>(count);
+  for (uint i = 0; i < count; i++) {
+    builder.add(kj::heap<Lane>(*this));
+  }
+  return builder.finish();
+}
+
+void IoPool::submit(kj::Own<Job> job) {
+  // Any job submitted after a pending sync means later sync()s can't piggyback on it.
+  pendingSyncs.erase(job->flow);
+
+  ++flowStats[job->flow].queued;
+  ++queuedJobs;
+
+  Lane& lane = laneFor(job->flow);
+  {
+    auto lock = lane.state.lockExclusive();
+    auto insertResult = lock->flows.insert(std::make_pair(job->flow, Flow()));
+    Flow& flow = insertResult.first->second;
+    if (insertResult.second) {
+      // New flow starts with full buckets: one second's worth.
+      flow.opTokens = opsPerSecondLimit;
+      flow.byteTokens = bytesPerSecondLimit;
+      flow.lastRefill = job->submitTime;
+    }
+    if (job->urgent) ++lock->urgentCount;
+    flow.jobs.push_back(kj::mv(job));
+    if (!flow.active) {
+      flow.active = true;
+      lock->active.push_back(&flow);
+    }
+  }
+  writeEvent(lane.eventFd, 1);
+}
+
+void IoPool::refill(Flow& flow, uint64_t now) {
+  double elapsed = (now - flow.lastRefill) / 1e9;
+  flow.lastRefill = now;
+  flow.opTokens = kj::min(flow.opTokens + elapsed * opsPerSecondLimit, opsPerSecondLimit);
+  flow.byteTokens = kj::min(flow.byteTokens + elapsed * bytesPerSecondLimit,
+                            bytesPerSecondLimit);
+}
+
+uint64_t IoPool::throttleDelay(Flow& flow) {
+  // How long (ns) until the flow is back within its caps.
+  double delay = 0;
+  if (opsPerSecondLimit > 0 && flow.opTokens < 0) {
+    delay = -flow.opTokens / opsPerSecondLimit;
+  }
+  if (bytesPerSecondLimit > 0 && flow.byteTokens < 0) {
+    delay = kj::max(delay, -flow.byteTokens / bytesPerSecondLimit);
+  }
+  return delay * 1e9;
+}
+
+kj::Own<IoPool::Job> IoPool::take(Lane::State& state, Flow& flow) {
+  // Remove the job at the head of `flow`, which must be at the head of `state.active`, charging
+  // the flow for it.
+
+  auto job = kj::mv(flow.jobs.front());
+  flow.jobs.pop_front();
+  if (job->urgent) --state.urgentCount;
+  flow.opTokens -= 1;
+  flow.byteTokens -= job->bytes;
+
+  if (flow.jobs.empty()) {
+    flow.active = false;
+    flow.deficit = 0;
+    state.active.pop_front();
+    if (flow.forgotten || (opsPerSecondLimit == 0 && bytesPerSecondLimit == 0)) {
+      // No buckets worth keeping.
+      state.flows.erase(job->flow);
+    }
+  }
+
+  return job;
+}
+
+kj::Own<IoPool::Job> IoPool::next(Lane::State& state, uint64_t& waitNs) {
+  // Choose the next job to run on the lane. Returns null if none can run now, in which case
+  // `waitNs` is how long until one can (or 0 if the lane is idle).
+
+  waitNs = 0;
+  uint64_t now = monotonicNs();
+
+  if (state.urgentCount > 0) {
+    for (auto iter = state.active.begin(); iter != state.active.end(); ++iter) {
+      Flow& flow = **iter;
+      if (flow.jobs.front()->urgent) {
+        // Serve it now. Move it to the head of the round-robin without disturbing the order of
+        // the others, then charge it like any other job.
+        state.active.erase(iter);
+        state.active.push_front(&flow);
+        refill(flow, now);
+        return take(state, flow);
+      }
+    }
+  }
+
+  size_t throttled = 0;
+  while (throttled < state.active.size()) {
+    Flow& flow = *state.active.front();
+
+    refill(flow, now);
+    if (!state.shutdown) {
+      uint64_t delay = throttleDelay(flow);
+      if (delay > 0) {
+        if (throttled == 0 || delay < waitNs) waitNs = delay;
+        state.active.pop_front();
+        state.active.push_back(&flow);
+        ++throttled;
+        continue;
+      }
+    }
+
+    Job& job = *flow.jobs.front();
+    int64_t cost = job.bytes + Volume::BLOCK_SIZE;
+    if (flow.deficit < cost) {
+      // Used up this round. Next flow.
+      flow.deficit += QUANTUM_BYTES;
+      state.active.pop_front();
+      state.active.push_back(&flow);
+      throttled = 0;
+      continue;
+    }
+
+    flow.deficit -= cost;
+    return take(state, flow);
+  }
+
+  if (throttled > 0) {
+    throttleStalls.fetch_add(1, std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+void IoPool::doLaneThread(Lane& lane) {
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    for (;;) {
+      kj::Own<Job> job;
+      uint64_t waitNs;
+      {
+        auto lock = lane.state.lockExclusive();
+        job = next(*lock, waitNs);
+        if (job.get() == nullptr && lock->active.empty() && lock->shutdown) {
+          break;
+        }
+      }
+
+      if (job.get() == nullptr) {
+        // Nothing to do, or everything queued is over its cap. Wait for a new job or for the
+        // first flow to come back under its cap, whichever is first.
+        struct pollfd pollFd;
+        memset(&pollFd, 0, sizeof(pollFd));
+        pollFd.fd = lane.eventFd;
+        pollFd.events = POLLIN;
+        int timeoutMs = waitNs == 0 ? -1 : int(waitNs / 1000000 + 1);
+        KJ_SYSCALL(poll(&pollFd, 1, timeoutMs));
+
+        uint64_t count;
+        ssize_t n;
+        KJ_NONBLOCKING_SYSCALL(n = read(lane.eventFd, &count, sizeof(count)));
+        continue;
+      }
+
+      job->exception = kj::runCatchingExceptions([&]() { job->func(); });
+
+      completed.lockExclusive()->add(kj::mv(job));
+      writeEvent(completionEventFd, 1);
+    }
+  })) {
+    // exception!
+    KJ_LOG(FATAL, "exception in I/O thread", *exception);
+
+    // Tear down the process because otherwise callers will hang forever.
+    abort();
+  }
+}
+
+kj::Promise<void> IoPool::completionLoop() {
+  return completionEventFdObserver.whenBecomesReadable().then([this]() {
+    uint64_t count;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = read(completionEventFd, &count, sizeof(count)));
+
+    if (n < 0) {
+      // Oops, not actually ready.
+    } else {
+      KJ_ASSERT(n == sizeof(count), "eventfd read had unexpected size", n);
+
+      kj::Vector<kj::Own<Job>> jobs;
+      {
+        auto lock = completed.lockExclusive();
+        jobs = kj::mv(*lock);
+      }
+
+      uint64_t now = monotonicNs();
+      for (auto& job: jobs) {
+        auto iter = pendingSyncs.find(job->flow);
+        if (iter != pendingSyncs.end() && iter->second == job.get()) {
+          pendingSyncs.erase(iter);
+        }
+
+        auto& stats = flowStats[job->flow];
+        --stats.queued;
+        ++stats.jobs;
+        stats.bytes += job->bytes;
+        uint64_t latency = now - job->submitTime;
+        stats.totalLatencyNs += latency;
+        stats.maxLatencyNs = kj::max(stats.maxLatencyNs, latency);
+        --queuedJobs;
+
+        KJ_IF_MAYBE(e, job->exception) {
+          for (auto& waiter: job->waiters) {
+            waiter->reject(kj::cp(*e));
+          }
+        } else {
+          for (auto& waiter: job->waiters) {
+            waiter->fulfill();
+          }
+        }
+      }
+    }
+
+    return completionLoop();
+  });
+}
+
+}  // namespace blackrock
@@ -0,0 +1,218 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_IO_POOL_H_
+#define BLACKROCK_IO_POOL_H_
+
+#include "common.h"
+#include <kj/async-unix.h>
+#include <kj/function.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/refcount.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+
+namespace blackrock {
+
+class IoPool: public kj::Refcounted {
+  // Pool of threads which perform blocking disk I/O -- reads, writes, hole punching, and
+  // fdatasync() -- on behalf of the event loop, so that one object's large read or slow sync
+  // doesn't stall every other RPC served by a storage node.
+  //
+  // Jobs are submitted under a "flow" -- typically one per object, obtained from newFlow(). Each
+  // flow maps to a fixed "lane", and each lane executes jobs on its own thread. Within a lane,
+  // each flow has its own queue, executed in FIFO order. Hence, operations on a single object are
+  // never reordered relative to each other -- e.g. a sync() always follows the writes that
+  // preceded it -- while operations on different objects proceed in parallel.
+  //
+  // Flows sharing a lane are served by deficit round-robin, weighted by bytes transferred, so that
+  // one grain rewriting its whole volume gets no more of the lane than a grain doing small
+  // interactive reads. Urgent jobs (syncs and metadata updates) at the head of a flow jump ahead
+  // of other flows' data transfers. Optionally, each flow is also capped in operations and bytes
+  // per second.
+  //
+  // This is refcounted because storage objects hold on to it, and objects can outlive the
+  // FilesystemStorage.
+
+public:
+  IoPool(kj::UnixEventPort& unixEventPort, uint threadCount,
+         uint opsPerSecondLimit, uint64_t bytesPerSecondLimit);
+  ~IoPool() noexcept(false);
+
+  typedef uint64_t FlowId;
+
+  FlowId newFlow();
+  // Allocate an ID for a new flow. IDs are never reused, so jobs still queued for a flow which
+  // has been forgotten never share a queue (or token buckets) with a file opened later, even if
+  // it gets the same descriptor number.
+
+  kj::Promise<void> run(FlowId flow, kj::Function<void()> func);
+  // Execute `func` on the lane belonging to `flow`. `func` runs in another thread, so it must not
+  // touch any state owned by the event loop. Dropping the returned promise does NOT cancel the
+  // job, so `func` must own (or hold a reference to) every buffer it uses. In particular it must
+  // not read or fill in an RPC's params or results: if the caller disconnects, the call is
+  // canceled and its messages freed while the job may still be queued. `func` itself is destroyed
+  // on the event loop thread after it has run, so it may hold non-thread-safe references.
+
+  kj::Promise<void> run(FlowId flow, uint64_t bytes, kj::Function<void()> func);
+  // Like run(), for a job which transfers `bytes` bytes of data. The flow is charged for them
+  // when scheduling.
+
+  kj::Promise<void> runUrgent(FlowId flow, kj::Function<void()> func);
+  // Like run(), for a short job which someone is likely blocked on, such as a metadata update.
+  // Once it reaches the head of its flow, it runs ahead of other flows, regardless of caps.
+
+  kj::Promise<void> sync(FlowId flow, int fd);
+  // fdatasync() `fd` after all jobs previously submitted to `flow` have completed. If the last job
+  // submitted to `flow` is itself a sync which hasn't completed yet, then we simply wait for that
+  // one: every write it needs to cover was queued ahead of it, so a second fdatasync() would be
+  // redundant. Syncs are urgent.
+
+  void forget(FlowId flow);
+  // Call when closing the flow's file. Drops the flow's state once any jobs still queued for it
+  // are done.
+
+  struct FlowStats {
+    uint queued = 0;
+    // Jobs submitted and not yet completed.
+
+    uint64_t jobs = 0;
+    uint64_t bytes = 0;
+    uint64_t totalLatencyNs = 0;
+    uint64_t maxLatencyNs = 0;
+    // Jobs completed, their total bytes, and time from submission to completion.
+  };
+
+  std::unordered_map<FlowId, FlowStats> takeFlowStats();
+  // Get counters for each flow accumulated since the last call, and reset them. Flows with nothing
+  // queued are dropped until they submit again.
+
+  inline uint64_t getQueueDepth() { return queuedJobs; }
+  // Jobs currently queued or running.
+
+  inline uint64_t getThrottleStalls() { return throttleStalls.load(std::memory_order_relaxed); }
+  // Number of times a lane had work queued but all of it was held back by the caps.
+
+  static constexpr int64_t QUANTUM_BYTES = 128 << 10;
+  // Deficit added to a flow each time round-robin reaches it. Every job also costs one block on
+  // top of its data, so that flows issuing many tiny operations don't get them free.
+
+private:
+  struct Job {
+    FlowId flow;
+    uint64_t bytes;
+    bool urgent;
+    kj::Function<void()> func;
+
+    uint64_t submitTime;
+    // monotonicNs() when submitted.
+
+    kj::Maybe<kj::Exception> exception;
+    // Set by the lane thread if `func` threw.
+
+    kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiters;
+    // Fulfilled when the job completes. Only touched by the event loop thread.
+
+    Job(FlowId flow, uint64_t bytes, bool urgent, kj::Function<void()> func);
+  };
+
+  struct Flow {
+    std::deque<kj::Own<Job>> jobs;
+
+    int64_t deficit = 0;
+    // Bytes the flow may still transfer in its current round.
+
+    bool active = false;
+    // Whether the flow is in its lane's `active` list.
+
+    bool forgotten = false;
+    // forget() was called while jobs were still queued. The flow is dropped once they're done.
+
+    double opTokens = 0;
+    double byteTokens = 0;
+    uint64_t lastRefill = 0;
+    // Token buckets implementing the per-object caps, if any. Tokens may go negative when a job
+    // costs more than was available; the flow then waits for them to refill to zero.
+  };
+
+  struct Lane {
+    struct State {
+      std::unordered_map<FlowId, Flow> flows;
+      // Each flow which has used this lane. Idle flows are kept (if caps are enabled) so that a
+      // flow can't refill its buckets by letting its queue drain, until forget() is called.
+
+      std::deque<Flow*> active;
+      // Flows with queued jobs, in round-robin order.
+
+      uint urgentCount = 0;
+      // Number of queued urgent jobs.
+
+      bool shutdown = false;
+    };
+    kj::MutexGuarded<State> state;
+
+    kj::AutoCloseFd eventFd;
+    // Non-blocking eventfd, signaled whenever a job is added and for shutdown.
+
+    kj::Thread thread;
+
+    explicit Lane(IoPool& pool);
+  };
+
+  uint opsPerSecondLimit;
+  uint64_t bytesPerSecondLimit;
+  // Per-flow caps; 0 = unlimited.
+
+  kj::AutoCloseFd completionEventFd;
+  kj::UnixEventPort::FdObserver completionEventFdObserver;
+  kj::MutexGuarded<kj::Vector<kj::Own<Job>>> completed;
+  // Lane threads move finished jobs to `completed` and then signal `completionEventFd`, which the
+  // event loop observes.
+
+  kj::Promise<void> completionTask;
+
+  std::unordered_map<FlowId, Job*> pendingSyncs;
+  // For each flow, the sync job which is the last job submitted to that flow, if it hasn't
+  // completed yet. Later sync()s can piggyback on it.
+
+  FlowId nextFlowId = 1;
+
+  std::unordered_map<FlowId, FlowStats> flowStats;
+  uint64_t queuedJobs = 0;
+  std::atomic<uint64_t> throttleStalls { 0 };
+  // Counters for takeFlowStats() and friends. `throttleStalls` is updated by the lane threads.
+
+  kj::Array<kj::Own<Lane>> lanes;
+  // Must be last, so that the threads are joined before anything else is destroyed.
+
+  kj::Array<kj::Own<Lane>> makeLanes(uint count);
+  Lane& laneFor(FlowId flow) { return *lanes[flow % lanes.size()]; }
+
+  void submit(kj::Own<Job> job);
+  void refill(Flow& flow, uint64_t now);
+  uint64_t throttleDelay(Flow& flow);
+  kj::Own<Job> take(Lane::State& state, Flow& flow);
+  kj::Own<Job> next(Lane::State& state, uint64_t& waitNs);
+  void doLaneThread(Lane& lane);
+  kj::Promise<void> completionLoop();
+};
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_IO_POOL_H_
@@ -288,8 +288,9 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
   // Start workers.
   for (uint i = 0; i < workerCount; i++) {
     start({ ComputeDriver::MachineType::WORKER, i }, [&](Machine::Client&& machine) {
-      return registrationArray(
-          workerFeeder.addBackend(machine.becomeWorkerRequest().send().getWorker()));
+      auto req = machine.becomeWorkerRequest();
+      req.setConfig(config.getWorkerConfig());
+      return registrationArray(workerFeeder.addBackend(req.send().getWorker()));
     });
   }
 
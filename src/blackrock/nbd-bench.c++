@@ -0,0 +1,681 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nbd-bridge.h"
+#include "fs-storage.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <sandstorm/util.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#undef BLOCK_SIZE
+
+namespace blackrock {
+
+class NbdBench {
+  // Load harness for NbdVolumeAdapter. Plays the part of the kernel's NBD client over socketpairs,
+  // so the block path can be benchmarked and regression-tested without root or the nbd module.
+  // The adapters are backed by an in-memory Volume that does no I/O, or by a real
+  // FilesystemStorage. Reports IOPS, bandwidth, per-command latency, and how many socket
+  // syscalls the adapters needed per request. Every read reply is checked against what was
+  // written, so a run also fails if the adapter loses or misplaces data.
+
+public:
+  NbdBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock NBD adapter benchmark",
+                           "Runs <workload> through NbdVolumeAdapters and reports ops/s and "
+                           "latency. Workloads are:\n"
+                           "  seq-read, rand-read, seq-write, rand-write: one command of "
+                           "--blocks blocks per request\n"
+                           "  random-4k: random 4k requests, 70% reads\n"
+                           "  sequential-1m: sequential 1MB writes\n"
+                           "  flush-heavy: random 4k requests, 30% reads, with a flush after "
+                           "every 8 writes\n"
+                           "  trace:<file>: replays a recorded trace. Each line is "
+                           "\"<command> <offset> <length>\", where <command> is R (read), "
+                           "W (write), F (flush), T (trim), or Z (write zeroes), and <offset> "
+                           "and <length> are in bytes. Blank lines and # comments are ignored. "
+                           "The trace is repeated if --ops exceeds its length.")
+        .addOptionWithArg({'n', "ops"}, KJ_BIND_METHOD(*this, setOps), "<count>",
+                          "number of NBD requests to time (default: 100000, or the length of "
+                          "the trace)")
+        .addOptionWithArg({'q', "queue-depth"}, KJ_BIND_METHOD(*this, setQueueDepth), "<count>",
+                          "requests in flight at once, across all connections (default: 32)")
+        .addOptionWithArg({'c', "connections"}, KJ_BIND_METHOD(*this, setConnections), "<count>",
+                          "NBD connections, each with its own adapter, as with "
+                          "NBD_FLAG_CAN_MULTI_CONN (default: 1)")
+        .addOptionWithArg({'b', "blocks"}, KJ_BIND_METHOD(*this, setBlocks), "<count>",
+                          "4k blocks per request for the seq-* and rand-* workloads (default: 1)")
+        .addOptionWithArg({"span"}, KJ_BIND_METHOD(*this, setSpan), "<MB>",
+                          "size of the volume region that synthetic workloads touch "
+                          "(default: 1024)")
+        .addOptionWithArg({'s', "storage"}, KJ_BIND_METHOD(*this, setStorageDir), "<path>",
+                          "back the adapters with a FilesystemStorage in this scratch directory "
+                          "(anything in it is deleted) instead of an in-memory stub")
+        .expectArg("<workload>", KJ_BIND_METHOD(*this, setWorkload))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::StringPtr workloadName;
+  kj::Maybe<uint> opCountOption;
+  uint queueDepth = 32;
+  uint connectionCount = 1;
+  uint blocksPerOp = 1;
+  uint spanMb = 1024;
+  kj::Maybe<kj::StringPtr> storageDir;
+
+  static constexpr uint FLUSH_HEAVY_WRITES_PER_FLUSH = 8;
+
+  static kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint& result) {
+    KJ_IF_MAYBE(n, sandstorm::parseUInt(arg, 10)) {
+      if (*n == 0) return "must be positive";
+      result = *n;
+      return true;
+    } else {
+      return "not a number";
+    }
+  }
+
+  kj::MainBuilder::Validity setOps(kj::StringPtr arg) {
+    uint n = 0;
+    auto result = parseCount(arg, n);
+    if (n > 0) opCountOption = n;
+    return result;
+  }
+  kj::MainBuilder::Validity setQueueDepth(kj::StringPtr arg) {
+    return parseCount(arg, queueDepth);
+  }
+  kj::MainBuilder::Validity setConnections(kj::StringPtr arg) {
+    return parseCount(arg, connectionCount);
+  }
+  kj::MainBuilder::Validity setBlocks(kj::StringPtr arg) { return parseCount(arg, blocksPerOp); }
+  kj::MainBuilder::Validity setSpan(kj::StringPtr arg) { return parseCount(arg, spanMb); }
+  kj::MainBuilder::Validity setStorageDir(kj::StringPtr arg) { storageDir = arg; return true; }
+
+  kj::MainBuilder::Validity setWorkload(kj::StringPtr arg) {
+    if (arg.startsWith("trace:")) {
+      workloadName = arg;
+      return true;
+    }
+    for (auto name: {"seq-read", "rand-read", "seq-write", "rand-write", "random-4k",
+                     "sequential-1m", "flush-heavy"}) {
+      if (arg == name) {
+        workloadName = arg;
+        return true;
+      }
+    }
+    return "unknown workload";
+  }
+
+  // ---------------------------------------------------------------------------
+
+  static kj::ArrayPtr<const byte> blockContent(uint64_t blockNum) {
+    // The content the benchmark writes to the given block, which is also what StubVolume holds
+    // for blocks that haven't been written. Blocks whose numbers differ by less than 256 differ,
+    // so data landing in the wrong block, or a wrong part of it, shows up on read-back.
+
+    static const kj::Array<byte> pattern = []() {
+      auto result = kj::heapArray<byte>(Volume::BLOCK_SIZE + 256);
+      for (size_t i = 0; i < result.size(); i++) {
+        result[i] = i * 7 + 1;
+      }
+      return result;
+    }();
+    return pattern.slice(blockNum % 256, blockNum % 256 + Volume::BLOCK_SIZE);
+  }
+
+  class StubVolume final: public Volume::Server {
+    // Keeps the volume's content in memory and does no I/O, so that the benchmark measures the
+    // adapter rather than storage. Blocks that have never been written hold blockContent().
+
+  protected:
+    kj::Promise<void> read(ReadContext context) override {
+      auto params = context.getParams();
+      uint32_t start = params.getBlockNum();
+      uint32_t count = params.getCount();
+      fill(start, context.getResults(sizeHint(count)).initData(count * Volume::BLOCK_SIZE));
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> readExtents(ReadExtentsContext context) override {
+      auto params = context.getParams();
+      uint32_t start = params.getBlockNum();
+      uint32_t count = params.getCount();
+      auto extent = context.getResults(sizeHint(count)).initExtents(1)[0];
+      extent.setCount(count);
+      fill(start, extent.initData(count * Volume::BLOCK_SIZE));
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> readv(ReadvContext context) override {
+      auto ranges = context.getParams().getRanges();
+      uint32_t total = 0;
+      for (auto range: ranges) total += range.getCount();
+      auto extents = context.getResults(sizeHint(total)).initExtents(ranges.size());
+      for (auto i: kj::indices(ranges)) {
+        extents[i].setCount(ranges[i].getCount());
+        fill(ranges[i].getBlockNum(),
+             extents[i].initData(ranges[i].getCount() * Volume::BLOCK_SIZE));
+      }
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> write(WriteContext context) override {
+      auto params = context.getParams();
+      store(params.getBlockNum(), params.getData());
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> writev(WritevContext context) override {
+      auto params = context.getParams();
+      auto data = params.getData();
+      size_t pos = 0;
+      for (auto range: params.getRanges()) {
+        size_t size = range.getCount() * Volume::BLOCK_SIZE;
+        KJ_REQUIRE(pos + size <= data.size(), "writev() data shorter than ranges");
+        store(range.getBlockNum(), data.slice(pos, pos + size));
+        pos += size;
+      }
+      KJ_REQUIRE(pos == data.size(), "writev() data longer than ranges");
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> zero(ZeroContext context) override {
+      auto params = context.getParams();
+      for (uint32_t i = 0; i < params.getCount(); i++) {
+        blocks[params.getBlockNum() + i] = nullptr;
+      }
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> sync(SyncContext context) override { return kj::READY_NOW; }
+
+  private:
+    std::unordered_map<uint32_t, kj::Array<byte>> blocks;
+    // Blocks which have been written. Null means the block was zeroed.
+
+    static capnp::MessageSize sizeHint(uint32_t blocks) {
+      return { 16 + blocks * (Volume::BLOCK_SIZE / sizeof(capnp::word) + 2), 0 };
+    }
+
+    void fill(uint32_t start, capnp::Data::Builder data) {
+      for (size_t pos = 0; pos < data.size(); pos += Volume::BLOCK_SIZE) {
+        uint32_t blockNum = start + pos / Volume::BLOCK_SIZE;
+        auto iter = blocks.find(blockNum);
+        if (iter == blocks.end()) {
+          memcpy(data.begin() + pos, blockContent(blockNum).begin(), Volume::BLOCK_SIZE);
+        } else if (iter->second == nullptr) {
+          memset(data.begin() + pos, 0, Volume::BLOCK_SIZE);
+        } else {
+          memcpy(data.begin() + pos, iter->second.begin(), Volume::BLOCK_SIZE);
+        }
+      }
+    }
+
+    void store(uint32_t start, capnp::Data::Reader data) {
+      KJ_REQUIRE(data.size() % Volume::BLOCK_SIZE == 0, "write not block-aligned");
+      for (size_t pos = 0; pos < data.size(); pos += Volume::BLOCK_SIZE) {
+        auto& slot = blocks[start + pos / Volume::BLOCK_SIZE];
+        if (slot == nullptr) {
+          slot = kj::heapArray<byte>(Volume::BLOCK_SIZE);
+        }
+        memcpy(slot.begin(), data.begin() + pos, Volume::BLOCK_SIZE);
+      }
+    }
+  };
+
+  // ---------------------------------------------------------------------------
+
+  enum Command: uint8_t { READ, WRITE, FLUSH, TRIM, WRITE_ZEROES, COMMAND_COUNT };
+
+  static constexpr const char* COMMAND_NAMES[COMMAND_COUNT] = {
+    "read", "write", "flush", "trim", "write-zeroes"
+  };
+
+  static uint32_t nbdType(Command command) {
+    switch (command) {
+      case READ: return NBD_CMD_READ;
+      case WRITE: return NBD_CMD_WRITE;
+      case FLUSH: return NBD_CMD_FLUSH;
+      case TRIM: return NBD_CMD_TRIM;
+      case WRITE_ZEROES: return 6;  // NBD_CMD_WRITE_ZEROES; missing from older linux/nbd.h
+      case COMMAND_COUNT: break;
+    }
+    KJ_UNREACHABLE;
+  }
+
+  struct Op {
+    Command command;
+    uint64_t offset;
+    uint32_t length;
+  };
+
+  kj::Vector<Op> trace;
+  // Loaded from the trace file, if the workload is a trace.
+
+  uint64_t writesSinceFlush = 0;
+
+  void loadTrace(kj::StringPtr path) {
+    uint lineNumber = 0;
+    for (auto& line: sandstorm::splitLines(sandstorm::readAll(path))) {
+      ++lineNumber;
+      auto fields = sandstorm::splitSpace(line);
+      KJ_REQUIRE(fields.size() == 3 || (fields.size() == 1 && kj::str(fields[0]) == "F"),
+                 "malformed trace line", path, lineNumber, line);
+      auto name = kj::str(fields[0]);
+
+      Op op;
+      if (name == "R") {
+        op.command = READ;
+      } else if (name == "W") {
+        op.command = WRITE;
+      } else if (name == "F") {
+        op.command = FLUSH;
+      } else if (name == "T") {
+        op.command = TRIM;
+      } else if (name == "Z") {
+        op.command = WRITE_ZEROES;
+      } else {
+        KJ_FAIL_REQUIRE("unknown command in trace", path, lineNumber, name);
+      }
+
+      op.offset = 0;
+      op.length = 0;
+      if (fields.size() == 3) {
+        op.offset = KJ_REQUIRE_NONNULL(sandstorm::parseUInt(kj::str(fields[1]), 10),
+                                       "bad offset in trace", path, lineNumber);
+        op.length = KJ_REQUIRE_NONNULL(sandstorm::parseUInt(kj::str(fields[2]), 10),
+                                       "bad length in trace", path, lineNumber);
+      }
+      if (op.command != READ) {
+        // The adapter (like the kernel) only deals in whole blocks for these.
+        KJ_REQUIRE(op.offset % Volume::BLOCK_SIZE == 0 && op.length % Volume::BLOCK_SIZE == 0,
+                   "trace request not block-aligned", path, lineNumber);
+      }
+      trace.add(op);
+    }
+    KJ_REQUIRE(trace.size() > 0, "trace is empty", path);
+  }
+
+  Op makeOp(uint64_t i) {
+    // Returns the i'th request of the workload.
+
+    if (trace.size() > 0) {
+      return trace[i % trace.size()];
+    }
+
+    auto randomOp = [&](Command command, uint32_t blocks) -> Op {
+      uint64_t slots = kj::max(uint64_t(spanMb) * 256 / blocks, uint64_t(1));
+      return { command, uint64_t(random() % slots) * blocks * Volume::BLOCK_SIZE,
+               blocks * Volume::BLOCK_SIZE };
+    };
+    auto seqOp = [&](Command command, uint32_t blocks) -> Op {
+      uint64_t slots = kj::max(uint64_t(spanMb) * 256 / blocks, uint64_t(1));
+      return { command, (i % slots) * blocks * Volume::BLOCK_SIZE, blocks * Volume::BLOCK_SIZE };
+    };
+
+    if (workloadName == "seq-read") {
+      return seqOp(READ, blocksPerOp);
+    } else if (workloadName == "seq-write") {
+      return seqOp(WRITE, blocksPerOp);
+    } else if (workloadName == "rand-read") {
+      return randomOp(READ, blocksPerOp);
+    } else if (workloadName == "rand-write") {
+      return randomOp(WRITE, blocksPerOp);
+    } else if (workloadName == "random-4k") {
+      return randomOp(random() % 10 < 7 ? READ : WRITE, 1);
+    } else if (workloadName == "sequential-1m") {
+      return seqOp(WRITE, 256);
+    } else if (workloadName == "flush-heavy") {
+      if (writesSinceFlush >= FLUSH_HEAVY_WRITES_PER_FLUSH) {
+        writesSinceFlush = 0;
+        return { FLUSH, 0, 0 };
+      }
+      Op op = randomOp(random() % 10 < 3 ? READ : WRITE, 1);
+      if (op.command == WRITE) ++writesSinceFlush;
+      return op;
+    }
+    KJ_UNREACHABLE;
+  }
+
+  // ---------------------------------------------------------------------------
+
+  static uint64_t htonll(uint64_t a) {
+    return (uint64_t(htonl(a & 0xffffffff)) << 32) | htonl(a >> 32);
+  }
+
+  static uint64_t nowNs() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+  struct Connection {
+    kj::Own<NbdVolumeAdapter> adapter;
+    kj::Promise<void> adapterTask = nullptr;
+
+    kj::Own<kj::AsyncIoStream> client;
+    // The kernel's end of the socketpair.
+
+    kj::Promise<void> sendQueue = kj::READY_NOW;
+    // Requests are written one at a time, like the kernel does.
+
+    uint inFlight = 0;
+    // Requests sent whose replies haven't been received.
+
+    kj::Array<byte> readScratch;
+    // Where read replies' data is received to be checked.
+  };
+
+  struct Slot {
+    // A request in flight. The slot index is the request's handle.
+
+    Connection* connection;
+    Op op;
+    uint64_t startTime;
+    uint64_t issuedAfter;
+    // `completedOps` when the request was sent.
+  };
+
+  kj::Array<Connection> connections;
+  kj::Array<Slot> slots;
+
+  std::unordered_map<uint64_t, uint64_t> writtenBlocks;
+  // For each block that a write has been acknowledged for, `completedOps` just before the first
+  // such acknowledgement. Reads sent after that must not find the block empty.
+
+  std::unordered_set<uint64_t> zeroedBlocks;
+  // Blocks that a trim or write-zeroes has been sent for. Since the request may race with reads
+  // and writes on other connections, these may read back either way from then on.
+
+  uint64_t opCount = 0;
+  uint64_t nextOp = 0;
+  uint64_t completedOps = 0;
+  uint64_t bytesRead = 0;
+  uint64_t bytesWritten = 0;
+
+  kj::Vector<uint64_t> latencies[COMMAND_COUNT];
+
+  void issue(uint slotIndex) {
+    // Send the next request of the workload using the given slot.
+
+    auto& slot = slots[slotIndex];
+    slot.op = makeOp(nextOp++);
+    bool hasPayload = slot.op.command == WRITE;
+    if (slot.op.command == TRIM || slot.op.command == WRITE_ZEROES) {
+      for (uint64_t i = 0; i < slot.op.length / Volume::BLOCK_SIZE; i++) {
+        zeroedBlocks.insert(slot.op.offset / Volume::BLOCK_SIZE + i);
+      }
+    }
+
+    auto message = kj::heapArray<byte>(
+        sizeof(struct nbd_request) + (hasPayload ? slot.op.length : 0));
+    auto& request = *reinterpret_cast<struct nbd_request*>(message.begin());
+    request.magic = htonl(NBD_REQUEST_MAGIC);
+    request.type = htonl(nbdType(slot.op.command));
+    memset(request.handle, 0, sizeof(request.handle));
+    memcpy(request.handle, &slotIndex, sizeof(slotIndex));
+    request.from = htonll(slot.op.offset);
+    request.len = htonl(slot.op.length);
+    if (hasPayload) {
+      // Never all zero, so writes don't get turned into zero() calls.
+      byte* pos = message.begin() + sizeof(request);
+      for (uint64_t i = 0; i < slot.op.length / Volume::BLOCK_SIZE; i++) {
+        memcpy(pos, blockContent(slot.op.offset / Volume::BLOCK_SIZE + i).begin(),
+               Volume::BLOCK_SIZE);
+        pos += Volume::BLOCK_SIZE;
+      }
+    }
+
+    slot.startTime = nowNs();
+    slot.issuedAfter = completedOps;
+    auto& connection = *slot.connection;
+    ++connection.inFlight;
+    connection.sendQueue = kj::mv(connection.sendQueue)
+        .then([&connection,KJ_MVCAP(message)]() mutable {
+      auto promise = connection.client->write(message.begin(), message.size());
+      return promise.attach(kj::mv(message));
+    });
+  }
+
+  kj::Promise<void> receiveReplies(Connection& connection) {
+    // Reads replies from one connection until it has none outstanding, issuing a new request in
+    // each slot that frees up.
+
+    if (connection.inFlight == 0) return kj::READY_NOW;
+
+    auto reply = kj::heap<struct nbd_reply>();
+    auto promise = connection.client->read(reply.get(), sizeof(*reply));
+    return promise.then([this,&connection,KJ_MVCAP(reply)]() -> kj::Promise<void> {
+      KJ_ASSERT(ntohl(reply->magic) == NBD_REPLY_MAGIC);
+      KJ_ASSERT(reply->error == 0, "NBD request failed", ntohl(reply->error));
+      uint slotIndex;
+      memcpy(&slotIndex, reply->handle, sizeof(slotIndex));
+      KJ_ASSERT(slotIndex < slots.size() && slots[slotIndex].connection == &connection);
+
+      auto finish = [this,&connection,slotIndex]() {
+        auto& slot = slots[slotIndex];
+        latencies[slot.op.command].add(nowNs() - slot.startTime);
+        if (slot.op.command == READ) bytesRead += slot.op.length;
+        if (slot.op.command == WRITE) {
+          bytesWritten += slot.op.length;
+          for (uint64_t i = 0; i < slot.op.length / Volume::BLOCK_SIZE; i++) {
+            writtenBlocks.insert({ slot.op.offset / Volume::BLOCK_SIZE + i, completedOps });
+          }
+        }
+        ++completedOps;
+        --connection.inFlight;
+        if (nextOp < opCount) issue(slotIndex);
+        return receiveReplies(connection);
+      };
+
+      auto& slot = slots[slotIndex];
+      if (slot.op.command == READ && slot.op.length > 0) {
+        if (connection.readScratch.size() < slot.op.length) {
+          connection.readScratch = kj::heapArray<byte>(slot.op.length);
+        }
+        return connection.client->read(connection.readScratch.begin(), slot.op.length)
+            .then([this,&connection,slotIndex,KJ_MVCAP(finish)]() mutable {
+          verifyRead(slots[slotIndex], connection.readScratch.slice(0, slots[slotIndex].op.length));
+          return finish();
+        });
+      } else {
+        return finish();
+      }
+    });
+  }
+
+  void verifyRead(const Slot& slot, kj::ArrayPtr<const byte> data) {
+    // Checks a read reply against what has been written. Each block must hold blockContent(),
+    // except that it may be all zeros if it has been trimmed, or if it's on real storage (where
+    // new volumes are empty) and no write to it had been acknowledged when the read was sent.
+
+    uint64_t pos = slot.op.offset;
+    while (data.size() > 0) {
+      uint64_t blockNum = pos / Volume::BLOCK_SIZE;
+      size_t offset = pos % Volume::BLOCK_SIZE;
+      size_t n = kj::min(data.size(), Volume::BLOCK_SIZE - offset);
+      if (memcmp(data.begin(), blockContent(blockNum).begin() + offset, n) != 0) {
+        KJ_ASSERT(isAllZero(data.begin(), n), "read returned wrong data", blockNum);
+
+        bool mayBeEmpty = zeroedBlocks.count(blockNum) > 0;
+        if (!mayBeEmpty && storageDir != nullptr) {
+          auto iter = writtenBlocks.find(blockNum);
+          mayBeEmpty = iter == writtenBlocks.end() || iter->second >= slot.issuedAfter;
+        }
+        KJ_ASSERT(mayBeEmpty, "read returned zeros for a written block", blockNum);
+      }
+      data = data.slice(n, data.size());
+      pos += n;
+    }
+  }
+
+  bool run() {
+    if (workloadName.startsWith("trace:")) {
+      loadTrace(workloadName.slice(strlen("trace:")));
+    }
+    KJ_IF_MAYBE(n, opCountOption) {
+      opCount = *n;
+    } else {
+      opCount = trace.size() > 0 ? trace.size() : 100000;
+    }
+
+    auto io = kj::setupAsyncIo();
+
+    // Set up the volume.
+    kj::AutoCloseFd dirFd;
+    FilesystemStorage* storageServer = nullptr;
+    kj::Maybe<StorageRootSet::Client> storage;
+    Volume::Client volume = nullptr;
+    KJ_IF_MAYBE(dir, storageDir) {
+      if (access(dir->cStr(), F_OK) >= 0) {
+        sandstorm::recursivelyDelete(*dir);
+      }
+      KJ_SYSCALL(mkdir(dir->cStr(), 0777), *dir);
+      dirFd = sandstorm::raiiOpen(*dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+      auto server = kj::heap<FilesystemStorage>(dirFd,
+          io.unixEventPort, io.provider->getTimer(), nullptr);
+      storageServer = server.get();
+      StorageRootSet::Client root = kj::mv(server);
+      volume = root.getFactoryRequest().send().getFactory()
+          .newVolumeRequest().send().getVolume();
+
+      // Give the volume a name so that it isn't collected out from under us.
+      auto req = root.setRequest<Volume>();
+      req.setName("volume");
+      req.setObject(volume);
+      req.send().wait(io.waitScope);
+      storage = kj::mv(root);
+    } else {
+      volume = kj::heap<StubVolume>();
+    }
+
+    // Connect the adapters.
+    connections = kj::heapArray<Connection>(connectionCount);
+    for (auto& connection: connections) {
+      auto pipe = io.provider->newTwoWayPipe();
+      connection.client = kj::mv(pipe.ends[1]);
+      connection.adapter = kj::heap<NbdVolumeAdapter>(kj::mv(pipe.ends[0]), volume,
+                                                      NbdAccessType::READ_WRITE);
+      connection.adapterTask = connection.adapter->run()
+          .eagerlyEvaluate([](kj::Exception&& e) {
+        KJ_LOG(FATAL, "NbdVolumeAdapter failed", e);
+      });
+    }
+
+    slots = kj::heapArray<Slot>(kj::min(uint64_t(queueDepth), opCount));
+    for (auto i: kj::indices(slots)) {
+      slots[i].connection = &connections[i % connections.size()];
+    }
+    for (auto& list: latencies) {
+      list.reserve(opCount);
+    }
+
+    uint64_t start = nowNs();
+    for (auto i: kj::indices(slots)) {
+      issue(i);
+    }
+    auto receivers = kj::heapArrayBuilder<kj::Promise<void>>(connections.size());
+    for (auto& connection: connections) {
+      receivers.add(receiveReplies(connection));
+    }
+    kj::joinPromises(receivers.finish()).wait(io.waitScope);
+    uint64_t elapsed = nowNs() - start;
+
+    // Disconnect cleanly, as the kernel would.
+    NbdVolumeAdapter::Stats stats;
+    for (auto& connection: connections) {
+      auto disc = kj::heap<struct nbd_request>();
+      memset(disc.get(), 0, sizeof(*disc));
+      disc->magic = htonl(NBD_REQUEST_MAGIC);
+      disc->type = htonl(NBD_CMD_DISC);
+      kj::mv(connection.sendQueue).then([&connection,&disc]() {
+        return connection.client->write(disc.get(), sizeof(*disc));
+      }).wait(io.waitScope);
+      connection.adapterTask.wait(io.waitScope);
+
+      auto& adapterStats = connection.adapter->getStats();
+      stats.requests += adapterStats.requests;
+      stats.socketReads += adapterStats.socketReads;
+      stats.socketWrites += adapterStats.socketWrites;
+    }
+
+    report(elapsed, stats);
+    if (storageServer != nullptr) {
+      auto storageStats = storageServer->getStats();
+      context.warning(kj::str(
+          "  storage: ", storageStats.journalTransactions, " journal transactions, ",
+          storageStats.journalSyncs, " journal fsyncs, ",
+          storageStats.objectSyncs, " object fsyncs"));
+    }
+
+    // The adapters' sockets belong to `io`, so they must go first.
+    slots = nullptr;
+    connections = nullptr;
+    return true;
+  }
+
+  void report(uint64_t elapsedNs, const NbdVolumeAdapter::Stats& stats) {
+    double seconds = elapsedNs / 1e9;
+
+    context.warning(kj::str(
+        workloadName, ": ", completedOps, " requests, queue depth ", slots.size(), ", ",
+        connections.size(), " connection(s), ", seconds, " s\n"
+        "  throughput: ", uint64_t(completedOps / seconds), " IOPS, read ",
+        uint64_t(bytesRead / seconds / (1 << 20)), " MB/s, write ",
+        uint64_t(bytesWritten / seconds / (1 << 20)), " MB/s"));
+
+    for (uint c = 0; c < COMMAND_COUNT; c++) {
+      auto& list = latencies[c];
+      if (list.size() == 0) continue;
+      std::sort(list.begin(), list.end());
+      auto percentile = [&](double p) -> double {
+        size_t index = kj::min(size_t(list.size() * p), list.size() - 1);
+        return list[index] / 1e3;
+      };
+      context.warning(kj::str(
+          "  ", COMMAND_NAMES[c], ": ", list.size(), " requests, latency us: p50 ",
+          percentile(0.5), ", p99 ", percentile(0.99), ", p999 ", percentile(0.999),
+          ", max ", list.back() / 1e3));
+    }
+
+    context.warning(kj::str(
+        "  adapter: ", stats.requests, " requests, ", stats.socketReads, " socket reads, ",
+        stats.socketWrites, " socket writes (",
+        double(stats.requests) / kj::max(stats.socketReads, uint64_t(1)), " requests/read, ",
+        double(stats.requests) / kj::max(stats.socketWrites, uint64_t(1)), " replies/write)"));
+  }
+};
+
+constexpr const char* NbdBench::COMMAND_NAMES[NbdBench::COMMAND_COUNT];
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::NbdBench)
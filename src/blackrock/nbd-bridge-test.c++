@@ -0,0 +1,584 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nbd-bridge.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <map>
+#undef BLOCK_SIZE
+
+namespace blackrock {
+namespace {
+
+// These tests play the part of the kernel's NBD client: they write raw NBD requests to one end
+// of a socketpair, with an NbdVolumeAdapter on the other end, and parse the replies. Requests
+// which are sent together in one write() arrive at the adapter together, so they are batched the
+// way a full kernel queue would be.
+
+uint64_t htonll(uint64_t a) {
+  return (uint64_t(htonl(a & 0xffffffff)) << 32) | htonl(a >> 32);
+}
+
+constexpr uint32_t NBD_CMD_WRITE_ZEROES = 6;
+// Not in older versions of linux/nbd.h.
+
+kj::Array<byte> testData(uint seed, uint32_t blockCount) {
+  // Content for a write. Never all zero, and differs between blocks and between seeds.
+  auto result = kj::heapArray<byte>(blockCount * Volume::BLOCK_SIZE);
+  for (size_t i = 0; i < result.size(); i++) {
+    result[i] = seed * 31 + (i / Volume::BLOCK_SIZE) * 13 + i * 7 + 1;
+  }
+  return result;
+}
+
+class MemoryVolume final: public Volume::Server {
+  // Volume held in memory, initially all zeros. Holes are returned as zero extents, as
+  // FilesystemStorage does. Logs each call that changes the volume, or syncs it, in the order
+  // received.
+
+public:
+  kj::Vector<kj::String> calls;
+  // E.g. "writev 10+4 20+1", "write 3+1", "zero 5+2", "sync".
+
+  kj::Array<byte> get(uint32_t blockNum, uint32_t count) {
+    auto result = kj::heapArray<byte>(count * Volume::BLOCK_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+      copyBlock(blockNum + i, result.begin() + i * Volume::BLOCK_SIZE);
+    }
+    return result;
+  }
+
+protected:
+  kj::Promise<void> read(ReadContext context) override {
+    auto params = context.getParams();
+    uint32_t start = params.getBlockNum();
+    uint32_t count = params.getCount();
+    auto data = context.getResults(sizeHint(count)).initData(count * Volume::BLOCK_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+      copyBlock(start + i, data.begin() + i * Volume::BLOCK_SIZE);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readExtents(ReadExtentsContext context) override {
+    auto params = context.getParams();
+    kj::Vector<Run> runs;
+    addRuns(params.getBlockNum(), params.getCount(), runs);
+    fillExtents(runs, context.getResults(sizeHint(params.getCount())).initExtents(runs.size()));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readv(ReadvContext context) override {
+    auto ranges = context.getParams().getRanges();
+    kj::Vector<Run> runs;
+    uint32_t total = 0;
+    for (auto range: ranges) {
+      addRuns(range.getBlockNum(), range.getCount(), runs);
+      total += range.getCount();
+    }
+    fillExtents(runs, context.getResults(sizeHint(total)).initExtents(runs.size()));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> write(WriteContext context) override {
+    auto params = context.getParams();
+    auto data = params.getData();
+    KJ_REQUIRE(data.size() % Volume::BLOCK_SIZE == 0);
+    calls.add(kj::str("write ", params.getBlockNum(), "+", data.size() / Volume::BLOCK_SIZE));
+    store(params.getBlockNum(), data);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> writev(WritevContext context) override {
+    auto params = context.getParams();
+    auto data = params.getData();
+    kj::Vector<kj::String> parts;
+    size_t pos = 0;
+    for (auto range: params.getRanges()) {
+      size_t size = range.getCount() * Volume::BLOCK_SIZE;
+      KJ_REQUIRE(pos + size <= data.size());
+      store(range.getBlockNum(), data.slice(pos, pos + size));
+      parts.add(kj::str(range.getBlockNum(), "+", range.getCount()));
+      pos += size;
+    }
+    KJ_REQUIRE(pos == data.size());
+    calls.add(kj::str("writev ", kj::strArray(parts, " ")));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> zero(ZeroContext context) override {
+    auto params = context.getParams();
+    calls.add(kj::str("zero ", params.getBlockNum(), "+", params.getCount()));
+    for (uint32_t i = 0; i < params.getCount(); i++) {
+      blocks.erase(params.getBlockNum() + i);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> sync(SyncContext context) override {
+    calls.add(kj::str("sync"));
+    return kj::READY_NOW;
+  }
+
+private:
+  std::unordered_map<uint32_t, kj::Array<byte>> blocks;
+  // Blocks which have been written and not since zeroed.
+
+  struct Run {
+    uint32_t start;
+    uint32_t count;
+    bool isData;
+  };
+
+  static capnp::MessageSize sizeHint(uint32_t blocks) {
+    return { 16 + blocks * (Volume::BLOCK_SIZE / sizeof(capnp::word) + 2), 0 };
+  }
+
+  void copyBlock(uint32_t blockNum, byte* out) {
+    auto iter = blocks.find(blockNum);
+    if (iter == blocks.end()) {
+      memset(out, 0, Volume::BLOCK_SIZE);
+    } else {
+      memcpy(out, iter->second.begin(), Volume::BLOCK_SIZE);
+    }
+  }
+
+  void store(uint32_t start, capnp::Data::Reader data) {
+    for (size_t pos = 0; pos < data.size(); pos += Volume::BLOCK_SIZE) {
+      auto& slot = blocks[start + pos / Volume::BLOCK_SIZE];
+      if (slot == nullptr) {
+        slot = kj::heapArray<byte>(Volume::BLOCK_SIZE);
+      }
+      memcpy(slot.begin(), data.begin() + pos, Volume::BLOCK_SIZE);
+    }
+  }
+
+  void addRuns(uint32_t start, uint32_t count, kj::Vector<Run>& runs) {
+    // Splits the range into runs of data and holes. Runs never span two ranges.
+    for (uint32_t i = 0; i < count; i++) {
+      bool isData = blocks.count(start + i) > 0;
+      if (i > 0 && runs.back().isData == isData) {
+        ++runs.back().count;
+      } else {
+        runs.add(Run { start + i, 1, isData });
+      }
+    }
+  }
+
+  void fillExtents(kj::ArrayPtr<const Run> runs,
+                   capnp::List<Volume::Extent>::Builder extents) {
+    for (auto i: kj::indices(runs)) {
+      extents[i].setCount(runs[i].count);
+      if (runs[i].isData) {
+        auto data = extents[i].initData(runs[i].count * Volume::BLOCK_SIZE);
+        for (uint32_t j = 0; j < runs[i].count; j++) {
+          copyBlock(runs[i].start + j, data.begin() + j * Volume::BLOCK_SIZE);
+        }
+      } else {
+        extents[i].setZeros();
+      }
+    }
+  }
+};
+
+struct NbdTestFixture {
+  NbdTestFixture(): io(kj::setupAsyncIo()), volume(nullptr) {
+    auto server = kj::heap<MemoryVolume>();
+    memory = server.get();
+    volume = kj::mv(server);
+  }
+
+  kj::AsyncIoContext io;
+  MemoryVolume* memory;
+  Volume::Client volume;
+
+  struct Connection {
+    kj::Own<NbdVolumeAdapter> adapter;
+    kj::Own<NbdVolumeAdapterThread> adapterThread;
+    kj::Promise<void> adapterTask = nullptr;
+    kj::Own<kj::AsyncIoStream> client;
+
+    kj::Vector<byte> outgoing;
+    // Requests added since the last exchange().
+
+    std::map<uint64_t, uint32_t> readLengths;
+    // Bytes of data expected with the reply to each outstanding read, by handle.
+  };
+
+  struct Reply {
+    uint64_t handle;
+    uint32_t error;
+    kj::Array<byte> data;
+  };
+
+  kj::Own<Connection> connect() {
+    auto result = kj::heap<Connection>();
+    auto pipe = io.provider->newTwoWayPipe();
+    result->client = kj::mv(pipe.ends[1]);
+    result->adapter = kj::heap<NbdVolumeAdapter>(kj::mv(pipe.ends[0]), volume,
+                                                 NbdAccessType::READ_WRITE);
+    result->adapterTask = result->adapter->run().eagerlyEvaluate(nullptr);
+    return result;
+  }
+
+  kj::Own<Connection> connectOnThread() {
+    // Like connect(), but the adapter runs on a thread of its own, reaching `volume` through our
+    // event loop.
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    auto result = kj::heap<Connection>();
+    result->client = io.lowLevelProvider->wrapSocketFd(fds[1],
+        kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+        kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+    result->adapterThread = kj::heap<NbdVolumeAdapterThread>(
+        *io.lowLevelProvider, kj::AutoCloseFd(fds[0]), volume, NbdAccessType::READ_WRITE);
+    result->adapterTask = result->adapterThread->run().eagerlyEvaluate(nullptr);
+    return result;
+  }
+
+  void addRequest(Connection& connection, uint32_t type, uint64_t handle,
+                  uint64_t offset, uint32_t length, kj::ArrayPtr<const byte> payload = nullptr) {
+    struct nbd_request request;
+    request.magic = htonl(NBD_REQUEST_MAGIC);
+    request.type = htonl(type);
+    memcpy(request.handle, &handle, sizeof(handle));
+    request.from = htonll(offset);
+    request.len = htonl(length);
+    connection.outgoing.addAll(kj::arrayPtr(&request, 1).asBytes());
+    connection.outgoing.addAll(payload);
+  }
+
+  void addWrite(Connection& connection, uint64_t handle, uint32_t blockNum,
+                kj::ArrayPtr<const byte> data) {
+    addRequest(connection, NBD_CMD_WRITE, handle,
+               uint64_t(blockNum) * Volume::BLOCK_SIZE, data.size(), data);
+  }
+
+  void addRead(Connection& connection, uint64_t handle, uint64_t offset, uint32_t length) {
+    addRequest(connection, NBD_CMD_READ, handle, offset, length);
+    connection.readLengths[handle] = length;
+  }
+
+  void addFlush(Connection& connection, uint64_t handle) {
+    addRequest(connection, NBD_CMD_FLUSH, handle, 0, 0);
+  }
+
+  void addZero(Connection& connection, uint32_t type, uint64_t handle,
+               uint32_t blockNum, uint32_t count) {
+    addRequest(connection, type, handle, uint64_t(blockNum) * Volume::BLOCK_SIZE,
+               count * Volume::BLOCK_SIZE);
+  }
+
+  kj::Promise<void> receive(Connection& connection, uint count, kj::Vector<Reply>& replies) {
+    if (count == 0) return kj::READY_NOW;
+
+    auto header = kj::heap<struct nbd_reply>();
+    auto promise = connection.client->read(header.get(), sizeof(*header));
+    return promise.then([this,&connection,count,&replies,KJ_MVCAP(header)]() {
+      KJ_ASSERT(ntohl(header->magic) == NBD_REPLY_MAGIC);
+      uint64_t handle;
+      memcpy(&handle, header->handle, sizeof(handle));
+
+      size_t length = 0;
+      auto iter = connection.readLengths.find(handle);
+      if (iter != connection.readLengths.end()) {
+        length = iter->second;
+        connection.readLengths.erase(iter);
+      }
+
+      auto data = kj::heapArray<byte>(length);
+      auto promise = connection.client->read(data.begin(), data.size());
+      replies.add(Reply { handle, ntohl(header->error), kj::mv(data) });
+      return promise.then([this,&connection,count,&replies]() {
+        return receive(connection, count - 1, replies);
+      });
+    });
+  }
+
+  kj::Vector<Reply> exchange(Connection& connection, uint replyCount) {
+    // Sends the requests added so far in one write(), and waits for `replyCount` replies. Replies
+    // are read while the requests are still being sent, as the kernel does.
+    auto message = connection.outgoing.releaseAsArray();
+    auto sent = connection.client->write(message.begin(), message.size());
+
+    kj::Vector<Reply> replies;
+    receive(connection, replyCount, replies).wait(io.waitScope);
+    sent.wait(io.waitScope);
+    for (auto& reply: replies) {
+      KJ_EXPECT(reply.error == 0, "NBD request failed", reply.handle, reply.error);
+    }
+    return replies;
+  }
+
+  kj::Array<byte> readBlocks(Connection& connection, uint32_t blockNum, uint32_t count) {
+    addRead(connection, 0, uint64_t(blockNum) * Volume::BLOCK_SIZE, count * Volume::BLOCK_SIZE);
+    auto replies = exchange(connection, 1);
+    return kj::mv(replies[0].data);
+  }
+
+  void disconnect(Connection& connection) {
+    addRequest(connection, NBD_CMD_DISC, 0, 0, 0);
+    auto message = connection.outgoing.releaseAsArray();
+    connection.client->write(message.begin(), message.size()).wait(io.waitScope);
+    connection.adapterTask.wait(io.waitScope);
+  }
+};
+
+void expectBytes(kj::ArrayPtr<const byte> actual, kj::ArrayPtr<const byte> expected,
+                 kj::StringPtr what) {
+  KJ_ASSERT(actual.size() == expected.size(), what, actual.size(), expected.size());
+  for (size_t i = 0; i < actual.size(); i++) {
+    if (actual[i] != expected[i]) {
+      KJ_FAIL_EXPECT("wrong content", what, i / Volume::BLOCK_SIZE, i % Volume::BLOCK_SIZE,
+                     actual[i], expected[i]);
+      return;
+    }
+  }
+}
+
+KJ_TEST("NBD adapter: overlapping and adjacent writes in one batch") {
+  NbdTestFixture env;
+  auto conn = env.connect();
+
+  auto a = testData(1, 2);
+  auto b = testData(2, 1);
+  auto c = testData(3, 2);
+  auto d = testData(4, 1);
+  env.addWrite(*conn, 1, 10, a);  // blocks 10-11
+  env.addWrite(*conn, 2, 12, b);  // block 12, adjacent
+  env.addWrite(*conn, 3, 11, c);  // blocks 11-12, overwriting the end of both
+  env.addWrite(*conn, 4, 20, d);  // block 20, separate
+  auto replies = env.exchange(*conn, 4);
+
+  std::map<uint64_t, uint> handles;
+  for (auto& reply: replies) ++handles[reply.handle];
+  KJ_EXPECT(handles.size() == 4);
+  for (auto& entry: handles) {
+    KJ_EXPECT(entry.first >= 1 && entry.first <= 4 && entry.second == 1, entry.first);
+  }
+
+  // The batch became one call, with blocks 10-12 merged into a single range and each block sent
+  // once with its final content.
+  KJ_ASSERT(env.memory->calls.size() == 1, kj::strArray(env.memory->calls, ", "));
+  KJ_EXPECT(env.memory->calls[0] == "writev 10+3 20+1", env.memory->calls[0]);
+
+  auto expected = kj::heapArray<byte>(4 * Volume::BLOCK_SIZE);
+  memcpy(expected.begin(), a.begin(), Volume::BLOCK_SIZE);
+  memcpy(expected.begin() + Volume::BLOCK_SIZE, c.begin(), 2 * Volume::BLOCK_SIZE);
+  memset(expected.begin() + 3 * Volume::BLOCK_SIZE, 0, Volume::BLOCK_SIZE);
+  expectBytes(env.memory->get(10, 4), expected, "volume");
+  expectBytes(env.memory->get(20, 1), d, "volume block 20");
+
+  // Read it back through the adapter, including the hole at block 13 and an unaligned read
+  // crossing the block 11-12 boundary; these two go out as one readv().
+  env.addRead(*conn, 5, 10 * Volume::BLOCK_SIZE, 4 * Volume::BLOCK_SIZE);
+  env.addRead(*conn, 6, 11 * Volume::BLOCK_SIZE + 100, 5000);
+  replies = env.exchange(*conn, 2);
+  for (auto& reply: replies) {
+    if (reply.handle == 5) {
+      expectBytes(reply.data, expected, "read 5");
+    } else {
+      KJ_EXPECT(reply.handle == 6);
+      expectBytes(reply.data, expected.slice(Volume::BLOCK_SIZE + 100, Volume::BLOCK_SIZE + 5100),
+                  "read 6");
+    }
+  }
+
+  env.disconnect(*conn);
+}
+
+KJ_TEST("NBD adapter: requests straddling the read buffer") {
+  NbdTestFixture env;
+  auto conn = env.connect();
+
+  // About 3MB of requests of varying sizes, sent all at once. The adapter reads them in 128k
+  // pieces, so the ends of its buffer fall in the middle of headers and of payloads, and the
+  // 600-block write is mostly read directly into its Volume request. Reads in between must see
+  // exactly the writes before them.
+  constexpr uint32_t REGION = 1024;
+  auto model = kj::heapArray<byte>(REGION * Volume::BLOCK_SIZE);
+  memset(model.begin(), 0, model.size());
+
+  std::map<uint64_t, kj::Array<byte>> expectedReads;
+  uint32_t seed = 12345;
+  auto next = [&](uint32_t n) -> uint32_t {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  };
+
+  uint64_t handle = 0;
+  for (uint i = 0; i < 200; i++) {
+    ++handle;
+    if (i % 10 == 9) {
+      uint64_t offset = next(REGION * Volume::BLOCK_SIZE - 65536);
+      uint32_t length = next(65536) + 1;
+      env.addRead(*conn, handle, offset, length);
+      expectedReads[handle] = kj::heapArray<byte>(model.slice(offset, offset + length));
+      continue;
+    }
+
+    uint32_t count = i == 100 ? 600 : next(5) + 1;
+    uint32_t blockNum = next(REGION - count + 1);
+    auto data = testData(i, count);
+    env.addWrite(*conn, handle, blockNum, data);
+    memcpy(model.begin() + blockNum * Volume::BLOCK_SIZE, data.begin(), data.size());
+  }
+  KJ_ASSERT(conn->outgoing.size() > 16 * 128 * 1024, conn->outgoing.size());
+
+  auto replies = env.exchange(*conn, handle);
+  KJ_EXPECT(replies.size() == handle);
+  for (auto& reply: replies) {
+    auto iter = expectedReads.find(reply.handle);
+    if (iter != expectedReads.end()) {
+      expectBytes(reply.data, iter->second, kj::str("read ", reply.handle));
+    } else {
+      KJ_EXPECT(reply.data.size() == 0);
+    }
+  }
+  KJ_EXPECT(conn->adapter->getStats().requests == handle);
+
+  expectBytes(env.memory->get(0, REGION), model, "volume");
+  expectBytes(env.readBlocks(*conn, 0, REGION), model, "final read");
+
+  env.disconnect(*conn);
+}
+
+KJ_TEST("NBD adapter: flush is ordered after earlier writes") {
+  NbdTestFixture env;
+  auto conn = env.connect();
+
+  env.addWrite(*conn, 1, 1, testData(1, 1));
+  env.addWrite(*conn, 2, 2, testData(2, 1));
+  env.addZero(*conn, NBD_CMD_TRIM, 3, 5, 1);
+  auto zeros = kj::heapArray<byte>(Volume::BLOCK_SIZE);
+  memset(zeros.begin(), 0, zeros.size());
+  env.addWrite(*conn, 4, 3, zeros);
+  env.addWrite(*conn, 5, 4, testData(5, 1));
+  env.addFlush(*conn, 6);
+  env.addWrite(*conn, 7, 1, testData(7, 1));
+  env.addZero(*conn, NBD_CMD_WRITE_ZEROES, 8, 6, 2);
+  env.exchange(*conn, 8);
+
+  // Every request before the flush reached the volume before the sync, in order, and the write
+  // after it didn't. The trim and the all-zero write each cut the batch short.
+  auto expected = kj::heapArray<kj::StringPtr>({
+    "write 1+2", "zero 5+1", "zero 3+1", "write 4+1", "sync", "write 1+1", "zero 6+2"
+  });
+  KJ_ASSERT(env.memory->calls.size() == expected.size(),
+            kj::strArray(env.memory->calls, ", "));
+  for (auto i: kj::indices(expected)) {
+    KJ_EXPECT(env.memory->calls[i] == expected[i], i, env.memory->calls[i]);
+  }
+
+  // A flush sent after a write was acknowledged covers it, even though the write was batched.
+  env.memory->calls.clear();
+  env.addWrite(*conn, 9, 8, testData(9, 1));
+  env.addWrite(*conn, 10, 9, testData(10, 1));
+  env.exchange(*conn, 2);
+  env.addFlush(*conn, 11);
+  env.exchange(*conn, 1);
+  KJ_ASSERT(env.memory->calls.size() == 2, kj::strArray(env.memory->calls, ", "));
+  KJ_EXPECT(env.memory->calls[0] == "write 8+2");
+  KJ_EXPECT(env.memory->calls[1] == "sync");
+
+  env.disconnect(*conn);
+}
+
+KJ_TEST("NBD adapter: multiple connections to one volume") {
+  NbdTestFixture env;
+  auto conn1 = env.connect();
+  auto conn2 = env.connect();
+
+  // Writes acknowledged on one connection are covered by a flush on the other, and visible to
+  // its reads.
+  auto data = testData(1, 4);
+  for (uint32_t i = 0; i < 4; i++) {
+    env.addWrite(*conn1, i + 1, 100 + i,
+                 data.slice(i * Volume::BLOCK_SIZE, (i + 1) * Volume::BLOCK_SIZE));
+  }
+  env.exchange(*conn1, 4);
+  env.addFlush(*conn2, 5);
+  env.exchange(*conn2, 1);
+  KJ_ASSERT(env.memory->calls.size() == 2, kj::strArray(env.memory->calls, ", "));
+  KJ_EXPECT(env.memory->calls[0] == "write 100+4");
+  KJ_EXPECT(env.memory->calls[1] == "sync");
+  expectBytes(env.readBlocks(*conn2, 100, 4), data, "read on second connection");
+
+  // Both connections writing at once, each then reading what the other wrote.
+  auto data1 = testData(2, 3);
+  auto data2 = testData(3, 3);
+  env.addWrite(*conn1, 6, 200, data1);
+  env.addWrite(*conn2, 7, 300, data2);
+  auto sent1 = conn1->client->write(conn1->outgoing.begin(), conn1->outgoing.size());
+  auto sent2 = conn2->client->write(conn2->outgoing.begin(), conn2->outgoing.size());
+  kj::Vector<NbdTestFixture::Reply> replies1, replies2;
+  env.receive(*conn1, 1, replies1).wait(env.io.waitScope);
+  env.receive(*conn2, 1, replies2).wait(env.io.waitScope);
+  sent1.wait(env.io.waitScope);
+  sent2.wait(env.io.waitScope);
+  conn1->outgoing.clear();
+  conn2->outgoing.clear();
+  KJ_EXPECT(replies1[0].handle == 6 && replies1[0].error == 0);
+  KJ_EXPECT(replies2[0].handle == 7 && replies2[0].error == 0);
+
+  expectBytes(env.readBlocks(*conn1, 300, 3), data2, "first connection reading second's write");
+  expectBytes(env.readBlocks(*conn2, 200, 3), data1, "second connection reading first's write");
+
+  // Closing one connection leaves the other working.
+  env.disconnect(*conn1);
+  expectBytes(env.readBlocks(*conn2, 100, 4), data, "read after other connection closed");
+  env.disconnect(*conn2);
+}
+
+KJ_TEST("NBD adapter: connections served on their own threads") {
+  NbdTestFixture env;
+  auto conn1 = env.connectOnThread();
+  auto conn2 = env.connectOnThread();
+
+  auto data1 = testData(1, 8);
+  auto data2 = testData(2, 8);
+  env.addWrite(*conn1, 1, 100, data1);
+  env.addWrite(*conn2, 2, 200, data2);
+  auto sent1 = conn1->client->write(conn1->outgoing.begin(), conn1->outgoing.size());
+  auto sent2 = conn2->client->write(conn2->outgoing.begin(), conn2->outgoing.size());
+  kj::Vector<NbdTestFixture::Reply> replies1, replies2;
+  env.receive(*conn1, 1, replies1).wait(env.io.waitScope);
+  env.receive(*conn2, 1, replies2).wait(env.io.waitScope);
+  sent1.wait(env.io.waitScope);
+  sent2.wait(env.io.waitScope);
+  conn1->outgoing.clear();
+  conn2->outgoing.clear();
+  KJ_EXPECT(replies1[0].handle == 1 && replies1[0].error == 0);
+  KJ_EXPECT(replies2[0].handle == 2 && replies2[0].error == 0);
+
+  // Each connection sees what the other wrote, and a flush on either reaches the volume.
+  expectBytes(env.readBlocks(*conn1, 200, 8), data2, "first thread reading second's write");
+  expectBytes(env.readBlocks(*conn2, 100, 8), data1, "second thread reading first's write");
+  env.addFlush(*conn1, 3);
+  env.exchange(*conn1, 1);
+  KJ_EXPECT(env.memory->calls.back() == "sync", kj::strArray(env.memory->calls, ", "));
+
+  env.disconnect(*conn1);
+  expectBytes(env.readBlocks(*conn2, 200, 8), data2, "read after other thread finished");
+  env.disconnect(*conn2);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -30,11 +30,16 @@
 #include <blackrock/sparse-data.capnp.h>
 #include <blackrock/blank-ext4.capnp.h>
 #include <limits.h>
+#include <algorithm>
 
 #include <sys/mount.h>
 #include <linux/fs.h>  // must come after mount.h because of macro pollution
 #undef BLOCK_SIZE  // #defined in mount.h and fs.h, ugh
 
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)  // missing from older linux/nbd.h
+#endif
+
 namespace blackrock {
 
 namespace {
@@ -47,6 +52,12 @@ static uint64_t ntohll(uint64_t a) {
   return ((uint64_t) lo) << 32U | hi;
 }
 
+constexpr uint32_t NBD_CMD_TYPE_MASK = 0xffff;
+// The upper 16 bits of nbd_request.type are command flags (e.g. NBD_CMD_FLAG_NO_HOLE).
+
+constexpr uint32_t NBD_CMD_WRITE_ZEROES = 6;
+// Not in older versions of linux/nbd.h (see also NBD_FLAG_SEND_WRITE_ZEROES above).
+
 constexpr uint64_t VOLUME_SIZE = 1ull << 40;
 // Volumes in our storage interface do not have a defined size, since they are sparse. But Linux
 // wants us to tell it a size, so we'll claim 1TB. We will actually create a much smaller
@@ -58,13 +69,36 @@ constexpr uint MAX_NBDS = 4093;
 constexpr uint MAX_RPC_BLOCKS = 512;
 // Maximum number of blocks we'll transfer in a single Volume RPC.
 
+constexpr uint MAX_BATCH_REQUESTS = 64;
+// Maximum number of NBD requests we'll gather into a single readv() or writev().
+
+constexpr size_t READ_BUFFER_SIZE = 128 * 1024;
+// Size of the buffer NBD requests are read into. Large enough to hold a full queue of read
+// requests, or several small writes with their payloads. Larger writes are read partly directly
+// into the Volume request.
+
+const byte ZEROS[MAX_RPC_BLOCKS * Volume::BLOCK_SIZE] = {};
+// Source for zero runs returned by readExtents(). Since this is never written, it never consumes
+// any actual memory.
+
+struct SharedReadvResponse: public kj::Refcounted {
+  // A readv() response, shared by the replies to all of the NBD requests it covers.
+
+  capnp::Response<Volume::ReadvResults> response;
+
+  explicit SharedReadvResponse(capnp::Response<Volume::ReadvResults>&& response)
+      : response(kj::mv(response)) {}
+};
+
 }  // namespace
 
 NbdVolumeAdapter::NbdVolumeAdapter(kj::Own<kj::AsyncIoStream> socket, Volume::Client volume,
                                    NbdAccessType access)
     : socket(kj::mv(socket)), volume(kj::mv(volume)),
       disconnectedPaf(kj::newPromiseAndFulfiller<void>()),
-      access(access), tasks(*this) {}
+      access(access), tasks(*this), readBuffer(kj::heapArray<byte>(READ_BUFFER_SIZE)) {}
+
+NbdVolumeAdapter::~NbdVolumeAdapter() noexcept(false) {}
 
 struct NbdVolumeAdapter::RequestHandle {
   char handle[8];
@@ -74,19 +108,85 @@ struct NbdVolumeAdapter::RequestHandle {
   }
 };
 
+struct NbdVolumeAdapter::PendingRead {
+  RequestHandle handle;
+  uint32_t startBlock;
+  uint32_t blockCount;
+  uint32_t startPad;  // bytes to drop from the start of the first block
+  uint32_t endPad;    // bytes to drop from the end of the last block
+};
+
+struct NbdVolumeAdapter::PendingWrite {
+  RequestHandle handle;
+  capnp::Request<Volume::WriteParams, Volume::WriteResults> request;
+  // The data is read from the socket directly into the request. If the write ends up in a batch
+  // of one, or the volume doesn't implement writev(), this is sent as-is.
+};
+
+struct NbdVolumeAdapter::StagedBlock {
+  uint32_t blockNum;
+  const byte* data;
+  // Points into the PendingWrite that supplied the block.
+};
+
 struct NbdVolumeAdapter::ReplyAndIovec {
   kj::Array<capnp::Response<Volume::ReadResults>> responses;
-  kj::Array<kj::ArrayPtr<const byte>> iov;
+  kj::Array<capnp::Response<Volume::ReadExtentsResults>> extentResponses;
+  kj::Vector<kj::ArrayPtr<const byte>> iov;
+  kj::Own<SharedReadvResponse> readvResponse;
   struct nbd_reply reply;
 
-  ReplyAndIovec(kj::Array<capnp::Response<Volume::ReadResults>> responsesParam,
-                RequestHandle handle, uint startPad, uint endPad)
-      : responses(kj::mv(responsesParam)),
-        iov(kj::heapArray<kj::ArrayPtr<const byte>>(responses.size() + 1)) {
-    iov[0] = kj::arrayPtr(&reply, 1).asBytes();
-    for (uint i: kj::indices(responses)) {
-      iov[i + 1] = responses[i].getData();
+  ReplyAndIovec() {
+    // Reply with no data, e.g. to a write.
+    iov.add(kj::arrayPtr(&reply, 1).asBytes());
+  }
+
+  explicit ReplyAndIovec(kj::Array<capnp::Response<Volume::ReadResults>> responsesParam)
+      : responses(kj::mv(responsesParam)) {
+    iov.add(kj::arrayPtr(&reply, 1).asBytes());
+    for (auto& response: responses) {
+      iov.add(response.getData());
     }
+  }
+
+  explicit ReplyAndIovec(kj::Array<capnp::Response<Volume::ReadExtentsResults>> responsesParam)
+      : extentResponses(kj::mv(responsesParam)) {
+    iov.add(kj::arrayPtr(&reply, 1).asBytes());
+    for (auto& response: extentResponses) {
+      for (auto extent: response.getExtents()) {
+        addExtent(extent);
+      }
+    }
+  }
+
+  ReplyAndIovec(kj::Own<SharedReadvResponse> readvResponseParam, uint firstExtent, uint endExtent)
+      : readvResponse(kj::mv(readvResponseParam)) {
+    // Reply covering extents [firstExtent, endExtent) of a readv() response.
+    iov.add(kj::arrayPtr(&reply, 1).asBytes());
+    auto extents = readvResponse->response.getExtents();
+    for (uint i = firstExtent; i < endExtent; i++) {
+      addExtent(extents[i]);
+    }
+  }
+
+  void addExtent(Volume::Extent::Reader extent) {
+    uint64_t size = uint64_t(extent.getCount()) * Volume::BLOCK_SIZE;
+    if (extent.isData()) {
+      auto data = extent.getData();
+      KJ_REQUIRE(data.size() == size, "volume returned wrong-sized extent");
+      iov.add(data);
+    } else {
+      // Expand zeros locally.
+      while (size > 0) {
+        size_t n = kj::min(size, sizeof(ZEROS));
+        iov.add(kj::arrayPtr(ZEROS, n));
+        size -= n;
+      }
+    }
+  }
+
+  void finish(RequestHandle handle, uint startPad, uint endPad, int error = 0) {
+    // Trim the data to the byte range actually requested and fill in the reply header.
 
     if (startPad != 0) {
       auto piece = iov[1];
@@ -98,7 +198,7 @@ struct NbdVolumeAdapter::ReplyAndIovec {
     }
 
     reply.magic = htonl(NBD_REPLY_MAGIC);
-    reply.error = 0;
+    reply.error = htonl(error);
     memcpy(reply.handle, handle.handle, sizeof(handle.handle));
   }
 };
@@ -108,178 +208,508 @@ void NbdVolumeAdapter::updateVolume(Volume::Client newVolume) {
 }
 
 kj::Promise<void> NbdVolumeAdapter::run() {
-  return socket->read(&request, sizeof(request))
-      .then([this]() -> kj::Promise<void> {
-    KJ_ASSERT(ntohl(request.magic) == NBD_REQUEST_MAGIC);
-    switch (ntohl(request.type)) {
-      case NBD_CMD_READ: {
-        // Unfortunately, NBD sometimes receives read requests that are not block-aligned. For
-        // example, on mount, it receives a request for the first 1024 bytes of the volume.
-        uint64_t startByte = ntohll(request.from);
-        uint64_t endByte = startByte + ntohl(request.len);
-        uint32_t startBlock = startByte / Volume::BLOCK_SIZE;
-        uint32_t startPad = startByte % Volume::BLOCK_SIZE;
-        uint32_t endBlock = endByte / Volume::BLOCK_SIZE;
-        uint32_t endPad = endByte % Volume::BLOCK_SIZE;
-        if (endPad != 0) {
-          endPad = Volume::BLOCK_SIZE - endPad;
-          ++endBlock;
-        }
+  // Handle every complete request already in the buffer. The kernel typically has many requests
+  // queued on the socket, so a single read() usually brings in a whole batch of them.
+  while (readEnd - readPos >= sizeof(request)) {
+    memcpy(&request, readBuffer.begin() + readPos, sizeof(request));
+    readPos += sizeof(request);
+    ++stats.requests;
+    KJ_IF_MAYBE(promise, handleRequest()) {
+      return kj::mv(*promise);
+    }
+  }
 
-        uint32_t blockCount = endBlock - startBlock;
-
-        // Split into requests of no more than the maximum size.
-        uint reqCount = (blockCount + (MAX_RPC_BLOCKS - 1)) / MAX_RPC_BLOCKS;
-        auto promises =
-            kj::heapArrayBuilder<kj::Promise<capnp::Response<Volume::ReadResults>>>(reqCount);
-        for (uint i = 0; i < reqCount; i++) {
-          auto req = volume.readRequest();
-          uint o = i * MAX_RPC_BLOCKS;
-          req.setBlockNum(startBlock + o);
-          req.setCount(kj::min(blockCount - o, MAX_RPC_BLOCKS));
-          promises.add(req.send());
-        }
+  // Move the partial request (if any) to the front of the buffer and read as much as is
+  // available, waiting for at least the rest of one header.
+  size_t partial = readEnd - readPos;
+  memmove(readBuffer.begin(), readBuffer.begin() + readPos, partial);
+  readPos = 0;
+  readEnd = partial;
+  ++stats.socketReads;
+  return socket->tryRead(readBuffer.begin() + partial, sizeof(request) - partial,
+                         readBuffer.size() - partial)
+      .then([this](size_t n) -> kj::Promise<void> {
+    readEnd += n;
+    if (readEnd < sizeof(request)) {
+      return KJ_EXCEPTION(DISCONNECTED, "NBD socket closed without NBD_CMD_DISC");
+    }
+    return run();
+  });
+}
 
-        // Send all requests and handle responses.
-        RequestHandle reqHandle = request.handle;
-        tasks.add(kj::joinPromises(promises.finish())
-            .then([this,reqHandle,startPad,endPad](auto responses) -> void {
-          auto reply = kj::heap<ReplyAndIovec>(kj::mv(responses), reqHandle, startPad, endPad);
-          replyQueue = replyQueue.then([this,KJ_MVCAP(reply)]() mutable {
-            auto promise = socket->write(reply->iov);
-            return promise.attach(kj::mv(reply));
-          });
-        }, [this,reqHandle](kj::Exception&& e) {
-          replyError(reqHandle, kj::mv(e), "read");
-        }));
-        return run();
+kj::Maybe<kj::Promise<void>> NbdVolumeAdapter::handleRequest() {
+  // Handles the request in `request`. Returns null if run() should go on to the next request, or
+  // a promise to return from run() instead if the request needs to wait for something first.
+
+  KJ_ASSERT(ntohl(request.magic) == NBD_REQUEST_MAGIC);
+  switch (ntohl(request.type) & NBD_CMD_TYPE_MASK) {
+    case NBD_CMD_READ: {
+      // Unfortunately, NBD sometimes receives read requests that are not block-aligned. For
+      // example, on mount, it receives a request for the first 1024 bytes of the volume.
+      uint64_t startByte = ntohll(request.from);
+      uint64_t endByte = startByte + ntohl(request.len);
+      uint32_t startBlock = startByte / Volume::BLOCK_SIZE;
+      uint32_t startPad = startByte % Volume::BLOCK_SIZE;
+      uint32_t endBlock = endByte / Volume::BLOCK_SIZE;
+      uint32_t endPad = endByte % Volume::BLOCK_SIZE;
+      if (endPad != 0) {
+        endPad = Volume::BLOCK_SIZE - endPad;
+        ++endBlock;
       }
-      case NBD_CMD_WRITE: {
-        auto req = volume.writeRequest();
-        uint64_t offset = ntohll(request.from);
-        uint32_t size = ntohl(request.len);
-        KJ_ASSERT(offset % Volume::BLOCK_SIZE == 0);
-        req.setBlockNum(offset / Volume::BLOCK_SIZE);
-        KJ_ASSERT(size % Volume::BLOCK_SIZE == 0);
-        auto data = req.initData(size);
-
-        RequestHandle reqHandle = request.handle;
-        return socket->read(data.begin(), data.size())
+
+      uint32_t blockCount = endBlock - startBlock;
+
+      queueRead(PendingRead { request.handle, startBlock, blockCount, startPad, endPad });
+      return nullptr;
+    }
+    case NBD_CMD_WRITE: {
+      auto req = volume.writeRequest();
+      uint64_t offset = ntohll(request.from);
+      uint32_t size = ntohl(request.len);
+      KJ_ASSERT(offset % Volume::BLOCK_SIZE == 0);
+      req.setBlockNum(offset / Volume::BLOCK_SIZE);
+      KJ_ASSERT(size % Volume::BLOCK_SIZE == 0);
+      auto data = req.initData(size);
+      RequestHandle reqHandle = request.handle;
+
+      // Take as much of the payload as we have from the buffer.
+      size_t n = kj::min(data.size(), readEnd - readPos);
+      memcpy(data.begin(), readBuffer.begin() + readPos, n);
+      readPos += n;
+
+      if (n < data.size()) {
+        // Read the rest directly into the request.
+        ++stats.socketReads;
+        return socket->read(data.begin() + n, data.size() - n)
             .then([this,reqHandle,data,KJ_MVCAP(req)]() mutable {
-          if (access != NbdAccessType::READ_WRITE) {
-            // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
-            // read-only and set the block device read-only at the kernel level.
-            KJ_LOG(ERROR, "caught write() on read-only NBD device");
-            reply(reqHandle, EPERM);
-            return run();
-          }
-
-          // Check if the data is all-zero.
-          bool allZero = true;
-          for (const uint64_t* ptr = reinterpret_cast<uint64_t*>(data.begin()),
-               *end = reinterpret_cast<uint64_t*>(data.end());
-               ptr < end; ++ptr) {
-            if (*ptr != 0) {
-              allZero = false;
-              break;
-            }
-          }
-
-          if (allZero) {
-            // Oh, this write is just zeros. Convert it to a zero() call instead. This optimization
-            // alone drastically cuts the initial size of an ext4 filesystem and also works around
-            // many databases aggressively preallocating space.
-            //
-            // TODO(perf): What if a large write has many pages of zeros interleaved with non-zero
-            //   pages? Do we want to break it up into some writes and some zeros? This would
-            //   fragment the request and also possibly fragment the storage. To avoid fragmenting
-            //   the request, we might want to do this detection server-side, or attach a list of
-            //   hints on the client side. Fragmenting the disk might not be worth it, though.
-            //
-            // TODO(perf): Apparently the Linux kernel supports block drivers informing it that
-            //   TRIMed bytes will be read back as zeros, and ext4 takes advantage of this.
-            //   NBD doesn't appear to have a way to set this. Maybe we should tweak the driver?
-            auto req2 = volume.zeroRequest();
-            req2.setBlockNum(req.getBlockNum());
-            req2.setCount(data.size() / Volume::BLOCK_SIZE);
-            tasks.add(req2.send().then([this,reqHandle](auto resp) -> void {
-              reply(reqHandle);
-            }, [this,reqHandle](kj::Exception&& e) {
-              replyError(reqHandle, kj::mv(e), "zero");
-            }));
-          } else {
-            tasks.add(req.send().then([this,reqHandle](auto resp) -> void {
-              reply(reqHandle);
-            }, [this,reqHandle](kj::Exception&& e) {
-              replyError(reqHandle, kj::mv(e), "write");
-            }));
-          }
+          handleWrite(reqHandle, kj::mv(req), data);
           return run();
         });
       }
-      case NBD_CMD_DISC: {
-        // Disconnect requested. Stop reading, finish writes and shutdown write end.
-        return replyQueue.then([this]() {
-          socket->shutdownWrite();
-        });
+
+      handleWrite(reqHandle, kj::mv(req), data);
+      return nullptr;
+    }
+    case NBD_CMD_DISC: {
+      // Disconnect requested. Stop reading, finish writes and shutdown write end.
+      flushBatch();
+      return replyQueue.then([this]() {
+        socket->shutdownWrite();
+      });
+    }
+    case NBD_CMD_FLUSH: {
+      RequestHandle reqHandle = request.handle;
+      if (access != NbdAccessType::READ_WRITE) {
+        // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
+        // read-only and set the block device read-only at the kernel level.
+        KJ_LOG(ERROR, "caught flush() on read-only NBD device");
+        reply(reqHandle, EPERM);
+        return nullptr;
       }
-      case NBD_CMD_FLUSH: {
-        RequestHandle reqHandle = request.handle;
-        if (access != NbdAccessType::READ_WRITE) {
-          // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
-          // read-only and set the block device read-only at the kernel level.
-          KJ_LOG(ERROR, "caught flush() on read-only NBD device");
-          reply(reqHandle, EPERM);
-          return run();
-        }
 
-        tasks.add(volume.syncRequest().send().then([this,reqHandle](auto resp) -> void {
-          reply(reqHandle);
-        }, [this,reqHandle](kj::Exception&& e) {
-          replyError(reqHandle, kj::mv(e), "sync");
-        }));
-        return run();
+      flushBatch();
+
+      tasks.add(volume.syncRequest().send().then([this,reqHandle](auto resp) -> void {
+        reply(reqHandle);
+      }, [this,reqHandle](kj::Exception&& e) {
+        replyError(reqHandle, kj::mv(e), "sync");
+      }));
+      return nullptr;
+    }
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES: {
+      // Both map to zero(), which punches a hole. Since holes read back as zeros, that satisfies
+      // WRITE_ZEROES even when the kernel sets NBD_CMD_FLAG_NO_HOLE.
+      RequestHandle reqHandle = request.handle;
+      if (access != NbdAccessType::READ_WRITE) {
+        // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
+        // read-only and set the block device read-only at the kernel level.
+        KJ_LOG(ERROR, "caught trim() or write-zeroes on read-only NBD device");
+        reply(reqHandle, EPERM);
+        return nullptr;
       }
-      case NBD_CMD_TRIM: {
-        RequestHandle reqHandle = request.handle;
-        if (access != NbdAccessType::READ_WRITE) {
-          // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
-          // read-only and set the block device read-only at the kernel level.
-          KJ_LOG(ERROR, "caught trim() on read-only NBD device");
-          reply(reqHandle, EPERM);
-          return run();
-        }
 
-        auto req = volume.zeroRequest();
-        uint64_t offset = ntohll(request.from);
-        uint32_t size = ntohl(request.len);
-        KJ_ASSERT(offset % Volume::BLOCK_SIZE == 0);
-        req.setBlockNum(offset / Volume::BLOCK_SIZE);
-        KJ_ASSERT(size % Volume::BLOCK_SIZE == 0);
-        req.setCount(size / Volume::BLOCK_SIZE);
-
-        tasks.add(req.send().then([this,reqHandle](auto resp) -> void {
-          reply(reqHandle);
-        }, [this,reqHandle](kj::Exception&& e) {
-          replyError(reqHandle, kj::mv(e), "zero");
-        }));
-        return run();
+      flushBatch();
+
+      auto req = volume.zeroRequest();
+      uint64_t offset = ntohll(request.from);
+      uint32_t size = ntohl(request.len);
+      KJ_ASSERT(offset % Volume::BLOCK_SIZE == 0);
+      req.setBlockNum(offset / Volume::BLOCK_SIZE);
+      KJ_ASSERT(size % Volume::BLOCK_SIZE == 0);
+      req.setCount(size / Volume::BLOCK_SIZE);
+
+      tasks.add(req.send().then([this,reqHandle](auto resp) -> void {
+        reply(reqHandle);
+      }, [this,reqHandle](kj::Exception&& e) {
+        replyError(reqHandle, kj::mv(e), "zero");
+      }));
+      return nullptr;
+    }
+    default:
+      KJ_FAIL_ASSERT("unknown NBD command", request.type);
+  }
+}
+
+void NbdVolumeAdapter::handleWrite(RequestHandle reqHandle,
+    capnp::Request<Volume::WriteParams, Volume::WriteResults>&& req, capnp::Data::Builder data) {
+  if (access != NbdAccessType::READ_WRITE) {
+    // Whoops, read-only block device. This shouldn't happen since we mount the filesystem
+    // read-only and set the block device read-only at the kernel level.
+    KJ_LOG(ERROR, "caught write() on read-only NBD device");
+    reply(reqHandle, EPERM);
+    return;
+  }
+
+  if (isAllZero(data.begin(), data.size())) {
+    flushBatch();  // keep requests in order
+
+    // Oh, this write is just zeros. Convert it to a zero() call instead. This optimization
+    // alone drastically cuts the initial size of an ext4 filesystem and also works around
+    // many databases aggressively preallocating space. (Writes that are only partially
+    // zero are split into writes and hole punches server-side, so they don't consume
+    // space either; doing it here too just avoids sending the zeros over the network.)
+    //
+    // TODO(perf): Apparently the Linux kernel supports block drivers informing it that
+    //   TRIMed bytes will be read back as zeros, and ext4 takes advantage of this.
+    //   NBD doesn't appear to have a way to set this. Maybe we should tweak the driver?
+    auto req2 = volume.zeroRequest();
+    req2.setBlockNum(req.getBlockNum());
+    req2.setCount(data.size() / Volume::BLOCK_SIZE);
+    tasks.add(req2.send().then([this,reqHandle](auto resp) -> void {
+      reply(reqHandle);
+    }, [this,reqHandle](kj::Exception&& e) {
+      replyError(reqHandle, kj::mv(e), "zero");
+    }));
+  } else {
+    queueWrite(PendingWrite { reqHandle, kj::mv(req) });
+  }
+}
+
+void NbdVolumeAdapter::queueRead(PendingRead&& read) {
+  if (!pendingWrites.empty() || pendingReads.size() >= MAX_BATCH_REQUESTS ||
+      pendingBlocks + read.blockCount > MAX_RPC_BLOCKS) {
+    flushBatch();
+  }
+
+  if (read.blockCount > MAX_RPC_BLOCKS) {
+    // Too big to batch; readBlocks() will split it up.
+    sendRead(read);
+    return;
+  }
+
+  pendingBlocks += read.blockCount;
+  pendingReads.add(kj::mv(read));
+  scheduleFlush();
+}
+
+void NbdVolumeAdapter::queueWrite(PendingWrite&& write) {
+  uint32_t blockCount = write.request.getData().size() / Volume::BLOCK_SIZE;
+  if (!pendingReads.empty() || pendingWrites.size() >= MAX_BATCH_REQUESTS ||
+      pendingBlocks + blockCount > MAX_RPC_BLOCKS) {
+    flushBatch();
+  }
+
+  if (blockCount > MAX_RPC_BLOCKS) {
+    sendWrite(write);
+    return;
+  }
+
+  pendingBlocks += blockCount;
+  pendingWrites.add(kj::mv(write));
+  scheduleFlush();
+}
+
+void NbdVolumeAdapter::scheduleFlush() {
+  ++batchGeneration;
+  if (!flushScheduled) {
+    flushScheduled = true;
+    tasks.add(waitToFlush(batchGeneration));
+  }
+}
+
+kj::Promise<void> NbdVolumeAdapter::waitToFlush(uint generation) {
+  // When the kernel has several requests queued on the socket, run() receives them all without
+  // yielding to the event loop, so by the time an evalLater() callback runs, it has drained
+  // everything available. Hence, the batch is complete once a turn passes with no new requests.
+  return kj::evalLater([this,generation]() -> kj::Promise<void> {
+    if (generation != batchGeneration) {
+      return waitToFlush(batchGeneration);
+    }
+
+    flushScheduled = false;
+    flushBatch();
+    return kj::READY_NOW;
+  });
+}
+
+void NbdVolumeAdapter::flushBatch() {
+  if (!pendingReads.empty()) {
+    flushReads();
+  }
+  if (!pendingWrites.empty()) {
+    flushWrites();
+  }
+  pendingBlocks = 0;
+}
+
+void NbdVolumeAdapter::flushReads() {
+  auto reads = pendingReads.releaseAsArray();
+
+  if (reads.size() == 1 || !useVectoredIo) {
+    for (auto& read: reads) {
+      sendRead(read);
+    }
+    return;
+  }
+
+  auto req = volume.readvRequest();
+  auto ranges = req.initRanges(reads.size());
+  for (auto i: kj::indices(reads)) {
+    ranges[i].setBlockNum(reads[i].startBlock);
+    ranges[i].setCount(reads[i].blockCount);
+  }
+
+  kj::ArrayPtr<const PendingRead> readsPtr = reads;
+  tasks.add(req.send().then([readsPtr](capnp::Response<Volume::ReadvResults>&& response) {
+    // Split the extents back up among the requests. No extent spans two ranges.
+    auto shared = kj::refcounted<SharedReadvResponse>(kj::mv(response));
+    auto extents = shared->response.getExtents();
+    auto replies = kj::heapArrayBuilder<kj::Own<ReplyAndIovec>>(readsPtr.size());
+    uint e = 0;
+    for (auto& read: readsPtr) {
+      uint first = e;
+      uint64_t covered = 0;
+      while (covered < read.blockCount) {
+        KJ_REQUIRE(e < extents.size(), "readv() returned too few extents");
+        covered += extents[e++].getCount();
+      }
+      KJ_REQUIRE(covered == read.blockCount, "readv() returned extent spanning ranges");
+      replies.add(kj::heap<ReplyAndIovec>(kj::addRef(*shared), first, e));
+    }
+    return replies.finish();
+  }).then([this,readsPtr](kj::Array<kj::Own<ReplyAndIovec>> replies) {
+    for (auto i: kj::indices(readsPtr)) {
+      replyData(readsPtr[i], kj::mv(replies[i]));
+    }
+  }, [this,readsPtr](kj::Exception&& e) {
+    if (e.getType() == kj::Exception::Type::UNIMPLEMENTED) {
+      // Volume implementation predates readv(). Send the reads individually from now on.
+      useVectoredIo = false;
+      for (auto& read: readsPtr) {
+        sendRead(read);
+      }
+    } else {
+      for (auto& read: readsPtr) {
+        replyError(read.handle, kj::cp(e), "readv");
       }
-      default:
-        KJ_FAIL_ASSERT("unknown NBD command", request.type);
     }
+  }).attach(kj::mv(reads)));
+}
+
+void NbdVolumeAdapter::flushWrites() {
+  auto writes = pendingWrites.releaseAsArray();
+
+  if (writes.size() == 1) {
+    sendWrite(writes[0]);
+    return;
+  }
+
+  // Flatten the batch into blocks sorted by block number, keeping only the last write to each
+  // block, so that adjacent writes merge into one range and overwritten data isn't sent at all.
+  kj::Vector<StagedBlock> blocks(pendingBlocks);
+  for (auto& write: writes) {
+    auto data = write.request.getData();
+    uint32_t start = write.request.getBlockNum();
+    for (uint32_t i = 0; i < data.size() / Volume::BLOCK_SIZE; i++) {
+      blocks.add(StagedBlock { start + i, data.begin() + i * Volume::BLOCK_SIZE });
+    }
+  }
+  std::stable_sort(blocks.begin(), blocks.end(), [](const StagedBlock& a, const StagedBlock& b) {
+    return a.blockNum < b.blockNum;
   });
+  size_t n = 0;
+  for (auto& block: blocks) {
+    if (n > 0 && blocks[n - 1].blockNum == block.blockNum) {
+      blocks[n - 1] = block;  // stable sort, so this write came later
+    } else {
+      blocks[n++] = block;
+    }
+  }
+  blocks.resize(n);
+  auto staged = blocks.releaseAsArray();
+
+  // Every request in the batch gets the same outcome: the kernel only learns a write succeeded
+  // once everything it might have been merged with has been written too.
+  kj::ArrayPtr<PendingWrite> writesPtr = writes;
+  tasks.add(sendStaged(staged).then([this,writesPtr]() {
+    for (auto& write: writesPtr) {
+      reply(write.handle);
+    }
+  }, [this,writesPtr](kj::Exception&& e) {
+    for (auto& write: writesPtr) {
+      replyError(write.handle, kj::cp(e), "write");
+    }
+  }).attach(kj::mv(staged), kj::mv(writes)));
+}
+
+kj::Promise<void> NbdVolumeAdapter::sendStaged(kj::ArrayPtr<const StagedBlock> blocks) {
+  // Send the coalesced blocks as one writev() if they form several runs, or one write() per run
+  // if they form a single run or the volume predates writev().
+
+  uint runCount = 0;
+  for (auto i: kj::indices(blocks)) {
+    if (i == 0 || blocks[i].blockNum != blocks[i - 1].blockNum + 1) ++runCount;
+  }
+
+  if (runCount > 1 && useVectoredIo) {
+    auto req = volume.writevRequest(capnp::MessageSize {
+        16 + runCount + blocks.size() * Volume::BLOCK_SIZE / sizeof(capnp::word), 0 });
+    auto ranges = req.initRanges(runCount);
+    auto data = req.initData(blocks.size() * Volume::BLOCK_SIZE);
+    uint r = 0;
+    for (auto i: kj::indices(blocks)) {
+      if (i == 0 || blocks[i].blockNum != blocks[i - 1].blockNum + 1) {
+        ranges[r++].setBlockNum(blocks[i].blockNum);
+      }
+      ranges[r - 1].setCount(ranges[r - 1].getCount() + 1);
+      memcpy(data.begin() + i * Volume::BLOCK_SIZE, blocks[i].data, Volume::BLOCK_SIZE);
+    }
+
+    return req.send().then([](auto&&) {}, [this,blocks](kj::Exception&& e) -> kj::Promise<void> {
+      if (e.getType() == kj::Exception::Type::UNIMPLEMENTED && useVectoredIo) {
+        // Volume implementation predates writev(). Send one write() per run from now on.
+        useVectoredIo = false;
+        return sendStaged(blocks);
+      } else {
+        return kj::mv(e);
+      }
+    });
+  }
+
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(runCount);
+  size_t i = 0;
+  while (i < blocks.size()) {
+    size_t j = i + 1;
+    while (j < blocks.size() && blocks[j].blockNum == blocks[j - 1].blockNum + 1) ++j;
+
+    auto req = volume.writeRequest(capnp::MessageSize {
+        16 + (j - i) * Volume::BLOCK_SIZE / sizeof(capnp::word), 0 });
+    req.setBlockNum(blocks[i].blockNum);
+    auto data = req.initData((j - i) * Volume::BLOCK_SIZE);
+    for (size_t k = i; k < j; k++) {
+      memcpy(data.begin() + (k - i) * Volume::BLOCK_SIZE, blocks[k].data, Volume::BLOCK_SIZE);
+    }
+    promises.add(req.send().then([](auto&&) {}));
+    i = j;
+  }
+  return kj::joinPromises(promises.finish());
+}
+
+void NbdVolumeAdapter::sendRead(const PendingRead& read) {
+  PendingRead readCopy = read;
+  tasks.add(readBlocks(read.startBlock, read.blockCount)
+      .then([this,readCopy](kj::Own<ReplyAndIovec> reply) -> void {
+    replyData(readCopy, kj::mv(reply));
+  }, [this,readCopy](kj::Exception&& e) {
+    replyError(readCopy.handle, kj::mv(e), "read");
+  }));
+}
+
+void NbdVolumeAdapter::sendWrite(PendingWrite& write) {
+  RequestHandle reqHandle = write.handle;
+  tasks.add(write.request.send().then([this,reqHandle](auto resp) -> void {
+    reply(reqHandle);
+  }, [this,reqHandle](kj::Exception&& e) {
+    replyError(reqHandle, kj::mv(e), "write");
+  }));
+}
+
+void NbdVolumeAdapter::replyData(const PendingRead& read, kj::Own<ReplyAndIovec> reply) {
+  reply->finish(read.handle, read.startPad, read.endPad);
+  queueReply(kj::mv(reply));
+}
+
+void NbdVolumeAdapter::queueReply(kj::Own<ReplyAndIovec> reply) {
+  pendingReplies.add(kj::mv(reply));
+  if (!replyWriteScheduled) {
+    replyWriteScheduled = true;
+    replyQueue = replyQueue.then([this]() { return writeReplies(); });
+  }
+}
+
+kj::Promise<void> NbdVolumeAdapter::writeReplies() {
+  // Send every reply queued since the last write went out in a single writev().
+  replyWriteScheduled = false;
+  auto replies = pendingReplies.releaseAsArray();
+
+  size_t pieceCount = 0;
+  for (auto& reply: replies) {
+    pieceCount += reply->iov.size();
+  }
+  auto pieces = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(pieceCount);
+  for (auto& reply: replies) {
+    pieces.addAll(reply->iov);
+  }
+  auto piecesArray = pieces.finish();
+
+  ++stats.socketWrites;
+  auto promise = socket->write(piecesArray);
+  return promise.attach(kj::mv(piecesArray), kj::mv(replies));
+}
+
+kj::Promise<kj::Own<NbdVolumeAdapter::ReplyAndIovec>> NbdVolumeAdapter::readBlocks(
+    uint32_t startBlock, uint32_t blockCount) {
+  // Split into requests of no more than the maximum size.
+  uint reqCount = (blockCount + (MAX_RPC_BLOCKS - 1)) / MAX_RPC_BLOCKS;
+
+  if (useReadExtents) {
+    // Prefer readExtents() so that holes aren't shipped over the network as zeros.
+    auto promises = kj::heapArrayBuilder<
+        kj::Promise<capnp::Response<Volume::ReadExtentsResults>>>(reqCount);
+    for (uint i = 0; i < reqCount; i++) {
+      auto req = volume.readExtentsRequest();
+      uint o = i * MAX_RPC_BLOCKS;
+      req.setBlockNum(startBlock + o);
+      req.setCount(kj::min(blockCount - o, MAX_RPC_BLOCKS));
+      promises.add(req.send());
+    }
+
+    return kj::joinPromises(promises.finish())
+        .then([](auto responses) -> kj::Promise<kj::Own<ReplyAndIovec>> {
+      return kj::heap<ReplyAndIovec>(kj::mv(responses));
+    }, [this,startBlock,blockCount](kj::Exception&& e)
+        -> kj::Promise<kj::Own<ReplyAndIovec>> {
+      if (e.getType() == kj::Exception::Type::UNIMPLEMENTED && useReadExtents) {
+        // Volume implementation predates readExtents(). Fall back to read() from now on.
+        useReadExtents = false;
+        return readBlocks(startBlock, blockCount);
+      } else {
+        return kj::mv(e);
+      }
+    });
+  } else {
+    auto promises =
+        kj::heapArrayBuilder<kj::Promise<capnp::Response<Volume::ReadResults>>>(reqCount);
+    for (uint i = 0; i < reqCount; i++) {
+      auto req = volume.readRequest();
+      uint o = i * MAX_RPC_BLOCKS;
+      req.setBlockNum(startBlock + o);
+      req.setCount(kj::min(blockCount - o, MAX_RPC_BLOCKS));
+      promises.add(req.send());
+    }
+
+    return kj::joinPromises(promises.finish())
+        .then([](auto responses) {
+      return kj::heap<ReplyAndIovec>(kj::mv(responses));
+    });
+  }
 }
 
 void NbdVolumeAdapter::reply(RequestHandle reqHandle, int error) {
-  auto reply = kj::heap<struct nbd_reply>();
-  reply->magic = htonl(NBD_REPLY_MAGIC);
-  reply->error = htonl(error);
-  memcpy(reply->handle, reqHandle.handle, sizeof(reqHandle.handle));
-  replyQueue = replyQueue.then([this,KJ_MVCAP(reply)]() mutable {
-    auto promise = socket->write(reply.get(), sizeof(*reply));
-    return promise.attach(kj::mv(reply));
-  });
+  auto reply = kj::heap<ReplyAndIovec>();
+  reply->finish(reqHandle, 0, 0, error);
+  queueReply(kj::mv(reply));
 }
 
 void NbdVolumeAdapter::replyError(
@@ -306,6 +736,109 @@ void NbdVolumeAdapter::taskFailed(kj::Exception&& exception) {
 
 // =======================================================================================
 
+namespace {
+
+static constexpr byte STATUS_DISCONNECTED = 'd';
+static constexpr byte STATUS_FAILED = 'f';
+// Sent from an NbdVolumeAdapterThread's thread to the thread which owns it.
+
+struct FdPair {
+  kj::AutoCloseFd ends[2];
+
+  FdPair() {
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    ends[0] = kj::AutoCloseFd(fds[0]);
+    ends[1] = kj::AutoCloseFd(fds[1]);
+  }
+};
+
+}  // namespace
+
+NbdVolumeAdapterThread::NbdVolumeAdapterThread(
+    kj::LowLevelAsyncIoProvider& ioProvider, kj::AutoCloseFd socket, Volume::Client volume,
+    NbdAccessType access)
+    : disconnectedPaf(kj::newPromiseAndFulfiller<void>()) {
+  FdPair rpcPair;
+  FdPair statusPair;
+
+  thread = kj::heap<kj::Thread>(
+      [socket = kj::mv(socket),rpcFd = kj::mv(rpcPair.ends[1]),
+       statusFd = kj::mv(statusPair.ends[1]),access]() mutable {
+    threadMain(kj::mv(socket), kj::mv(rpcFd), kj::mv(statusFd), access);
+  });
+
+  rpcSocket = ioProvider.wrapSocketFd(rpcPair.ends[0].release(),
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+  rpc = kj::heap<capnp::TwoPartyClient>(*rpcSocket, kj::mv(volume),
+                                        capnp::rpc::twoparty::Side::SERVER);
+  statusSocket = ioProvider.wrapSocketFd(statusPair.ends[0].release(),
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+  finished = readStatus().eagerlyEvaluate(nullptr);
+}
+
+NbdVolumeAdapterThread::~NbdVolumeAdapterThread() noexcept(false) {}
+
+kj::Promise<void> NbdVolumeAdapterThread::run() {
+  return kj::mv(finished);
+}
+
+kj::Promise<void> NbdVolumeAdapterThread::readStatus() {
+  return statusSocket->tryRead(&status, 1, 1).then([this](size_t n) -> kj::Promise<void> {
+    if (n == 0) {
+      // The thread is done.
+      KJ_REQUIRE(!failed, "NbdVolumeAdapter failed on its thread; see the log for why");
+      return kj::READY_NOW;
+    }
+
+    if (status == STATUS_DISCONNECTED) {
+      disconnectedPaf.fulfiller->fulfill();
+    } else if (status == STATUS_FAILED) {
+      failed = true;
+    }
+    return readStatus();
+  });
+}
+
+void NbdVolumeAdapterThread::threadMain(kj::AutoCloseFd socket, kj::AutoCloseFd rpcFd,
+                                        kj::AutoCloseFd statusFd, NbdAccessType access) {
+  auto report = [&](byte message) {
+    // Best-effort: if the owner has already gone away, there's no one left to tell.
+    ssize_t n;
+    do {
+      n = send(statusFd, &message, 1, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+  };
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    auto io = kj::setupAsyncIo();
+    auto rpcStream = io.lowLevelProvider->wrapSocketFd(rpcFd.release(),
+        kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+        kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC);
+    capnp::TwoPartyClient rpc(*rpcStream);
+
+    NbdVolumeAdapter adapter(
+        io.lowLevelProvider->wrapSocketFd(socket.release(),
+            kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+            kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC),
+        rpc.bootstrap().castAs<Volume>(), access);
+    auto disconnected = adapter.onDisconnected().then([&]() {
+      report(STATUS_DISCONNECTED);
+    }).eagerlyEvaluate(nullptr);
+
+    adapter.run().wait(io.waitScope);
+  })) {
+    KJ_LOG(ERROR, "NbdVolumeAdapter failed", *exception);
+    report(STATUS_FAILED);
+  }
+
+  // Closing `statusFd` on the way out tells the owner we're done.
+}
+
+// =======================================================================================
+
 NbdDevice::NbdDevice() {
   // We try to claim a random NBD device. If it's already locked, we try another one, with a random
   // probing interval. The number of devices is prime so we will eventually probe all slots
@@ -373,6 +906,15 @@ static void pwriteAll(int fd, const void* data, size_t size, off_t offset) {
 }
 
 void NbdDevice::format() {
+  // Volumes created with StorageFactory.newFormattedVolume() already contain the image. Check the
+  // ext4 superblock magic so that we don't rewrite it.
+  uint16_t magic;
+  ssize_t n;
+  KJ_SYSCALL(n = pread(fd, &magic, sizeof(magic), 1024 + 0x38));
+  if (n == sizeof(magic) && magic == 0xEF53) {
+    return;
+  }
+
   SparseData::Reader sparse = BLANK_EXT4;
 
   for (auto chunk: sparse.getChunks()) {
@@ -587,9 +1129,23 @@ void NbdDevice::loadKernelModule() {
 
 // =======================================================================================
 
+namespace {
+
+kj::Array<kj::AutoCloseFd> arrayOfOne(kj::AutoCloseFd fd) {
+  auto builder = kj::heapArrayBuilder<kj::AutoCloseFd>(1);
+  builder.add(kj::mv(fd));
+  return builder.finish();
+}
+
+}  // namespace
+
 NbdBinding::NbdBinding(NbdDevice& device, kj::AutoCloseFd socket, NbdAccessType access)
-    : device(setup(device, kj::mv(socket), access)),
-      doItThread([&device,KJ_MVCAP(socket)]() mutable {
+    : NbdBinding(device, arrayOfOne(kj::mv(socket)), access) {}
+
+NbdBinding::NbdBinding(NbdDevice& device, kj::Array<kj::AutoCloseFd> sockets,
+                       NbdAccessType access)
+    : device(setup(device, kj::mv(sockets), access)),
+      doItThread([&device]() mutable {
         // The NBD driver sometimes does weird things when signals are received. Block common
         // signals that might be directed at the process but certainly shouldn't be handled by
         // this thread.
@@ -629,15 +1185,32 @@ retry:
   }
 }
 
-NbdDevice& NbdBinding::setup(NbdDevice& device, kj::AutoCloseFd socket, NbdAccessType access) {
+NbdDevice& NbdBinding::setup(NbdDevice& device, kj::Array<kj::AutoCloseFd> sockets,
+                             NbdAccessType access) {
+  KJ_REQUIRE(sockets.size() > 0);
+
+  // Only advertise the commands NbdVolumeAdapter will actually perform: a read-only adapter
+  // refuses flush, trim, and write-zeroes. Every adapter's replies are sent only once the volume
+  // has completed the operation, and a flush syncs the whole volume, so a flush on any one
+  // connection covers writes completed on all of them, which is what CAN_MULTI_CONN promises.
+  int flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+  if (access == NbdAccessType::READ_ONLY) {
+    flags |= NBD_FLAG_READ_ONLY;
+  } else {
+    flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES;
+  }
+
   int nbdFd = device.getFd();
   int readOnly = access == NbdAccessType::READ_ONLY;
   KJ_SYSCALL(ioctl(nbdFd, NBD_CLEAR_SOCK));
   KJ_SYSCALL(ioctl(nbdFd, NBD_SET_BLKSIZE, Volume::BLOCK_SIZE));
   KJ_SYSCALL(ioctl(nbdFd, NBD_SET_SIZE, VOLUME_SIZE));
-  KJ_SYSCALL(ioctl(nbdFd, NBD_SET_FLAGS, NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM));
+  KJ_SYSCALL(ioctl(nbdFd, NBD_SET_FLAGS, flags));
   KJ_SYSCALL(ioctl(nbdFd, BLKROSET, &readOnly));
-  KJ_SYSCALL(ioctl(nbdFd, NBD_SET_SOCK, socket.get()));
+  for (auto& socket: sockets) {
+    // Each NBD_SET_SOCK adds a connection; the kernel spreads requests across them.
+    KJ_SYSCALL(ioctl(nbdFd, NBD_SET_SOCK, socket.get()));
+  }
   return device;
 }
 
@@ -20,7 +20,9 @@
 #include "common.h"
 #include <kj/string.h>
 #include <kj/async-io.h>
+#include <kj/vector.h>
 #include <blackrock/storage.capnp.h>
+#include <capnp/rpc-twoparty.h>
 #include <linux/nbd.h>
 
 namespace blackrock {
@@ -37,6 +39,8 @@ public:
                    NbdAccessType access);
   // NBD requests are read from `socket` and implemented via `volume`.
 
+  ~NbdVolumeAdapter() noexcept(false);
+
   void updateVolume(Volume::Client newVolume);
   // Replaces the Volume capability with a new one, which must point to the exact same volume.
   // Useful for recovering after disconnects, if the driver hasn't noticed the disconnect yet.
@@ -50,6 +54,18 @@ public:
   // Resolves if the underlying volume becomes disconnected, in which case it's time to force-kill
   // everything using it. Can only be called once.
 
+  struct Stats {
+    uint64_t requests = 0;
+    // NBD requests received.
+
+    uint64_t socketReads = 0;
+    uint64_t socketWrites = 0;
+    // read() and write() calls made on the socket. Requests are parsed out of a buffer and replies
+    // are sent in batches, so at high queue depth these should be well below `requests`.
+  };
+
+  const Stats& getStats() { return stats; }
+
 private:
   kj::Own<kj::AsyncIoStream> socket;
   Volume::Client volume;
@@ -57,6 +73,12 @@ private:
   NbdAccessType access;
   bool disconnected = false;
   kj::TaskSet tasks;
+  Stats stats;
+
+  kj::Array<byte> readBuffer;
+  size_t readPos = 0;
+  size_t readEnd = 0;
+  // Data read from the socket but not yet parsed is in readBuffer[readPos, readEnd).
 
   kj::Promise<void> replyQueue = kj::READY_NOW;
   // Promise for completion of previous write() operation to handle.socket.
@@ -66,15 +88,115 @@ private:
   // TODO(someday): When overlapping write()s are supported by AsyncIoStream, simplify this.
 
   struct nbd_request request;
-  // We only read one of these at a time, so might as well allocate it here.
+  // The request currently being handled, copied out of `readBuffer`.
+
+  bool useReadExtents = true;
+  // Cleared if the volume turns out not to implement readExtents().
+
+  bool useVectoredIo = true;
+  // Cleared if the volume turns out not to implement readv() and writev().
 
   struct RequestHandle;
   struct ReplyAndIovec;
+  struct PendingRead;
+  struct PendingWrite;
+  struct StagedBlock;
+
+  kj::Vector<PendingRead> pendingReads;
+  kj::Vector<PendingWrite> pendingWrites;
+  uint pendingBlocks = 0;
+  // Requests which have been read from the socket but not yet sent to the volume. Consecutive
+  // reads (or writes) are gathered up and sent as a single readv() (or writev()) call once the
+  // kernel stops handing us new requests. At most one of the two vectors is non-empty at a time,
+  // so requests are still sent to the volume in the order they arrived.
+  //
+  // Batched writes are coalesced before sending: adjacent writes become one range, and blocks
+  // written more than once are sent only with their final content. Each request is replied to
+  // only once the whole batch has been written, so a flush (which always ends the batch first)
+  // still covers every write the kernel has seen acknowledged.
+
+  uint batchGeneration = 0;
+  bool flushScheduled = false;
+  // `batchGeneration` is incremented every time a request is added to the batch. A flush is
+  // scheduled when the batch starts and keeps deferring itself until a turn of the event loop
+  // passes without the generation changing.
+
+  kj::Vector<kj::Own<ReplyAndIovec>> pendingReplies;
+  bool replyWriteScheduled = false;
+  // Replies waiting to be written. They are all sent in one writev() once the previous write
+  // completes, so replies produced in the same turn, or while a write is in progress, share a
+  // syscall.
+
+  kj::Maybe<kj::Promise<void>> handleRequest();
+  void handleWrite(RequestHandle reqHandle,
+                   capnp::Request<Volume::WriteParams, Volume::WriteResults>&& req,
+                   capnp::Data::Builder data);
+  void queueRead(PendingRead&& read);
+  void queueWrite(PendingWrite&& write);
+  void scheduleFlush();
+  kj::Promise<void> waitToFlush(uint generation);
+  void flushBatch();
+  void flushReads();
+  void flushWrites();
+  void sendRead(const PendingRead& read);
+  void sendWrite(PendingWrite& write);
+  kj::Promise<void> sendStaged(kj::ArrayPtr<const StagedBlock> blocks);
+
+  kj::Promise<kj::Own<ReplyAndIovec>> readBlocks(uint32_t startBlock, uint32_t blockCount);
+  void replyData(const PendingRead& read, kj::Own<ReplyAndIovec> reply);
+  void queueReply(kj::Own<ReplyAndIovec> reply);
+  kj::Promise<void> writeReplies();
   void reply(RequestHandle reqHandle, int error = 0);
   void replyError(RequestHandle reqHandle, kj::Exception&& exception, const char* op);
   void taskFailed(kj::Exception&& exception) override;
 };
 
+class NbdVolumeAdapterThread {
+  // Runs an NbdVolumeAdapter on a thread of its own, with its own event loop, so that several NBD
+  // connections to one volume are served in parallel rather than taking turns on the caller's
+  // loop. The adapter reaches the volume through a Cap'n Proto connection back to the calling
+  // thread, which keeps serving `volume` on its loop.
+
+public:
+  NbdVolumeAdapterThread(kj::LowLevelAsyncIoProvider& ioProvider, kj::AutoCloseFd socket,
+                         Volume::Client volume, NbdAccessType access);
+  // NBD requests are read from `socket` -- which from now on belongs to the adapter's thread --
+  // and implemented via `volume`.
+
+  ~NbdVolumeAdapterThread() noexcept(false);
+  // Joins the thread. Wait for run() first: the thread doesn't exit until the device is shut
+  // down.
+
+  kj::Promise<void> run();
+  // Resolves when the adapter's loop has finished, as with NbdVolumeAdapter::run(). Can only be
+  // called once.
+
+  kj::Promise<void> onDisconnected() { return kj::mv(disconnectedPaf.promise); }
+  // As with NbdVolumeAdapter::onDisconnected(). Can only be called once.
+
+private:
+  kj::Own<kj::Thread> thread;
+  // Declared first so that it's joined last, once the connection serving the volume is gone.
+
+  kj::Own<kj::AsyncIoStream> rpcSocket;
+  kj::Own<capnp::TwoPartyClient> rpc;
+  // Serves `volume` to the thread.
+
+  kj::Own<kj::AsyncIoStream> statusSocket;
+  // The thread sends a byte here when the volume is disconnected or the adapter fails, and closes
+  // its end once the adapter's loop has finished.
+
+  byte status = 0;
+  bool failed = false;
+  kj::PromiseFulfillerPair<void> disconnectedPaf;
+  kj::Promise<void> finished = nullptr;
+
+  kj::Promise<void> readStatus();
+
+  static void threadMain(kj::AutoCloseFd socket, kj::AutoCloseFd rpcFd, kj::AutoCloseFd statusFd,
+                         NbdAccessType access);
+};
+
 class NbdDevice {
   // Represents a claim to a specific `/dev/nbdX` device node.
 
@@ -94,7 +216,8 @@ public:
   void format();
   // Format the device as an ext4 filesystem with an initial size of 8GB. This is accomplished by
   // simply writing a template image directly to the disk, so format() will result in exactly the
-  // same disk image every time.
+  // same disk image every time. Does nothing if the device already contains an ext4 filesystem,
+  // as volumes created with StorageFactory.newFormattedVolume() do.
 
   void trimJournalIfClean();
   // Verify that the journal is currently clean, and then TRIM it. Call immediately after a clean
@@ -146,6 +269,11 @@ public:
   // Binds the given NBD device to the given socket. (The other end of the socket pair should be
   // passed to `NbdVolumeAdapter`.)
 
+  NbdBinding(NbdDevice& device, kj::Array<kj::AutoCloseFd> sockets, NbdAccessType access);
+  // Binds the device to several sockets at once (NBD_FLAG_CAN_MULTI_CONN). The kernel spreads
+  // requests across them, so each should be served by its own `NbdVolumeAdapter`, all for the
+  // same volume.
+
   ~NbdBinding() noexcept(false);
   // Disconnects the binding.
 
@@ -155,7 +283,8 @@ private:
   // Executes the NBD_DO_IT ioctl(), which runs the NBD device loop in the kernel, not returning
   // until the device is disconnected.
 
-  static NbdDevice& setup(NbdDevice& device, kj::AutoCloseFd socket, NbdAccessType access);
+  static NbdDevice& setup(NbdDevice& device, kj::Array<kj::AutoCloseFd> sockets,
+                          NbdAccessType access);
 };
 
 class Mount {
@@ -0,0 +1,275 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "package-cache.h"
+#include <kj/test.h>
+#include <kj/async-io.h>
+
+namespace blackrock {
+namespace {
+
+bool isZeroBlock(uint32_t block) {
+  return block % 7 == 3;
+}
+
+byte blockByte(uint32_t block) {
+  // Every block is filled with one byte, which differs between neighboring blocks.
+  return isZeroBlock(block) ? 0 : block % 251 + 1;
+}
+
+class StubVolume final: public Volume::Server {
+  // Read-only volume whose content is a function of the block number. Records every read, and
+  // can hold readv() calls until told to release them.
+
+public:
+  struct Call {
+    bool isReadahead;
+    kj::Array<BlockRange> ranges;
+  };
+  kj::Vector<Call> calls;
+
+  bool holdReads = false;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> heldReads;
+
+  uint32_t blocksRead(bool readahead) {
+    uint32_t result = 0;
+    for (auto& call: calls) {
+      if (call.isReadahead != readahead) continue;
+      for (auto& range: call.ranges) result += range.count;
+    }
+    return result;
+  }
+
+protected:
+  kj::Promise<void> readExtents(ReadExtentsContext context) override {
+    auto params = context.getParams();
+    auto ranges = kj::heapArray<BlockRange>({ { params.getBlockNum(), params.getCount() } });
+    context.releaseParams();
+    reply(ranges, [&](uint size, capnp::MessageSize sizeHint) {
+      return context.getResults(sizeHint).initExtents(size);
+    });
+    calls.add(Call { true, kj::mv(ranges) });
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readv(ReadvContext context) override {
+    auto rangeList = context.getParams().getRanges();
+    auto builder = kj::heapArrayBuilder<BlockRange>(rangeList.size());
+    for (auto range: rangeList) {
+      builder.add(BlockRange { range.getBlockNum(), range.getCount() });
+    }
+    auto ranges = builder.finish();
+    context.releaseParams();
+
+    auto promise = kj::Promise<void>(kj::READY_NOW);
+    if (holdReads) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      heldReads.add(kj::mv(paf.fulfiller));
+      promise = kj::mv(paf.promise);
+    }
+
+    return promise.then([this,context,KJ_MVCAP(ranges)]() mutable {
+      reply(ranges, [&](uint size, capnp::MessageSize sizeHint) {
+        return context.getResults(sizeHint).initExtents(size);
+      });
+      calls.add(Call { false, kj::mv(ranges) });
+    });
+  }
+
+private:
+  template <typename InitFunc>
+  void reply(kj::ArrayPtr<const BlockRange> ranges, InitFunc&& initExtents) {
+    kj::Vector<kj::Array<byte>> content;
+    kj::Vector<const byte*> blocks;
+    for (auto& range: ranges) {
+      for (uint32_t i = 0; i < range.count; i++) {
+        uint32_t block = range.start + i;
+        if (isZeroBlock(block)) {
+          blocks.add(nullptr);
+        } else {
+          auto data = kj::heapArray<byte>(Volume::BLOCK_SIZE);
+          memset(data.begin(), blockByte(block), data.size());
+          blocks.add(data.begin());
+          content.add(kj::mv(data));
+        }
+      }
+    }
+    encodeExtents(ranges, blocks.asPtr(), kj::fwd<InitFunc>(initExtents));
+  }
+};
+
+struct PackageCacheTestFixture {
+  explicit PackageCacheTestFixture(size_t budgetBytes = 64 << 20)
+      : io(kj::setupAsyncIo()),
+        cache(kj::refcounted<PackageBlockCache>(budgetBytes)) {}
+
+  kj::AsyncIoContext io;
+  kj::Own<PackageBlockCache> cache;
+
+  Volume::Client wrap(kj::StringPtr packageId, StubVolume*& stub) {
+    auto server = kj::heap<StubVolume>();
+    stub = server.get();
+    return cache->wrap(packageId.asBytes(), kj::mv(server));
+  }
+
+  capnp::RemotePromise<Volume::ReadResults> startRead(
+      Volume::Client& volume, uint32_t blockNum, uint32_t count) {
+    auto req = volume.readRequest();
+    req.setBlockNum(blockNum);
+    req.setCount(count);
+    return req.send();
+  }
+
+  void expectContent(capnp::Data::Reader data, uint32_t blockNum, uint32_t count) {
+    KJ_ASSERT(data.size() == count * Volume::BLOCK_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+      byte expected = blockByte(blockNum + i);
+      for (uint j = 0; j < Volume::BLOCK_SIZE; j++) {
+        if (data[i * Volume::BLOCK_SIZE + j] != expected) {
+          KJ_FAIL_EXPECT("wrong content", blockNum + i, j, data[i * Volume::BLOCK_SIZE + j]);
+          return;
+        }
+      }
+    }
+  }
+
+  void read(Volume::Client& volume, uint32_t blockNum, uint32_t count) {
+    auto response = startRead(volume, blockNum, count).wait(io.waitScope);
+    expectContent(response.getData(), blockNum, count);
+  }
+
+  void settle() {
+    // Let any readahead complete.
+    io.provider->getTimer().afterDelay(1 * kj::MILLISECONDS).wait(io.waitScope);
+  }
+};
+
+KJ_TEST("package cache: hits and misses") {
+  PackageCacheTestFixture env;
+  StubVolume* stub;
+  auto volume = env.wrap("pkg", stub);
+
+  // Reads which don't follow on from each other, so there's no readahead. Block 10 is all-zero.
+  env.read(volume, 100, 4);
+  KJ_EXPECT(env.cache->getStats().misses == 4);
+  KJ_EXPECT(env.cache->getStats().hits == 0);
+  KJ_EXPECT(stub->calls.size() == 1);
+
+  env.read(volume, 10, 1);
+  env.read(volume, 101, 2);
+  KJ_EXPECT(env.cache->getStats().misses == 5);
+  KJ_EXPECT(env.cache->getStats().hits == 2);
+  KJ_EXPECT(stub->calls.size() == 2);
+
+  // A read that's partly cached only fetches the rest.
+  env.read(volume, 98, 8);
+  KJ_EXPECT(env.cache->getStats().misses == 9);
+  KJ_EXPECT(env.cache->getStats().hits == 6);
+  KJ_ASSERT(stub->calls.size() == 3);
+  KJ_ASSERT(stub->calls[2].ranges.size() == 2);
+  KJ_EXPECT(stub->calls[2].ranges[0].start == 98);
+  KJ_EXPECT(stub->calls[2].ranges[0].count == 2);
+  KJ_EXPECT(stub->calls[2].ranges[1].start == 104);
+  KJ_EXPECT(stub->calls[2].ranges[1].count == 2);
+
+  KJ_EXPECT(env.cache->getStats().blocks == 9);
+  KJ_EXPECT(env.cache->getStats().readaheadBlocks == 0);
+
+  // Another mount of the same package shares the cache; a different package doesn't.
+  StubVolume* stub2;
+  auto volume2 = env.wrap("pkg", stub2);
+  env.read(volume2, 100, 4);
+  KJ_EXPECT(stub2->calls.size() == 0);
+
+  StubVolume* stub3;
+  auto volume3 = env.wrap("other", stub3);
+  env.read(volume3, 100, 4);
+  KJ_EXPECT(stub3->calls.size() == 1);
+}
+
+KJ_TEST("package cache: readahead window grows") {
+  PackageCacheTestFixture env;
+  StubVolume* stub;
+  auto volume = env.wrap("pkg", stub);
+
+  // Read sequentially, 16 blocks at a time.
+  uint32_t lastReadahead = 0;
+  uint32_t largest = 0;
+  for (uint32_t block = 1000; block < 1000 + 16 * 64; block += 16) {
+    env.read(volume, block, 16);
+    env.settle();
+
+    uint32_t total = stub->blocksRead(true);
+    if (total > lastReadahead) {
+      largest = kj::max(largest, total - lastReadahead);
+      lastReadahead = total;
+    }
+  }
+
+  // The first read isn't known to be sequential, and the second is the one that starts readahead,
+  // so both miss; every read after that hits. The window starts at 64 blocks and grows towards the
+  // maximum of 1024, so later top-ups are bigger.
+  KJ_EXPECT(stub->blocksRead(false) == 32, stub->blocksRead(false));
+  KJ_EXPECT(env.cache->getStats().misses == 32);
+  KJ_EXPECT(env.cache->getStats().hits == 16 * 62);
+  KJ_EXPECT(env.cache->getStats().readaheadBlocks == stub->blocksRead(true));
+  KJ_EXPECT(largest > 64, largest);
+  KJ_EXPECT(largest <= 1024, largest);
+
+  // A non-sequential read resets the window: no readahead follows it.
+  uint32_t before = stub->blocksRead(true);
+  env.read(volume, 50000, 16);
+  env.settle();
+  KJ_EXPECT(stub->blocksRead(true) == before);
+}
+
+KJ_TEST("package cache: blocks evicted while waiting are fetched again") {
+  // Room for three blocks of data.
+  PackageCacheTestFixture env(3 * (Volume::BLOCK_SIZE + 64) + 100);
+  StubVolume* stub;
+  auto volume = env.wrap("pkg", stub);
+  StubVolume* otherStub;
+  auto otherVolume = env.wrap("other", otherStub);
+
+  env.read(volume, 20, 1);
+  KJ_EXPECT(env.cache->getStats().blocks == 1);
+
+  // Block 20 is cached, so this only fetches block 21 -- and we hold that fetch.
+  stub->holdReads = true;
+  auto pending = env.startRead(volume, 20, 2);
+  env.settle();
+  KJ_ASSERT(stub->heldReads.size() == 1);
+
+  // Meanwhile, another package fills the cache, evicting block 20.
+  env.read(otherVolume, 500, 4);
+  KJ_EXPECT(env.cache->getStats().evictions == 1);
+
+  // Now the first read finds that block 20 is gone, and has to go back for it.
+  stub->holdReads = false;
+  stub->heldReads[0]->fulfill();
+  auto response = pending.wait(env.io.waitScope);
+  env.expectContent(response.getData(), 20, 2);
+
+  KJ_ASSERT(stub->calls.size() == 3);
+  KJ_ASSERT(stub->calls[1].ranges.size() == 1);
+  KJ_EXPECT(stub->calls[1].ranges[0].start == 21);
+  KJ_ASSERT(stub->calls[2].ranges.size() == 1);
+  KJ_EXPECT(stub->calls[2].ranges[0].start == 20);
+  KJ_EXPECT(stub->calls[2].ranges[0].count == 1);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -0,0 +1,326 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "package-cache.h"
+#include <kj/function.h>
+
+namespace blackrock {
+
+static constexpr uint32_t MIN_READAHEAD_BLOCKS = 64;
+static constexpr uint32_t MAX_READAHEAD_BLOCKS = 1024;
+// The readahead window for a package volume starts at 256k once reads look sequential and doubles
+// with each further sequential read, up to 4MB.
+
+class PackageBlockCache::CachingVolume: public Volume::Server {
+  // Reads a package volume through the cache. Writes are not supported.
+
+public:
+  CachingVolume(PackageBlockCache& cache, uint32_t packageNumber, Volume::Client inner)
+      : cache(kj::addRef(cache)), packageNumber(packageNumber), inner(kj::mv(inner)) {}
+
+protected:
+  kj::Promise<void> read(ReadContext context) override {
+    auto params = context.getParams();
+    auto ranges = kj::heapArray<BlockRange>({ { params.getBlockNum(), params.getCount() } });
+    context.releaseParams();
+
+    return getBlocks(kj::mv(ranges),
+        [context](kj::ArrayPtr<const BlockRange>, kj::ArrayPtr<const byte* const> blocks) mutable {
+      // Data segments are zero-initialized, so only the non-zero blocks need copying.
+      auto data = context.getResults(capnp::MessageSize {
+          16 + blocks.size() * Volume::BLOCK_SIZE / sizeof(capnp::word), 0 })
+          .initData(blocks.size() * Volume::BLOCK_SIZE);
+      for (auto i: kj::indices(blocks)) {
+        if (blocks[i] != nullptr) {
+          memcpy(data.begin() + i * Volume::BLOCK_SIZE, blocks[i], Volume::BLOCK_SIZE);
+        }
+      }
+    });
+  }
+
+  kj::Promise<void> readExtents(ReadExtentsContext context) override {
+    auto params = context.getParams();
+    auto ranges = kj::heapArray<BlockRange>({ { params.getBlockNum(), params.getCount() } });
+    context.releaseParams();
+
+    return getBlocks(kj::mv(ranges),
+        [context](kj::ArrayPtr<const BlockRange> ranges,
+                  kj::ArrayPtr<const byte* const> blocks) mutable {
+      encodeExtents(ranges, blocks, [&](uint size, capnp::MessageSize sizeHint) {
+        return context.getResults(sizeHint).initExtents(size);
+      });
+    });
+  }
+
+  kj::Promise<void> readv(ReadvContext context) override {
+    auto params = context.getParams();
+    auto rangeList = params.getRanges();
+    auto ranges = kj::heapArrayBuilder<BlockRange>(rangeList.size());
+    for (auto range: rangeList) {
+      ranges.add(BlockRange { range.getBlockNum(), range.getCount() });
+    }
+    context.releaseParams();
+
+    return getBlocks(ranges.finish(),
+        [context](kj::ArrayPtr<const BlockRange> ranges,
+                  kj::ArrayPtr<const byte* const> blocks) mutable {
+      encodeExtents(ranges, blocks, [&](uint size, capnp::MessageSize sizeHint) {
+        return context.getResults(sizeHint).initExtents(size);
+      });
+    });
+  }
+
+  kj::Promise<void> sync(SyncContext context) override {
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Own<PackageBlockCache> cache;
+  uint32_t packageNumber;
+  Volume::Client inner;
+
+  uint32_t nextSequential = 0;
+  // Block following the end of the last read. A read starting here is considered sequential.
+
+  uint32_t readaheadWindow = 0;
+  uint32_t readaheadEnd = 0;
+  // Current readahead window (0 = not sequential), and the end of what has been read ahead so far.
+
+  bool readaheadInFlight = false;
+  kj::Promise<void> readahead = kj::READY_NOW;
+
+  typedef kj::Function<void(kj::ArrayPtr<const BlockRange> ranges,
+                            kj::ArrayPtr<const byte* const> blocks)> DeliverFunc;
+
+  inline uint64_t key(uint32_t block) {
+    return (uint64_t(packageNumber) << 32) | block;
+  }
+
+  kj::Promise<void> getBlocks(kj::Array<BlockRange> ranges, DeliverFunc deliver) {
+    // Looks up every block covered by `ranges` in the cache, fetches the missing ones from the
+    // inner volume, and passes the content of each (null = zero) to `deliver()`. The pointers are
+    // only valid during the call.
+
+    kj::Vector<BlockRange> missing;
+    for (auto& range: ranges) {
+      for (uint32_t i = 0; i < range.count; i++) {
+        uint32_t block = range.start + i;
+        if (cache->contains(key(block))) {
+          ++cache->stats.hits;
+        } else {
+          ++cache->stats.misses;
+          if (missing.size() > 0 && missing.back().start + missing.back().count == block) {
+            ++missing.back().count;
+          } else {
+            missing.add(BlockRange { block, 1 });
+          }
+        }
+      }
+    }
+
+    if (ranges.size() > 0) maybeReadAhead(ranges);
+
+    if (missing.size() == 0) {
+      KJ_IF_MAYBE(blocks, gather(ranges, {})) {
+        deliver(ranges, *blocks);
+        return kj::READY_NOW;
+      }
+      KJ_UNREACHABLE;  // gather() doesn't evict, so everything we just saw is still there.
+    }
+
+    auto req = inner.readvRequest();
+    auto reqRanges = req.initRanges(missing.size());
+    for (auto i: kj::indices(missing)) {
+      reqRanges[i].setBlockNum(missing[i].start);
+      reqRanges[i].setCount(missing[i].count);
+    }
+    return req.send().then([this,KJ_MVCAP(ranges),KJ_MVCAP(missing),KJ_MVCAP(deliver)](
+        auto&& response) mutable -> kj::Promise<void> {
+      auto fetched = splitExtents(missing.asPtr(), response.getExtents());
+      KJ_IF_MAYBE(blocks, gather(ranges, fetched)) {
+        deliver(ranges, *blocks);
+      } else {
+        // Blocks which were cached when we started were evicted while we waited. This takes a lot
+        // of concurrent misses; just start over.
+        addToCache(fetched);
+        return getBlocks(kj::mv(ranges), kj::mv(deliver));
+      }
+      addToCache(fetched);
+      return kj::READY_NOW;
+    });
+  }
+
+  kj::Maybe<kj::Array<const byte*>> gather(
+      kj::ArrayPtr<const BlockRange> ranges,
+      const std::unordered_map<uint32_t, const byte*>& fetched) {
+    // Collects the content of each block covered by `ranges` from `fetched` or the cache. Returns
+    // null if any block is in neither.
+
+    size_t total = 0;
+    for (auto& range: ranges) total += range.count;
+    auto result = kj::heapArrayBuilder<const byte*>(total);
+    for (auto& range: ranges) {
+      for (uint32_t i = 0; i < range.count; i++) {
+        uint32_t block = range.start + i;
+        auto iter = fetched.find(block);
+        if (iter != fetched.end()) {
+          result.add(iter->second);
+        } else KJ_IF_MAYBE(entry, cache->find(key(block))) {
+          result.add(entry->begin());
+        } else {
+          return nullptr;
+        }
+      }
+    }
+    return result.finish();
+  }
+
+  static std::unordered_map<uint32_t, const byte*> splitExtents(
+      kj::ArrayPtr<const BlockRange> ranges, capnp::List<Volume::Extent>::Reader extents) {
+    // Maps each block covered by `ranges` to its content in `extents` (null = zero).
+
+    std::unordered_map<uint32_t, const byte*> result;
+    auto range = ranges.begin();
+    uint32_t offset = 0;
+    for (auto extent: extents) {
+      const byte* data = nullptr;
+      if (extent.isData()) {
+        auto bytes = extent.getData();
+        KJ_ASSERT(bytes.size() == extent.getCount() * Volume::BLOCK_SIZE);
+        data = bytes.begin();
+      }
+      for (uint32_t i = 0; i < extent.getCount(); i++) {
+        KJ_ASSERT(range != ranges.end(), "volume returned too many blocks");
+        result[range->start + offset] = data == nullptr ? nullptr : data + i * Volume::BLOCK_SIZE;
+        if (++offset == range->count) {
+          ++range;
+          offset = 0;
+        }
+      }
+    }
+    KJ_ASSERT(range == ranges.end(), "volume returned too few blocks");
+    return result;
+  }
+
+  void addToCache(const std::unordered_map<uint32_t, const byte*>& blocks) {
+    for (auto& block: blocks) {
+      cache->insert(key(block.first), block.second);
+    }
+  }
+
+  void maybeReadAhead(kj::ArrayPtr<const BlockRange> ranges) {
+    // If the read described by `ranges` continues where the last one left off, make sure the
+    // blocks following it are cached or on their way.
+
+    uint32_t end = ranges.back().start + ranges.back().count;
+    if (ranges.front().start == nextSequential) {
+      readaheadWindow = kj::min(kj::max(readaheadWindow * 2, MIN_READAHEAD_BLOCKS),
+                                MAX_READAHEAD_BLOCKS);
+    } else {
+      readaheadWindow = 0;
+      readaheadEnd = 0;
+    }
+    nextSequential = end;
+
+    if (readaheadWindow == 0 || readaheadInFlight) return;
+    if (end > UINT32_MAX - readaheadWindow) return;  // end of the volume
+
+    // Only top up once at least half the window has been consumed, so that readahead requests
+    // are reasonably large.
+    uint32_t begin = kj::max(end, readaheadEnd);
+    uint32_t limit = end + readaheadWindow;
+    if (begin >= end + readaheadWindow / 2) return;
+    readaheadEnd = limit;
+
+    while (begin < limit && cache->contains(key(begin))) ++begin;
+    if (begin == limit) return;
+
+    auto req = inner.readExtentsRequest();
+    req.setBlockNum(begin);
+    req.setCount(limit - begin);
+    readaheadInFlight = true;
+    readahead = req.send().then([this,begin,limit](auto&& response) {
+      BlockRange range = { begin, limit - begin };
+      for (auto& block: splitExtents(kj::arrayPtr(&range, 1), response.getExtents())) {
+        if (!cache->contains(key(block.first))) {
+          cache->insert(key(block.first), block.second);
+          ++cache->stats.readaheadBlocks;
+        }
+      }
+    }, [](kj::Exception&& exception) {
+      // Ignore. If the blocks are actually read, the error will be reported then.
+    }).then([this]() {
+      readaheadInFlight = false;
+    }).eagerlyEvaluate(nullptr);
+  }
+};
+
+PackageBlockCache::PackageBlockCache(size_t budgetBytes): budgetBytes(budgetBytes) {}
+PackageBlockCache::~PackageBlockCache() noexcept(false) {}
+
+Volume::Client PackageBlockCache::wrap(kj::ArrayPtr<const byte> packageId, Volume::Client volume) {
+  return kj::heap<CachingVolume>(*this, getPackageNumber(packageId), kj::mv(volume));
+}
+
+uint32_t PackageBlockCache::getPackageNumber(kj::ArrayPtr<const byte> packageId) {
+  auto iter = packageNumbers.find(packageId);
+  if (iter != packageNumbers.end()) return iter->second;
+
+  uint32_t number = packageIds.size();
+  auto& id = packageIds.add(kj::heapArray(packageId));
+  packageNumbers[id] = number;
+  return number;
+}
+
+kj::Maybe<const kj::Array<byte>&> PackageBlockCache::find(uint64_t key) {
+  auto iter = entries.find(key);
+  if (iter == entries.end()) return nullptr;
+  lru.splice(lru.end(), lru, iter->second.lruPos);
+  return iter->second.data;
+}
+
+static constexpr size_t PACKAGE_CACHE_ENTRY_OVERHEAD = 64;
+// Approximate bookkeeping cost of a cache entry (hash node, LRU node, allocation header), which
+// is all an all-zero block costs.
+
+void PackageBlockCache::insert(uint64_t key, const byte* data) {
+  auto insertResult = entries.insert(std::make_pair(key, Entry()));
+  auto& entry = insertResult.first->second;
+  if (!insertResult.second) {
+    // Already cached (e.g. fetched by two overlapping requests).
+    lru.splice(lru.end(), lru, entry.lruPos);
+    return;
+  }
+
+  if (data != nullptr) {
+    entry.data = kj::heapArray(data, Volume::BLOCK_SIZE);
+  }
+  entry.lruPos = lru.insert(lru.end(), key);
+  ++stats.blocks;
+  stats.bytes += entry.data.size() + PACKAGE_CACHE_ENTRY_OVERHEAD;
+
+  while (stats.bytes > budgetBytes && !lru.empty()) {
+    auto victim = entries.find(lru.front());
+    KJ_ASSERT(victim != entries.end());
+    --stats.blocks;
+    stats.bytes -= victim->second.data.size() + PACKAGE_CACHE_ENTRY_OVERHEAD;
+    ++stats.evictions;
+    entries.erase(victim);
+    lru.pop_front();
+  }
+}
+
+}  // namespace blackrock
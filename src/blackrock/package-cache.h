@@ -0,0 +1,161 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_PACKAGE_CACHE_H_
+#define BLACKROCK_PACKAGE_CACHE_H_
+
+#include "common.h"
+#include <blackrock/storage.capnp.h>
+#include <kj/debug.h>
+#include <kj/refcount.h>
+#include <kj/vector.h>
+#include <unordered_map>
+#include <list>
+#include <string.h>
+
+namespace blackrock {
+
+struct ByteStringHash {
+  inline size_t operator()(const kj::ArrayPtr<const byte>& token) const {
+    size_t result = 0;
+    memcpy(&result, token.begin(), kj::min(sizeof(result), token.size()));
+    return result;
+  }
+  inline size_t operator()(const kj::ArrayPtr<const byte>& a,
+                           const kj::ArrayPtr<const byte>& b) const {
+    return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size()) == 0;
+  }
+};
+
+struct BlockRange {
+  // A run of blocks, as seen by Volume wrappers which serve reads partly from memory.
+
+  uint32_t start;
+  uint32_t count;
+};
+
+template <typename InitFunc>
+void encodeExtents(kj::ArrayPtr<const BlockRange> ranges, kj::ArrayPtr<const byte* const> blocks,
+                   InitFunc&& initExtents) {
+  // Given the content of each block covered by `ranges` (null = zero), build the list of extents
+  // to return from readExtents() or readv(), never letting a run cross from one range into the
+  // next. `initExtents(size, sizeHint)` allocates the output list.
+
+  uint32_t dataBlocks = 0;
+  uint runCount = 0;
+  uint32_t b = 0;
+  for (auto& range: ranges) {
+    for (uint32_t i = 0; i < range.count; i++, b++) {
+      KJ_ASSERT(b < blocks.size());
+      if (blocks[b] != nullptr) ++dataBlocks;
+      if (i == 0 || (blocks[b] == nullptr) != (blocks[b - 1] == nullptr)) ++runCount;
+    }
+  }
+  KJ_ASSERT(b == blocks.size());
+
+  auto list = initExtents(runCount, capnp::MessageSize {
+      16 + runCount * 4 + dataBlocks * Volume::BLOCK_SIZE / sizeof(capnp::word), 0 });
+  uint r = 0;
+  b = 0;
+  for (auto& range: ranges) {
+    uint32_t end = b + range.count;
+    while (b < end) {
+      bool isZero = blocks[b] == nullptr;
+      uint32_t j = b + 1;
+      while (j < end && (blocks[j] == nullptr) == isZero) ++j;
+
+      auto extent = list[r++];
+      extent.setCount(j - b);
+      if (isZero) {
+        extent.setZeros();
+      } else {
+        auto data = extent.initData((j - b) * Volume::BLOCK_SIZE);
+        for (uint32_t k = b; k < j; k++) {
+          memcpy(data.begin() + (k - b) * Volume::BLOCK_SIZE, blocks[k], Volume::BLOCK_SIZE);
+        }
+      }
+      b = j;
+    }
+  }
+  KJ_ASSERT(r == runCount);
+}
+
+class PackageBlockCache: public kj::Refcounted {
+  // Worker-wide cache of blocks read from package volumes. Entries are keyed by package ID, so
+  // they are shared by every mount of a package and survive the package being unmounted: a grain
+  // starting an app that ran recently doesn't have to fetch its files from storage again. Packages
+  // never change, so entries never go stale; the least-recently-used blocks are evicted once the
+  // cache exceeds its budget.
+
+public:
+  explicit PackageBlockCache(size_t budgetBytes);
+  ~PackageBlockCache() noexcept(false);
+  KJ_DISALLOW_COPY(PackageBlockCache);
+
+  Volume::Client wrap(kj::ArrayPtr<const byte> packageId, Volume::Client volume);
+  // Returns a read-only Volume which serves reads from the cache, forwarding misses to `volume`
+  // and reading ahead when it sees sequential access. The Volume holds a reference to the cache.
+
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Blocks read through the cache, and whether they were found in it.
+
+    uint64_t readaheadBlocks = 0;
+    // Blocks fetched before they were asked for.
+
+    uint64_t evictions = 0;
+    // Blocks dropped to stay within the budget.
+
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+    // Current size of the cache.
+  };
+
+  const Stats& getStats() { return stats; }
+
+private:
+  class CachingVolume;
+
+  struct Entry {
+    kj::Array<byte> data;
+    // Content of the block, or null if it is all zeros.
+
+    std::list<uint64_t>::iterator lruPos;
+  };
+
+  size_t budgetBytes;
+  Stats stats;
+
+  std::unordered_map<uint64_t, Entry> entries;
+  std::list<uint64_t> lru;
+  // Keyed by package number in the upper 32 bits and block number in the lower. Least-recently
+  // used at the front.
+
+  std::unordered_map<kj::ArrayPtr<const byte>, uint32_t, ByteStringHash, ByteStringHash>
+      packageNumbers;
+  kj::Vector<kj::Array<byte>> packageIds;
+  // Package IDs are arbitrary byte strings, so each is assigned a small number for use in keys.
+
+  uint32_t getPackageNumber(kj::ArrayPtr<const byte> packageId);
+  kj::Maybe<const kj::Array<byte>&> find(uint64_t key);
+  bool contains(uint64_t key) { return entries.count(key) > 0; }
+  void insert(uint64_t key, const byte* data);
+};
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_PACKAGE_CACHE_H_
@@ -81,7 +81,11 @@ private:
     // either the stream is still uploading, or it failed to fully upload). Once set this
     // can never be unset.
 
-    byte reserved[2];
+    byte blobContent;
+    // For Blobs, where the content lives (inline, indexed in the content store, or a reference
+    // to shared content). Zero for other types.
+
+    byte reserved[1];
     // Must be zero.
 
     uint32_t accountedBlockCount;
@@ -0,0 +1,85 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stream-window.h"
+#include <kj/debug.h>
+
+namespace blackrock {
+
+static constexpr size_t MIN_CHUNK_BYTES = 8192;
+
+ByteStreamWindow::ByteStreamWindow(sandstorm::ByteStream::Client target, size_t windowBytes)
+    : target(kj::mv(target)),
+      windowBytes(kj::max(windowBytes, MIN_CHUNK_BYTES)),
+      chunkSize(MIN_CHUNK_BYTES) {}
+
+ByteStreamWindow::Chunk::Chunk(
+    capnp::Request<sandstorm::ByteStream::WriteParams,
+                   sandstorm::ByteStream::WriteResults>&& request,
+    capnp::Orphan<capnp::Data>&& data)
+    : request(kj::mv(request)), data(kj::mv(data)), buffer(this->data.get()) {}
+
+auto ByteStreamWindow::newChunk() -> Chunk {
+  auto req = target.writeRequest(capnp::MessageSize { chunkSize / sizeof(capnp::word) + 4, 0 });
+  auto orphan = capnp::Orphanage::getForMessageContaining(
+      kj::implicitCast<sandstorm::ByteStream::WriteParams::Builder>(req))
+      .newOrphan<capnp::Data>(chunkSize);
+  return Chunk(kj::mv(req), kj::mv(orphan));
+}
+
+kj::Promise<void> ByteStreamWindow::send(Chunk&& chunk, size_t size) {
+  KJ_REQUIRE(size > 0 && size <= chunk.buffer.size(), "invalid chunk size", size);
+
+  if (size < chunk.buffer.size()) {
+    chunk.data.truncate(size);
+  }
+  chunk.request.adoptData(kj::mv(chunk.data));
+
+  inFlight.push_back({ chunk.request.send().then([](auto&&) {}), size });
+  bytesInFlight += size;
+
+  return waitForRoom();
+}
+
+kj::Promise<void> ByteStreamWindow::done() {
+  if (inFlight.empty()) {
+    return target.doneRequest().send().then([](auto&&) {});
+  } else {
+    return completeOldest().then([this]() { return done(); });
+  }
+}
+
+kj::Promise<void> ByteStreamWindow::completeOldest() {
+  auto oldest = kj::mv(inFlight.front());
+  inFlight.pop_front();
+
+  return oldest.promise.then([this,size = oldest.size]() {
+    bytesInFlight -= size;
+
+    // The receiver is keeping up, so try bigger chunks.
+    chunkSize = kj::min(chunkSize * 2, kj::max(windowBytes / 4, MIN_CHUNK_BYTES));
+  });
+}
+
+kj::Promise<void> ByteStreamWindow::waitForRoom() {
+  if (bytesInFlight + chunkSize <= windowBytes) {
+    return kj::READY_NOW;
+  } else {
+    return completeOldest().then([this]() { return waitForRoom(); });
+  }
+}
+
+}  // namespace blackrock
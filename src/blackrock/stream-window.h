@@ -0,0 +1,87 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_STREAM_WINDOW_H_
+#define BLACKROCK_STREAM_WINDOW_H_
+
+#include "common.h"
+#include <sandstorm/util.capnp.h>
+#include <kj/async.h>
+#include <deque>
+
+namespace blackrock {
+
+class ByteStreamWindow {
+  // Flow control for sending a large amount of data to a `ByteStream`. Rather than waiting for
+  // each write() to return before sending the next one, we keep up to `windowBytes` worth of
+  // writes in flight, so that throughput over a high-latency link isn't limited to one chunk per
+  // round trip. Chunks start small and double each time a write is acknowledged, up to a quarter
+  // of the window. If the receiver falls behind, the window fills up and send() doesn't resolve
+  // until some write completes, so we never have more than the window outstanding.
+
+public:
+  static constexpr size_t DEFAULT_WINDOW_BYTES = 1 << 20;
+
+  explicit ByteStreamWindow(sandstorm::ByteStream::Client target,
+                            size_t windowBytes = DEFAULT_WINDOW_BYTES);
+  KJ_DISALLOW_COPY(ByteStreamWindow);
+
+  class Chunk {
+  public:
+    kj::ArrayPtr<byte> getBuffer() { return buffer; }
+    // Space to fill in. Its size is the window's current chunk size.
+
+  private:
+    capnp::Request<sandstorm::ByteStream::WriteParams, sandstorm::ByteStream::WriteResults> request;
+    capnp::Orphan<capnp::Data> data;
+    kj::ArrayPtr<byte> buffer;
+
+    Chunk(capnp::Request<sandstorm::ByteStream::WriteParams,
+                         sandstorm::ByteStream::WriteResults>&& request,
+          capnp::Orphan<capnp::Data>&& data);
+    friend class ByteStreamWindow;
+  };
+
+  Chunk newChunk();
+  // Start a new write(). Read data directly into the chunk's buffer, then pass it to send().
+
+  kj::Promise<void> send(Chunk&& chunk, size_t size);
+  // Sends the first `size` bytes of `chunk`, which must be non-zero. Resolves when there is room
+  // in the window for another chunk. Rejects if an earlier write failed.
+
+  kj::Promise<void> done();
+  // Waits for all writes to complete and then calls done() on the stream.
+
+private:
+  sandstorm::ByteStream::Client target;
+  size_t windowBytes;
+  size_t chunkSize;
+
+  struct InFlight {
+    kj::Promise<void> promise;
+    size_t size;
+  };
+  std::deque<InFlight> inFlight;
+  size_t bytesInFlight = 0;
+  // Writes sent but not yet acknowledged, oldest first.
+
+  kj::Promise<void> completeOldest();
+  kj::Promise<void> waitForRoom();
+};
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_STREAM_WINDOW_H_
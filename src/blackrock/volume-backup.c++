@@ -0,0 +1,567 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "volume-backup.h"
+#include "stream-window.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <sodium/randombytes.h>
+#include <string.h>
+
+namespace blackrock {
+
+namespace {
+
+static constexpr uint32_t BATCH_BLOCKS = 256;
+// Blocks per readv() when building a delta, and per write() when restoring one: 1MB, well under
+// readv()'s limit.
+
+static constexpr uint32_t ZERO_BATCH_BLOCKS = 1u << 16;
+// Blocks per zero() when restoring. A delta may have a range covering most of the volume.
+
+struct BlockRun {
+  uint32_t blockNum;
+  uint32_t count;
+};
+
+struct DeltaRange {
+  uint32_t blockNum;
+  uint32_t count;
+  bool zero;
+};
+
+struct ChangedBlocks {
+  uint64_t since;
+  // Epoch the changes are relative to; zero if `runs` covers the whole volume.
+
+  kj::Array<BlockRun> runs;
+};
+
+kj::Promise<ChangedBlocks> getChangedBlocks(Volume::Client snapshot, uint64_t since) {
+  auto req = snapshot.getChangedBlocksRequest();
+  req.setSinceEpoch(since);
+  return req.send().then([KJ_MVCAP(snapshot),since](auto&& response) mutable
+                         -> kj::Promise<ChangedBlocks> {
+    if (!response.getKnown()) {
+      KJ_REQUIRE(since != 0, "volume doesn't know its allocated blocks");
+      KJ_LOG(INFO, "volume lost track of changes; starting a new backup chain");
+      return getChangedBlocks(kj::mv(snapshot), 0);
+    }
+
+    auto ranges = response.getRanges();
+    kj::Vector<BlockRun> runs(ranges.size());
+    for (auto range: ranges) {
+      if (range.getCount() > 0) {
+        runs.add(BlockRun { range.getBlockNum(), range.getCount() });
+      }
+    }
+    return ChangedBlocks { since, runs.releaseAsArray() };
+  });
+}
+
+class DeltaBuilder {
+  // Reads the given runs of blocks from a snapshot and uploads the non-zero ones to a blob,
+  // recording which ranges went where.
+
+public:
+  DeltaBuilder(Volume::Client snapshot, kj::Array<BlockRun> runs,
+               sandstorm::ByteStream::Client stream)
+      : snapshot(kj::mv(snapshot)), runs(kj::mv(runs)), window(kj::mv(stream)) {}
+
+  kj::Promise<void> run() {
+    // Read and upload everything, then call done() on the stream.
+
+    if (runIndex == runs.size()) {
+      return window.done();
+    }
+
+    // Take up to BATCH_BLOCKS blocks from the remaining runs.
+    kj::Vector<BlockRun> batch;
+    uint32_t blocks = 0;
+    while (runIndex < runs.size() && blocks < BATCH_BLOCKS) {
+      auto& run = runs[runIndex];
+      uint32_t n = kj::min(run.count - runOffset, BATCH_BLOCKS - blocks);
+      batch.add(BlockRun { run.blockNum + runOffset, n });
+      blocks += n;
+      runOffset += n;
+      if (runOffset == run.count) {
+        ++runIndex;
+        runOffset = 0;
+      }
+    }
+
+    auto req = snapshot.readvRequest();
+    auto list = req.initRanges(batch.size());
+    for (auto i: kj::indices(batch)) {
+      list[i].setBlockNum(batch[i].blockNum);
+      list[i].setCount(batch[i].count);
+    }
+
+    return req.send().then([this,KJ_MVCAP(batch)](auto&& response) {
+      // No extent spans two ranges, so each one starts where the previous one left off, or at the
+      // start of the next range.
+      kj::Vector<byte> data;
+      size_t batchIndex = 0;
+      uint32_t batchOffset = 0;
+      for (auto extent: response.getExtents()) {
+        KJ_REQUIRE(batchIndex < batch.size(), "readv() returned too many blocks");
+        uint32_t count = extent.getCount();
+        KJ_REQUIRE(count <= batch[batchIndex].count - batchOffset, "readv() extent spans ranges");
+
+        if (extent.isData()) {
+          auto bytes = extent.getData();
+          KJ_REQUIRE(bytes.size() == uint64_t(count) * Volume::BLOCK_SIZE,
+                     "readv() returned wrong amount of data");
+          data.addAll(bytes);
+        }
+        addRange(batch[batchIndex].blockNum + batchOffset, count, !extent.isData());
+
+        batchOffset += count;
+        if (batchOffset == batch[batchIndex].count) {
+          ++batchIndex;
+          batchOffset = 0;
+        }
+      }
+      KJ_REQUIRE(batchIndex == batch.size(), "readv() returned too few blocks");
+
+      auto bytes = data.releaseAsArray();
+      auto ptr = bytes.asPtr();
+      return send(ptr).attach(kj::mv(bytes));
+    }).then([this]() {
+      return run();
+    });
+  }
+
+  kj::ArrayPtr<const DeltaRange> getRanges() { return ranges; }
+
+private:
+  Volume::Client snapshot;
+  kj::Array<BlockRun> runs;
+  size_t runIndex = 0;
+  uint32_t runOffset = 0;
+  // Position of the next block to read.
+
+  ByteStreamWindow window;
+  kj::Vector<DeltaRange> ranges;
+
+  void addRange(uint32_t blockNum, uint32_t count, bool zero) {
+    if (count == 0) return;
+    if (ranges.size() > 0) {
+      auto& last = ranges.back();
+      if (last.zero == zero && uint64_t(last.blockNum) + last.count == blockNum &&
+          uint64_t(last.count) + count <= 0xffffffffu) {
+        last.count += count;
+        return;
+      }
+    }
+    ranges.add(DeltaRange { blockNum, count, zero });
+  }
+
+  kj::Promise<void> send(kj::ArrayPtr<const byte> data) {
+    if (data.size() == 0) return kj::READY_NOW;
+
+    auto chunk = window.newChunk();
+    auto buffer = chunk.getBuffer();
+    size_t n = kj::min(buffer.size(), data.size());
+    memcpy(buffer.begin(), data.begin(), n);
+    return window.send(kj::mv(chunk), n).then([this,data,n]() {
+      return send(data.slice(n, data.size()));
+    });
+  }
+};
+
+class DeltaApplier final: public sandstorm::ByteStream::Server {
+  // Receives a delta's data, as written by its blob, and writes each block to its place in the
+  // target volume.
+
+public:
+  DeltaApplier(Volume::Client target, VolumeBackup::Delta::Reader delta)
+      : target(kj::mv(target)) {
+    for (auto range: delta.getRanges()) {
+      if (!range.getZero() && range.getCount() > 0) {
+        runs.add(BlockRun { range.getBlockNum(), range.getCount() });
+      }
+    }
+  }
+
+  void requireDone() {
+    KJ_REQUIRE(isDone, "delta blob wasn't fully written");
+  }
+
+  kj::Promise<void> write(WriteContext context) override {
+    KJ_REQUIRE(!isDone);
+    buffer.addAll(context.getParams().getData());
+
+    kj::Vector<kj::Promise<void>> writes;
+    size_t consumed = 0;
+    for (;;) {
+      size_t available = (buffer.size() - consumed) / Volume::BLOCK_SIZE;
+      if (available == 0) break;
+      KJ_REQUIRE(runIndex < runs.size(), "delta has more data than its ranges say");
+
+      auto& run = runs[runIndex];
+      uint32_t n = kj::min(run.count - runOffset, BATCH_BLOCKS);
+      if (n > available) n = available;
+      auto req = target.writeRequest();
+      req.setBlockNum(run.blockNum + runOffset);
+      req.setData(kj::arrayPtr(buffer.begin() + consumed, n * Volume::BLOCK_SIZE));
+      writes.add(req.send().ignoreResult());
+
+      consumed += n * Volume::BLOCK_SIZE;
+      runOffset += n;
+      if (runOffset == run.count) {
+        ++runIndex;
+        runOffset = 0;
+      }
+    }
+
+    // Keep any partial block for the next write().
+    size_t remaining = buffer.size() - consumed;
+    memmove(buffer.begin(), buffer.begin() + consumed, remaining);
+    buffer.resize(remaining);
+
+    return kj::joinPromises(writes.releaseAsArray());
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    KJ_REQUIRE(!isDone);
+    KJ_REQUIRE(runIndex == runs.size() && buffer.size() == 0,
+               "delta has less data than its ranges say");
+    isDone = true;
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> expectSize(ExpectSizeContext context) override {
+    return kj::READY_NOW;
+  }
+
+private:
+  Volume::Client target;
+  kj::Vector<BlockRun> runs;
+  size_t runIndex = 0;
+  uint32_t runOffset = 0;
+  // Where the next block of data goes.
+
+  kj::Vector<byte> buffer;
+  bool isDone = false;
+};
+
+kj::Promise<void> applyDelta(Volume::Client target, VolumeBackup::Delta::Reader delta,
+                             bool first) {
+  kj::Vector<kj::Promise<void>> promises;
+
+  if (!first) {
+    // On a new volume, the first delta's zero ranges are zero already.
+    for (auto range: delta.getRanges()) {
+      if (!range.getZero()) continue;
+      uint64_t blockNum = range.getBlockNum();
+      uint64_t end = blockNum + range.getCount();
+      while (blockNum < end) {
+        uint32_t n = kj::min(end - blockNum, uint64_t(ZERO_BATCH_BLOCKS));
+        auto req = target.zeroRequest();
+        req.setBlockNum(blockNum);
+        req.setCount(n);
+        promises.add(req.send().ignoreResult());
+        blockNum += n;
+      }
+    }
+  }
+
+  auto applier = kj::heap<DeltaApplier>(target, delta);
+  DeltaApplier& applierRef = *applier;
+  sandstorm::ByteStream::Client stream = kj::mv(applier);
+  auto req = delta.getData().writeToRequest();
+  req.setStream(stream);
+  promises.add(req.send().then([&applierRef,KJ_MVCAP(stream)](auto&&) {
+    applierRef.requireDone();
+  }));
+
+  return kj::joinPromises(promises.releaseAsArray());
+}
+
+kj::Promise<void> applyDeltas(Volume::Client target,
+                              capnp::List<VolumeBackup::Delta>::Reader deltas,
+                              uint index, uint count) {
+  if (index == count) {
+    return target.syncRequest().send().ignoreResult();
+  }
+
+  return applyDelta(target, deltas[index], index == 0)
+      .then([KJ_MVCAP(target),deltas,index,count]() mutable {
+    return applyDeltas(kj::mv(target), deltas, index + 1, count);
+  });
+}
+
+struct UploadedDelta {
+  kj::Own<DeltaBuilder> builder;
+  OwnedBlob::Client blob;
+
+  void copyTo(VolumeBackup::Delta::Builder delta) {
+    auto ranges = builder->getRanges();
+    delta.setData(blob);
+    auto list = delta.initRanges(ranges.size());
+    for (auto i: kj::indices(ranges)) {
+      list[i].setBlockNum(ranges[i].blockNum);
+      list[i].setCount(ranges[i].count);
+      list[i].setZero(ranges[i].zero);
+    }
+  }
+};
+
+kj::Promise<UploadedDelta> uploadDelta(StorageFactory::Client storageFactory,
+                                       Volume::Client snapshot, kj::Array<BlockRun> runs) {
+  auto upload = storageFactory.uploadBlobRequest().send();
+  auto builder = kj::heap<DeltaBuilder>(kj::mv(snapshot), kj::mv(runs), upload.getStream());
+  auto promise = builder->run();
+  return promise.then([KJ_MVCAP(upload)]() mutable {
+    return kj::mv(upload);
+  }).then([KJ_MVCAP(builder)](auto&& uploaded) mutable {
+    return UploadedDelta { kj::mv(builder), uploaded.getBlob() };
+  });
+}
+
+kj::String headName(kj::StringPtr grainId) {
+  return kj::str("volume-backup-", grainId);
+}
+
+kj::String chainName(kj::StringPtr grainId, uint64_t generation) {
+  return kj::str("volume-backup-", grainId, '-', generation);
+}
+
+kj::Promise<kj::Maybe<uint64_t>> getGeneration(StorageRootSet::Client storage,
+                                               kj::StringPtr grainId) {
+  // Returns the generation of the grain's current chain, or null if it has none.
+
+  auto req = storage.tryGetRequest<Assignable<VolumeBackupHead>>();
+  req.setName(headName(grainId));
+  return req.send().then([](auto&& result) -> kj::Promise<kj::Maybe<uint64_t>> {
+    if (!result.hasObject()) {
+      return kj::Maybe<uint64_t>(nullptr);
+    }
+
+    return result.getObject().template castAs<OwnedAssignable<VolumeBackupHead>>()
+        .getRequest().send().then([](auto&& head) -> kj::Maybe<uint64_t> {
+      return head.getValue().getGeneration();
+    });
+  });
+}
+
+}  // namespace
+
+kj::Promise<kj::Maybe<VolumeBackupPosition>> appendVolumeBackup(
+    StorageRootSet::Client storage, kj::StringPtr grainId, Volume::Client snapshot,
+    uint64_t epoch, kj::StringPtr backupId) {
+  auto headLookup = ({
+    auto req = storage.getOrCreateAssignableRequest<VolumeBackupHead>();
+    req.setName(headName(grainId));
+    // Chains left behind by an earlier head (see dropVolumeBackups()) may still exist, and must
+    // not be extended from a different volume, so a new head starts at a random generation.
+    uint64_t generation;
+    randombytes_buf(&generation, sizeof(generation));
+    req.initDefaultValue().setGeneration(generation);
+    req.send().getObject().getRequest().send();
+  });
+
+  return headLookup.then([KJ_MVCAP(storage),grainId = kj::heapString(grainId),
+                          KJ_MVCAP(snapshot),epoch,backupId = kj::heapString(backupId)]
+                         (auto&& head) mutable {
+    uint64_t generation = head.getValue().getGeneration();
+    auto req = storage.getOrCreateAssignableRequest<VolumeBackup>();
+    req.setName(chainName(grainId, generation));
+    req.initDefaultValue();
+    return req.send().getObject().getRequest().send()
+        .then([KJ_MVCAP(storage),KJ_MVCAP(grainId),KJ_MVCAP(snapshot),epoch,KJ_MVCAP(backupId),
+               KJ_MVCAP(head),generation](auto&& current) mutable {
+      auto value = current.getValue();
+      uint deltaCount = value.getDeltas().size();
+      uint64_t since = deltaCount > 0 && deltaCount < MAX_VOLUME_BACKUP_DELTAS
+                     ? value.getEpoch() : 0;
+
+      auto changes = getChangedBlocks(snapshot, since);
+      return changes.then([KJ_MVCAP(storage),KJ_MVCAP(grainId),KJ_MVCAP(snapshot),epoch,
+                           KJ_MVCAP(backupId),KJ_MVCAP(head),generation,KJ_MVCAP(current)]
+                          (ChangedBlocks&& changed) mutable {
+        StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
+        auto uploaded = uploadDelta(storageFactory, kj::mv(snapshot), kj::mv(changed.runs));
+        return uploaded.then([KJ_MVCAP(storage),KJ_MVCAP(storageFactory),KJ_MVCAP(grainId),
+                              epoch,KJ_MVCAP(backupId),KJ_MVCAP(head),generation,
+                              KJ_MVCAP(current),since = changed.since]
+                             (UploadedDelta&& delta) mutable
+                             -> kj::Promise<kj::Maybe<VolumeBackupPosition>> {
+          auto old = current.getValue();
+          auto oldDeltas = old.getDeltas();
+          auto oldBackups = old.getBackups();
+
+          if (since != 0) {
+            // Extend the chain, and list this backup as depending on it.
+            auto req = current.getSetter().setRequest();
+            auto value = req.initValue();
+            value.setEpoch(epoch);
+            auto deltas = value.initDeltas(oldDeltas.size() + 1);
+            for (auto i: kj::indices(oldDeltas)) {
+              deltas.setWithCaveats(i, oldDeltas[i]);
+            }
+            delta.copyTo(deltas[oldDeltas.size()]);
+            auto backups = value.initBackups(oldBackups.size() + 1);
+            for (auto i: kj::indices(oldBackups)) {
+              backups.set(i, oldBackups[i]);
+            }
+            backups.set(oldBackups.size(), backupId);
+
+            VolumeBackupPosition position { generation, deltas.size() };
+            return req.send().then([position](auto&&) -> kj::Maybe<VolumeBackupPosition> {
+              return position;
+            });
+          } else if (oldBackups.size() == 0) {
+            // Nothing depends on the old deltas, so start over in place.
+            auto req = current.getSetter().setRequest();
+            auto value = req.initValue();
+            value.setEpoch(epoch);
+            delta.copyTo(value.initDeltas(1)[0]);
+            return req.send().then([](auto&&) -> kj::Maybe<VolumeBackupPosition> {
+              return nullptr;
+            });
+          } else {
+            // Backups still depend on the old chain, so start a new generation beside it. Create
+            // the chain before pointing the head at it; if we fail in between, the next backup
+            // simply overwrites it.
+            auto newChain = ({
+              auto req = storageFactory.newAssignableRequest<VolumeBackup>();
+              auto value = req.initInitialValue();
+              value.setEpoch(epoch);
+              delta.copyTo(value.initDeltas(1)[0]);
+              req.send().getAssignable();
+            });
+
+            auto req = storage.setRequest<Assignable<VolumeBackup>>();
+            req.setName(chainName(grainId, generation + 1));
+            req.setObject(kj::mv(newChain));
+            return req.send().then([KJ_MVCAP(head),generation](auto&&) mutable {
+              auto req = head.getSetter().setRequest();
+              req.initValue().setGeneration(generation + 1);
+              return req.send().then([](auto&&) -> kj::Maybe<VolumeBackupPosition> {
+                return nullptr;
+              });
+            });
+          }
+        });
+      });
+    });
+  });
+}
+
+kj::Promise<void> restoreVolumeBackup(StorageRootSet::Client storage,
+                                      ChainedBackup::Reader backup, Volume::Client target) {
+  uint deltaCount = backup.getDeltaCount();
+  auto req = storage.getRequest<Assignable<VolumeBackup>>();
+  req.setName(chainName(backup.getGrainId(), backup.getGeneration()));
+  return req.send().getObject().castAs<OwnedAssignable<VolumeBackup>>().getRequest().send()
+      .then([KJ_MVCAP(target),deltaCount](auto&& chain) mutable {
+    auto deltas = chain.getValue().getDeltas();
+    KJ_REQUIRE(deltaCount > 0 && deltaCount <= deltas.size(), "volume backup is missing deltas",
+               deltaCount, deltas.size());
+    return applyDeltas(kj::mv(target), deltas, 0, deltaCount).attach(kj::mv(chain));
+  });
+}
+
+kj::Promise<void> releaseVolumeBackup(StorageRootSet::Client storage,
+                                      ChainedBackup::Reader backup, kj::StringPtr backupId) {
+  auto grainId = backup.getGrainId();
+  uint64_t generation = backup.getGeneration();
+  auto lookup = getGeneration(storage, grainId);
+  return lookup.then([KJ_MVCAP(storage),name = chainName(grainId, generation),generation,
+                      backupId = kj::heapString(backupId)](kj::Maybe<uint64_t> current) mutable {
+    bool isCurrent = false;
+    KJ_IF_MAYBE(c, current) {
+      isCurrent = *c == generation;
+    }
+
+    auto req = storage.tryGetRequest<Assignable<VolumeBackup>>();
+    req.setName(name);
+    return req.send().then([KJ_MVCAP(storage),KJ_MVCAP(name),KJ_MVCAP(backupId),isCurrent]
+                           (auto&& result) mutable -> kj::Promise<void> {
+      if (!result.hasObject()) {
+        return kj::READY_NOW;
+      }
+
+      return result.getObject().template castAs<OwnedAssignable<VolumeBackup>>()
+          .getRequest().send()
+          .then([KJ_MVCAP(storage),KJ_MVCAP(name),KJ_MVCAP(backupId),isCurrent]
+                (auto&& chain) mutable -> kj::Promise<void> {
+        auto value = chain.getValue();
+        kj::Vector<capnp::Text::Reader> remaining;
+        for (auto id: value.getBackups()) {
+          if (id != backupId) remaining.add(id);
+        }
+
+        if (remaining.size() == 0 && !isCurrent) {
+          // Nothing else needs the chain, and no new backup will extend it.
+          auto req = storage.removeRequest();
+          req.setName(name);
+          return req.send().ignoreResult();
+        }
+
+        auto req = chain.getSetter().setRequest();
+        auto newValue = req.initValue();
+        newValue.setEpoch(value.getEpoch());
+        newValue.setDeltas(value.getDeltas());
+        auto backups = newValue.initBackups(remaining.size());
+        for (auto i: kj::indices(remaining)) {
+          backups.set(i, remaining[i]);
+        }
+        return req.send().ignoreResult();
+      });
+    });
+  });
+}
+
+kj::Promise<void> dropVolumeBackups(StorageRootSet::Client storage, kj::StringPtr grainId) {
+  auto lookup = getGeneration(storage, grainId);
+  return lookup.then([KJ_MVCAP(storage),grainId = kj::heapString(grainId)]
+                     (kj::Maybe<uint64_t> generation) mutable -> kj::Promise<void> {
+    if (generation == nullptr) {
+      return kj::READY_NOW;
+    }
+
+    auto req = storage.removeRequest();
+    req.setName(headName(grainId));
+    auto name = chainName(grainId, KJ_ASSERT_NONNULL(generation));
+    return req.send().then([KJ_MVCAP(storage),KJ_MVCAP(name)](auto&&) mutable {
+      auto req = storage.tryGetRequest<Assignable<VolumeBackup>>();
+      req.setName(name);
+      return req.send().then([KJ_MVCAP(storage),KJ_MVCAP(name)]
+                             (auto&& result) mutable -> kj::Promise<void> {
+        if (!result.hasObject()) {
+          return kj::READY_NOW;
+        }
+
+        return result.getObject().template castAs<OwnedAssignable<VolumeBackup>>()
+            .getRequest().send()
+            .then([KJ_MVCAP(storage),KJ_MVCAP(name)](auto&& chain) mutable -> kj::Promise<void> {
+          if (chain.getValue().getBackups().size() > 0) {
+            // Backups still depend on it; the last one to be deleted drops it.
+            return kj::READY_NOW;
+          }
+          auto req = storage.removeRequest();
+          req.setName(name);
+          return req.send().ignoreResult();
+        });
+      });
+    });
+  });
+}
+
+}  // namespace blackrock
@@ -0,0 +1,78 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_VOLUME_BACKUP_H_
+#define BLACKROCK_VOLUME_BACKUP_H_
+
+#include "common.h"
+#include <blackrock/storage.capnp.h>
+#include <blackrock/storage-schema.capnp.h>
+#include <kj/async.h>
+
+namespace blackrock {
+
+// Block-level backups of volumes, kept as a chain of deltas in a `VolumeBackup`. Unlike the zip
+// produced by `Worker.packBackup()`, which always copies the whole grain, each backup only copies
+// the blocks that changed since the previous one, as told by `Volume.getChangedBlocks()`.
+//
+// A grain's chains live in the storage root set: `volume-backup-<grainId>` is a `VolumeBackupHead`
+// naming the current chain, `volume-backup-<grainId>-<generation>`. A backup which extends the
+// chain is recorded as a `ChainedBackup` -- the chain's first N deltas -- rather than a zip. Each
+// chain lists the backups recorded against it, and is kept until they are all deleted.
+
+static constexpr uint MAX_VOLUME_BACKUP_DELTAS = 32;
+// Once a chain has this many deltas, the next backup starts it over with a full copy, so that
+// restoring doesn't have to replay an unbounded history (and superseded blocks are freed).
+
+struct VolumeBackupPosition {
+  uint64_t generation;
+  uint32_t deltaCount;
+  // What a `ChainedBackup` records.
+};
+
+kj::Promise<kj::Maybe<VolumeBackupPosition>> appendVolumeBackup(
+    StorageRootSet::Client storage, kj::StringPtr grainId, Volume::Client snapshot,
+    uint64_t epoch, kj::StringPtr backupId);
+// Adds a delta to the grain's current chain holding the blocks of `snapshot` which changed since
+// the chain's last delta. `snapshot` and `epoch` are the results of a `Volume.pause()`.
+//
+// If the delta extends the chain, `backupId` is listed on the chain and the position to record in
+// its `ChainedBackup` is returned. Otherwise -- the chain was empty or long, or the volume can't
+// tell what changed, e.g. because the storage server restarted uncleanly -- the chain is started
+// over with a full copy, moving to a new generation if backups still depend on the old one, and
+// null is returned: the caller should pack a zip as usual. So there is a zip at least every
+// MAX_VOLUME_BACKUP_DELTAS backups.
+//
+// Two backups of the same grain must not run concurrently; the second one's update of the chain
+// fails.
+
+kj::Promise<void> restoreVolumeBackup(StorageRootSet::Client storage,
+                                      ChainedBackup::Reader backup, Volume::Client target);
+// Writes the content recorded by `backup` to `target`, which must be a new (all-zero) volume, then
+// syncs it.
+
+kj::Promise<void> releaseVolumeBackup(StorageRootSet::Client storage,
+                                      ChainedBackup::Reader backup, kj::StringPtr backupId);
+// Removes `backupId` from its chain's list, dropping the chain if it was the last backup to
+// depend on it and the grain has moved on to a newer one. The caller removes the record itself.
+
+kj::Promise<void> dropVolumeBackups(StorageRootSet::Client storage, kj::StringPtr grainId);
+// Forgets the grain's current chain, e.g. because the grain was deleted or its volume replaced, so
+// that the next backup starts a new one. The chain itself is dropped unless backups depend on it.
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_VOLUME_BACKUP_H_
@@ -31,6 +31,8 @@
 #include <errno.h>
 #include <sandstorm/backup.h>
 #include "bundle.h"
+#include "stream-window.h"
+#include "package-cache.h"
 
 #include <sys/mount.h>
 #undef BLOCK_SIZE // grr, mount.h
@@ -75,26 +77,39 @@ private:
   bool isDone = false;
 };
 
-kj::Promise<void> uploadBlob(kj::AutoCloseFd fd, sandstorm::ByteStream::Client stream) {
-  auto req = stream.writeRequest(capnp::MessageSize {2052, 0});
-  auto orphanage = capnp::Orphanage::getForMessageContaining(
-      kj::implicitCast<sandstorm::ByteStream::WriteParams::Builder>(req));
-
-  auto orphan = orphanage.newOrphan<capnp::Data>(8192);
-  auto buffer = orphan.get();
+kj::Promise<void> uploadBlobLoop(kj::AutoCloseFd fd, kj::Own<ByteStreamWindow> window) {
+  auto chunk = window->newChunk();
+  auto buffer = chunk.getBuffer();
   ssize_t n;
   KJ_SYSCALL(n = read(fd, buffer.begin(), buffer.size()));
-  if (n < buffer.size()) {
-    if (n == 0) {
-      return stream.doneRequest().send().then([](auto&&) {});
-    }
-    orphan.truncate(n);
+  if (n == 0) {
+    auto promise = window->done();
+    return promise.attach(kj::mv(window));
   }
 
-  req.adoptData(kj::mv(orphan));
+  auto promise = window->send(kj::mv(chunk), n);
+  return promise.then([KJ_MVCAP(fd),KJ_MVCAP(window)]() mutable {
+    return uploadBlobLoop(kj::mv(fd), kj::mv(window));
+  });
+}
 
-  return req.send().then([KJ_MVCAP(fd),KJ_MVCAP(stream)](auto&&) mutable {
-    return uploadBlob(kj::mv(fd), kj::mv(stream));
+kj::Promise<void> uploadBlob(kj::AutoCloseFd fd, sandstorm::ByteStream::Client stream) {
+  return uploadBlobLoop(kj::mv(fd), kj::heap<ByteStreamWindow>(kj::mv(stream)));
+}
+
+OwnedVolume::Client newFormattedVolume(StorageFactory::Client storage) {
+  // Create a volume which already contains a blank ext4 filesystem, so that NbdDevice::format()
+  // in the subprocess finds nothing to do. Storage nodes which predate newFormattedVolume() throw
+  // UNIMPLEMENTED, in which case we create an empty volume and format() writes the image itself.
+
+  return storage.newFormattedVolumeRequest().send()
+      .then([](auto&& response) -> OwnedVolume::Client {
+    return response.getVolume();
+  }, [storage](kj::Exception&& exception) mutable -> OwnedVolume::Client {
+    if (exception.getType() != kj::Exception::Type::UNIMPLEMENTED) {
+      kj::throwFatalException(kj::mv(exception));
+    }
+    return storage.newVolumeRequest().send().getVolume();
   });
 }
 
@@ -159,6 +174,12 @@ struct AsyncInSyncOutPipe {
   }
 };
 
+constexpr uint GRAIN_NBD_CONNECTIONS = 4;
+// Number of NBD connections (socket pairs, each served by its own NbdVolumeAdapterThread) backing
+// a grain's volume. The kernel gives each connection its own hardware queue and receive thread,
+// and each adapter runs on its own thread, so requests are handled on several CPUs instead of
+// contending for one socket and one event loop.
+
 struct NbdSocketPair {
   kj::Own<kj::AsyncIoStream> userEnd;
   kj::AutoCloseFd kernelEnd;
@@ -218,6 +239,62 @@ protected:
     });
   }
 
+  kj::Promise<void> readExtents(ReadExtentsContext context) override {
+    auto params = context.getParams();
+    uint32_t start = params.getBlockNum();
+    uint32_t count = params.getCount();
+    context.releaseParams();
+
+    auto req = inner.readExtentsRequest();
+    req.setBlockNum(start);
+    req.setCount(count);
+    return req.send().then([this,start,count,context](auto&& results) mutable {
+      BlockRange range = { start, count };
+      if (!isOverlaid(range)) {
+        // Common case: nothing in this range has been written locally.
+        context.setResults(results);
+        return;
+      }
+
+      applyOverlay(kj::arrayPtr(&range, 1), results.getExtents(),
+          [&](uint size, capnp::MessageSize sizeHint) {
+        return context.getResults(sizeHint).initExtents(size);
+      });
+    });
+  }
+
+  kj::Promise<void> readv(ReadvContext context) override {
+    auto params = context.getParams();
+    auto rangeList = params.getRanges();
+    auto ranges = kj::heapArrayBuilder<BlockRange>(rangeList.size());
+    for (auto range: rangeList) {
+      ranges.add(BlockRange { range.getBlockNum(), range.getCount() });
+    }
+    context.releaseParams();
+
+    auto req = inner.readvRequest();
+    auto reqRanges = req.initRanges(ranges.size());
+    for (auto i: kj::indices(ranges)) {
+      reqRanges[i].setBlockNum(ranges[i].start);
+      reqRanges[i].setCount(ranges[i].count);
+    }
+    return req.send().then([this,context,ranges = ranges.finish()](auto&& results) mutable {
+      bool overlaid = false;
+      for (auto& range: ranges) {
+        overlaid = overlaid || isOverlaid(range);
+      }
+      if (!overlaid) {
+        context.setResults(results);
+        return;
+      }
+
+      applyOverlay(ranges, results.getExtents(),
+          [&](uint size, capnp::MessageSize sizeHint) {
+        return context.getResults(sizeHint).initExtents(size);
+      });
+    });
+  }
+
   kj::Promise<void> write(WriteContext context) override {
     auto params = context.getParams();
     uint32_t start = params.getBlockNum();
@@ -237,6 +314,30 @@ protected:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> writev(WritevContext context) override {
+    auto params = context.getParams();
+    auto data = params.getData();
+
+    const byte* pos = data.begin();
+    for (auto range: params.getRanges()) {
+      uint32_t start = range.getBlockNum();
+      uint32_t count = range.getCount();
+      KJ_ASSERT(pos + count * Volume::BLOCK_SIZE <= data.end());
+
+      for (uint32_t i = 0; i < count; i++) {
+        auto& slot = overlay[start + i];
+        if (slot == nullptr) {
+          slot = kj::heapArray<byte>(Volume::BLOCK_SIZE);
+        }
+        memcpy(slot.begin(), pos, Volume::BLOCK_SIZE);
+        pos += Volume::BLOCK_SIZE;
+      }
+    }
+    KJ_ASSERT(pos == data.end());
+
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> zero(ZeroContext context) override {
     auto params = context.getParams();
     uint32_t start = params.getBlockNum();
@@ -260,6 +361,51 @@ private:
   std::unordered_map<uint32_t, kj::Array<byte>> overlay;
   // Maps block index -> block content. All byte arrays are exactly one block in size, unless they
   // are null, in which case the block is all-zero.
+
+  bool isOverlaid(BlockRange range) {
+    for (uint32_t i = 0; i < range.count; i++) {
+      if (overlay.count(range.start + i) > 0) return true;
+    }
+    return false;
+  }
+
+  template <typename InitFunc>
+  void applyOverlay(kj::ArrayPtr<const BlockRange> ranges,
+                    capnp::List<Volume::Extent>::Reader extents, InitFunc&& initExtents) {
+    // Given the extents returned by the inner volume for `ranges`, build the list of extents
+    // reflecting the overlay. `initExtents(size, sizeHint)` allocates the output list.
+
+    // Figure out the current content of each block (null = zero)...
+    kj::Vector<const byte*> blocks;
+    for (auto extent: extents) {
+      if (extent.isData()) {
+        auto data = extent.getData();
+        KJ_ASSERT(data.size() == extent.getCount() * Volume::BLOCK_SIZE);
+        for (uint32_t i = 0; i < extent.getCount(); i++) {
+          blocks.add(data.begin() + i * Volume::BLOCK_SIZE);
+        }
+      } else {
+        for (uint32_t i = 0; i < extent.getCount(); i++) {
+          blocks.add(nullptr);
+        }
+      }
+    }
+
+    uint32_t b = 0;
+    for (auto& range: ranges) {
+      for (uint32_t i = 0; i < range.count; i++, b++) {
+        KJ_ASSERT(b < blocks.size());
+        auto iter = overlay.find(range.start + i);
+        if (iter != overlay.end()) {
+          blocks[b] = iter->second == nullptr ? nullptr : iter->second.begin();
+        }
+      }
+    }
+    KJ_ASSERT(b == blocks.size());
+
+    // ...then re-encode as extents.
+    encodeExtents(ranges, blocks.asPtr(), kj::fwd<InitFunc>(initExtents));
+  }
 };
 
 }  // namespace
@@ -268,8 +414,11 @@ private:
 
 byte PackageMountSet::dummyByte = 0;
 
-PackageMountSet::PackageMountSet(kj::AsyncIoContext& ioContext)
-    : ioContext(ioContext), tasks(*this) {}
+PackageMountSet::PackageMountSet(kj::AsyncIoContext& ioContext, uint64_t cacheBytes)
+    : ioContext(ioContext), blockCache(kj::refcounted<PackageBlockCache>(cacheBytes)),
+      tasks(*this) {
+  tasks.add(logCacheStats());
+}
 PackageMountSet::~PackageMountSet() noexcept(false) {
   KJ_ASSERT(mounts.empty(), "PackageMountSet destroyed while packages still mounted!") { break; }
 }
@@ -333,6 +482,23 @@ void PackageMountSet::returnPackage(kj::Own<PackageMount> package) {
   }
 }
 
+kj::Promise<void> PackageMountSet::logCacheStats() {
+  return ioContext.lowLevelProvider->getTimer().afterDelay(10 * kj::MINUTES).then([this]() {
+    auto& stats = blockCache->getStats();
+    uint64_t hits = stats.hits - lastLoggedStats.hits;
+    uint64_t misses = stats.misses - lastLoggedStats.misses;
+    if (hits + misses > 0) {
+      uint64_t hitPercent = hits * 100 / (hits + misses);
+      uint64_t readaheadBlocks = stats.readaheadBlocks - lastLoggedStats.readaheadBlocks;
+      uint64_t evictions = stats.evictions - lastLoggedStats.evictions;
+      KJ_LOG(INFO, "package block cache", hits, misses, hitPercent, readaheadBlocks, evictions,
+             stats.blocks, stats.bytes);
+    }
+    lastLoggedStats = stats;
+    return logCacheStats();
+  });
+}
+
 void PackageMountSet::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
@@ -343,8 +509,8 @@ PackageMountSet::PackageMount::PackageMount(PackageMountSet& mountSet,
     : mountSet(mountSet),
       id(kj::heapArray(id)),
       path(kj::heapString(path)),
-      volumeAdapter(kj::heap<NbdVolumeAdapter>(kj::mv(nbdUserEnd), kj::mv(volume),
-                                               NbdAccessType::READ_ONLY)),
+      volumeAdapter(kj::heap<NbdVolumeAdapter>(kj::mv(nbdUserEnd),
+          mountSet.blockCache->wrap(id, kj::mv(volume)), NbdAccessType::READ_ONLY)),
       volumeRunTask(volumeAdapter->run().eagerlyEvaluate([](kj::Exception&& exception) {
         KJ_LOG(FATAL, "NbdVolumeAdapter failed (grain)", exception);
       })),
@@ -417,7 +583,7 @@ PackageMountSet::PackageMount::~PackageMount() noexcept(false) {
 }
 
 void PackageMountSet::PackageMount::updateVolume(Volume::Client newVolume) {
-  volumeAdapter->updateVolume(kj::mv(newVolume));
+  volumeAdapter->updateVolume(mountSet.blockCache->wrap(id, kj::mv(newVolume)));
 }
 
 void PackageMountSet::PackageMount::unregister() {
@@ -438,7 +604,7 @@ public:
                Worker::Client workerCap,
                kj::Own<capnp::MessageBuilder>&& grainState,
                sandstorm::Assignable<GrainState>::Setter::Client&& grainStateSetter,
-               kj::Own<kj::AsyncIoStream> nbdSocket,
+               kj::Array<kj::AutoCloseFd> nbdSockets,
                Volume::Client volume,
                kj::Own<kj::AsyncIoStream> capnpSocket,
                kj::Own<PackageMountSet::PackageMount> packageMountParam,
@@ -451,13 +617,15 @@ public:
         grainState(kj::mv(grainState)),
         grainStateSetter(kj::mv(grainStateSetter)),
         packageMount(kj::mv(packageMountParam)),
-        nbdVolume(kj::mv(nbdSocket), kj::mv(volume), NbdAccessType::READ_WRITE),
-        volumeRunTask(nbdVolume.run().eagerlyEvaluate([](kj::Exception&& exception) {
+        nbdVolumes(KJ_MAP(socket, nbdSockets) {
+          return kj::heap<NbdVolumeAdapterThread>(worker.ioProvider, kj::mv(socket), volume,
+                                                  NbdAccessType::READ_WRITE);
+        }),
+        volumeRunTask(kj::joinPromises(KJ_MAP(adapter, nbdVolumes) { return adapter->run(); })
+            .eagerlyEvaluate([](kj::Exception&& exception) {
           KJ_LOG(FATAL, "NbdVolumeAdapter failed (grain)", exception);
         })),
-        volumeDisconnectTask(nbdVolume.onDisconnected()
-            .exclusiveJoin(packageMount->onDisconnected())
-            .then([this]() {
+        volumeDisconnectTask(onAnyDisconnected().then([this]() {
           // If the package or grain volume disconnected while the grain is still running, kill
           // the grain.
           KJ_LOG(ERROR, "emergency grain shutdown due to storage loss", grainId);
@@ -496,7 +664,9 @@ public:
   }
 
   kj::Promise<void> onExit() {
-    return processWaitTask.catch_([this](auto) { return kj::mv(volumeRunTask); });
+    // Either way, wait for the NBD adapters to finish: destroying them joins their threads, which
+    // mustn't block the event loop serving their volume.
+    return processWaitTask.catch_([](auto) {}).then([this]() { return kj::mv(volumeRunTask); });
   }
 
   sandstorm::Supervisor::Client getSupervisor() {
@@ -504,6 +674,14 @@ public:
   }
 
 private:
+  kj::Promise<void> onAnyDisconnected() {
+    kj::Promise<void> result = packageMount->onDisconnected();
+    for (auto& adapter: nbdVolumes) {
+      result = result.exclusiveJoin(adapter->onDisconnected());
+    }
+    return result;
+  }
+
   WorkerImpl& worker;
   Worker::Client workerCap;
   kj::Own<capnp::MessageBuilder> grainState;
@@ -513,7 +691,9 @@ private:
   //   mutable types.
 
   kj::Own<PackageMountSet::PackageMount> packageMount;
-  NbdVolumeAdapter nbdVolume;
+  kj::Array<kj::Own<NbdVolumeAdapterThread>> nbdVolumes;
+  // One per NBD connection, all serving the grain's volume.
+
   kj::Promise<void> volumeRunTask;
   kj::Promise<void> volumeDisconnectTask;
 
@@ -531,9 +711,10 @@ private:
 };
 
 WorkerImpl::WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet& subprocessSet,
-                       LocalPersistentRegistry& persistentRegistry)
+                       LocalPersistentRegistry& persistentRegistry, WorkerConfig::Reader config)
     : ioProvider(*ioContext.lowLevelProvider), subprocessSet(subprocessSet),
-      persistentRegistry(persistentRegistry), packageMountSet(ioContext), tasks(*this) {
+      persistentRegistry(persistentRegistry),
+      packageMountSet(ioContext, config.getPackageCacheBytes()), tasks(*this) {
   NbdDevice::loadKernelModule();
   KJ_IF_MAYBE(fd, sandstorm::raiiOpenIfExists(
       "/proc/sys/kernel/unprivileged_userns_clone", O_WRONLY | O_TRUNC | O_CLOEXEC)) {
@@ -588,7 +769,7 @@ kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
 
   // Construct objects and create the GrainState Assignable.
   auto storageFactory = params.getStorage();
-  auto grainVolume = storageFactory.newVolumeRequest().send().getVolume();
+  auto grainVolume = newFormattedVolume(storageFactory);
   auto grainStateHolder = kj::heap<capnp::MallocMessageBuilder>(8);
   auto req = storageFactory.newAssignableRequest<GrainState>();
   {
@@ -677,15 +858,17 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
              KJ_MVCAP(command),KJ_MVCAP(grainVolume),KJ_MVCAP(grainId),
              KJ_MVCAP(core),KJ_MVCAP(persistentRegistration)]
             (auto&& packageMount) mutable {
-    // Create the NBD socketpair. The Supervisor will actually mount the NBD device (in its own
+    // Create the NBD socketpairs. The Supervisor will actually mount the NBD device (in its own
     // mount namespace) but we'll implement it in the Worker.
-    int nbdSocketPair[2];
-    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, nbdSocketPair));
-    kj::AutoCloseFd nbdKernelEnd(nbdSocketPair[0]);
-    auto nbdUserEnd = ioProvider.wrapSocketFd(nbdSocketPair[1],
-        kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
-        kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
-        kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+    auto nbdKernelEnds = kj::heapArrayBuilder<kj::AutoCloseFd>(GRAIN_NBD_CONNECTIONS);
+    auto nbdUserEnds = kj::heapArrayBuilder<kj::AutoCloseFd>(GRAIN_NBD_CONNECTIONS);
+    for (uint i = 0; i < GRAIN_NBD_CONNECTIONS; i++) {
+      // The user ends go to adapters on their own threads, so aren't wrapped for our event loop.
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds));
+      nbdUserEnds.add(kj::AutoCloseFd(fds[0]));
+      nbdKernelEnds.add(kj::AutoCloseFd(fds[1]));
+    }
 
     // Create the Cap'n Proto socketpair, for Worker <-> Supervisor communication.
     int capnpSocketPair[2];
@@ -699,8 +882,9 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
     kj::String packageRoot = kj::str(packageMount->getPath(), "/spk");
 
     // Build array of StringPtr for argv.
+    auto nbdConnectionsArg = kj::str("--nbd-connections=", GRAIN_NBD_CONNECTIONS);
     KJ_STACK_ARRAY(kj::StringPtr, argv,
-        command.commandArgs.size() + command.envArgs.size() + 7 + isNew, 16, 16);
+        command.commandArgs.size() + command.envArgs.size() + 8 + isNew, 16, 16);
     {
       int i = 0;
       argv[i++] = "blackrock";
@@ -708,6 +892,7 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
       if (isNew) {
         argv[i++] = "-n";
       }
+      argv[i++] = nbdConnectionsArg;
       argv[i++] = packageMount->getPath();
       argv[i++] = "--";  // begin supervisor args
       for (auto& envArg: command.envArgs) {
@@ -726,13 +911,18 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
     sandstorm::Subprocess::Options options("/proc/self/exe");
     options.argv = argv;
 
-    // Pass the capnp socket on FD 3 and the kernel end of the NBD socketpair as FD 4.
-    int moreFds[2] = { capnpSupervisorEnd, nbdKernelEnd };
+    // Pass the capnp socket on FD 3 and the kernel ends of the NBD socketpairs as FD 4 and up.
+    auto kernelEnds = nbdKernelEnds.finish();
+    int moreFds[1 + GRAIN_NBD_CONNECTIONS];
+    moreFds[0] = capnpSupervisorEnd;
+    for (auto i: kj::indices(kernelEnds)) {
+      moreFds[1 + i] = kernelEnds[i];
+    }
     options.moreFds = moreFds;
 
     // Make the RunningGrain.
     auto grain = kj::heap<RunningGrain>(
-        *this, thisCap(), kj::mv(grainState), kj::mv(grainStateSetter), kj::mv(nbdUserEnd),
+        *this, thisCap(), kj::mv(grainState), kj::mv(grainStateSetter), nbdUserEnds.finish(),
         kj::mv(grainVolume), kj::mv(capnpWorkerEnd), kj::mv(packageMount), kj::mv(options),
         kj::mv(grainId), kj::mv(core), kj::mv(persistentRegistration));
 
@@ -876,7 +1066,7 @@ kj::Promise<void> WorkerImpl::unpackPackage(UnpackPackageContext context) {
 
   auto promise = subprocessSet.waitForSuccess(kj::mv(options));
 
-  auto volume = context.getParams().getStorage().newVolumeRequest().send().getVolume();
+  auto volume = newFormattedVolume(context.getParams().getStorage());
 
   context.getResults().setStream(kj::heap<PackageUploadStreamImpl>(
       thisCap(), kj::mv(volume), kj::mv(nbdUserEnd),
@@ -897,7 +1087,7 @@ kj::Promise<void> WorkerImpl::unpackBackup(UnpackBackupContext context) {
   auto& tmpfileRef = *tmpfile;
 
   // Create the new volume.
-  auto volume = storage.newVolumeRequest().send().getVolume();
+  auto volume = newFormattedVolume(storage);
 
   // We have two lambdas below that both want to capture `volume`. Due to clang bug #22354, if we
   // try to use the copy constructor to capture `volume` "by value" rather than by move, we run
@@ -1100,21 +1290,34 @@ kj::MainFunc MetaSupervisorMain::getMain() {
   return kj::MainBuilder(context, "Blackrock version " SANDSTORM_VERSION,
                          "Runs 'blackrock supervise' passing it <args>. Forwards the -n option "
                          "if given. The caller must provide a Cap'n Proto towparty socket on "
-                         "FD 3 which is used to talk to the grain supervisor, and FD 4 must be "
-                         "a socket implementing the NBD protocol exporting the grain's mutable "
-                         "storage.\n"
+                         "FD 3 which is used to talk to the grain supervisor, and FD 4 (and "
+                         "following, see --nbd-connections) must be a socket implementing the "
+                         "NBD protocol exporting the grain's mutable storage.\n"
                          "\n"
                          "NOT FOR HUMAN CONSUMPTION: Given the FD requirements, you obviously "
                          "can't run this directly from the command-line. It is intended to be "
                          "invoked by the Blackrock worker.")
       .addOption({'n', "new"}, [this]() { isNew = true; args.add("-n"); return true; },
                  "Initializes a new grain. (Otherwise, runs an existing one.)")
+      .addOptionWithArg({"nbd-connections"}, KJ_BIND_METHOD(*this, setNbdConnections),
+                        "<count>", "Number of NBD sockets, on consecutive FDs starting at 4, all "
+                        "exporting the grain's storage. (Default: 1)")
       .expectArg("<pkg>", [this](kj::StringPtr s) { packageMount = s; return true; })
       .expectZeroOrMoreArgs("<args>", [this](kj::StringPtr s) { args.add(s); return true; })
       .callAfterParsing(KJ_BIND_METHOD(*this, run))
       .build();
 }
 
+kj::MainBuilder::Validity MetaSupervisorMain::setNbdConnections(kj::StringPtr arg) {
+  KJ_IF_MAYBE(n, sandstorm::parseUInt(arg, 10)) {
+    if (*n == 0) return "must be positive";
+    nbdConnections = *n;
+    return true;
+  } else {
+    return "not a number";
+  }
+}
+
 kj::MainBuilder::Validity MetaSupervisorMain::run() {
   // Rename the task to allow for orderly teardown when killing all blackrock processes.
   KJ_SYSCALL(prctl(PR_SET_NAME, "blackrock-msup", 0, 0, 0));
@@ -1124,8 +1327,10 @@ kj::MainBuilder::Validity MetaSupervisorMain::run() {
   // clones of the mount are gone before we disconnect nbd.
   KJ_SYSCALL(prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0));
 
-  // Set CLOEXEC on the the nbd fd so that the supervisor doesn't see it.
-  KJ_SYSCALL(fcntl(4, F_SETFD, FD_CLOEXEC));
+  // Set CLOEXEC on the the nbd fds so that the supervisor doesn't see them.
+  for (uint i = 0; i < nbdConnections; i++) {
+    KJ_SYSCALL(fcntl(4 + i, F_SETFD, FD_CLOEXEC));
+  }
 
   // Enter mount namespace, to mount the grain.
   unshareMountNamespace();
@@ -1154,7 +1359,11 @@ kj::MainBuilder::Validity MetaSupervisorMain::run() {
 
   // We'll mount our grain data on /mnt because it's our own mount namespace so why not?
   NbdDevice device;
-  NbdBinding binding(device, kj::AutoCloseFd(4), NbdAccessType::READ_WRITE);
+  auto nbdSockets = kj::heapArrayBuilder<kj::AutoCloseFd>(nbdConnections);
+  for (uint i = 0; i < nbdConnections; i++) {
+    nbdSockets.add(kj::AutoCloseFd(4 + i));
+  }
+  NbdBinding binding(device, nbdSockets.finish(), NbdAccessType::READ_WRITE);
 
   if (isNew) {
     device.format();
@@ -25,6 +25,7 @@
 #include <sandstorm/supervisor.h>
 #include <kj/async-io.h>
 #include "local-persistent-registry.h"
+#include "package-cache.h"
 
 namespace kj {
   class Thread;
@@ -34,21 +35,10 @@ namespace blackrock {
 
 class NbdVolumeAdapter;
 
-struct ByteStringHash {
-  inline size_t operator()(const kj::ArrayPtr<const byte>& token) const {
-    size_t result = 0;
-    memcpy(&result, token.begin(), kj::min(sizeof(result), token.size()));
-    return result;
-  }
-  inline size_t operator()(const kj::ArrayPtr<const byte>& a,
-                           const kj::ArrayPtr<const byte>& b) const {
-    return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size()) == 0;
-  }
-};
-
 class PackageMountSet: private kj::TaskSet::ErrorHandler {
 public:
-  explicit PackageMountSet(kj::AsyncIoContext& ioContext);
+  PackageMountSet(kj::AsyncIoContext& ioContext, uint64_t cacheBytes);
+  // `cacheBytes` is the budget of the PackageBlockCache shared by all mounts.
   ~PackageMountSet() noexcept(false);
   KJ_DISALLOW_COPY(PackageMountSet);
 
@@ -114,6 +104,12 @@ private:
                      ByteStringHash, ByteStringHash> mounts;
   uint64_t counter = 0;
 
+  kj::Own<PackageBlockCache> blockCache;
+
+  PackageBlockCache::Stats lastLoggedStats;
+
+  kj::Promise<void> logCacheStats();
+
   static byte dummyByte;
   // Target of pipe reads and writes where we don't care about the content.
 
@@ -125,7 +121,7 @@ private:
 class WorkerImpl: public Worker::Server, private kj::TaskSet::ErrorHandler {
 public:
   WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet& subprocessSet,
-             LocalPersistentRegistry& persistentRegistry);
+             LocalPersistentRegistry& persistentRegistry, WorkerConfig::Reader config);
   ~WorkerImpl() noexcept(false);
 
 protected:
@@ -189,6 +185,9 @@ private:
   kj::StringPtr packageMount;
   kj::Vector<kj::StringPtr> args;
   bool isNew = false;
+  uint nbdConnections = 1;
+
+  kj::MainBuilder::Validity setNbdConnections(kj::StringPtr arg);
 };
 
 class UnpackMain: public sandstorm::AbstractMain {